@@ -0,0 +1,83 @@
+; msr_safe.asm - RDMSR/WRMSR that survive a #GP in host context
+;
+; Used for MSRs the guest reaches through an exit but that this part may not
+; implement. The caller (msrpm.c) loads a copy of the host IDT whose #GP gate
+; is HvMsrSafeGpHandler around each call; a fault on one of the two MSR
+; instructions resumes at its fixup, which returns FALSE. Any other #GP goes
+; on to the original handler. GIF is clear on the exit path, so nothing else
+; can arrive through the borrowed IDT meanwhile.
+
+option casemap:none
+
+EXTERN g_HvMsrGpHandler:QWORD
+
+.code
+
+;------------------------------------------------------------------------------
+; BOOLEAN HvMsrSafeRead(UINT32 Msr, UINT64* Value)
+;------------------------------------------------------------------------------
+PUBLIC HvMsrSafeRead
+HvMsrSafeRead PROC
+        mov     r8, rdx
+HvMsrSafeReadInsn::
+        rdmsr
+        shl     rdx, 32
+        or      rax, rdx
+        mov     [r8], rax
+        mov     eax, 1
+        ret
+HvMsrSafeReadFault::
+        xor     eax, eax
+        ret
+HvMsrSafeRead ENDP
+
+;------------------------------------------------------------------------------
+; BOOLEAN HvMsrSafeWrite(UINT32 Msr, UINT64 Value)
+;------------------------------------------------------------------------------
+PUBLIC HvMsrSafeWrite
+HvMsrSafeWrite PROC
+        mov     rax, rdx
+        shr     rdx, 32
+HvMsrSafeWriteInsn::
+        wrmsr
+        mov     eax, 1
+        ret
+HvMsrSafeWriteFault::
+        xor     eax, eax
+        ret
+HvMsrSafeWrite ENDP
+
+;------------------------------------------------------------------------------
+; #GP gate of the borrowed IDT
+; Frame: [rsp] = error code, [rsp + 8] = RIP, then CS, RFLAGS, RSP, SS
+;------------------------------------------------------------------------------
+PUBLIC HvMsrSafeGpHandler
+HvMsrSafeGpHandler PROC
+        push    rax
+
+        lea     rax, HvMsrSafeReadInsn
+        cmp     [rsp + 10h], rax
+        je      FixRead
+
+        lea     rax, HvMsrSafeWriteInsn
+        cmp     [rsp + 10h], rax
+        je      FixWrite
+
+        pop     rax
+        jmp     qword ptr [g_HvMsrGpHandler]
+
+FixRead:
+        lea     rax, HvMsrSafeReadFault
+        jmp     Resume
+
+FixWrite:
+        lea     rax, HvMsrSafeWriteFault
+
+Resume:
+        mov     [rsp + 10h], rax
+        pop     rax
+        add     rsp, 8
+        iretq
+HvMsrSafeGpHandler ENDP
+
+END
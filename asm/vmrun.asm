@@ -8,6 +8,13 @@ option casemap:none
 KTRAP_FRAME_SIZE            equ     190h
 MACHINE_FRAME_SIZE          equ     28h
 
+; HOST_STACK_LAYOUT offsets from GuestVmcbPa (the host RSP at VmRunLoop),
+; must match vcpu.h
+HSL_VMRUN_TSC               equ     20h
+HSL_EXIT_TSC                equ     28h
+HSL_RDX_SCRATCH             equ     30h
+HSL_HOST_STATE              equ     38h
+
 .code
 
 extern HandleVmExit : proc
@@ -85,11 +92,27 @@ LaunchVm PROC FRAME
         mov     rsp, rcx
 
 VmRunLoop:
-        ; Load VMCB PA and execute VMRUN cycle
+        ; Stamp the TSC for the guest/host time split; RDTSC clobbers the
+        ; guest RDX POPAQ just restored, so park it in the stack layout
+        mov     [rsp + HSL_RDX_SCRATCH], rdx
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     [rsp + HSL_VMRUN_TSC], rax
+        mov     rdx, [rsp + HSL_RDX_SCRATCH]
+
+        ; Load VMCB PA and execute VMRUN cycle. The VMLOAD/VMSAVE state
+        ; (FS/GS/TR/LDTR bases, KernelGsBase, STAR/LSTAR/CSTAR/SFMASK,
+        ; SYSENTER) is left in the CPU across exits; only when HandleVmExit
+        ; swapped the host's in (HvEnsureHostState) does the guest's have
+        ; to be reloaded from the VMCB
         mov     rax, [rsp]
+        cmp     qword ptr [rsp + HSL_HOST_STATE], 0
+        je      GuestStateLive
         vmload  rax
+        mov     qword ptr [rsp + HSL_HOST_STATE], 0
+GuestStateLive:
         vmrun   rax
-        vmsave  rax
 
         ; VMEXIT occurred - set up stack frame
         .pushframe
@@ -114,7 +137,10 @@ VmRunLoop:
         mov     rdx, rsp
         mov     rcx, [rsp + 8 * 18 + KTRAP_FRAME_SIZE]
 
-        ; Allocate shadow space and save XMM registers
+        ; Allocate shadow space and save XMM registers. xmm0-5 are volatile
+        ; in the x64 ABI, so any compiled code on the exit path (memcpy,
+        ; struct copies) may use them; handlers that go further (AVX) save
+        ; the rest through HvXstateEnsure
         sub     rsp, 80h
         movaps  xmmword ptr [rsp + 20h], xmm0
         movaps  xmmword ptr [rsp + 30h], xmm1
@@ -124,6 +150,14 @@ VmRunLoop:
         movaps  xmmword ptr [rsp + 70h], xmm5
         .endprolog
 
+        ; Exit timestamp (guest RAX/RDX are already saved by PUSHAQ)
+        mov     r8, rdx
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     [rsp + 80h + 8 * 16 + KTRAP_FRAME_SIZE + HSL_EXIT_TSC], rax
+        mov     rdx, r8
+
         ; Call the C exit handler
         call    HandleVmExit
 
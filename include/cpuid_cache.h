@@ -0,0 +1,56 @@
+#pragma once
+#include <ntifs.h>
+
+struct _VCPU;
+
+//
+// Per-VCPU snapshot of the CPUID leaves the guest sees, with the hypervisor
+// and stealth masks already applied. The table is built on the owning CPU
+// at init, so per-processor values (initial APIC ID, x2APIC topology) are
+// exact; HvHandleCpuid answers from it instead of executing CPUID.
+//
+// Leaves that depend on live state are not cached: 0xD reports sizes for
+// the current XCR0/XSS, and anything outside the snapshot (leaves beyond
+// the reported maxima, subleaves past HV_CPUID_MAX_SUBLEAVES) executes the
+// real instruction. OSXSAVE and OSPKE are patched from the guest's CR4.
+//
+#define HV_CPUID_STD_LEAVES         0x20        // 0x00000000 - 0x0000001F
+#define HV_CPUID_EXT_LEAVES         0x30        // 0x80000000 - 0x8000002F
+#define HV_CPUID_MAX_SUBLEAVES      8
+#define HV_CPUID_MAX_ENTRIES        256
+#define HV_CPUID_TAG                'ICVH'
+
+typedef struct _HV_CPUID_ENTRY
+{
+    UINT32 Eax;
+    UINT32 Ebx;
+    UINT32 Ecx;
+    UINT32 Edx;
+} HV_CPUID_ENTRY;
+
+//
+// Where a leaf's entries start; Count = 0 means execute CPUID live
+//
+typedef struct _HV_CPUID_LEAF
+{
+    UINT16 First;
+    UINT8 Count;            // 1, or HV_CPUID_MAX_SUBLEAVES for subleaf-indexed leaves
+    UINT8 Indexed;          // ECX selects the entry
+} HV_CPUID_LEAF;
+
+typedef struct _HV_CPUID_TABLE
+{
+    HV_CPUID_LEAF Std[HV_CPUID_STD_LEAVES];
+    HV_CPUID_LEAF Ext[HV_CPUID_EXT_LEAVES];
+    ULONG Used;
+    LONG Generation;        // g_HvCpuidGeneration this snapshot was taken at
+    UINT64 Hits;
+    UINT64 Misses;
+    HV_CPUID_ENTRY Entries[HV_CPUID_MAX_ENTRIES];
+} HV_CPUID_TABLE;
+
+NTSTATUS HvCpuidInitVcpu(struct _VCPU* V);
+VOID     HvCpuidDestroyVcpu(struct _VCPU* V);
+
+VOID HvCpuidLookup(struct _VCPU* V, UINT32 Leaf, UINT32 Subleaf, HV_CPUID_ENTRY* Out);
+VOID HvCpuidInvalidate(VOID);
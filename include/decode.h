@@ -0,0 +1,82 @@
+#pragma once
+#include <ntifs.h>
+
+//
+// Compact x86-64 decoder for the memory-touching instructions the emulator
+// completes on NPF (see emulate.h): MOV, MOVZX/MOVSX, MOVS, STOS, AND, OR,
+// XCHG and CMPXCHG. Everything else decodes as HvInsnUnsupported and the
+// caller falls back to its non-emulated path.
+//
+// The decoder is a pure function of the instruction bytes and the CPU mode;
+// it touches no VCPU or kernel state, so it can be built in user mode
+// against a corpus of encodings.
+//
+#define HV_INSN_MAX_LENGTH      15
+
+typedef enum _HV_INSN_OP
+{
+    HvInsnUnsupported = 0,
+    HvInsnMovStore,         // MOV m, r / MOV m, imm
+    HvInsnMovLoad,          // MOV r, m
+    HvInsnMovzx,
+    HvInsnMovsx,
+    HvInsnMovs,
+    HvInsnStos,
+    HvInsnAnd,
+    HvInsnOr,
+    HvInsnXchg,
+    HvInsnCmpxchg,
+} HV_INSN_OP;
+
+//
+// Operand-size / address-size defaults of the code segment
+//
+typedef enum _HV_CPU_MODE
+{
+    HvCpuMode16 = 0,
+    HvCpuMode32,
+    HvCpuMode64,
+} HV_CPU_MODE;
+
+#define HV_SEG_ES   0
+#define HV_SEG_CS   1
+#define HV_SEG_SS   2
+#define HV_SEG_DS   3
+#define HV_SEG_FS   4
+#define HV_SEG_GS   5
+
+#define HV_REG_NONE 0xFF
+
+typedef struct _HV_INSN
+{
+    UINT8 Op;               // HV_INSN_OP
+    UINT8 Length;
+    UINT8 OperandSize;      // Bytes moved / operated on: 1, 2, 4 or 8
+    UINT8 SourceSize;       // MOVZX / MOVSX: bytes read from memory
+    UINT8 AddressSize;      // 2, 4 or 8
+    UINT8 Segment;          // HV_SEG_*, after overrides
+    UINT8 Rep;              // F3 / F2 on MOVS and STOS
+    UINT8 Lock;
+
+    //
+    // Register operand (HV_REG_NONE for the immediate forms). HighByte
+    // selects AH/CH/DH/BH for 8-bit operands without REX.
+    //
+    UINT8 Reg;
+    UINT8 HighByte;
+    UINT8 MemIsDest;        // AND / OR: memory is the destination
+    UINT8 HasImm;
+
+    //
+    // Memory operand: Base + Index * Scale + Disp (RIP-relative: Disp is
+    // relative to the next instruction). Unused for MOVS / STOS.
+    //
+    UINT8 Base;             // HV_REG_NONE if absent
+    UINT8 Index;            // HV_REG_NONE if absent
+    UINT8 Scale;
+    UINT8 RipRelative;
+    INT64 Disp;
+    UINT64 Imm;             // Sign-extended to OperandSize
+} HV_INSN;
+
+BOOLEAN HvDecodeInstruction(const UINT8* Bytes, UINT32 Available, HV_CPU_MODE Mode, HV_INSN* Insn);
@@ -0,0 +1,87 @@
+#pragma once
+#include <ntifs.h>
+#include "vcpu.h"
+
+//
+// Deferred maintenance. Subsystems register periodic work items (the
+// layer refresh, ...) with a period and a cycle budget, both in TSC ticks;
+// each VCPU keeps its own deadline per item. The exit path compares the
+// exit TSC with the VCPU's earliest deadline and does nothing else until
+// one passes.
+//
+// Due work never runs on an arbitrary exit. It waits for an exit that
+// already has slack (handlers registered with HV_EXIT_HAS_SLACK: VMMCALL,
+// HLT) or, if none comes, for a dedicated exit: the physical-interrupt
+// intercept is armed, the next host interrupt exits, the work runs, and the
+// interrupt is delivered to the guest on VMRUN as it would have been.
+//
+// Items cannot be preempted; each run is timed against the item's budget.
+// An item that overruns is counted as a straggler, and whatever else was
+// due waits for the next slack exit instead of piling onto this one.
+//
+#define HV_DEFER_MAX_ITEMS      16
+#define HV_DEFER_TAG            'FDVH'
+
+typedef VOID (*HV_DEFER_ROUTINE)(VCPU* V);
+
+typedef struct _HV_DEFER_ITEM
+{
+    const CHAR* Name;
+    HV_DEFER_ROUTINE Routine;
+    UINT64 Period;                  // TSC ticks between runs
+    UINT64 Budget;                  // TSC ticks one run may take
+} HV_DEFER_ITEM;
+
+typedef struct _HV_DEFER_STATE
+{
+    UINT64 NextDeadline;            // Earliest Deadline[] (0 = recompute on the next exit)
+    BOOLEAN ExitArmed;              // INTR intercept set for a dedicated exit
+
+    struct
+    {
+        UINT64 Deadline;            // 0 = not scheduled yet
+        UINT64 Runs;
+        UINT64 Cycles;
+        UINT64 MaxCycles;
+        UINT64 Stragglers;          // Runs over budget
+    } Items[HV_DEFER_MAX_ITEMS];
+
+    UINT64 SlackRuns;               // Work run on an exit that had slack
+    UINT64 DedicatedRuns;           // ... on an armed INTR exit
+    UINT64 Postponed;               // Due items pushed back by a straggler
+} HV_DEFER_STATE;
+
+typedef enum _HV_DEFER_STAT
+{
+    // Per VCPU
+    HvDeferStatSlackRuns = 0,
+    HvDeferStatDedicatedRuns,
+    HvDeferStatPostponed,
+    HvDeferStatItemCount,
+
+    // Per item
+    HvDeferStatRuns,
+    HvDeferStatCycles,
+    HvDeferStatMaxCycles,
+    HvDeferStatStragglers,
+} HV_DEFER_STAT;
+
+NTSTATUS HvDeferInitVcpu(VCPU* V);
+VOID     HvDeferDestroyVcpu(VCPU* V);
+
+NTSTATUS HvRegisterDeferredWork(const CHAR* Name, HV_DEFER_ROUTINE Routine, UINT64 Period, UINT64 Budget);
+
+VOID   HvDeferRun(VCPU* V, UINT64 Now, BOOLEAN Slack);
+UINT64 HvDeferQuery(VCPU* V, ULONG Item, HV_DEFER_STAT Stat);
+
+//
+// Exit-path check: one compare unless a deadline has passed. While the
+// dedicated exit is armed only slack exits (the INTR exit among them) go on.
+//
+static __forceinline VOID HvDeferPoll(VCPU* V, UINT64 Now, BOOLEAN Slack)
+{
+    HV_DEFER_STATE* d = V->Defer;
+
+    if (d && Now >= d->NextDeadline && (Slack || !d->ExitArmed))
+        HvDeferRun(V, Now, Slack);
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <ntifs.h>
+#include "vcpu.h"
+#include "decode.h"
+
+//
+// Completes an NPF-trapped data access in place: the faulting instruction is
+// decoded (from the VMCB decode-assist bytes when the CPU provides them,
+// from guest memory otherwise), its accesses to the trapped page are
+// redirected to a host buffer, and RIP moves past it. The NPT entry is left
+// alone, so the page stays trapped with no remap or rearm.
+//
+// Decoded instructions are cached per VCPU, keyed by (CR3, RIP); a hit with
+// decode assists is checked against the fetched bytes, a hit without them
+// is trusted until HvEmuInvalidate.
+//
+#define HV_EMU_CACHE_ENTRIES        64          // Power of two
+#define HV_EMU_MAX_STRING_ELEMENTS  512         // Per exit; the rest re-executes the REP
+#define HV_EMU_TAG                  'DEVH'
+
+typedef struct _HV_EMU_CACHE_ENTRY
+{
+    UINT64 Cr3;
+    UINT64 Rip;
+    LONG Generation;
+    UINT8 Mode;                             // HV_CPU_MODE
+    UINT8 Bytes[HV_INSN_MAX_LENGTH];
+    HV_INSN Insn;
+} HV_EMU_CACHE_ENTRY;
+
+typedef struct _HV_EMU_STATE
+{
+    HV_EMU_CACHE_ENTRY Cache[HV_EMU_CACHE_ENTRIES];
+    UINT64 Emulated;
+    UINT64 CacheHits;
+    UINT64 Fetches;         // Instruction bytes read from guest memory (no decode assist)
+    UINT64 Failures;        // Undecodable or unsupported; the caller's fallback ran
+    UINT64 PageFaults;      // Operand refused by the guest's tables; #PF injected
+} HV_EMU_STATE;
+
+typedef enum _HV_EMU_STAT
+{
+    HvEmuStatEmulated = 0,
+    HvEmuStatCacheHits,
+    HvEmuStatFetches,
+    HvEmuStatFailures,
+    HvEmuStatPageFaults,
+} HV_EMU_STAT;
+
+typedef enum _HV_EMU_RESULT
+{
+    HvEmuNotHandled = 0,    // Guest untouched; the caller's fallback runs
+    HvEmuCompleted,         // Access done against the page, RIP advanced
+    HvEmuFaulted,           // Guest #PF injected; the access did not happen
+} HV_EMU_RESULT;
+
+NTSTATUS HvEmuInitVcpu(VCPU* V);
+VOID     HvEmuDestroyVcpu(VCPU* V);
+
+HV_EMU_RESULT HvEmulateMmio(VCPU* V, PGUEST_REGISTERS GuestRegs, UINT64 PageGpa, PVOID PageVa);
+VOID    HvEmuInvalidate(VOID);
+UINT64  HvEmuQuery(VCPU* V, HV_EMU_STAT Stat);
@@ -0,0 +1,92 @@
+#pragma once
+#include <ntifs.h>
+#include "vcpu.h"
+
+//
+// Per-VCPU pending-event queue. Handlers post exceptions here instead of
+// writing EVENTINJ; HandleVmExit delivers at most one event per VMRUN, in
+// priority order:
+//
+//   1. the pending exception (one slot; a second exception merges into it,
+//      escalating to #DF as the double-fault table prescribes)
+//   2. an NMI or external interrupt whose delivery the exit interrupted
+//   3. external interrupts set in Irq, highest vector first
+//
+// An event the exit interrupted (EXITINTINFO) is queued first, so anything
+// a handler posts merges with it exactly as if the CPU had raised both.
+// Interrupts the guest cannot take yet (IF clear, interrupt shadow) are
+// held back with a virtual interrupt request: V_IRQ plus the VINTR
+// intercept make the CPU exit as soon as the guest can accept one, so
+// nothing is polled.
+//
+// NMIs and interrupts can be posted from any CPU (hypercall 0x2F1/0x2F2);
+// the poster kicks the target so it picks them up at the end of an exit
+// straight away. A posted NMI is not injected through EVENTINJ: NMIs are
+// not intercepted, so the hypervisor cannot tell whether the guest is
+// still inside an NMI handler. It is sent to the core's own local APIC
+// instead and the CPU holds it until the guest's NMI blocking allows.
+//
+#define HV_EVENT_TAG                'QEVH'
+
+//
+// EVENTINJ / EXITINTINFO layout
+//
+#define HV_EVENT_VALID              (1UL << 31)
+#define HV_EVENT_ERROR_VALID        (1UL << 11)
+#define HV_EVENT_TYPE_SHIFT         8
+#define HV_EVENT_TYPE_INTR          0
+#define HV_EVENT_TYPE_NMI           2
+#define HV_EVENT_TYPE_EXCEPTION     3
+#define HV_EVENT_TYPE_SOFT_INT      4
+
+#define HV_VECTOR_DE                0
+#define HV_VECTOR_UD                6
+#define HV_VECTOR_DF                8
+#define HV_VECTOR_TS                10
+#define HV_VECTOR_NP                11
+#define HV_VECTOR_SS                12
+#define HV_VECTOR_GP                13
+#define HV_VECTOR_PF                14
+
+typedef struct _HV_EVENT_QUEUE
+{
+    UINT32 Reinject;            // Interrupted NMI / INTR, EVENTINJ format (0 = none)
+    UINT32 Exception;           // Pending exception, EVENTINJ format (0 = none)
+    UINT32 ExceptionError;
+    volatile LONG64 Irq[4];     // Pending external interrupt vectors, one bit each
+    volatile LONG Nmi;          // NMI posted, not yet raised
+    BOOLEAN WindowOpen;         // VINTR intercept and V_IRQ requested
+
+    volatile LONG64 Posted;
+    UINT64 Injected;
+    UINT64 Reinjected;
+    UINT64 DoubleFaults;        // Merges escalated to #DF
+    UINT64 WindowExits;
+    UINT64 NmisRaised;
+} HV_EVENT_QUEUE;
+
+typedef enum _HV_EVENT_STAT
+{
+    HvEventStatPosted = 0,
+    HvEventStatInjected,
+    HvEventStatReinjected,
+    HvEventStatDoubleFaults,
+    HvEventStatWindowExits,
+    HvEventStatNmisRaised,
+} HV_EVENT_STAT;
+
+NTSTATUS HvEventInitVcpu(VCPU* V);
+VOID     HvEventDestroyVcpu(VCPU* V);
+
+//
+// Exceptions are posted by the VCPU's own exit handlers; NMIs and
+// interrupts (vector 32 and up) from any CPU
+//
+VOID    HvEventQueueException(VCPU* V, UINT8 Vector, BOOLEAN HasError, UINT32 ErrorCode);
+BOOLEAN HvEventQueueNmi(VCPU* V);
+BOOLEAN HvEventQueueInterrupt(VCPU* V, UINT8 Vector);
+
+VOID   HvEventBeginExit(VCPU* V);
+VOID   HvEventWindowExit(VCPU* V);
+VOID   HvEventDeliver(VCPU* V);
+UINT64 HvEventQuery(VCPU* V, HV_EVENT_STAT Stat);
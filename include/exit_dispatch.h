@@ -0,0 +1,56 @@
+#pragma once
+#include <ntifs.h>
+#include "vcpu.h"
+
+//
+// Direct-indexed VMEXIT dispatch. Every AMD exit code up to VMGEXIT (0x403)
+// has a slot; unclaimed slots point at the default handler, so HandleVmExit
+// does one bounds check and one indirect call per exit.
+//
+#define HV_EXIT_TABLE_SIZE  0x404
+
+//
+// What HandleVmExit should do with the guest RIP once the handler returns
+//
+typedef enum _HV_EXIT_ACTION
+{
+    HvExitResume = 0,       // RIP already correct (fault, event injection, ...)
+    HvExitAdvanceRip,       // Skip the intercepted instruction
+} HV_EXIT_ACTION;
+
+typedef HV_EXIT_ACTION (*HV_EXIT_HANDLER)(VCPU* V, PGUEST_REGISTERS GuestRegs);
+
+//
+// Handler flags. Exits run with the guest's VMLOAD/VMSAVE state (GS base,
+// KernelGsBase, syscall MSRs, TR, ...) still in the CPU; a handler that
+// reads the PCR through GS, touches those MSRs or reads them from the VMCB
+// sets HV_EXIT_NEEDS_HOST_STATE, or calls HvEnsureHostState itself on the
+// paths that need it.
+//
+#define HV_EXIT_NEEDS_HOST_STATE    0x01
+
+//
+// The exit stub preserves only xmm0-5 (the registers compiled C may use).
+// A handler that runs AVX code sets HV_EXIT_NEEDS_XSTATE, or calls
+// HvXstateEnsure on the paths that need it, to have the guest's full
+// x87/SSE/AVX state saved first and restored when the exit completes.
+//
+#define HV_EXIT_NEEDS_XSTATE        0x02
+
+//
+// Exits that are slow paths already (the guest is idle or asked for the
+// hypervisor) set HV_EXIT_HAS_SLACK; due deferred work runs on them rather
+// than on a latency-sensitive exit (see defer.h)
+//
+#define HV_EXIT_HAS_SLACK           0x04
+
+typedef struct _HV_EXIT_ENTRY
+{
+    HV_EXIT_HANDLER Handler;
+    UINT8 InsnLength;       // Used to advance RIP when NextRip is not provided
+    UINT8 Flags;            // HV_EXIT_*
+} HV_EXIT_ENTRY;
+
+VOID     HvInitializeExitHandlers(VOID);
+NTSTATUS HvRegisterExitHandler(UINT64 ExitCode, HV_EXIT_HANDLER Handler, UINT8 InsnLength, UINT8 Flags);
+NTSTATUS HvUnregisterExitHandler(UINT64 ExitCode, HV_EXIT_HANDLER Handler);
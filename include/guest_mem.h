@@ -6,6 +6,13 @@ BOOLEAN GuestReadGva(VCPU* Vcpu, UINT64 GuestVirtualAddress, PVOID Buffer, SIZE_
 BOOLEAN GuestWriteGva(VCPU* Vcpu, UINT64 GuestVirtualAddress, PVOID Buffer, SIZE_T Size);
 BOOLEAN GuestReadGpa(VCPU* Vcpu, UINT64 GuestPhysicalAddress, PVOID Buffer, SIZE_T Size);
 BOOLEAN GuestWriteGpa(VCPU* Vcpu, UINT64 GuestPhysicalAddress, PVOID Buffer, SIZE_T Size);
+BOOLEAN GuestReadHpa(VCPU* Vcpu, UINT64 HostPhysicalAddress, PVOID Buffer, SIZE_T Size);
+
+PVOID GuestMapGpaPage(VCPU* Vcpu, UINT64 GuestPhysicalAddress);
+VOID  GuestUnmapWindow(VCPU* Vcpu);
+
+NTSTATUS GuestMemInitVcpu(VCPU* Vcpu);
+VOID GuestMemDestroyVcpu(VCPU* Vcpu);
 
 PHYSICAL_ADDRESS GuestTranslateGvaToGpa(VCPU* Vcpu, UINT64 Gva);
 PHYSICAL_ADDRESS GuestTranslateGpaToHpa(VCPU* Vcpu, UINT64 Gpa);
@@ -0,0 +1,131 @@
+#pragma once
+#include <ntifs.h>
+#include "vcpu.h"
+
+//
+// Guest page-table walker shared by every GVA translation (hypercall
+// buffers, string I/O, MMIO emulation, NPT's shadow-CR3 lookups). It
+// handles 4- and 5-level paging, 1GB / 2MB / 4KB leaves and PCID-tagged
+// CR3 values, and reports the rights the mapping grants (W, U, X) so a
+// caller can check an access the way the CPU would.
+//
+// A per-VCPU software TLB sits in front of it, keyed by (CR3 frame, GVA
+// page): the PCID bits are ignored, since address spaces sharing a table
+// root share translations, and a CR3 load does not flush it. Each entry
+// keeps every entry of the walk it was built from, root to leaf, with the
+// values it saw. It is only used from exit handlers, and the guest cannot
+// run on this CPU within one exit, so:
+//
+//   - the first hit in an exit re-reads those entries and drops the TLB
+//     entry if any changed (accessed / dirty aside). That costs the reads
+//     of a walk but none of its decoding.
+//   - later hits in the same exit read no guest memory. What can still
+//     change underneath them is a write the hypervisor itself sees (its
+//     own guest-memory writes, NPT write faults: GuestTlbNotifyWrite) to a
+//     table frame a cached walk went through. Those frames are hashed into
+//     a small filter, so the check is one bit test, and a match flushes.
+//   - GuestTlbInvalidate flushes every VCPU
+//
+// Most callers translate the same few pages many times per exit (string
+// I/O, MMIO emulation checking both ends of an operand), which is what the
+// second case is for.
+//
+#define GUEST_TLB_ENTRIES       64              // Power of two
+#define GUEST_TLB_FILTER_BITS   1024            // Power of two
+#define GUEST_TLB_TAG           'BTVH'
+
+//
+// Access / rights bits, laid out like the #PF error code
+//
+#define GUEST_ACCESS_PRESENT    0x01            // ErrorCode only: protection fault
+#define GUEST_ACCESS_WRITE      0x02
+#define GUEST_ACCESS_USER       0x04
+#define GUEST_ACCESS_EXEC       0x10
+
+//
+// Paging controls from CR0 / CR4 / EFER that change the walk
+//
+#define GUEST_PAGING_WP         0x1             // CR0.WP: supervisor writes honour R/W
+#define GUEST_PAGING_NXE        0x2             // EFER.NXE: bit 63 is NX
+#define GUEST_PAGING_LA57       0x4             // CR4.LA57: 5-level tables
+
+typedef struct _GUEST_WALK
+{
+    UINT64 Gpa;                 // Translated address (page frame + offset)
+    UINT64 LeafGpa;             // Guest physical address of the leaf entry
+    UINT64 Leaf;                // Its value
+    UINT64 PageSize;            // 4KB, 2MB or 1GB
+    UINT32 Rights;              // GUEST_ACCESS_WRITE / USER / EXEC granted by every level
+    UINT32 ErrorCode;           // #PF error code when the walk fails
+    UINT32 UpperCount;
+    UINT64 UpperGpa[4];         // Entries above the leaf, root first
+    UINT64 Upper[4];
+} GUEST_WALK;
+
+//
+// Reads one 8-byte table entry at a guest physical address
+//
+typedef BOOLEAN (*GUEST_READ_QWORD)(PVOID Context, UINT64 Gpa, UINT64* Value);
+
+typedef struct _GUEST_TLB_ENTRY
+{
+    UINT64 Cr3;                 // Table root frame
+    UINT64 GvaPage;
+    UINT64 GpaPage;
+    UINT64 LeafGpa;
+    UINT64 Leaf;
+    UINT64 PageSize;
+    UINT64 UpperGpa[4];         // Entries above the leaf, root first
+    UINT64 Upper[4];
+    UINT64 CheckedExit;         // Exit in which the entries were last re-read
+    UINT32 UpperCount;
+    UINT32 Rights;
+    LONG Generation;
+} GUEST_TLB_ENTRY;
+
+typedef struct _GUEST_TLB
+{
+    GUEST_TLB_ENTRY Entries[GUEST_TLB_ENTRIES];
+    LONG Generation;            // Entries from older generations are invalid
+    LONG SeenGlobal;            // Last GuestTlbInvalidate generation folded in
+
+    // Table frames of the walks cached since the last flush
+    UINT64 TableFilter[GUEST_TLB_FILTER_BITS / 64];
+
+    UINT64 Hits;
+    UINT64 Misses;
+    UINT64 Stale;               // Hits dropped because an entry of the walk changed
+    UINT64 Faults;              // Walks ending in not-present or a rights violation
+    UINT64 Flushes;             // Writes to cached table frames
+    UINT64 Rechecks;            // Hits that re-read their walk (first use in an exit)
+} GUEST_TLB;
+
+typedef enum _GUEST_TLB_STAT
+{
+    GuestTlbStatHits = 0,
+    GuestTlbStatMisses,
+    GuestTlbStatStale,
+    GuestTlbStatFaults,
+    GuestTlbStatFlushes,
+    GuestTlbStatRechecks,
+} GUEST_TLB_STAT;
+
+//
+// The walk itself: no VCPU or kernel state, only the reader it is given
+//
+BOOLEAN GuestWalkTables(GUEST_READ_QWORD Read, PVOID Context, UINT64 Cr3, UINT64 Gva,
+                        UINT32 Paging, UINT32 Access, GUEST_WALK* Walk);
+
+NTSTATUS GuestTlbInitVcpu(VCPU* V);
+VOID     GuestTlbDestroyVcpu(VCPU* V);
+
+//
+// Translate through the VCPU's TLB. GuestWalk takes an explicit CR3;
+// GuestWalkCurrent uses the guest's current one.
+//
+BOOLEAN GuestWalk(VCPU* V, UINT64 Cr3, UINT64 Gva, UINT32 Access, GUEST_WALK* Walk);
+BOOLEAN GuestWalkCurrent(VCPU* V, UINT64 Gva, UINT32 Access, GUEST_WALK* Walk);
+
+VOID   GuestTlbInvalidate(VOID);
+VOID   GuestTlbNotifyWrite(VCPU* V, UINT64 Gpa);
+UINT64 GuestTlbQuery(VCPU* V, GUEST_TLB_STAT Stat);
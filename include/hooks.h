@@ -6,11 +6,10 @@
 VOID HookCpuidEmulate(UINT32 leaf, UINT32 subleaf,
     UINT32* eax, UINT32* ebx, UINT32* ecx, UINT32* edx);
 
-UINT64 HookHandleMsrRead(VCPU* V, UINT64 msr);
-VOID   HookHandleMsrWrite(VCPU* V, UINT64 msr, UINT64 value);
+NTSTATUS HookRegisterMsrHandlers(VOID);
 
 VOID HookInstallSyscall(VCPU* V);
-VOID HookRemoveSyscall();
+VOID HookRemoveSyscall(VCPU* V);
 
 
 UINT64 HookEncryptCr3(UINT64 cr3);
@@ -23,6 +22,3 @@ BOOLEAN HookNptHandleFault(VCPU* V, UINT64 faultingGpa);
 
 
 UINT64 HookVmmcallDispatch(VCPU* V, UINT64 code, UINT64 a1, UINT64 a2, UINT64 a3);
-
-
-VOID HookIoIntercept(VCPU* V);
@@ -0,0 +1,43 @@
+#pragma once
+#include <ntifs.h>
+
+struct _VCPU;
+
+//
+// Per-VCPU heavy-hitters sketch of exit sites, keyed by (guest RIP, exit
+// code, guest CR3). A count-min sketch estimates every key's frequency in
+// fixed memory; a small top-K list remembers which keys are the heaviest.
+// Only the owning VCPU writes its sketch, so updates take no locks; readers
+// on other CPUs use the top-K sequence counter to avoid torn entries.
+//
+#define HV_HOTSPOT_DEPTH        4
+#define HV_HOTSPOT_WIDTH        1024        // Power of two
+#define HV_HOTSPOT_TOPK         16
+#define HV_HOTSPOT_AGE_SHIFT    20          // Halve all counts every 2^20 updates
+#define HV_HOTSPOT_MAX_RESULTS  32
+#define HV_HOTSPOT_TAG          'PHVH'
+
+typedef struct _HV_HOTSPOT_ENTRY
+{
+    UINT64 Rip;
+    UINT64 ExitCode;
+    UINT64 Cr3;
+    UINT64 Count;
+} HV_HOTSPOT_ENTRY;
+
+typedef struct _HV_HOTSPOT
+{
+    UINT32 Counters[HV_HOTSPOT_DEPTH][HV_HOTSPOT_WIDTH];
+    HV_HOTSPOT_ENTRY Top[HV_HOTSPOT_TOPK];
+    ULONG TopCount;
+    volatile LONG TopSeq;           // Odd while Top is being changed
+    UINT64 Updates;
+    volatile LONG ResetPending;     // Applied by the owning VCPU on its next exit
+} HV_HOTSPOT;
+
+NTSTATUS HvHotspotInitVcpu(struct _VCPU* V);
+VOID     HvHotspotDestroyVcpu(struct _VCPU* V);
+
+VOID  HvHotspotRecord(struct _VCPU* V, UINT64 Rip, UINT64 ExitCode, UINT64 Cr3);
+ULONG HvHotspotMerge(HV_HOTSPOT_ENTRY* Out, ULONG Max);
+VOID  HvHotspotRequestReset(VOID);
@@ -0,0 +1,75 @@
+#pragma once
+#include <ntifs.h>
+#include "vcpu.h"
+#include "exit_dispatch.h"
+
+//
+// I/O permission map: one bit per port, 12KB as the APM requires (the bits
+// past port 0xFFFF catch multi-byte accesses that wrap). The processor tests
+// the bit of every byte an access touches, so a word or dword access exits
+// if any of its ports is marked. With the IOIO intercept enabled only marked
+// ports exit; the map starts empty.
+//
+// Handlers are registered per port range. An intercepted access no handler
+// covers is performed on the real port. String instructions (INS/OUTS, with
+// or without REP) are transferred in batches: the handler sees up to a page
+// of elements per call, and one exit moves up to HV_IO_MAX_STRING_BYTES.
+//
+#define HV_IOPM_SIZE                0x3000
+#define HV_IO_MAX_HANDLERS          16
+#define HV_IO_BUFFER_SIZE           PAGE_SIZE
+#define HV_IO_MAX_STRING_BYTES      0x10000     // Per exit; the rest re-executes the REP
+#define HV_IO_TAG                   'OIVH'
+
+//
+// One port access as handed to a handler. Data holds Count elements of Size
+// bytes in execution order: filled by the handler for IN, consumed for OUT.
+//
+typedef struct _HV_IO_ACCESS
+{
+    UINT16 Port;
+    UINT8 Size;             // 1, 2 or 4
+    BOOLEAN In;
+    UINT32 Count;           // 1 for IN/OUT, up to a buffer's worth for INS/OUTS
+    PVOID Data;
+} HV_IO_ACCESS;
+
+//
+// Return FALSE to have #GP injected into the guest
+//
+typedef BOOLEAN (*HV_IO_HANDLER)(VCPU* V, HV_IO_ACCESS* Access);
+
+typedef struct _HV_IO_RANGE
+{
+    UINT16 First;
+    UINT16 Last;
+    HV_IO_HANDLER Handler;
+} HV_IO_RANGE;
+
+typedef struct _HV_IO_STATE
+{
+    UINT64 Exits;
+    UINT64 StringExits;
+    UINT64 Elements;        // Port accesses performed, string elements included
+    UINT64 PassThrough;
+    DECLSPEC_ALIGN(16) UINT8 Buffer[HV_IO_BUFFER_SIZE];
+} HV_IO_STATE;
+
+typedef enum _HV_IO_STAT
+{
+    HvIoStatExits = 0,
+    HvIoStatStringExits,
+    HvIoStatElements,
+    HvIoStatPassThrough,
+} HV_IO_STAT;
+
+NTSTATUS HvIoInitVcpu(VCPU* V);
+VOID     HvIoDestroyVcpu(VCPU* V);
+
+NTSTATUS HvIoSetVcpuIntercept(VCPU* V, UINT16 First, UINT16 Last, BOOLEAN Enable);
+NTSTATUS HvIoSetIntercept(UINT16 First, UINT16 Last, BOOLEAN Enable);
+
+NTSTATUS HvRegisterIoHandler(UINT16 First, UINT16 Last, HV_IO_HANDLER Handler);
+
+HV_EXIT_ACTION HvIoHandleExit(VCPU* V, PGUEST_REGISTERS GuestRegs);
+UINT64         HvIoQuery(VCPU* V, HV_IO_STAT Stat);
@@ -5,7 +5,4 @@
 VOID HvActivateLayeredPipeline(VCPU* V);
 
 
-BOOLEAN HvHandleLayeredNpf(VCPU* V, UINT64 faultGpa);
-
-
-VOID HvRefreshExecLayer(VCPU* V, UINT64 exitCode);
+BOOLEAN HvHandleLayeredNpf(VCPU* V, PGUEST_REGISTERS GuestRegs, UINT64 faultGpa);
@@ -18,6 +18,11 @@
 #define MSR_GS_BASE               0xC0000101
 #define MSR_KERNEL_GS_BASE        0xC0000102
 
+#define MSR_SYSENTER_CS           0x00000174
+#define MSR_SYSENTER_ESP          0x00000175
+#define MSR_SYSENTER_EIP          0x00000176
+#define MSR_PAT                   0x00000277
+
 static __forceinline UINT64 MsrRead(ULONG msr)
 {
     return __readmsr(msr);
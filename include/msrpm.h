@@ -0,0 +1,87 @@
+#pragma once
+#include <ntifs.h>
+#include "vcpu.h"
+
+//
+// MSR permission map: two bits (read, write) per MSR in three 2KB regions,
+// 0x00000000-0x00001FFF, 0xC0000000-0xC0001FFF and 0xC0010000-0xC0011FFF.
+// With the MSR intercept enabled an access exits only when its bit is set;
+// MSRs outside the three regions always exit (on Zen that includes the SMCA
+// banks at 0xC0002000, which the Windows MCA code uses).
+//
+// Intercept bits are set per MSR or per range, on one VCPU or on every VCPU
+// (plus the template new VCPUs start from). Handlers are registered per MSR;
+// an intercepted MSR without one is passed through to the guest's value.
+// Out-of-range MSRs without a handler are run natively behind a fault-safe
+// RDMSR/WRMSR (msr_safe.asm), so one this part lacks gives the guest its #GP.
+//
+#define HV_MSRPM_SIZE           0x2000
+#define HV_MSR_MAX_HANDLERS     32
+#define HV_MSR_TAG              'SMVH'
+
+#define HV_MSR_READ             0x1
+#define HV_MSR_WRITE            0x2
+
+//
+// Handler flags
+//
+#define HV_MSR_SHADOWED         0x1     // Serve reads from the per-VCPU shadow cache
+
+//
+// Return FALSE to have #GP injected into the guest
+//
+typedef BOOLEAN (*HV_MSR_READ_HANDLER)(VCPU* V, UINT32 Msr, UINT64* Value);
+typedef BOOLEAN (*HV_MSR_WRITE_HANDLER)(VCPU* V, UINT32 Msr, UINT64 Value);
+
+typedef struct _HV_MSR_HANDLER
+{
+    UINT32 Msr;
+    UINT32 Flags;
+    HV_MSR_READ_HANDLER Read;
+    HV_MSR_WRITE_HANDLER Write;
+    volatile LONG Generation;       // Bumped to drop every VCPU's shadow of this MSR
+} HV_MSR_HANDLER;
+
+//
+// Last value each VCPU read through a shadowed handler. An entry is valid
+// while its generation matches the handler's.
+//
+typedef struct _HV_MSR_SHADOW
+{
+    struct
+    {
+        UINT64 Value;
+        LONG Generation;
+    } Entries[HV_MSR_MAX_HANDLERS];
+
+    UINT64 Hits;
+    UINT64 HandlerReads;
+    UINT64 PassThrough;
+    UINT64 NativeFaults;            // Out-of-range accesses that raised #GP
+} HV_MSR_SHADOW;
+
+typedef enum _HV_MSR_STAT
+{
+    HvMsrStatShadowHits = 0,
+    HvMsrStatHandlerReads,
+    HvMsrStatPassThrough,
+    HvMsrStatNativeFaults,
+} HV_MSR_STAT;
+
+NTSTATUS HvMsrInitVcpu(VCPU* V);
+VOID     HvMsrDestroyVcpu(VCPU* V);
+
+NTSTATUS HvMsrSetVcpuIntercept(VCPU* V, UINT32 Msr, UINT32 Access, BOOLEAN Enable);
+NTSTATUS HvMsrSetVcpuInterceptRange(VCPU* V, UINT32 First, UINT32 Last, UINT32 Access, BOOLEAN Enable);
+NTSTATUS HvMsrSetIntercept(UINT32 Msr, UINT32 Access, BOOLEAN Enable);
+NTSTATUS HvMsrSetInterceptRange(UINT32 First, UINT32 Last, UINT32 Access, BOOLEAN Enable);
+
+NTSTATUS HvRegisterMsrHandler(UINT32 Msr, HV_MSR_READ_HANDLER Read, HV_MSR_WRITE_HANDLER Write, UINT32 Flags);
+VOID     HvMsrInvalidateShadow(UINT32 Msr);
+
+UINT64 HvMsrReadGuest(VCPU* V, UINT32 Msr);
+VOID   HvMsrWriteGuest(VCPU* V, UINT32 Msr, UINT64 Value);
+
+BOOLEAN HvMsrHandleRead(VCPU* V, UINT32 Msr, UINT64* Value);
+BOOLEAN HvMsrHandleWrite(VCPU* V, UINT32 Msr, UINT64 Value);
+UINT64  HvMsrQuery(VCPU* V, HV_MSR_STAT Stat);
@@ -1,5 +1,6 @@
 #pragma once
 #include <ntifs.h>
+#include "page_map.h"
 
 #define PAGE_PRESENT     1ULL
 #define PAGE_WRITE       (1ULL << 1)
@@ -26,6 +27,128 @@ typedef union _NPT_ENTRY
     };
 } NPT_ENTRY;
 
+//
+// Pages reserved per VCPU for NPT tables created after init (copy-on-write
+// clones of the shared PML4/PDPTs, split PDs and PTs, MMIO fault-in). The
+// arena cannot grow after load, so it is sized from the high-water marks
+// NptQueryArena reports: a full dirty-log range takes about 68 pages (64 PTs,
+// their PDs and the PML4/PDPT clones) and typical hook sets stay below 20.
+// The rest is headroom for hooks spread over many 2MB regions.
+//
+#define NPT_ARENA_PAGES 128
+
+typedef struct _NPT_ARENA
+{
+    PUINT8 BaseVa;
+    UINT64 BasePa;
+    ULONG PageCount;
+    ULONG NextFree;     // Bump index of the first never-used page
+    ULONG FreeHead;     // Freelist head as (page index + 1), 0 = empty
+    ULONG InUse;
+    ULONG HighWater;
+    ULONG Failures;
+} NPT_ARENA;
+
+//
+// Hook map slots per VCPU. The practical limit is lower: each hook on a new
+// 2MB region costs one PT (and one PD per new 1GB region) from the arena
+// above, so hooks can span at most about NPT_ARENA_PAGES / 2 distinct 2MB
+// regions, less while dirty logging holds its PTs. Any number of hooks fit
+// in regions that are already split. NptAddShadowHooks checks the arena up
+// front and installs nothing if the batch would not fit.
+//
+#define NPT_HOOK_CAPACITY 4096
+
+//
+// NPF traps per VCPU (not-present 4KB pages that signal on first touch)
+//
+#define NPT_TRAP_CAPACITY 256
+#define NPT_TRAP_TAG      'TTPN'
+
+typedef struct _NPT_TRAP
+{
+    UINT64 GpaPage;
+    UINT64 OriginalPageFrame;
+    NPT_ENTRY* Leaf;            // Cached 4KB PTE, valid while the trap exists
+    BOOLEAN Armed;
+    BOOLEAN UsingFakePage;
+} NPT_TRAP;
+
+typedef struct _NPT_HOOK_DESC
+{
+    UINT64 TargetGpa;
+    UINT64 NewHpa;
+} NPT_HOOK_DESC;
+
+typedef struct _NPT_ARENA_STATS
+{
+    ULONG Capacity;
+    ULONG InUse;
+    ULONG HighWater;
+    ULONG Failures;
+    ULONG Splits;
+    ULONG Merges;
+} NPT_ARENA_STATS;
+
+//
+// Dirty logging covers one GPA range of up to NPT_DIRTY_MAX_PAGES (128MB).
+// Every 2MB of range costs one PT from each VCPU's arena.
+//
+#define NPT_DIRTY_MAX_PAGES 32768
+#define NPT_DIRTY_USE_DBIT  0x1
+
+typedef struct _NPT_DIRTY_STATS
+{
+    BOOLEAN Active;
+    ULONG PageCount;
+    ULONG Faults;           // Write NPFs taken on this VCPU
+    ULONG Stragglers;       // VCPUs that missed the last harvest
+    ULONG StartFailures;    // VCPUs that ran out of arena write-protecting a range
+} NPT_DIRTY_STATS;
+
+//
+// Accessed-bit sampler: up to NPT_SAMPLE_MAX_RANGES GPA ranges, histogram
+// kept per 2MB region (NPT_SAMPLE_MAX_BUCKETS regions = 4GB in total)
+//
+#define NPT_SAMPLE_MAX_RANGES   8
+#define NPT_SAMPLE_MAX_BUCKETS  2048
+
+typedef struct _NPT_SAMPLE_BUCKET
+{
+    UINT16 Touched;         // 4KB pages accessed during the last full pass
+    UINT16 Accum;           // Pass in progress
+    UINT8 Heat;             // Passes with any access, saturating, decays
+    UINT8 Reserved[3];
+} NPT_SAMPLE_BUCKET;
+
+typedef struct _NPT_SAMPLE_RANGE
+{
+    UINT64 BaseGpa;
+    UINT64 EndGpa;
+    ULONG FirstBucket;
+} NPT_SAMPLE_RANGE;
+
+typedef struct _NPT_SYNC_STATS
+{
+    UINT64 Generation;
+    UINT64 LastVisibleTicks;    // Publish -> applied on every VCPU (TSC)
+    UINT64 MaxVisibleTicks;
+    ULONG Resyncs;
+    ULONG Kicks;
+} NPT_SYNC_STATS;
+
+//
+// Classification of a guest physical address (1GB granularity below the top
+// of RAM) used to decide whether an NPF on an unpopulated slot is a
+// legitimate lazy fill
+//
+typedef enum _NPT_GPA_CLASS
+{
+    NptGpaNone = 0,
+    NptGpaRam = 1,
+    NptGpaMmio = 2,
+} NPT_GPA_CLASS;
+
 typedef struct _NPT_STATE
 {
     NPT_ENTRY* Pml4;
@@ -34,15 +157,13 @@ typedef struct _NPT_STATE
     UINT64 ShadowCr3;
 
 
-    struct
-    {
-        UINT64 GpaPage;
-        UINT64 OriginalPageFrame;
-        BOOLEAN Armed;
-        BOOLEAN UsingFakePage;
-    } Apic, Acpi, Smm, Mmio;
+    // Trap registry: dense slot array, GPA page -> slot index, fired list
+    NPT_TRAP* Traps;
+    ULONG TrapCount;
+    PAGE_MAP TrapIndex;
+    ULONG* Fired;
+    ULONG FiredCount;
 
-  
     struct
     {
         UINT64 GpaPage;
@@ -55,35 +176,101 @@ typedef struct _NPT_STATE
     PHYSICAL_ADDRESS FakePagePa[2];
     ULONG FakePageIndex;
 
-    struct
-    {
-        UINT64 TargetGpaPage;
-        UINT64 NewHpaPage;
-        BOOLEAN Active;
-    } ShadowHook;
+    // Shadow hooks keyed by target GPA page, value = replacement HPA page
+    PAGE_MAP Hooks;
     
     // Flag to track when TLB flush is needed after hook operations
     BOOLEAN TlbFlushPending;
-    
-    // 1GB page PDPT entries (for simple identity mapping)
-    // This provides full address space coverage without per-page allocation
-    NPT_ENTRY* PdptEntries;
-    PHYSICAL_ADDRESS PdptEntriesPa;
+
+    // Tables cloned out of the shared identity hierarchy (copy-on-write)
+    ULONG CowClones;
+
+    // Dirty page logging (double-buffered, see NptDirtyEpoch)
+    struct
+    {
+        UINT64 BaseGpa;
+        ULONG PageCount;
+        ULONG Current;          // Index of the live bitmap
+        PULONG Bitmap[2];
+        ULONG Faults;
+        BOOLEAN UseDBit;
+        BOOLEAN Active;
+    } Dirty;
+
+    // Accessed-bit sampler: this VCPU's copy of the configuration (as of
+    // Seq), its cursor and per-2MB histogram (NptSampleStep)
+    struct
+    {
+        NPT_SAMPLE_BUCKET* Buckets;
+        ULONG Seq;
+        ULONG Range;
+        UINT64 Cursor;
+        UINT64 NextPassTsc;
+        ULONG Passes;
+        ULONG RangeCount;
+        ULONG BucketCount;
+        UINT64 PeriodTsc;
+        NPT_SAMPLE_RANGE Ranges[NPT_SAMPLE_MAX_RANGES];
+    } Sampler;
+
+    // Last global NPT generation replayed into this VCPU (NptSyncChanges)
+    UINT64 SyncedGeneration;
+    ULONG SyncFailures;
+
+    // Large leaves broken down / coalesced back by the split engine
+    ULONG Splits;
+    ULONG Merges;
+
+    NPT_ARENA Arena;
 } NPT_STATE;
 
-VOID NptGlobalInit(VOID);
+NTSTATUS NptGlobalInit(VOID);
+VOID NptGlobalDestroy(VOID);
+VOID NptReportSharing(ULONG VcpuCount);
 NTSTATUS NptInitialize(NPT_STATE* State);
 VOID NptDestroy(NPT_STATE* State);
 PVOID NptLookupTable(UINT64 pa);
+VOID NptQueryArena(NPT_STATE* State, NPT_ARENA_STATS* Stats);
+NPT_GPA_CLASS NptClassifyGpa(UINT64 Gpa);
+BOOLEAN NptHandleLazyFill(NPT_STATE* State, UINT64 Gpa);
 
 PHYSICAL_ADDRESS NptTranslateGvaToHpa(NPT_STATE* State, UINT64 Gva);
 PHYSICAL_ADDRESS NptTranslateGpaToHpa(NPT_STATE* State, UINT64 Gpa);
 BOOLEAN NptHookPage(NPT_STATE* State, UINT64 GuestPhysical, UINT64 NewHostPhysical);
 VOID NptUpdateShadowCr3(NPT_STATE* State, UINT64 GuestCr3);
-BOOLEAN NptInstallShadowHook(NPT_STATE* State, UINT64 TargetGpa, UINT64 NewHpa);
-VOID NptClearShadowHook(NPT_STATE* State);
+BOOLEAN NptAddShadowHook(NPT_STATE* State, UINT64 TargetGpa, UINT64 NewHpa);
+ULONG NptAddShadowHooks(NPT_STATE* State, const NPT_HOOK_DESC* Hooks, ULONG Count);
+BOOLEAN NptRemoveShadowHook(NPT_STATE* State, UINT64 TargetGpa);
+BOOLEAN NptFindShadowHook(NPT_STATE* State, UINT64 Gpa, UINT64* NewHpa);
+VOID NptClearShadowHooks(NPT_STATE* State);
+
+BOOLEAN NptPublishHook(UINT64 TargetGpa, UINT64 NewHpa);
+BOOLEAN NptPublishUnhook(UINT64 TargetGpa);
+VOID NptPublishClearHooks(VOID);
+BOOLEAN NptSyncChanges(NPT_STATE* State);
+VOID NptQuerySyncStats(NPT_SYNC_STATS* Stats);
+
+NTSTATUS NptDirtyLogStart(NPT_STATE* Self, ULONG SelfIndex, UINT64 BaseGpa, ULONG PageCount, ULONG Flags);
+VOID NptDirtyLogStop(NPT_STATE* Self, ULONG SelfIndex);
+ULONG NptDirtyLogHarvest(NPT_STATE* Self, ULONG SelfIndex, PULONG* Bitmap, ULONG* PageCount);
+VOID NptDirtyLogHarvestDone(VOID);
+BOOLEAN NptHandleDirtyFault(NPT_STATE* State, UINT64 Gpa, UINT64 ErrorCode);
+VOID NptQueryDirtyStats(NPT_STATE* State, NPT_DIRTY_STATS* Stats);
+
+VOID NptSampleStep(NPT_STATE* State);
+NTSTATUS NptSamplerAddRange(UINT64 BaseGpa, UINT64 PageCount);
+VOID NptSamplerControl(BOOLEAN Enable, UINT64 PeriodTsc);
+ULONG NptSamplerCollect(NPT_SAMPLE_BUCKET* Out, ULONG First, ULONG MaxBuckets, ULONG* Passes);
 
 
 BOOLEAN NptSetupHardwareTriggers(NPT_STATE* State, UINT64 apicGpa, UINT64 acpiGpa, UINT64 smmGpa, UINT64 mmioGpa);
 BOOLEAN NptHandleHardwareTriggers(NPT_STATE* State, UINT64 faultGpa, UINT64* mailboxValue);
 VOID NptRearmHardwareTriggers(NPT_STATE* State);
+VOID NptClearHardwareTriggers(NPT_STATE* State);
+
+BOOLEAN NptAddTrap(NPT_STATE* State, UINT64 Gpa);
+BOOLEAN NptRemoveTrap(NPT_STATE* State, UINT64 Gpa);
+BOOLEAN NptHandleTrapFault(NPT_STATE* State, UINT64 FaultGpa, UINT64* MailboxValue);
+PVOID NptTrapBacking(NPT_STATE* State, UINT64 Gpa);
+VOID NptRearmTraps(NPT_STATE* State);
+VOID NptClearTraps(NPT_STATE* State);
@@ -0,0 +1,14 @@
+#pragma once
+#include <ntifs.h>
+#include "vcpu.h"
+
+//
+// Content hash over guest physical pages, for integrity checks of code
+// and tables from the exit path. Eight 32-bit lanes of the xxHash32 round
+// run over each 32-byte stripe; the AVX2 kernel and the scalar kernel
+// compute the same value, so either can be used to verify the other.
+//
+#define PAGE_HASH_MAX_PAGES     4096        // Bounds one exit to 16MB of hashing
+#define PAGE_HASH_FAILED        (~0ULL)
+
+UINT64 PageHashGuest(VCPU* V, UINT64 Gpa, UINT64 Pages, BOOLEAN Vector);
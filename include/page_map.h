@@ -0,0 +1,45 @@
+#pragma once
+#include <ntifs.h>
+
+//
+// Open-addressed hash keyed by 4KB GPA page, used on the NPF path where a
+// lookup has to be O(1) without locks or allocation.
+//
+// Capacity is fixed at init (power of two, linear probing). Keys are stored
+// with bit 0 set so page 0 is a valid key; a slot holding 0 is empty and
+// PAGE_MAP_TOMBSTONE marks a removed entry so probe chains stay intact.
+// Once tombstones pile up the table is rehashed in place, which moves live
+// entries; Rehashes counts that so a cursor held across unlocked sections
+// can tell its position is stale.
+//
+#define PAGE_MAP_TOMBSTONE  2ULL
+#define PAGE_MAP_TAG        'MPVH'
+
+typedef struct _PAGE_MAP_SLOT
+{
+    UINT64 Key;
+    UINT64 Value;
+} PAGE_MAP_SLOT;
+
+typedef struct _PAGE_MAP
+{
+    PAGE_MAP_SLOT* Slots;
+    ULONG Mask;         // Slot count - 1
+    ULONG Count;        // Live entries
+    ULONG Used;         // Live entries + tombstones
+    ULONG Limit;        // Max Used before inserts are refused (3/4 load)
+    ULONG Rehashes;     // In-place rehashes so far (live entries moved)
+} PAGE_MAP;
+
+NTSTATUS PageMapInit(PAGE_MAP* Map, ULONG Capacity);
+VOID PageMapDestroy(PAGE_MAP* Map);
+VOID PageMapClear(PAGE_MAP* Map);
+
+BOOLEAN PageMapInsert(PAGE_MAP* Map, UINT64 Gpa, UINT64 Value);
+BOOLEAN PageMapRemove(PAGE_MAP* Map, UINT64 Gpa, UINT64* OldValue);
+UINT64* PageMapFind(PAGE_MAP* Map, UINT64 Gpa);
+
+//
+// Iterate live entries: Cursor starts at 0, returns FALSE when done
+//
+BOOLEAN PageMapNext(PAGE_MAP* Map, ULONG* Cursor, UINT64* Gpa, UINT64* Value);
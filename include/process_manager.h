@@ -8,6 +8,7 @@ typedef struct _PROCESS_DETAILS
     UINT64 DirectoryTableBase;
 } PROCESS_DETAILS, *PPROCESS_DETAILS;
 
+NTSTATUS ProcessManagerInit(VOID);
 NTSTATUS ProcessQueryByPid(HANDLE Pid, PPROCESS_DETAILS Details);
 NTSTATUS ProcessQueryCurrent(PPROCESS_DETAILS Details);
 EXTERN_C PVOID PsGetProcessSectionBaseAddress(PEPROCESS Process);
@@ -8,6 +8,14 @@ typedef struct _SMP_STATE
     ULONG ProcessorCount;
     VCPU** Vcpus;
     PPROCESSOR_NUMBER ProcessorNumbers;
+
+    // Remote kick: NMI through the local APIC, claimed by our NMI callback
+    UINT32* ApicIds;
+    volatile LONG* KickPending;
+    PVOID NmiCallback;
+    PVOID ApicMmio;             // xAPIC register page, NULL in x2APIC mode
+    BOOLEAN X2Apic;
+    volatile LONG Kicks;
 } SMP_STATE;
 
 #define SMP_MAX_VCPUS_ALL 0
@@ -15,3 +23,10 @@ typedef struct _SMP_STATE
 NTSTATUS SmpInitialize(SMP_STATE* State, ULONG MaxVcpus);
 NTSTATUS SmpLaunch(SMP_STATE* State);
 VOID SmpShutdown(SMP_STATE* State);
+
+ULONG SmpGetVcpuCount(VOID);
+VCPU* SmpGetVcpu(ULONG Index);
+VOID SmpKick(ULONG Index);
+VOID SmpKickOthers(ULONG SelfIndex);
+BOOLEAN SmpRaiseGuestNmi(ULONG Index);
+ULONG SmpQueryKicks(VOID);
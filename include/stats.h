@@ -0,0 +1,71 @@
+#pragma once
+#include <ntifs.h>
+#include "exit_dispatch.h"
+
+//
+// Per-VCPU exit latency statistics. Each VCPU updates only its own block
+// from the exit path; readers on other CPUs get a slightly stale but
+// consistent-enough view, which is all a profiler needs.
+//
+// Histograms are log-linear: four sub-buckets per power of two, so every
+// bucket is within 25% of its neighbours from 4 cycles up to 2^32 cycles.
+//
+#define HV_HIST_SUB_BITS        2
+#define HV_HIST_BUCKETS         128
+#define HV_STAT_EXIT_SLOTS      32      // Distinct exit codes tracked per VCPU
+#define HV_STAT_CALL_SLOTS      32      // Distinct hypercall codes tracked per VCPU
+#define HV_STAT_TAG             'TSVH'
+
+typedef struct _HV_HISTOGRAM
+{
+    UINT64 Count;
+    UINT64 Total;
+    UINT64 Max;
+    UINT32 Buckets[HV_HIST_BUCKETS];
+} HV_HISTOGRAM;
+
+typedef struct _HV_STATS
+{
+    //
+    // Exit code -> slot + 1 (0 = not seen yet); the last slot collects
+    // every code that arrives after the others are taken
+    //
+    UINT8 ExitSlot[HV_EXIT_TABLE_SIZE];
+    UINT64 ExitCodes[HV_STAT_EXIT_SLOTS];
+    HV_HISTOGRAM Exit[HV_STAT_EXIT_SLOTS];
+    ULONG ExitSlotsUsed;
+
+    UINT64 CallCodes[HV_STAT_CALL_SLOTS];
+    HV_HISTOGRAM Call[HV_STAT_CALL_SLOTS];
+    ULONG CallSlotsUsed;
+
+    //
+    // World-switch split, from the TSC stamps LaunchVm takes around VMRUN
+    //
+    UINT64 GuestTsc;
+    UINT64 HostTsc;
+    UINT64 LastExitTsc;
+
+    volatile LONG ResetPending;     // Applied by the owning VCPU on its next exit
+} HV_STATS;
+
+typedef enum _HV_STAT_FIELD
+{
+    HvStatGuestTsc = 0,
+    HvStatHostTsc,
+    HvStatExits,
+    HvStatExitSlots,
+    HvStatCallSlots,
+} HV_STAT_FIELD;
+
+struct _VCPU;
+
+NTSTATUS HvStatsInitVcpu(struct _VCPU* V);
+VOID     HvStatsDestroyVcpu(struct _VCPU* V);
+
+VOID   HvStatsRecordExit(struct _VCPU* V, UINT64 ExitCode, UINT64 Cycles);
+VOID   HvStatsRecordCall(struct _VCPU* V, UINT64 Code, UINT64 Cycles);
+VOID   HvStatsRecordWorldSwitch(struct _VCPU* V, UINT64 VmrunTsc, UINT64 ExitTsc);
+UINT64 HvStatsQuery(struct _VCPU* Source, HV_STAT_FIELD Field);
+BOOLEAN HvStatsGetHistogram(struct _VCPU* Source, BOOLEAN Calls, ULONG Slot, UINT64* Code, HV_HISTOGRAM* Out);
+VOID   HvStatsRequestReset(struct _VCPU* Source);
@@ -1,5 +1,7 @@
 #pragma once
+#include <ntifs.h>
 
+struct _VCPU;
 
 VOID StealthEnable();
 VOID StealthDisable();
@@ -15,7 +17,6 @@ UINT64 StealthDecryptCr3(UINT64 cr3_enc);
 
 
 VOID StealthHideHypervisorMemory(struct _VCPU* V);
-VOID StealthCleanVmcb(struct _VCPU* V);
 
 
 BOOLEAN StealthPreventVmrunDetection();
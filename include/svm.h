@@ -1,8 +1,17 @@
 #pragma once
 #include <ntifs.h>
 
+//
+// Values from the AMD APM vol. 2: exit codes from appendix C, intercept
+// bits from the VMCB control area layout in appendix B (word 3 is the
+// 32-bit vector at offset 0x0C, word 4 the one at 0x10). Word 3 bit 1 is
+// the NMI intercept and word 4 bit 3 is VMSAVE, so an off-by-a-row value
+// here silently intercepts the wrong instruction.
+//
+
 // SVM Exit Codes
-#define SVM_EXIT_VINTR        0x61
+#define SVM_EXIT_INTR         0x60
+#define SVM_EXIT_VINTR        0x64
 #define SVM_EXIT_RDTSC        0x6E
 #define SVM_EXIT_CPUID        0x72
 #define SVM_EXIT_HLT          0x78
@@ -17,7 +26,9 @@
 #define SVM_INTERCEPT_WORD4   4
 
 // Intercept bits for word 3
-#define SVM_INTERCEPT_RDTSC   (1u << 1)
+#define SVM_INTERCEPT_INTR    (1u << 0)
+#define SVM_INTERCEPT_VINTR   (1u << 4)
+#define SVM_INTERCEPT_RDTSC   (1u << 14)
 #define SVM_INTERCEPT_CPUID   (1u << 18)
 #define SVM_INTERCEPT_HLT     (1u << 24)
 #define SVM_INTERCEPT_IOIO    (1u << 27)
@@ -26,11 +37,22 @@
 // Intercept bits for word 4
 #define SVM_INTERCEPT_VMRUN   (1u << 0)
 #define SVM_INTERCEPT_VMMCALL (1u << 1)
-#define SVM_INTERCEPT_RDTSCP  (1u << 3)
+#define SVM_INTERCEPT_RDTSCP  (1u << 7)
 
 // NPT control
 #define SVM_NESTED_CTL_NP_ENABLE 0x1
 
+//
+// Logging from the VMEXIT path. DbgPrint takes locks and may IPI, neither of
+// which is safe with the guest frozen and GIF clear, so exit-path messages
+// compile away unless HV_EXIT_PATH_DEBUG is defined for a debug session.
+//
+#ifdef HV_EXIT_PATH_DEBUG
+#define HV_EXIT_LOG(...) DbgPrint(__VA_ARGS__)
+#else
+#define HV_EXIT_LOG(...) ((void)0)
+#endif
+
 // Custom HV status codes
 #define HV_STATUS_BASE                ((NTSTATUS)0xC0F00000) 
 #define HV_STATUS_ALLOC_VCPU          (HV_STATUS_BASE + 0x01)
@@ -44,6 +66,7 @@
 #define HV_STATUS_NPT_PML4            (HV_STATUS_BASE + 0x12)
 #define HV_STATUS_NPT_PDPT            (HV_STATUS_BASE + 0x13)
 #define HV_STATUS_NPT_PD              (HV_STATUS_BASE + 0x14)
+#define HV_STATUS_NPT_ARENA           (HV_STATUS_BASE + 0x15)
 #define HV_STATUS_SMP_ALLOC           (HV_STATUS_BASE + 0x20)
 #define HV_STATUS_SVMINIT_CPU_BASE    (HV_STATUS_BASE + 0x30)
 
@@ -67,3 +90,12 @@ NTSTATUS SvmLaunch(struct _VCPU* V);
 VOID     SvmShutdown(struct _VCPU* V);
 
 NTSTATUS HypervisorHandleExit(struct _VCPU* V);
+
+// A/B switch for VMCB state caching (FALSE = reload everything on each VMRUN)
+VOID     HvSetVmcbCaching(BOOLEAN Enable);
+
+// Swap the host's VMLOAD/VMSAVE state in for the rest of this exit
+VOID     HvEnsureHostState(struct _VCPU* V);
+
+// A/B switch for lazy VMLOAD/VMSAVE (FALSE = swap on every exit)
+VOID     HvSetLazyHostState(BOOLEAN Enable);
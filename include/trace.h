@@ -0,0 +1,62 @@
+#pragma once
+#include <ntifs.h>
+#include "sync.h"
+
+struct _VCPU;
+
+//
+// Per-VCPU VMEXIT trace ring. Each VCPU is the only producer of its own ring
+// and never waits: when the consumer falls behind the oldest records are
+// overwritten and counted as lost. Consumers (the drain hypercall, possibly
+// on another CPU) validate every copied record against its sequence number.
+//
+#define HV_TRACE_RING_RECORDS   1024    // Power of two
+#define HV_TRACE_TAG            'RTVH'
+
+//
+// HV_TRACE_RECORD.Outcome layout
+//
+#define HV_TRACE_OUTCOME_ADVANCE    0x00000001  // Handler advanced RIP
+#define HV_TRACE_OUTCOME_INJECT     0x00000100  // Event injected on this exit
+#define HV_TRACE_OUTCOME_VECTOR(o)  (((o) >> 16) & 0xFF)
+
+typedef struct _HV_TRACE_RECORD
+{
+    UINT64 Seq;             // Index + 1 once the record is complete, 0 while it is written
+    UINT64 Tsc;
+    UINT64 ExitCode;
+    UINT64 Rip;
+    UINT64 ExitInfo1;
+    UINT64 ExitInfo2;
+    UINT64 Cr3;
+    UINT32 Outcome;
+    UINT32 Reserved;
+} HV_TRACE_RECORD;
+
+C_ASSERT(sizeof(HV_TRACE_RECORD) == 64);
+
+typedef struct _HV_TRACE_RING
+{
+    HV_TRACE_RECORD Records[HV_TRACE_RING_RECORDS];
+    volatile UINT64 Head;   // Records ever written (producer)
+    volatile UINT64 Tail;   // Next record the consumer wants
+    volatile UINT64 Lost;   // Overwritten before they were drained
+    UINT64 Drained;
+    HV_SPINLOCK DrainLock;  // Serializes consumers only; the producer never takes it
+} HV_TRACE_RING;
+
+typedef struct _HV_TRACE_STATS
+{
+    UINT64 Written;
+    UINT64 Drained;
+    UINT64 Lost;
+    BOOLEAN Enabled;
+} HV_TRACE_STATS;
+
+NTSTATUS HvTraceInitVcpu(struct _VCPU* V);
+VOID     HvTraceDestroyVcpu(struct _VCPU* V);
+
+VOID    HvTraceEnable(BOOLEAN Enable);
+VOID    HvTraceExit(struct _VCPU* V, UINT64 Tsc, UINT64 Rip, UINT32 Outcome);
+ULONG   HvTraceDrain(struct _VCPU* Source, HV_TRACE_RECORD* Out, ULONG Max);
+VOID    HvTraceQueryStats(struct _VCPU* Source, HV_TRACE_STATS* Stats);
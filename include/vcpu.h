@@ -2,6 +2,7 @@
 #include <ntifs.h>
 #include "vmcb.h"
 #include "npt.h"
+#include "trace.h"
 
 //
 // Size of the VCPU host stack (must match KERNEL_STACK_SIZE = 0x6000)
@@ -48,7 +49,10 @@ typedef struct _HOST_STACK_LAYOUT
     UINT64 HostVmcbPa;              // Host VMCB PA
     struct _VCPU* Self;             // Pointer back to VCPU
     UINT64 ProcessorIndex;          // CPU index
-    UINT64 Reserved1;               // Padding for alignment
+    UINT64 VmrunTsc;                // TSC just before VMRUN (vmrun.asm HSL_VMRUN_TSC)
+    UINT64 ExitTsc;                 // TSC after guest registers are saved (HSL_EXIT_TSC)
+    UINT64 RdxScratch;              // Guest RDX while LaunchVm reads the TSC (HSL_RDX_SCRATCH)
+    UINT64 HostStateLoaded;         // Host VMSAVE state is in the CPU, guest's is in the VMCB (HSL_HOST_STATE)
 } HOST_STACK_LAYOUT, *PHOST_STACK_LAYOUT;
 
 //
@@ -83,13 +87,13 @@ typedef struct _VCPU
     NPT_STATE Npt;
 
     //
-    // MSR Permission Map (3 pages = 0x6000)
+    // MSR Permission Map (0x2000, see msrpm.h)
     //
     PVOID Msrpm;
     PHYSICAL_ADDRESS MsrpmPa;
 
     //
-    // I/O Permission Map (0x2000)
+    // I/O Permission Map (0x3000, see iopm.h)
     //
     PVOID Iopm;
     PHYSICAL_ADDRESS IopmPa;
@@ -101,7 +105,6 @@ typedef struct _VCPU
     {
         UINT64 ExitCount;
         UINT64 LastExitCode;
-        UINT64 ExitBudget;
     } Exec;
 
     //
@@ -114,6 +117,78 @@ typedef struct _VCPU
         BOOLEAN Active;
     } Ipc;
 
+    //
+    // Per-VCPU physical mapping window (one reserved page of system VA whose
+    // PTE is rewritten in place), used by guest memory access on the exit path
+    //
+    struct
+    {
+        PVOID Va;
+        volatile UINT64* Pte;
+    } MapWindow;
+
+    //
+    // VMEXIT trace ring (single producer: this VCPU)
+    //
+    HV_TRACE_RING* Trace;
+
+    //
+    // Exit / hypercall latency histograms (see stats.h)
+    //
+    struct _HV_STATS* Stats;
+
+    //
+    // Heavy-hitter exit sites (see hotspot.h)
+    //
+    struct _HV_HOTSPOT* Hotspots;
+
+    //
+    // Guest x87/SSE/AVX image for handlers that run vector code (see xstate.h)
+    //
+    struct _HV_XSTATE* Xstate;
+
+    //
+    // CPUID responses snapshotted on this CPU (see cpuid_cache.h)
+    //
+    struct _HV_CPUID_TABLE* Cpuid;
+
+    //
+    // Last values of shadowed intercepted MSRs (see msrpm.h)
+    //
+    struct _HV_MSR_SHADOW* MsrShadow;
+
+    //
+    // Copy of this CPU's host IDT with the #GP gate redirected, loaded
+    // around out-of-range MSR accesses (see msrpm.c); built on first use
+    //
+    PVOID MsrSafeIdt;
+    BOOLEAN MsrSafeIdtReady;
+
+    //
+    // IOIO counters and the string I/O bounce buffer (see iopm.h)
+    //
+    struct _HV_IO_STATE* Io;
+
+    //
+    // Decoded-instruction cache for NPF emulation (see emulate.h)
+    //
+    struct _HV_EMU_STATE* Emu;
+
+    //
+    // Exceptions, NMIs and interrupts waiting for injection (see event.h)
+    //
+    struct _HV_EVENT_QUEUE* Events;
+
+    //
+    // Deadlines and run statistics of deferred work items (see defer.h)
+    //
+    struct _HV_DEFER_STATE* Defer;
+
+    //
+    // Software TLB in front of the guest page walker (see guest_walk.h)
+    //
+    struct _GUEST_TLB* Tlb;
+
     //
     // Extra metadata
     //
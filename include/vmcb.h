@@ -149,4 +149,142 @@ static __forceinline VMCB_STATE_SAVE_AREA* VmcbState(VMCB* Vmcb)
     return (VMCB_STATE_SAVE_AREA*)&Vmcb->Bytes[0x400];
 }
 
+//
+// VMCB clean bits (AMD APM vol. 2, "VMCB State Caching"). A set bit tells
+// VMRUN the CPU may reuse its cached copy of that group of fields; a clear
+// bit forces a reload. HandleVmExit marks everything clean on entry, and
+// handlers change cached fields only through the accessors below, which
+// clear just the bit that covers the field.
+//
+#define VMCB_CLEAN_INTERCEPTS   (1u << 0)   // Intercept vectors, TSC offset, pause filter
+#define VMCB_CLEAN_IOPM         (1u << 1)   // IOPM / MSRPM base
+#define VMCB_CLEAN_ASID         (1u << 2)
+#define VMCB_CLEAN_TPR          (1u << 3)   // V_TPR and the virtual interrupt controls
+#define VMCB_CLEAN_NP           (1u << 4)   // Nested CR3, nested control, gPAT
+#define VMCB_CLEAN_CRX          (1u << 5)   // CR0, CR3, CR4, EFER
+#define VMCB_CLEAN_DRX          (1u << 6)   // DR6, DR7
+#define VMCB_CLEAN_DT           (1u << 7)   // GDTR / IDTR
+#define VMCB_CLEAN_SEG          (1u << 8)   // CS, DS, SS, ES, CPL
+#define VMCB_CLEAN_CR2          (1u << 9)
+#define VMCB_CLEAN_LBR          (1u << 10)  // DebugCtl, branch / exception records
+#define VMCB_CLEAN_AVIC         (1u << 11)
+#define VMCB_CLEAN_ALL          0x00000FFFu
+
+static __forceinline VOID VmcbMarkAllClean(VMCB* Vmcb)
+{
+    VmcbControl(Vmcb)->VmcbClean = VMCB_CLEAN_ALL;
+}
+
+static __forceinline VOID VmcbMarkDirty(VMCB* Vmcb, UINT32 Bits)
+{
+    VmcbControl(Vmcb)->VmcbClean &= ~Bits;
+}
+
+static __forceinline VOID VmcbSetIntercept(VMCB* Vmcb, UINT32 Word, UINT32 Bits)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(Vmcb);
+    if ((c->Intercepts[Word] & Bits) != Bits)
+    {
+        c->Intercepts[Word] |= Bits;
+        c->VmcbClean &= ~VMCB_CLEAN_INTERCEPTS;
+    }
+}
+
+static __forceinline VOID VmcbClearIntercept(VMCB* Vmcb, UINT32 Word, UINT32 Bits)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(Vmcb);
+    if (c->Intercepts[Word] & Bits)
+    {
+        c->Intercepts[Word] &= ~Bits;
+        c->VmcbClean &= ~VMCB_CLEAN_INTERCEPTS;
+    }
+}
+
+static __forceinline VOID VmcbSetTscOffset(VMCB* Vmcb, UINT64 Offset)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(Vmcb);
+    if (c->TscOffset != Offset)
+    {
+        c->TscOffset = Offset;
+        c->VmcbClean &= ~VMCB_CLEAN_INTERCEPTS;
+    }
+}
+
+static __forceinline VOID VmcbSetPermissionMaps(VMCB* Vmcb, UINT64 IopmPa, UINT64 MsrpmPa)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(Vmcb);
+    c->IopmBasePa = IopmPa;
+    c->MsrpmBasePa = MsrpmPa;
+    c->VmcbClean &= ~VMCB_CLEAN_IOPM;
+}
+
+static __forceinline VOID VmcbSetAsid(VMCB* Vmcb, UINT32 Asid)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(Vmcb);
+    c->GuestAsid = Asid;
+    c->VmcbClean &= ~VMCB_CLEAN_ASID;
+}
+
+static __forceinline VOID VmcbSetInterruptControl(VMCB* Vmcb, UINT32 Value)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(Vmcb);
+    if (c->InterruptControl != Value)
+    {
+        c->InterruptControl = Value;
+        c->VmcbClean &= ~VMCB_CLEAN_TPR;
+    }
+}
+
+static __forceinline VOID VmcbSetNestedCr3(VMCB* Vmcb, UINT64 NestedCr3)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(Vmcb);
+    if (c->NestedCr3 != NestedCr3)
+    {
+        c->NestedCr3 = NestedCr3;
+        c->VmcbClean &= ~VMCB_CLEAN_NP;
+    }
+}
+
+static __forceinline VOID VmcbSetCr0(VMCB* Vmcb, UINT64 Value)
+{
+    VmcbState(Vmcb)->Cr0 = Value;
+    VmcbControl(Vmcb)->VmcbClean &= ~VMCB_CLEAN_CRX;
+}
+
+static __forceinline VOID VmcbSetCr3(VMCB* Vmcb, UINT64 Value)
+{
+    VmcbState(Vmcb)->Cr3 = Value;
+    VmcbControl(Vmcb)->VmcbClean &= ~VMCB_CLEAN_CRX;
+}
+
+static __forceinline VOID VmcbSetCr4(VMCB* Vmcb, UINT64 Value)
+{
+    VmcbState(Vmcb)->Cr4 = Value;
+    VmcbControl(Vmcb)->VmcbClean &= ~VMCB_CLEAN_CRX;
+}
+
+static __forceinline VOID VmcbSetEfer(VMCB* Vmcb, UINT64 Value)
+{
+    VmcbState(Vmcb)->Efer = Value;
+    VmcbControl(Vmcb)->VmcbClean &= ~VMCB_CLEAN_CRX;
+}
+
+static __forceinline VOID VmcbSetDr6(VMCB* Vmcb, UINT64 Value)
+{
+    VmcbState(Vmcb)->Dr6 = Value;
+    VmcbControl(Vmcb)->VmcbClean &= ~VMCB_CLEAN_DRX;
+}
+
+static __forceinline VOID VmcbSetDr7(VMCB* Vmcb, UINT64 Value)
+{
+    VmcbState(Vmcb)->Dr7 = Value;
+    VmcbControl(Vmcb)->VmcbClean &= ~VMCB_CLEAN_DRX;
+}
+
+static __forceinline VOID VmcbSetCr2(VMCB* Vmcb, UINT64 Value)
+{
+    VmcbState(Vmcb)->Cr2 = Value;
+    VmcbControl(Vmcb)->VmcbClean &= ~VMCB_CLEAN_CR2;
+}
+
 #pragma pack(pop)
@@ -0,0 +1,46 @@
+#pragma once
+#include <ntifs.h>
+
+struct _VCPU;
+
+//
+// Per-VCPU extended-state save area. The exit stub only spills xmm0-5,
+// which is what compiled C on the exit path may clobber; a handler that
+// runs AVX code (wide memory scans, hashing) first saves the guest's
+// x87/SSE/AVX state here with XSAVEOPT, and HandleVmExit restores it with
+// XRSTOR before resuming the guest. Exits that never ask pay nothing.
+//
+#define HV_XSTATE_TAG           'SXVH'
+#define HV_XSTATE_ALIGN         64
+
+#define HV_XSTATE_X87           0x1ULL
+#define HV_XSTATE_SSE           0x2ULL
+#define HV_XSTATE_AVX           0x4ULL
+
+typedef struct _HV_XSTATE
+{
+    PVOID Allocation;
+    PUCHAR Area;            // HV_XSTATE_ALIGN-aligned XSAVE image of the guest
+    ULONG Size;
+    UINT64 Mask;            // Components saved by the pending XSAVE
+    BOOLEAN Optimized;      // XSAVEOPT available
+    BOOLEAN Avx2;           // AVX2 present and YMM state enabled in XCR0
+    BOOLEAN Saved;          // Guest state lives in Area until the exit ends
+    UINT64 Saves;
+} HV_XSTATE;
+
+typedef enum _HV_XSTATE_FIELD
+{
+    HvXstateSize = 0,
+    HvXstateSaves,
+    HvXstateAvx2Usable,
+    HvXstateOptimizedSave,
+} HV_XSTATE_FIELD;
+
+NTSTATUS HvXstateInitVcpu(struct _VCPU* V);
+VOID     HvXstateDestroyVcpu(struct _VCPU* V);
+
+BOOLEAN HvXstateEnsure(struct _VCPU* V);
+VOID    HvXstateRestore(struct _VCPU* V);
+BOOLEAN HvXstateAvx2(struct _VCPU* V);
+UINT64  HvXstateQuery(struct _VCPU* V, HV_XSTATE_FIELD Field);
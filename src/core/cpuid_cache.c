@@ -0,0 +1,172 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "cpuid_cache.h"
+#include "vcpu.h"
+#include "vmcb.h"
+#include "stealth.h"
+
+#define CPUID_1_ECX_OSXSAVE         (1UL << 27)
+#define CPUID_1_ECX_HYPERVISOR      (1UL << 31)
+#define CPUID_7_ECX_OSPKE           (1UL << 4)
+#define CPUID_80000001_ECX_SVM      (1UL << 2)
+#define CR4_OSXSAVE                 (1ULL << 18)
+#define CR4_PKE                     (1ULL << 22)
+
+//
+// Bumped whenever the masks change (stealth toggled); each VCPU retakes its
+// snapshot on the next CPUID exit it sees with a stale generation
+//
+static volatile LONG g_HvCpuidGeneration = 1;
+
+VOID HvCpuidInvalidate(VOID)
+{
+    InterlockedIncrement(&g_HvCpuidGeneration);
+}
+
+static VOID HvCpuidApplyMasks(UINT32 Leaf, HV_CPUID_ENTRY* E)
+{
+    if (Leaf == 1)
+        E->Ecx &= ~CPUID_1_ECX_HYPERVISOR;
+
+    if (Leaf == 0x80000001)
+        E->Ecx &= ~CPUID_80000001_ECX_SVM;
+
+    StealthMaskCpuid(Leaf, &E->Ecx, &E->Edx);
+}
+
+static BOOLEAN HvCpuidIsIndexed(UINT32 Leaf)
+{
+    switch (Leaf)
+    {
+    case 0x4:           // Deterministic cache parameters
+    case 0x7:           // Structured extended features
+    case 0xB:           // x2APIC topology
+    case 0xF:           // RDT monitoring
+    case 0x10:          // RDT allocation
+    case 0x12:          // SGX
+    case 0x14:          // Processor trace
+    case 0x17:          // SoC vendor
+    case 0x18:          // TLB parameters
+    case 0x1B:
+    case 0x1D:          // Tile information
+    case 0x1E:
+    case 0x1F:          // V2 extended topology
+    case 0x8000001D:    // AMD cache topology
+    case 0x80000020:    // AMD platform QoS
+    case 0x80000026:    // AMD extended CPU topology
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static VOID HvCpuidCapture(HV_CPUID_TABLE* T, HV_CPUID_LEAF* Slot, UINT32 Leaf)
+{
+    BOOLEAN indexed = HvCpuidIsIndexed(Leaf);
+    ULONG count = indexed ? HV_CPUID_MAX_SUBLEAVES : 1;
+
+    // Out of room: the leaf stays live
+    if (T->Used + count > HV_CPUID_MAX_ENTRIES)
+        return;
+
+    Slot->First = (UINT16)T->Used;
+    Slot->Count = (UINT8)count;
+    Slot->Indexed = indexed;
+
+    for (ULONG sub = 0; sub < count; sub++)
+    {
+        HV_CPUID_ENTRY* e = &T->Entries[T->Used++];
+        __cpuidex((int*)e, (int)Leaf, (int)sub);
+        HvCpuidApplyMasks(Leaf, e);
+    }
+}
+
+//
+// Must run on the CPU the table belongs to
+//
+static VOID HvCpuidBuild(HV_CPUID_TABLE* T, LONG Generation)
+{
+    HV_CPUID_ENTRY max;
+
+    RtlZeroMemory(T->Std, sizeof(T->Std));
+    RtlZeroMemory(T->Ext, sizeof(T->Ext));
+    T->Used = 0;
+
+    __cpuidex((int*)&max, 0, 0);
+    for (UINT32 leaf = 0; leaf <= max.Eax && leaf < HV_CPUID_STD_LEAVES; leaf++)
+    {
+        if (leaf != 0xD)
+            HvCpuidCapture(T, &T->Std[leaf], leaf);
+    }
+
+    __cpuidex((int*)&max, (int)0x80000000, 0);
+    for (UINT32 leaf = 0x80000000; leaf <= max.Eax && leaf - 0x80000000 < HV_CPUID_EXT_LEAVES; leaf++)
+        HvCpuidCapture(T, &T->Ext[leaf - 0x80000000], leaf);
+
+    T->Generation = Generation;
+}
+
+NTSTATUS HvCpuidInitVcpu(VCPU* V)
+{
+    V->Cpuid = (HV_CPUID_TABLE*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_CPUID_TABLE), HV_CPUID_TAG);
+    if (!V->Cpuid)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(V->Cpuid, sizeof(HV_CPUID_TABLE));
+    HvCpuidBuild(V->Cpuid, g_HvCpuidGeneration);
+    return STATUS_SUCCESS;
+}
+
+VOID HvCpuidDestroyVcpu(VCPU* V)
+{
+    if (V->Cpuid)
+    {
+        ExFreePoolWithTag(V->Cpuid, HV_CPUID_TAG);
+        V->Cpuid = NULL;
+    }
+}
+
+//
+// CPUID as the guest should see it: a table load for cached leaves, the
+// real instruction (masked the same way) for everything else
+//
+VOID HvCpuidLookup(VCPU* V, UINT32 Leaf, UINT32 Subleaf, HV_CPUID_ENTRY* Out)
+{
+    HV_CPUID_TABLE* t = V->Cpuid;
+    const HV_CPUID_LEAF* slot = NULL;
+
+    if (t)
+    {
+        LONG generation = g_HvCpuidGeneration;
+        if (t->Generation != generation)
+            HvCpuidBuild(t, generation);
+
+        if (Leaf < HV_CPUID_STD_LEAVES)
+            slot = &t->Std[Leaf];
+        else if (Leaf - 0x80000000 < HV_CPUID_EXT_LEAVES)
+            slot = &t->Ext[Leaf - 0x80000000];
+    }
+
+    if (slot && slot->Count && (!slot->Indexed || Subleaf < slot->Count))
+    {
+        *Out = t->Entries[slot->First + (slot->Indexed ? Subleaf : 0)];
+        t->Hits++;
+    }
+    else
+    {
+        __cpuidex((int*)Out, (int)Leaf, (int)Subleaf);
+        HvCpuidApplyMasks(Leaf, Out);
+        if (t)
+            t->Misses++;
+    }
+
+    // These mirror the guest's CR4, not whatever the host had when the
+    // snapshot was taken
+    UINT64 cr4 = VmcbState(&V->GuestVmcb)->Cr4;
+
+    if (Leaf == 1)
+        Out->Ecx = (Out->Ecx & ~CPUID_1_ECX_OSXSAVE) | ((cr4 & CR4_OSXSAVE) ? CPUID_1_ECX_OSXSAVE : 0);
+
+    if (Leaf == 7 && Subleaf == 0)
+        Out->Ecx = (Out->Ecx & ~CPUID_7_ECX_OSPKE) | ((cr4 & CR4_PKE) ? CPUID_7_ECX_OSPKE : 0);
+}
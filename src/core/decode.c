@@ -0,0 +1,297 @@
+#include <ntifs.h>
+#include "decode.h"
+
+#define REX_B   0x1
+#define REX_X   0x2
+#define REX_R   0x4
+#define REX_W   0x8
+
+typedef struct _HV_DECODE_CURSOR
+{
+    const UINT8* Bytes;
+    UINT32 Available;
+    UINT32 Pos;
+    BOOLEAN Ok;
+} HV_DECODE_CURSOR;
+
+static UINT8 HvDecodeByte(HV_DECODE_CURSOR* C)
+{
+    if (C->Pos >= C->Available || C->Pos >= HV_INSN_MAX_LENGTH)
+    {
+        C->Ok = FALSE;
+        return 0;
+    }
+
+    return C->Bytes[C->Pos++];
+}
+
+//
+// Little-endian immediate or displacement, sign-extended to 64 bits
+//
+static INT64 HvDecodeSigned(HV_DECODE_CURSOR* C, UINT32 Size)
+{
+    UINT64 value = 0;
+
+    for (UINT32 i = 0; i < Size; i++)
+        value |= (UINT64)HvDecodeByte(C) << (i * 8);
+
+    if (Size < 8)
+    {
+        UINT32 shift = 64 - Size * 8;
+        return (INT64)(value << shift) >> shift;
+    }
+
+    return (INT64)value;
+}
+
+//
+// ModRM (+ SIB, displacement) of a memory operand. Register forms (mod = 3)
+// touch no memory and are rejected, as is 16-bit addressing.
+//
+static BOOLEAN HvDecodeModrm(HV_DECODE_CURSOR* C, HV_INSN* I, UINT8 Rex, BOOLEAN Long64, UINT8* RegField)
+{
+    UINT8 modrm = HvDecodeByte(C);
+    UINT8 mod = modrm >> 6;
+    UINT8 rm = modrm & 7;
+
+    *RegField = (UINT8)(((modrm >> 3) & 7) | ((Rex & REX_R) ? 8 : 0));
+
+    if (mod == 3 || I->AddressSize == 2)
+        return FALSE;
+
+    I->Base = HV_REG_NONE;
+    I->Index = HV_REG_NONE;
+    I->Scale = 1;
+
+    if (rm == 4)
+    {
+        UINT8 sib = HvDecodeByte(C);
+        UINT8 index = (UINT8)(((sib >> 3) & 7) | ((Rex & REX_X) ? 8 : 0));
+        UINT8 base = sib & 7;
+
+        I->Scale = (UINT8)(1 << (sib >> 6));
+        if (index != 4)
+            I->Index = index;
+
+        if (base == 5 && mod == 0)
+            I->Disp = HvDecodeSigned(C, 4);
+        else
+            I->Base = (UINT8)(base | ((Rex & REX_B) ? 8 : 0));
+    }
+    else if (rm == 5 && mod == 0)
+    {
+        // disp32: RIP-relative in 64-bit mode, absolute otherwise
+        I->RipRelative = Long64;
+        I->Disp = HvDecodeSigned(C, 4);
+    }
+    else
+    {
+        I->Base = (UINT8)(rm | ((Rex & REX_B) ? 8 : 0));
+    }
+
+    if (mod == 1)
+        I->Disp = HvDecodeSigned(C, 1);
+    else if (mod == 2)
+        I->Disp = HvDecodeSigned(C, 4);
+
+    return C->Ok;
+}
+
+//
+// Register operand: without REX, 8-bit encodings 4-7 are AH, CH, DH, BH
+//
+static VOID HvDecodeSetReg(HV_INSN* I, UINT8 Reg, UINT8 Rex)
+{
+    if (I->OperandSize == 1 && !Rex && Reg >= 4 && Reg < 8)
+    {
+        I->Reg = Reg - 4;
+        I->HighByte = TRUE;
+    }
+    else
+    {
+        I->Reg = Reg;
+    }
+}
+
+BOOLEAN HvDecodeInstruction(const UINT8* Bytes, UINT32 Available, HV_CPU_MODE Mode, HV_INSN* Insn)
+{
+    HV_DECODE_CURSOR c = { Bytes, Available, 0, TRUE };
+    HV_INSN* I = Insn;
+    BOOLEAN long64 = Mode == HvCpuMode64;
+    BOOLEAN opsize = FALSE, addrsize = FALSE, segOverride = FALSE;
+    UINT8 rex = 0, b, reg;
+    UINT32 opcode;
+
+    RtlZeroMemory(I, sizeof(*I));
+    I->Reg = HV_REG_NONE;
+    I->Base = HV_REG_NONE;
+    I->Index = HV_REG_NONE;
+    I->Segment = HV_SEG_DS;
+
+    //
+    // Legacy prefixes, then REX (64-bit mode only; a legacy prefix after a
+    // REX cancels it)
+    //
+    for (;;)
+    {
+        b = HvDecodeByte(&c);
+        if (!c.Ok)
+            return FALSE;
+
+        switch (b)
+        {
+        case 0x66: opsize = TRUE;   rex = 0; continue;
+        case 0x67: addrsize = TRUE; rex = 0; continue;
+        case 0xF0: I->Lock = TRUE;  rex = 0; continue;
+        case 0xF2:
+        case 0xF3: I->Rep = TRUE;   rex = 0; continue;
+        case 0x26: I->Segment = HV_SEG_ES; segOverride = TRUE; rex = 0; continue;
+        case 0x2E: I->Segment = HV_SEG_CS; segOverride = TRUE; rex = 0; continue;
+        case 0x36: I->Segment = HV_SEG_SS; segOverride = TRUE; rex = 0; continue;
+        case 0x3E: I->Segment = HV_SEG_DS; segOverride = TRUE; rex = 0; continue;
+        case 0x64: I->Segment = HV_SEG_FS; segOverride = TRUE; rex = 0; continue;
+        case 0x65: I->Segment = HV_SEG_GS; segOverride = TRUE; rex = 0; continue;
+        default:
+            break;
+        }
+
+        if (long64 && (b & 0xF0) == 0x40)
+        {
+            rex = b;
+            continue;
+        }
+
+        break;
+    }
+
+    opcode = b;
+    if (b == 0x0F)
+        opcode = 0x100 | HvDecodeByte(&c);
+
+    if (rex & REX_W)
+        I->OperandSize = 8;
+    else if (Mode == HvCpuMode16)
+        I->OperandSize = opsize ? 4 : 2;
+    else
+        I->OperandSize = opsize ? 2 : 4;
+
+    if (long64)
+        I->AddressSize = addrsize ? 4 : 8;
+    else if (Mode == HvCpuMode32)
+        I->AddressSize = addrsize ? 2 : 4;
+    else
+        I->AddressSize = addrsize ? 4 : 2;
+
+    switch (opcode)
+    {
+    case 0x88: case 0x89:           // MOV m, r
+    case 0x8A: case 0x8B:           // MOV r, m
+        I->Op = (opcode & 2) ? HvInsnMovLoad : HvInsnMovStore;
+        if (!(opcode & 1))
+            I->OperandSize = 1;
+        if (!HvDecodeModrm(&c, I, rex, long64, &reg))
+            return FALSE;
+        HvDecodeSetReg(I, reg, rex);
+        break;
+
+    case 0xC6: case 0xC7:           // MOV m, imm
+        I->Op = HvInsnMovStore;
+        if (opcode == 0xC6)
+            I->OperandSize = 1;
+        if (!HvDecodeModrm(&c, I, rex, long64, &reg) || (reg & 7) != 0)
+            return FALSE;
+        I->HasImm = TRUE;
+        I->Imm = (UINT64)HvDecodeSigned(&c, I->OperandSize == 8 ? 4 : I->OperandSize);
+        break;
+
+    case 0xA0: case 0xA1:           // MOV AL/rAX, moffs
+    case 0xA2: case 0xA3:           // MOV moffs, AL/rAX
+        I->Op = (opcode & 2) ? HvInsnMovStore : HvInsnMovLoad;
+        if (!(opcode & 1))
+            I->OperandSize = 1;
+        I->Reg = 0;
+        I->Disp = HvDecodeSigned(&c, I->AddressSize);
+        break;
+
+    case 0x1B6: case 0x1B7:         // MOVZX r, m8 / m16
+    case 0x1BE: case 0x1BF:         // MOVSX r, m8 / m16
+        I->Op = (opcode & 8) ? HvInsnMovsx : HvInsnMovzx;
+        I->SourceSize = (opcode & 1) ? 2 : 1;
+        if (!HvDecodeModrm(&c, I, rex, long64, &reg))
+            return FALSE;
+        I->Reg = reg;
+        break;
+
+    case 0xA4: case 0xA5:           // MOVS
+    case 0xAA: case 0xAB:           // STOS
+        I->Op = (opcode >= 0xAA) ? HvInsnStos : HvInsnMovs;
+        if (!(opcode & 1))
+            I->OperandSize = 1;
+        if (I->Op == HvInsnStos)
+            I->Reg = 0;
+        break;
+
+    case 0x08: case 0x09:           // OR m, r
+    case 0x0A: case 0x0B:           // OR r, m
+    case 0x20: case 0x21:           // AND m, r
+    case 0x22: case 0x23:           // AND r, m
+        I->Op = (opcode & 0x20) ? HvInsnAnd : HvInsnOr;
+        I->MemIsDest = !(opcode & 2);
+        if (!(opcode & 1))
+            I->OperandSize = 1;
+        if (!HvDecodeModrm(&c, I, rex, long64, &reg))
+            return FALSE;
+        HvDecodeSetReg(I, reg, rex);
+        break;
+
+    case 0x80: case 0x81: case 0x83:    // Group 1: /1 OR, /4 AND m, imm
+        if (opcode == 0x80)
+            I->OperandSize = 1;
+        if (!HvDecodeModrm(&c, I, rex, long64, &reg))
+            return FALSE;
+        if ((reg & 7) == 1)
+            I->Op = HvInsnOr;
+        else if ((reg & 7) == 4)
+            I->Op = HvInsnAnd;
+        else
+            return FALSE;
+        I->MemIsDest = TRUE;
+        I->HasImm = TRUE;
+        if (opcode == 0x81)
+            I->Imm = (UINT64)HvDecodeSigned(&c, I->OperandSize == 8 ? 4 : I->OperandSize);
+        else
+            I->Imm = (UINT64)HvDecodeSigned(&c, 1);
+        break;
+
+    case 0x86: case 0x87:           // XCHG m, r
+        I->Op = HvInsnXchg;
+        if (opcode == 0x86)
+            I->OperandSize = 1;
+        if (!HvDecodeModrm(&c, I, rex, long64, &reg))
+            return FALSE;
+        HvDecodeSetReg(I, reg, rex);
+        break;
+
+    case 0x1B0: case 0x1B1:         // CMPXCHG m, r
+        I->Op = HvInsnCmpxchg;
+        if (opcode == 0x1B0)
+            I->OperandSize = 1;
+        if (!HvDecodeModrm(&c, I, rex, long64, &reg))
+            return FALSE;
+        HvDecodeSetReg(I, reg, rex);
+        break;
+
+    default:
+        return FALSE;
+    }
+
+    if (!c.Ok)
+        return FALSE;
+
+    // Stack-based addressing defaults to SS
+    if (!segOverride && (I->Base == 4 || I->Base == 5))
+        I->Segment = HV_SEG_SS;
+
+    I->Length = (UINT8)c.Pos;
+    return TRUE;
+}
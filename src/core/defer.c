@@ -0,0 +1,198 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "defer.h"
+#include "svm.h"
+#include "vmcb.h"
+#include "smp.h"
+#include "sync.h"
+
+static HV_DEFER_ITEM g_HvDeferItems[HV_DEFER_MAX_ITEMS];
+static volatile LONG g_HvDeferCount = 0;
+static HV_SPINLOCK g_HvDeferLock = HV_SPINLOCK_INIT;
+
+NTSTATUS HvDeferInitVcpu(VCPU* V)
+{
+    V->Defer = (HV_DEFER_STATE*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_DEFER_STATE), HV_DEFER_TAG);
+    if (!V->Defer)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    // NextDeadline 0: the first exit schedules every registered item
+    RtlZeroMemory(V->Defer, sizeof(HV_DEFER_STATE));
+    return STATUS_SUCCESS;
+}
+
+VOID HvDeferDestroyVcpu(VCPU* V)
+{
+    if (V->Defer)
+    {
+        ExFreePoolWithTag(V->Defer, HV_DEFER_TAG);
+        V->Defer = NULL;
+    }
+}
+
+//
+// Items are only ever appended, so the exit path walks the table without the
+// lock. A new item is first scheduled one period after each VCPU's next exit.
+//
+NTSTATUS HvRegisterDeferredWork(const CHAR* Name, HV_DEFER_ROUTINE Routine, UINT64 Period, UINT64 Budget)
+{
+    NTSTATUS st = STATUS_SUCCESS;
+
+    if (!Routine || !Period)
+        return STATUS_INVALID_PARAMETER;
+
+    HvSpinLockAcquire(&g_HvDeferLock);
+
+    LONG count = g_HvDeferCount;
+    for (LONG i = 0; i < count; i++)
+    {
+        if (g_HvDeferItems[i].Routine == Routine)
+        {
+            st = STATUS_OBJECT_NAME_COLLISION;
+            goto out;
+        }
+    }
+
+    if (count == HV_DEFER_MAX_ITEMS)
+    {
+        st = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+
+    HV_DEFER_ITEM* item = &g_HvDeferItems[count];
+    item->Name = Name;
+    item->Routine = Routine;
+    item->Period = Period;
+    item->Budget = Budget;
+
+    // Publish the entry before the count that makes it visible
+    _WriteBarrier();
+    InterlockedExchange(&g_HvDeferCount, count + 1);
+
+    // Have every VCPU pick it up on its next exit
+    for (ULONG i = 0; i < SmpGetVcpuCount(); i++)
+    {
+        VCPU* v = SmpGetVcpu(i);
+        if (v && v->Defer)
+            InterlockedExchange64((volatile LONG64*)&v->Defer->NextDeadline, 0);
+    }
+
+out:
+    HvSpinLockRelease(&g_HvDeferLock);
+    return st;
+}
+
+static VOID HvDeferArmExit(VCPU* V, BOOLEAN Arm)
+{
+    HV_DEFER_STATE* d = V->Defer;
+
+    if (d->ExitArmed == Arm)
+        return;
+
+    if (Arm)
+        VmcbSetIntercept(&V->GuestVmcb, SVM_INTERCEPT_WORD3, SVM_INTERCEPT_INTR);
+    else
+        VmcbClearIntercept(&V->GuestVmcb, SVM_INTERCEPT_WORD3, SVM_INTERCEPT_INTR);
+
+    d->ExitArmed = Arm;
+}
+
+//
+// Some deadline has passed (or a new item needs scheduling). On a slack exit
+// run what is due; otherwise leave it due and arm the dedicated exit.
+//
+VOID HvDeferRun(VCPU* V, UINT64 Now, BOOLEAN Slack)
+{
+    HV_DEFER_STATE* d = V->Defer;
+    LONG count = g_HvDeferCount;
+    UINT64 next = MAXUINT64;
+    BOOLEAN pending = FALSE, ran = FALSE, overran = FALSE;
+
+    for (LONG i = 0; i < count; i++)
+    {
+        const HV_DEFER_ITEM* item = &g_HvDeferItems[i];
+        UINT64* deadline = &d->Items[i].Deadline;
+
+        if (!*deadline)
+            *deadline = Now + item->Period;
+
+        if (*deadline <= Now)
+        {
+            if (!Slack || overran)
+            {
+                if (overran)
+                    d->Postponed++;
+                pending = TRUE;
+                continue;
+            }
+
+            if (!ran)
+                HvEnsureHostState(V);
+
+            UINT64 start = __rdtsc();
+            item->Routine(V);
+            UINT64 cycles = __rdtsc() - start;
+
+            d->Items[i].Runs++;
+            d->Items[i].Cycles += cycles;
+            if (cycles > d->Items[i].MaxCycles)
+                d->Items[i].MaxCycles = cycles;
+            if (cycles > item->Budget)
+            {
+                d->Items[i].Stragglers++;
+                overran = TRUE;
+            }
+
+            // Periods count from this run, so a late run does not bunch up
+            *deadline = Now + item->Period;
+            ran = TRUE;
+        }
+
+        if (*deadline < next)
+            next = *deadline;
+    }
+
+    if (ran)
+    {
+        if (VmcbControl(&V->GuestVmcb)->ExitCode == SVM_EXIT_INTR)
+            d->DedicatedRuns++;
+        else
+            d->SlackRuns++;
+    }
+
+    // Work left due keeps the deadline in the past for the next slack exit;
+    // an item registered meanwhile is scheduled on the next exit
+    if (pending || g_HvDeferCount != count)
+        next = pending ? Now : 0;
+
+    d->NextDeadline = next;
+    HvDeferArmExit(V, pending);
+}
+
+UINT64 HvDeferQuery(VCPU* V, ULONG Item, HV_DEFER_STAT Stat)
+{
+    HV_DEFER_STATE* d = V->Defer;
+    if (!d)
+        return 0;
+
+    switch (Stat)
+    {
+    case HvDeferStatSlackRuns:      return d->SlackRuns;
+    case HvDeferStatDedicatedRuns:  return d->DedicatedRuns;
+    case HvDeferStatPostponed:      return d->Postponed;
+    case HvDeferStatItemCount:      return (UINT64)g_HvDeferCount;
+    default:                        break;
+    }
+
+    if (Item >= (ULONG)g_HvDeferCount)
+        return 0;
+
+    switch (Stat)
+    {
+    case HvDeferStatRuns:           return d->Items[Item].Runs;
+    case HvDeferStatCycles:         return d->Items[Item].Cycles;
+    case HvDeferStatMaxCycles:      return d->Items[Item].MaxCycles;
+    case HvDeferStatStragglers:     return d->Items[Item].Stragglers;
+    default:                        return 0;
+    }
+}
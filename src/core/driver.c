@@ -3,6 +3,8 @@
 #include "vcpu.h"
 #include "smp.h"
 #include "npt.h"
+#include "process_manager.h"
+#include "exit_dispatch.h"
 
 
 
@@ -46,6 +48,8 @@ VOID DriverUnload(PDRIVER_OBJECT D)
     if (g_Smp.Vcpus)
         SmpShutdown(&g_Smp);
 
+    NptGlobalDestroy();
+
     DbgPrint("SVM-HV: unloaded\n");
 }
 
@@ -73,12 +77,26 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT D, PUNICODE_STRING R)
         DbgPrint("SVM-HV: DriverEntry called without DriverObject (mapper load), skipping unload registration.\n");
     }
 
-    // Initialize NPT global state (spinlock + table map) before multi-core init
+    // Initialize NPT global state (PA->VA index, shared identity map) before multi-core init
     DbgPrint("SVM-HV: [CHECKPOINT 2] Calling NptGlobalInit\n");
-    NptGlobalInit();
+    NTSTATUS st = NptGlobalInit();
+    if (!NT_SUCCESS(st))
+    {
+        DbgPrint("SVM-HV: NptGlobalInit failed: 0x%X\n", st);
+        return st;
+    }
+
+    // Core intercept handlers; subsystems may add their own afterwards
+    HvInitializeExitHandlers();
+    HookRegisterMsrHandlers();
+
+    // Process queries from the exit path rely on offsets decoded here; a
+    // failure only disables those hypercalls
+    ProcessManagerInit();
+
     DbgPrint("SVM-HV: [CHECKPOINT 3] NptGlobalInit complete, calling SmpInitialize\n");
 
-	NTSTATUS st = SmpInitialize(&g_Smp, SMP_INIT_MAX_VCPUS);
+	st = SmpInitialize(&g_Smp, SMP_INIT_MAX_VCPUS);
     DbgPrint("SVM-HV: [CHECKPOINT 4] SmpInitialize returned 0x%X\n", st);
     if (!NT_SUCCESS(st))
     {
@@ -90,14 +108,20 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT D, PUNICODE_STRING R)
         }
 
         if (!NT_SUCCESS(st))
+        {
+            NptGlobalDestroy();
             return st;
+        }
     }
 
+    NptReportSharing(g_Smp.ProcessorCount);
+
     st = SmpLaunch(&g_Smp);
     if (!NT_SUCCESS(st))
     {
         DbgPrint("SVM-HV: SmpLaunch failed: 0x%X\n", st);
         SmpShutdown(&g_Smp);
+        NptGlobalDestroy();
         return st;
     }
     DbgPrint("SVM-HV: vmrun returned: 0x%X\n", st);
@@ -0,0 +1,589 @@
+#include <ntifs.h>
+#include "emulate.h"
+#include "vmcb.h"
+#include "msr.h"
+#include "msrpm.h"
+#include "guest_mem.h"
+#include "guest_walk.h"
+#include "event.h"
+
+//
+// NPF EXITINFO1 bits
+//
+#define NPF_FETCH           (1ULL << 4)
+#define NPF_FINAL_GPA       (1ULL << 32)    // Fault on the final translation, not a table walk
+
+#define EFER_LMA            (1ULL << 10)
+#define SEG_ATTR_L          (1u << 9)
+#define SEG_ATTR_DB         (1u << 10)
+
+#define RFLAGS_CF           (1ULL << 0)
+#define RFLAGS_PF           (1ULL << 2)
+#define RFLAGS_AF           (1ULL << 4)
+#define RFLAGS_ZF           (1ULL << 6)
+#define RFLAGS_SF           (1ULL << 7)
+#define RFLAGS_DF           (1ULL << 10)
+#define RFLAGS_OF           (1ULL << 11)
+#define RFLAGS_ARITH        (RFLAGS_CF | RFLAGS_PF | RFLAGS_AF | RFLAGS_ZF | RFLAGS_SF | RFLAGS_OF)
+
+//
+// Bumped to drop every VCPU's decoded instructions (guest code patched)
+//
+static volatile LONG g_HvEmuGeneration = 1;
+
+typedef struct _HV_EMU_CONTEXT
+{
+    VCPU* V;
+    PGUEST_REGISTERS Regs;
+    const HV_INSN* I;
+    HV_CPU_MODE Mode;
+    UINT64 PageGpa;
+    PUINT8 PageVa;
+
+    // First guest #PF an operand access ran into
+    BOOLEAN Faulted;
+    UINT64 FaultGva;
+    UINT32 FaultCode;
+} HV_EMU_CONTEXT;
+
+NTSTATUS HvEmuInitVcpu(VCPU* V)
+{
+    V->Emu = (HV_EMU_STATE*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_EMU_STATE), HV_EMU_TAG);
+    if (!V->Emu)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(V->Emu, sizeof(HV_EMU_STATE));
+    return STATUS_SUCCESS;
+}
+
+VOID HvEmuDestroyVcpu(VCPU* V)
+{
+    if (V->Emu)
+    {
+        ExFreePoolWithTag(V->Emu, HV_EMU_TAG);
+        V->Emu = NULL;
+    }
+}
+
+VOID HvEmuInvalidate(VOID)
+{
+    InterlockedIncrement(&g_HvEmuGeneration);
+}
+
+static __forceinline UINT64 HvEmuMask(UINT32 Size)
+{
+    return Size >= 8 ? ~0ULL : (1ULL << (Size * 8)) - 1;
+}
+
+//
+// GPR by x86 encoding (0 = RAX ... 15 = R15). GUEST_REGISTERS is stored in
+// reverse order; RSP lives in the VMCB.
+//
+static UINT64* HvEmuGpr(HV_EMU_CONTEXT* X, UINT8 Reg)
+{
+    if (Reg == 4)
+        return &VmcbState(&X->V->GuestVmcb)->Rsp;
+
+    return &((UINT64*)X->Regs)[15 - Reg];
+}
+
+static UINT64 HvEmuReadReg(HV_EMU_CONTEXT* X, UINT8 Reg, UINT32 Size, BOOLEAN HighByte)
+{
+    UINT64 value = *HvEmuGpr(X, Reg);
+    if (HighByte)
+        value >>= 8;
+
+    return value & HvEmuMask(Size);
+}
+
+//
+// Partial register writes: 8- and 16-bit writes keep the upper bits,
+// 32-bit writes zero-extend
+//
+static VOID HvEmuSetBits(UINT64* Reg, UINT64 Value, UINT32 Size, UINT32 Shift)
+{
+    UINT64 mask = HvEmuMask(Size) << Shift;
+
+    if (Size == 4)
+        *Reg = Value & 0xFFFFFFFF;
+    else
+        *Reg = (*Reg & ~mask) | ((Value << Shift) & mask);
+}
+
+static VOID HvEmuWriteReg(HV_EMU_CONTEXT* X, UINT8 Reg, UINT32 Size, BOOLEAN HighByte, UINT64 Value)
+{
+    HvEmuSetBits(HvEmuGpr(X, Reg), Value, Size, HighByte ? 8 : 0);
+}
+
+static UINT64 HvEmuSegmentBase(HV_EMU_CONTEXT* X, UINT8 Segment)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&X->V->GuestVmcb);
+
+    // Long mode ignores the ES/CS/SS/DS bases; FS/GS bases sit in MSRs
+    switch (Segment)
+    {
+    case HV_SEG_FS: return HvMsrReadGuest(X->V, MSR_FS_BASE);
+    case HV_SEG_GS: return HvMsrReadGuest(X->V, MSR_GS_BASE);
+    default:        break;
+    }
+
+    if (X->Mode == HvCpuMode64)
+        return 0;
+
+    switch (Segment)
+    {
+    case HV_SEG_ES: return s->Es.Base;
+    case HV_SEG_CS: return s->Cs.Base;
+    case HV_SEG_SS: return s->Ss.Base;
+    default:        return s->Ds.Base;
+    }
+}
+
+static UINT64 HvEmuLinear(HV_EMU_CONTEXT* X, UINT8 Segment, UINT64 Offset)
+{
+    return HvEmuSegmentBase(X, Segment) + (Offset & HvEmuMask(X->I->AddressSize));
+}
+
+//
+// Effective address of the ModRM / moffs operand
+//
+static UINT64 HvEmuOperandAddress(HV_EMU_CONTEXT* X)
+{
+    const HV_INSN* I = X->I;
+    UINT64 ea = (UINT64)I->Disp;
+
+    if (I->Base != HV_REG_NONE)
+        ea += *HvEmuGpr(X, I->Base);
+    if (I->Index != HV_REG_NONE)
+        ea += *HvEmuGpr(X, I->Index) * I->Scale;
+    if (I->RipRelative)
+        ea += VmcbState(&X->V->GuestVmcb)->Rip + I->Length;
+
+    return HvEmuLinear(X, I->Segment, ea);
+}
+
+static BOOLEAN HvEmuOnTrapPage(HV_EMU_CONTEXT* X, UINT64 Gva)
+{
+    PHYSICAL_ADDRESS gpa = GuestTranslateGvaToGpa(X->V, Gva);
+    return gpa.QuadPart && (gpa.QuadPart & ~0xFFFULL) == X->PageGpa;
+}
+
+//
+// Walk for an operand access the way the CPU would: write and user checks
+// from the access and the guest's CPL (CR0.WP and NX come from the walker).
+// A refusal is recorded so the caller can hand the guest its #PF.
+//
+static BOOLEAN HvEmuTranslate(HV_EMU_CONTEXT* X, UINT64 Gva, BOOLEAN Write, UINT64* Gpa)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&X->V->GuestVmcb);
+    UINT32 access = (Write ? GUEST_ACCESS_WRITE : 0) | (s->Cpl == 3 ? GUEST_ACCESS_USER : 0);
+    GUEST_WALK walk;
+
+    if (GuestWalkCurrent(X->V, Gva, access, &walk))
+    {
+        *Gpa = walk.Gpa;
+        return TRUE;
+    }
+
+    if (!X->Faulted)
+    {
+        X->Faulted = TRUE;
+        X->FaultGva = Gva;
+        X->FaultCode = walk.ErrorCode;
+    }
+
+    return FALSE;
+}
+
+//
+// Accesses to the trapped page go to the host buffer; anything else is
+// ordinary guest memory (the other side of a MOVS, say). Both ends of the
+// operand are checked, since it may straddle a page.
+//
+static BOOLEAN HvEmuAccess(HV_EMU_CONTEXT* X, UINT64 Gva, UINT64* Value, UINT32 Size, BOOLEAN Write)
+{
+    UINT64 gpa, last;
+
+    if (!HvEmuTranslate(X, Gva, Write, &gpa) || !HvEmuTranslate(X, Gva + Size - 1, Write, &last))
+        return FALSE;
+
+    if ((gpa & ~0xFFFULL) == X->PageGpa)
+    {
+        UINT64 offset = gpa & 0xFFF;
+        if (offset + Size > PAGE_SIZE)
+            return FALSE;
+
+        if (Write)
+            RtlCopyMemory(X->PageVa + offset, Value, Size);
+        else
+            RtlCopyMemory(Value, X->PageVa + offset, Size);
+        return TRUE;
+    }
+
+    return Write ? GuestWriteGva(X->V, Gva, Value, Size) : GuestReadGva(X->V, Gva, Value, Size);
+}
+
+static BOOLEAN HvEmuRead(HV_EMU_CONTEXT* X, UINT64 Gva, UINT32 Size, UINT64* Value)
+{
+    *Value = 0;
+    return HvEmuAccess(X, Gva, Value, Size, FALSE);
+}
+
+static BOOLEAN HvEmuWrite(HV_EMU_CONTEXT* X, UINT64 Gva, UINT32 Size, UINT64 Value)
+{
+    return HvEmuAccess(X, Gva, &Value, Size, TRUE);
+}
+
+static UINT64 HvEmuResultFlags(UINT64 Result, UINT32 Size)
+{
+    UINT64 flags = 0;
+    UINT8 parity = (UINT8)Result;
+
+    Result &= HvEmuMask(Size);
+    if (!Result)
+        flags |= RFLAGS_ZF;
+    if (Result >> (Size * 8 - 1))
+        flags |= RFLAGS_SF;
+
+    parity ^= parity >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+    if (!(parity & 1))
+        flags |= RFLAGS_PF;
+
+    return flags;
+}
+
+//
+// AND / OR: CF = OF = 0, AF left clear (undefined)
+//
+static VOID HvEmuLogicFlags(HV_EMU_CONTEXT* X, UINT64 Result, UINT32 Size)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&X->V->GuestVmcb);
+    s->Rflags = (s->Rflags & ~RFLAGS_ARITH) | HvEmuResultFlags(Result, Size);
+}
+
+//
+// Flags of A - B, as CMP sets them
+//
+static VOID HvEmuSubFlags(HV_EMU_CONTEXT* X, UINT64 A, UINT64 B, UINT32 Size)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&X->V->GuestVmcb);
+    UINT64 mask = HvEmuMask(Size);
+    UINT64 r = (A - B) & mask;
+    UINT64 flags = HvEmuResultFlags(r, Size);
+
+    A &= mask;
+    B &= mask;
+    if (A < B)
+        flags |= RFLAGS_CF;
+    if ((((A ^ B) & (A ^ r)) >> (Size * 8 - 1)) & 1)
+        flags |= RFLAGS_OF;
+    if ((A ^ B ^ r) & 0x10)
+        flags |= RFLAGS_AF;
+
+    s->Rflags = (s->Rflags & ~RFLAGS_ARITH) | flags;
+}
+
+//
+// MOVS / STOS, REP or not. Each element is translated on both sides before
+// either is touched; a failure part way stops with RCX/RSI/RDI reflecting
+// the elements done and RIP on the instruction, which the guest then
+// re-executes (and takes the #PF itself). A fault on the first element is
+// raised by HvEmulateMmio.
+//
+static BOOLEAN HvEmuString(HV_EMU_CONTEXT* X)
+{
+    const HV_INSN* I = X->I;
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&X->V->GuestVmcb);
+    PGUEST_REGISTERS r = X->Regs;
+    UINT32 size = I->OperandSize;
+    UINT64 amask = HvEmuMask(I->AddressSize);
+    UINT64 step = (s->Rflags & RFLAGS_DF) ? (UINT64)0 - size : size;
+    UINT64 remaining = I->Rep ? (r->Rcx & amask) : 1;
+    ULONG done = 0;
+
+    if (!remaining)
+    {
+        s->Rip += I->Length;
+        return TRUE;
+    }
+
+    // The hardware faulted on this instruction's first element
+    UINT64 dst = HvEmuLinear(X, HV_SEG_ES, r->Rdi);
+    UINT64 src = HvEmuLinear(X, I->Segment, r->Rsi);
+    if (!HvEmuOnTrapPage(X, dst) && (I->Op != HvInsnMovs || !HvEmuOnTrapPage(X, src)))
+        return FALSE;
+
+    while (remaining && done < HV_EMU_MAX_STRING_ELEMENTS)
+    {
+        UINT64 value, gpa;
+
+        // Destination must be writable before the source is read
+        dst = HvEmuLinear(X, HV_SEG_ES, r->Rdi);
+        if (!HvEmuTranslate(X, dst, TRUE, &gpa) || !HvEmuTranslate(X, dst + size - 1, TRUE, &gpa))
+            break;
+
+        if (I->Op == HvInsnMovs)
+        {
+            src = HvEmuLinear(X, I->Segment, r->Rsi);
+            if (!HvEmuRead(X, src, size, &value))
+                break;
+        }
+        else
+        {
+            value = HvEmuReadReg(X, 0, size, FALSE);
+        }
+
+        if (!HvEmuWrite(X, dst, size, value))
+            break;
+
+        HvEmuSetBits(&r->Rdi, r->Rdi + step, I->AddressSize, 0);
+        if (I->Op == HvInsnMovs)
+            HvEmuSetBits(&r->Rsi, r->Rsi + step, I->AddressSize, 0);
+        if (I->Rep)
+            HvEmuSetBits(&r->Rcx, (r->Rcx & amask) - 1, I->AddressSize, 0);
+
+        remaining--;
+        done++;
+    }
+
+    if (!done)
+        return FALSE;
+
+    if (!remaining)
+        s->Rip += I->Length;
+
+    return TRUE;
+}
+
+static BOOLEAN HvEmuExecute(HV_EMU_CONTEXT* X)
+{
+    const HV_INSN* I = X->I;
+    UINT32 size = I->OperandSize;
+    UINT64 mem, value, result;
+
+    if (I->Op == HvInsnMovs || I->Op == HvInsnStos)
+        return HvEmuString(X);
+
+    UINT64 gva = HvEmuOperandAddress(X);
+    if (!HvEmuOnTrapPage(X, gva))
+        return FALSE;
+
+    switch (I->Op)
+    {
+    case HvInsnMovStore:
+        value = I->HasImm ? I->Imm : HvEmuReadReg(X, I->Reg, size, I->HighByte);
+        if (!HvEmuWrite(X, gva, size, value))
+            return FALSE;
+        break;
+
+    case HvInsnMovLoad:
+        if (!HvEmuRead(X, gva, size, &mem))
+            return FALSE;
+        HvEmuWriteReg(X, I->Reg, size, I->HighByte, mem);
+        break;
+
+    case HvInsnMovzx:
+    case HvInsnMovsx:
+        if (!HvEmuRead(X, gva, I->SourceSize, &mem))
+            return FALSE;
+        if (I->Op == HvInsnMovsx && (mem >> (I->SourceSize * 8 - 1)))
+            mem |= ~HvEmuMask(I->SourceSize);
+        HvEmuWriteReg(X, I->Reg, size, FALSE, mem);
+        break;
+
+    case HvInsnAnd:
+    case HvInsnOr:
+        if (!HvEmuRead(X, gva, size, &mem))
+            return FALSE;
+        value = I->HasImm ? I->Imm : HvEmuReadReg(X, I->Reg, size, I->HighByte);
+        result = (I->Op == HvInsnAnd) ? (mem & value) : (mem | value);
+        if (I->MemIsDest)
+        {
+            if (!HvEmuWrite(X, gva, size, result))
+                return FALSE;
+        }
+        else
+        {
+            HvEmuWriteReg(X, I->Reg, size, I->HighByte, result);
+        }
+        HvEmuLogicFlags(X, result, size);
+        break;
+
+    case HvInsnXchg:
+        if (!HvEmuRead(X, gva, size, &mem))
+            return FALSE;
+        if (!HvEmuWrite(X, gva, size, HvEmuReadReg(X, I->Reg, size, I->HighByte)))
+            return FALSE;
+        HvEmuWriteReg(X, I->Reg, size, I->HighByte, mem);
+        break;
+
+    case HvInsnCmpxchg:
+        if (!HvEmuRead(X, gva, size, &mem))
+            return FALSE;
+        value = HvEmuReadReg(X, 0, size, FALSE);
+        HvEmuSubFlags(X, value, mem, size);
+        if (value == mem)
+        {
+            if (!HvEmuWrite(X, gva, size, HvEmuReadReg(X, I->Reg, size, I->HighByte)))
+                return FALSE;
+        }
+        else
+        {
+            HvEmuWriteReg(X, 0, size, FALSE, mem);
+        }
+        break;
+
+    default:
+        return FALSE;
+    }
+
+    VmcbState(&X->V->GuestVmcb)->Rip += I->Length;
+    return TRUE;
+}
+
+static HV_CPU_MODE HvEmuCpuMode(VCPU* V)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
+
+    if ((s->Efer & EFER_LMA) && (s->Cs.Attributes & SEG_ATTR_L))
+        return HvCpuMode64;
+
+    return (s->Cs.Attributes & SEG_ATTR_DB) ? HvCpuMode32 : HvCpuMode16;
+}
+
+//
+// Instruction bytes at RIP without decode assists: up to the end of the
+// page, plus whatever of the next page is mapped
+//
+static UINT32 HvEmuFetch(VCPU* V, HV_CPU_MODE Mode, UINT8* Bytes)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
+    UINT64 rip = (Mode == HvCpuMode64) ? s->Rip : s->Cs.Base + (s->Rip & 0xFFFFFFFF);
+    UINT32 first = (UINT32)(PAGE_SIZE - (rip & (PAGE_SIZE - 1)));
+
+    if (first >= HV_INSN_MAX_LENGTH)
+        return GuestReadGva(V, rip, Bytes, HV_INSN_MAX_LENGTH) ? HV_INSN_MAX_LENGTH : 0;
+
+    if (!GuestReadGva(V, rip, Bytes, first))
+        return 0;
+
+    if (!GuestReadGva(V, rip + first, Bytes + first, HV_INSN_MAX_LENGTH - first))
+        return first;
+
+    return HV_INSN_MAX_LENGTH;
+}
+
+static const HV_INSN* HvEmuDecode(VCPU* V, HV_CPU_MODE Mode)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
+    HV_EMU_STATE* emu = V->Emu;
+    LONG generation = g_HvEmuGeneration;
+    UINT32 assisted = c->InstructionLength;
+
+    if (assisted > HV_INSN_MAX_LENGTH)
+        assisted = HV_INSN_MAX_LENGTH;
+
+    ULONG slot = (ULONG)((s->Rip ^ (s->Rip >> 12) ^ (s->Cr3 >> 12)) & (HV_EMU_CACHE_ENTRIES - 1));
+    HV_EMU_CACHE_ENTRY* e = &emu->Cache[slot];
+
+    if (e->Generation == generation && e->Rip == s->Rip && e->Cr3 == s->Cr3 && e->Mode == (UINT8)Mode &&
+        (!assisted || (assisted >= e->Insn.Length && RtlEqualMemory(e->Bytes, c->InstructionBytes, e->Insn.Length))))
+    {
+        emu->CacheHits++;
+        return &e->Insn;
+    }
+
+    UINT8 bytes[HV_INSN_MAX_LENGTH] = { 0 };
+    UINT32 available = assisted;
+
+    if (available)
+    {
+        RtlCopyMemory(bytes, c->InstructionBytes, available);
+    }
+    else
+    {
+        available = HvEmuFetch(V, Mode, bytes);
+        emu->Fetches++;
+    }
+
+    if (!HvDecodeInstruction(bytes, available, Mode, &e->Insn))
+    {
+        e->Generation = 0;
+        return NULL;
+    }
+
+    e->Cr3 = s->Cr3;
+    e->Rip = s->Rip;
+    e->Mode = (UINT8)Mode;
+    RtlCopyMemory(e->Bytes, bytes, sizeof(e->Bytes));
+    e->Generation = generation;
+    return &e->Insn;
+}
+
+//
+// Complete the access that faulted on PageGpa, with the page's contents
+// taken from / written to PageVa. HvEmuNotHandled leaves the guest untouched
+// so the caller can fall back to remapping. An operand the guest's own
+// tables do not allow (not present, read-only, supervisor-only from CPL 3)
+// ends the emulation with that #PF injected, as the instruction would have
+// raised (HvEmuFaulted).
+//
+HV_EMU_RESULT HvEmulateMmio(VCPU* V, PGUEST_REGISTERS GuestRegs, UINT64 PageGpa, PVOID PageVa)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
+    HV_EMU_STATE* emu = V->Emu;
+    HV_EMU_CONTEXT x;
+
+    if (!emu || !PageVa)
+        return HvEmuNotHandled;
+
+    // Data accesses only, and only on the final translation (a fault while
+    // walking the guest's page tables is not an access we can replay)
+    if ((c->ExitInfo1 & NPF_FETCH) || !(c->ExitInfo1 & NPF_FINAL_GPA))
+        return HvEmuNotHandled;
+
+    x.V = V;
+    x.Regs = GuestRegs;
+    x.Mode = HvEmuCpuMode(V);
+    x.PageGpa = PageGpa & ~0xFFFULL;
+    x.PageVa = (PUINT8)PageVa;
+    x.Faulted = FALSE;
+    x.I = HvEmuDecode(V, x.Mode);
+
+    if (!x.I || !HvEmuExecute(&x))
+    {
+        if (x.Faulted)
+        {
+            VmcbSetCr2(&V->GuestVmcb, x.FaultGva);
+            HvEventQueueException(V, HV_VECTOR_PF, TRUE, x.FaultCode);
+            emu->PageFaults++;
+            return HvEmuFaulted;
+        }
+
+        emu->Failures++;
+        return HvEmuNotHandled;
+    }
+
+    emu->Emulated++;
+    return HvEmuCompleted;
+}
+
+UINT64 HvEmuQuery(VCPU* V, HV_EMU_STAT Stat)
+{
+    HV_EMU_STATE* emu = V->Emu;
+    if (!emu)
+        return 0;
+
+    switch (Stat)
+    {
+    case HvEmuStatEmulated:     return emu->Emulated;
+    case HvEmuStatCacheHits:    return emu->CacheHits;
+    case HvEmuStatFetches:      return emu->Fetches;
+    case HvEmuStatFailures:     return emu->Failures;
+    case HvEmuStatPageFaults:   return emu->PageFaults;
+    default:                    return 0;
+    }
+}
@@ -0,0 +1,298 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "event.h"
+#include "svm.h"
+#include "vmcb.h"
+#include "smp.h"
+
+#define RFLAGS_IF               (1ULL << 9)
+#define INTERRUPT_SHADOW        (1UL << 0)      // InterruptState: STI / MOV SS shadow
+
+//
+// InterruptControl bits for the interrupt-window request: a virtual
+// interrupt at the highest priority, ignoring V_TPR, so the CPU raises
+// VINTR as soon as the guest is interruptible. The vector is never
+// delivered; the VINTR intercept fires first.
+//
+#define V_IRQ                   (1UL << 8)
+#define V_INTR_PRIO_MAX         (0xFUL << 16)
+#define V_IGN_TPR               (1UL << 20)
+#define V_WINDOW_BITS           (V_IRQ | V_INTR_PRIO_MAX | V_IGN_TPR)
+
+#define HV_EVENT_CLASS_BENIGN       0
+#define HV_EVENT_CLASS_CONTRIBUTORY 1
+#define HV_EVENT_CLASS_PAGE_FAULT   2
+#define HV_EVENT_CLASS_DOUBLE_FAULT 3
+
+NTSTATUS HvEventInitVcpu(VCPU* V)
+{
+    V->Events = (HV_EVENT_QUEUE*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_EVENT_QUEUE), HV_EVENT_TAG);
+    if (!V->Events)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(V->Events, sizeof(HV_EVENT_QUEUE));
+    return STATUS_SUCCESS;
+}
+
+VOID HvEventDestroyVcpu(VCPU* V)
+{
+    if (V->Events)
+    {
+        ExFreePoolWithTag(V->Events, HV_EVENT_TAG);
+        V->Events = NULL;
+    }
+}
+
+static ULONG HvEventClass(UINT8 Vector)
+{
+    switch (Vector)
+    {
+    case HV_VECTOR_DE:
+    case HV_VECTOR_TS:
+    case HV_VECTOR_NP:
+    case HV_VECTOR_SS:
+    case HV_VECTOR_GP:
+        return HV_EVENT_CLASS_CONTRIBUTORY;
+    case HV_VECTOR_PF:
+        return HV_EVENT_CLASS_PAGE_FAULT;
+    case HV_VECTOR_DF:
+        return HV_EVENT_CLASS_DOUBLE_FAULT;
+    default:
+        return HV_EVENT_CLASS_BENIGN;
+    }
+}
+
+//
+// A second exception while one is pending follows the double-fault table:
+// contributory on contributory, or contributory / #PF on #PF, becomes #DF;
+// every other pair is handled serially, so the newer exception wins (the
+// older one recurs when the instruction re-executes)
+//
+VOID HvEventQueueException(VCPU* V, UINT8 Vector, BOOLEAN HasError, UINT32 ErrorCode)
+{
+    HV_EVENT_QUEUE* q = V->Events;
+    UINT32 info = HV_EVENT_VALID | (HV_EVENT_TYPE_EXCEPTION << HV_EVENT_TYPE_SHIFT) | Vector;
+
+    if (!q)
+        return;
+
+    InterlockedIncrement64(&q->Posted);
+
+    if (q->Exception)
+    {
+        ULONG first = HvEventClass((UINT8)q->Exception);
+        ULONG second = HvEventClass(Vector);
+
+        // Hardware would shut down here; keep the #DF that is pending
+        if (first == HV_EVENT_CLASS_DOUBLE_FAULT && second != HV_EVENT_CLASS_BENIGN)
+            return;
+
+        if ((first == HV_EVENT_CLASS_CONTRIBUTORY && second == HV_EVENT_CLASS_CONTRIBUTORY) ||
+            (first == HV_EVENT_CLASS_PAGE_FAULT && second != HV_EVENT_CLASS_BENIGN))
+        {
+            info = HV_EVENT_VALID | (HV_EVENT_TYPE_EXCEPTION << HV_EVENT_TYPE_SHIFT) | HV_VECTOR_DF;
+            HasError = TRUE;
+            ErrorCode = 0;
+            q->DoubleFaults++;
+        }
+    }
+
+    q->Exception = info | (HasError ? HV_EVENT_ERROR_VALID : 0);
+    q->ExceptionError = HasError ? ErrorCode : 0;
+}
+
+//
+// Cross-CPU posts: the bits are set atomically and the target delivers them
+// at the end of its next exit. Callers on another CPU kick the target
+// (SmpKick) to make that exit happen now.
+//
+BOOLEAN HvEventQueueNmi(VCPU* V)
+{
+    HV_EVENT_QUEUE* q = V->Events;
+    if (!q)
+        return FALSE;
+
+    InterlockedExchange(&q->Nmi, 1);
+    InterlockedIncrement64(&q->Posted);
+    return TRUE;
+}
+
+BOOLEAN HvEventQueueInterrupt(VCPU* V, UINT8 Vector)
+{
+    HV_EVENT_QUEUE* q = V->Events;
+
+    // 0-31 are exceptions, which are not posted this way
+    if (!q || Vector < 32)
+        return FALSE;
+
+    InterlockedOr64(&q->Irq[Vector >> 6], (LONG64)(1ULL << (Vector & 63)));
+    InterlockedIncrement64(&q->Posted);
+    return TRUE;
+}
+
+//
+// Start of every exit: EVENTINJ was consumed by the VMRUN that just ran,
+// and an event whose delivery the exit interrupted goes back in the queue.
+// INTn, INT3 and INTO are not re-injected; RIP still points at the
+// instruction, which raises them again.
+//
+VOID HvEventBeginExit(VCPU* V)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
+    HV_EVENT_QUEUE* q = V->Events;
+    UINT32 info = c->ExitIntInfo;
+
+    c->EventInjection = 0;
+
+    if (!q || !(info & HV_EVENT_VALID))
+        return;
+
+    UINT8 vector = (UINT8)info;
+    switch ((info >> HV_EVENT_TYPE_SHIFT) & 7)
+    {
+    case HV_EVENT_TYPE_INTR:
+    case HV_EVENT_TYPE_NMI:
+        q->Reinject = info & (HV_EVENT_VALID | (7UL << HV_EVENT_TYPE_SHIFT) | 0xFF);
+        q->Reinjected++;
+        break;
+
+    case HV_EVENT_TYPE_EXCEPTION:
+        if (vector == 3 || vector == 4)
+            break;
+        q->Exception = info & (HV_EVENT_VALID | HV_EVENT_ERROR_VALID | (7UL << HV_EVENT_TYPE_SHIFT) | 0xFF);
+        q->ExceptionError = c->ExitIntInfoErrorCode;
+        q->Reinjected++;
+        break;
+
+    default:
+        break;
+    }
+}
+
+static VOID HvEventSetWindow(VCPU* V, BOOLEAN Open)
+{
+    HV_EVENT_QUEUE* q = V->Events;
+    UINT32 control = VmcbControl(&V->GuestVmcb)->InterruptControl;
+
+    if (q->WindowOpen == Open)
+        return;
+
+    if (Open)
+    {
+        VmcbSetInterruptControl(&V->GuestVmcb, control | V_WINDOW_BITS);
+        VmcbSetIntercept(&V->GuestVmcb, SVM_INTERCEPT_WORD3, SVM_INTERCEPT_VINTR);
+    }
+    else
+    {
+        VmcbSetInterruptControl(&V->GuestVmcb, control & ~V_WINDOW_BITS);
+        VmcbClearIntercept(&V->GuestVmcb, SVM_INTERCEPT_WORD3, SVM_INTERCEPT_VINTR);
+    }
+
+    q->WindowOpen = Open;
+}
+
+//
+// VINTR: the guest can take an interrupt now. Drop the request; the
+// delivery at the end of this exit injects the interrupt and re-arms the
+// window if more are queued.
+//
+VOID HvEventWindowExit(VCPU* V)
+{
+    if (!V->Events)
+        return;
+
+    V->Events->WindowExits++;
+    HvEventSetWindow(V, FALSE);
+}
+
+static BOOLEAN HvEventTakeInterrupt(HV_EVENT_QUEUE* q, UINT8* Vector)
+{
+    for (LONG i = 3; i >= 0; i--)
+    {
+        ULONG bit;
+        UINT64 pending = (UINT64)q->Irq[i];
+
+        if (pending && _BitScanReverse64(&bit, pending))
+        {
+            InterlockedAnd64(&q->Irq[i], ~(LONG64)(1ULL << bit));
+            *Vector = (UINT8)(i * 64 + bit);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static __forceinline BOOLEAN HvEventInterruptsPending(HV_EVENT_QUEUE* q)
+{
+    return (q->Irq[0] | q->Irq[1] | q->Irq[2] | q->Irq[3]) != 0;
+}
+
+//
+// End of every exit: move the highest-priority pending event into EVENTINJ
+//
+VOID HvEventDeliver(VCPU* V)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
+    HV_EVENT_QUEUE* q = V->Events;
+    UINT8 vector;
+
+    if (!q)
+        return;
+
+    // Pending in the local APIC until VMRUN sets GIF, then taken by the
+    // guest whenever its NMI blocking allows, independent of EVENTINJ
+    if (q->Nmi && InterlockedExchange(&q->Nmi, 0) &&
+        SmpRaiseGuestNmi((ULONG)V->HostStackLayout.ProcessorIndex))
+        q->NmisRaised++;
+
+    if (!(c->EventInjection & HV_EVENT_VALID))
+    {
+        if (q->Exception)
+        {
+            c->EventInjection = q->Exception;
+            c->EventInjectionError = q->ExceptionError;
+            q->Exception = 0;
+        }
+        else if (q->Reinject)
+        {
+            c->EventInjection = q->Reinject;
+            c->EventInjectionError = 0;
+            q->Reinject = 0;
+        }
+        else if ((s->Rflags & RFLAGS_IF) && !(c->InterruptState & INTERRUPT_SHADOW) &&
+                 HvEventTakeInterrupt(q, &vector))
+        {
+            c->EventInjection = HV_EVENT_VALID | (HV_EVENT_TYPE_INTR << HV_EVENT_TYPE_SHIFT) | vector;
+            c->EventInjectionError = 0;
+        }
+
+        if (c->EventInjection & HV_EVENT_VALID)
+            q->Injected++;
+    }
+
+    // Interrupts held back by IF or the shadow get an exit as soon as the
+    // guest can take one. Exceptions and re-injections are not gated by IF,
+    // so VINTR says nothing about them: they go out with the next VMRUN
+    // whose EVENTINJ is free.
+    HvEventSetWindow(V, HvEventInterruptsPending(q));
+}
+
+UINT64 HvEventQuery(VCPU* V, HV_EVENT_STAT Stat)
+{
+    HV_EVENT_QUEUE* q = V->Events;
+    if (!q)
+        return 0;
+
+    switch (Stat)
+    {
+    case HvEventStatPosted:         return q->Posted;
+    case HvEventStatInjected:       return q->Injected;
+    case HvEventStatReinjected:     return q->Reinjected;
+    case HvEventStatDoubleFaults:   return q->DoubleFaults;
+    case HvEventStatWindowExits:    return q->WindowExits;
+    case HvEventStatNmisRaised:     return q->NmisRaised;
+    default:                        return 0;
+    }
+}
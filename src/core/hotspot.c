@@ -0,0 +1,252 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "hotspot.h"
+#include "vcpu.h"
+#include "smp.h"
+
+#define HV_HOTSPOT_MASK         (HV_HOTSPOT_WIDTH - 1)
+#define HV_HOTSPOT_READ_RETRIES 8
+
+C_ASSERT((HV_HOTSPOT_WIDTH & HV_HOTSPOT_MASK) == 0);
+
+NTSTATUS HvHotspotInitVcpu(VCPU* V)
+{
+    V->Hotspots = (HV_HOTSPOT*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_HOTSPOT), HV_HOTSPOT_TAG);
+    if (!V->Hotspots)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(V->Hotspots, sizeof(HV_HOTSPOT));
+    return STATUS_SUCCESS;
+}
+
+VOID HvHotspotDestroyVcpu(VCPU* V)
+{
+    if (V->Hotspots)
+    {
+        ExFreePoolWithTag(V->Hotspots, HV_HOTSPOT_TAG);
+        V->Hotspots = NULL;
+    }
+}
+
+//
+// 64-bit finalizer (splitmix64) over the folded key; the two halves give
+// the base and stride of the double-hashed row indices
+//
+static __forceinline UINT64 HvHotspotHash(UINT64 Rip, UINT64 ExitCode, UINT64 Cr3)
+{
+    UINT64 h = Rip ^ _rotl64(Cr3, 17) ^ (ExitCode * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static __forceinline ULONG HvHotspotColumn(UINT64 Hash, ULONG Row)
+{
+    UINT32 base = (UINT32)Hash;
+    UINT32 stride = (UINT32)(Hash >> 32) | 1;
+    return (base + Row * stride) & HV_HOTSPOT_MASK;
+}
+
+static UINT64 HvHotspotEstimate(HV_HOTSPOT* H, UINT64 Hash)
+{
+    UINT32 est = MAXUINT32;
+    for (ULONG row = 0; row < HV_HOTSPOT_DEPTH; row++)
+    {
+        UINT32 c = H->Counters[row][HvHotspotColumn(Hash, row)];
+        if (c < est)
+            est = c;
+    }
+    return est;
+}
+
+//
+// Halve every counter so the sketch follows the current workload instead
+// of saturating; amortized over 2^HV_HOTSPOT_AGE_SHIFT exits
+//
+static VOID HvHotspotAge(HV_HOTSPOT* H)
+{
+    for (ULONG row = 0; row < HV_HOTSPOT_DEPTH; row++)
+    {
+        for (ULONG col = 0; col < HV_HOTSPOT_WIDTH; col++)
+            H->Counters[row][col] >>= 1;
+    }
+
+    _InterlockedIncrement(&H->TopSeq);
+    for (ULONG i = 0; i < H->TopCount; i++)
+        H->Top[i].Count >>= 1;
+    _InterlockedIncrement(&H->TopSeq);
+}
+
+VOID HvHotspotRecord(VCPU* V, UINT64 Rip, UINT64 ExitCode, UINT64 Cr3)
+{
+    HV_HOTSPOT* h = V->Hotspots;
+    if (!h)
+        return;
+
+    if (h->ResetPending)
+    {
+        _InterlockedIncrement(&h->TopSeq);
+        RtlZeroMemory(h, FIELD_OFFSET(HV_HOTSPOT, TopSeq));
+        _InterlockedIncrement(&h->TopSeq);
+        h->Updates = 0;
+        h->ResetPending = 0;
+    }
+
+    UINT64 hash = HvHotspotHash(Rip, ExitCode, Cr3);
+
+    //
+    // Conservative update: only raise the counters that equal the current
+    // minimum, which keeps the overestimate from collisions much smaller
+    //
+    UINT64 est = HvHotspotEstimate(h, hash);
+    if (est == MAXUINT32)
+        return;
+
+    for (ULONG row = 0; row < HV_HOTSPOT_DEPTH; row++)
+    {
+        UINT32* c = &h->Counters[row][HvHotspotColumn(hash, row)];
+        if (*c == est)
+            (*c)++;
+    }
+    est++;
+
+    //
+    // Top-K maintenance: refresh the key if present, otherwise evict the
+    // lightest entry when this key now outweighs it
+    //
+    ULONG victim = 0;
+    for (ULONG i = 0; i < h->TopCount; i++)
+    {
+        HV_HOTSPOT_ENTRY* e = &h->Top[i];
+        if (e->Rip == Rip && e->ExitCode == ExitCode && e->Cr3 == Cr3)
+        {
+            e->Count = est;     // Single aligned store, no torn read possible
+            goto aged;
+        }
+        if (e->Count < h->Top[victim].Count)
+            victim = i;
+    }
+
+    if (h->TopCount < HV_HOTSPOT_TOPK)
+        victim = h->TopCount;
+    else if (est <= h->Top[victim].Count)
+        goto aged;
+
+    _InterlockedIncrement(&h->TopSeq);
+    h->Top[victim].Rip = Rip;
+    h->Top[victim].ExitCode = ExitCode;
+    h->Top[victim].Cr3 = Cr3;
+    h->Top[victim].Count = est;
+    if (victim == h->TopCount)
+        h->TopCount++;
+    _InterlockedIncrement(&h->TopSeq);
+
+aged:
+    if ((++h->Updates & ((1ULL << HV_HOTSPOT_AGE_SHIFT) - 1)) == 0)
+        HvHotspotAge(h);
+}
+
+//
+// Consistent copy of another VCPU's top-K list; returns 0 if the owner
+// kept changing it
+//
+static ULONG HvHotspotSnapshot(HV_HOTSPOT* H, HV_HOTSPOT_ENTRY* Out)
+{
+    for (ULONG attempt = 0; attempt < HV_HOTSPOT_READ_RETRIES; attempt++)
+    {
+        LONG seq = H->TopSeq;
+        if (seq & 1)
+        {
+            _mm_pause();
+            continue;
+        }
+
+        _ReadWriteBarrier();
+        ULONG count = H->TopCount;
+        if (count > HV_HOTSPOT_TOPK)
+            count = HV_HOTSPOT_TOPK;
+        RtlCopyMemory(Out, H->Top, count * sizeof(HV_HOTSPOT_ENTRY));
+        _ReadWriteBarrier();
+
+        if (H->TopSeq == seq)
+            return count;
+    }
+
+    return 0;
+}
+
+//
+// Merge every VCPU's sketch into one list of the heaviest exit sites. The
+// candidates are the union of the per-VCPU top-K lists; each is scored with
+// the sum of its count-min estimates across all VCPUs.
+//
+ULONG HvHotspotMerge(HV_HOTSPOT_ENTRY* Out, ULONG Max)
+{
+    HV_HOTSPOT_ENTRY local[HV_HOTSPOT_TOPK];
+    ULONG vcpus = SmpGetVcpuCount();
+    ULONG count = 0;
+
+    if (Max > HV_HOTSPOT_MAX_RESULTS)
+        Max = HV_HOTSPOT_MAX_RESULTS;
+    if (!Max)
+        return 0;
+
+    for (ULONG v = 0; v < vcpus; v++)
+    {
+        VCPU* source = SmpGetVcpu(v);
+        if (!source || !source->Hotspots)
+            continue;
+
+        ULONG n = HvHotspotSnapshot(source->Hotspots, local);
+        for (ULONG i = 0; i < n; i++)
+        {
+            HV_HOTSPOT_ENTRY* c = &local[i];
+            BOOLEAN seen = FALSE;
+
+            for (ULONG j = 0; j < count && !seen; j++)
+                seen = Out[j].Rip == c->Rip && Out[j].ExitCode == c->ExitCode && Out[j].Cr3 == c->Cr3;
+            if (seen)
+                continue;
+
+            UINT64 hash = HvHotspotHash(c->Rip, c->ExitCode, c->Cr3);
+            UINT64 total = 0;
+            for (ULONG w = 0; w < vcpus; w++)
+            {
+                VCPU* other = SmpGetVcpu(w);
+                if (other && other->Hotspots)
+                    total += HvHotspotEstimate(other->Hotspots, hash);
+            }
+
+            // Insertion into the descending result list
+            ULONG pos = count;
+            while (pos > 0 && Out[pos - 1].Count < total)
+                pos--;
+            if (pos >= Max)
+                continue;
+
+            ULONG last = (count < Max) ? count : Max - 1;
+            for (ULONG k = last; k > pos; k--)
+                Out[k] = Out[k - 1];
+
+            Out[pos] = *c;
+            Out[pos].Count = total;
+            if (count < Max)
+                count++;
+        }
+    }
+
+    return count;
+}
+
+VOID HvHotspotRequestReset(VOID)
+{
+    for (ULONG v = 0; v < SmpGetVcpuCount(); v++)
+    {
+        VCPU* source = SmpGetVcpu(v);
+        if (source && source->Hotspots)
+            InterlockedExchange(&source->Hotspots->ResetPending, 1);
+    }
+}
@@ -3,11 +3,61 @@
 #include "vcpu.h"
 #include "vmcb.h"
 #include "guest_mem.h"
+#include "guest_walk.h"
 #include "npt.h"
 #include "hooks.h"
 #include "stealth.h"
 #include "shadow_idt.h"
 #include "layers.h"
+#include "exit_dispatch.h"
+#include "trace.h"
+#include "stats.h"
+#include "hotspot.h"
+#include "xstate.h"
+#include "cpuid_cache.h"
+#include "msrpm.h"
+#include "iopm.h"
+#include "event.h"
+#include "defer.h"
+
+//
+// Exit handler table, indexed by exit code. Filled with HvHandleUnknownExit
+// by HvInitializeExitHandlers and updated at runtime with compare-exchange,
+// so a VCPU dispatching concurrently sees either the old or the new handler.
+//
+static HV_EXIT_ENTRY g_HvExitTable[HV_EXIT_TABLE_SIZE];
+
+static volatile BOOLEAN g_HvVmcbCaching = TRUE;
+
+VOID HvSetVmcbCaching(BOOLEAN Enable)
+{
+    g_HvVmcbCaching = Enable;
+}
+
+static volatile BOOLEAN g_HvLazyHostState = TRUE;
+
+VOID HvSetLazyHostState(BOOLEAN Enable)
+{
+    g_HvLazyHostState = Enable;
+}
+
+//
+// LaunchVm no longer VMSAVEs the guest after every VMRUN, so on entry to
+// HandleVmExit the CPU still holds the guest's FS/GS/TR/LDTR, KernelGsBase,
+// STAR/LSTAR/CSTAR/SFMASK and SYSENTER state. That is harmless while GIF is
+// clear (no interrupt can run on it) and the handler leaves those alone.
+// Anything that does need them swaps here: the guest's go to the VMCB, the
+// host's come back, and LaunchVm VMLOADs the guest before the next VMRUN.
+//
+VOID HvEnsureHostState(VCPU* V)
+{
+    if (V->HostStackLayout.HostStateLoaded)
+        return;
+
+    __svm_vmsave(V->HostStackLayout.GuestVmcbPa);
+    __svm_vmload(V->HostStackLayout.HostVmcbPa);
+    V->HostStackLayout.HostStateLoaded = TRUE;
+}
 
 //
 // Advance RIP to next instruction
@@ -26,203 +76,163 @@ static VOID HvAdvanceRIP(VCPU* V, UINT8 len)
 //
 // Handle CPUID exit
 //
-static VOID HvHandleCpuid(VCPU* V, PGUEST_REGISTERS GuestRegs)
+static HV_EXIT_ACTION HvHandleCpuid(VCPU* V, PGUEST_REGISTERS GuestRegs)
 {
-    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
-    UNREFERENCED_PARAMETER(s);
-
-    UINT64 leaf = GuestRegs->Rax;
-    UINT64 sub = GuestRegs->Rcx;
+    UINT32 leaf = (UINT32)GuestRegs->Rax;
+    UINT32 sub = (UINT32)GuestRegs->Rcx;
 
-    UINT32 eax = 0, ebx = 0, ecx = 0, edx = 0;
+    HV_CPUID_ENTRY r = { 0 };
     
     // Handle hypervisor presence leaves (0x40000000-0x400000FF)
     // Anti-cheat checks these - return zeros to pretend no hypervisor
-    if (leaf >= 0x40000000 && leaf <= 0x400000FF)
+    if (leaf < 0x40000000 || leaf > 0x400000FF)
     {
-        eax = 0;
-        ebx = 0;
-        ecx = 0;
-        edx = 0;
-    }
-    else
-    {
-        __cpuidex((int*)&eax, (int)leaf, (int)sub);
-
-        // Hide hypervisor presence in standard leaves
-        if (leaf == 1)
-            ecx &= ~(1 << 31);  // Clear hypervisor present bit
-
-        if (leaf == 0x80000001)
-            edx &= ~(1 << 2);   // Clear SVM bit
-            
-        // Apply stealth masks
-        StealthMaskCpuid((UINT32)leaf, &ecx, &edx);
+        // Snapshot with the hypervisor-present / SVM / stealth masks
+        // already applied; only dynamic leaves execute CPUID
+        HvCpuidLookup(V, leaf, sub, &r);
     }
 
-    GuestRegs->Rax = eax;
-    GuestRegs->Rbx = ebx;
-    GuestRegs->Rcx = ecx;
-    GuestRegs->Rdx = edx;
+    GuestRegs->Rax = r.Eax;
+    GuestRegs->Rbx = r.Ebx;
+    GuestRegs->Rcx = r.Ecx;
+    GuestRegs->Rdx = r.Edx;
 
-    HvAdvanceRIP(V, 2);
+    return HvExitAdvanceRip;
 }
 
 //
 // Handle MSR exit
 //
-static VOID HvHandleMsr(VCPU* V, PGUEST_REGISTERS GuestRegs)
+static HV_EXIT_ACTION HvHandleMsr(VCPU* V, PGUEST_REGISTERS GuestRegs)
 {
-    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
-
-    UINT64 rcx = GuestRegs->Rcx;
-    BOOLEAN write = (rcx >> 63) & 1;
-    UINT64 msr = rcx & ~0x8000000000000000ULL;
+    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
+    UINT32 msr = (UINT32)GuestRegs->Rcx;
+    BOOLEAN ok;
 
-    if (write)
+    // EXITINFO1: 0 = RDMSR, 1 = WRMSR; the value travels in EDX:EAX
+    if (c->ExitInfo1 & 1)
     {
-        UINT64 value = GuestRegs->Rax;
-        HookHandleMsrWrite(V, msr, value);
+        UINT64 value = ((UINT64)(UINT32)GuestRegs->Rdx << 32) | (UINT32)GuestRegs->Rax;
+        ok = HvMsrHandleWrite(V, msr, value);
     }
     else
     {
-        UINT64 value = HookHandleMsrRead(V, msr);
-        GuestRegs->Rax = value;
+        UINT64 value = 0;
+        ok = HvMsrHandleRead(V, msr, &value);
+        if (ok)
+        {
+            GuestRegs->Rax = (UINT32)value;
+            GuestRegs->Rdx = value >> 32;
+        }
     }
 
-    HvAdvanceRIP(V, 2);
+    if (!ok)
+    {
+        HvEventQueueException(V, HV_VECTOR_GP, TRUE, 0);
+        return HvExitResume;
+    }
+
+    return HvExitAdvanceRip;
 }
 
 //
 // Handle VMMCALL exit
 //
-static VOID HvHandleVmmcall(VCPU* V, PGUEST_REGISTERS GuestRegs)
+static HV_EXIT_ACTION HvHandleVmmcall(VCPU* V, PGUEST_REGISTERS GuestRegs)
 {
     UINT64 code = GuestRegs->Rax;
     UINT64 arg1 = GuestRegs->Rbx;
     UINT64 arg2 = GuestRegs->Rcx;
     UINT64 arg3 = GuestRegs->Rdx;
 
+    UINT64 start = __rdtsc();
     UINT64 result = HookVmmcallDispatch(V, code, arg1, arg2, arg3);
+    HvStatsRecordCall(V, code, __rdtsc() - start);
 
     GuestRegs->Rax = result;
 
-    HvAdvanceRIP(V, 3);
+    return HvExitAdvanceRip;
 }
 
 //
 // Handle NPF (Nested Page Fault) exit
 //
-static VOID HvHandleNpf(VCPU* V)
+static HV_EXIT_ACTION HvHandleNpf(VCPU* V, PGUEST_REGISTERS GuestRegs)
 {
     VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
 
     UINT64 fault_gpa = c->ExitInfo2;  // Faulting guest physical address
     UINT64 error_code = c->ExitInfo1; // NPF error code
+
+    // The guest may be editing a page table a cached translation went through
+    if (error_code & PAGE_WRITE)
+        GuestTlbNotifyWrite(V, fault_gpa);
+
+    // Dirty logging write faults are the common case while it is on; keep
+    // them ahead of the logging below
+    if (NptHandleDirtyFault(&V->Npt, fault_gpa, error_code))
+        return HvExitResume;
     
-    DbgPrint("SVM-HV: NPF at GPA=0x%llX ErrorCode=0x%llX RIP=0x%llX\n",
+    HV_EXIT_LOG("SVM-HV: NPF at GPA=0x%llX ErrorCode=0x%llX RIP=0x%llX\n",
              fault_gpa, error_code, VmcbState(&V->GuestVmcb)->Rip);
 
-    // Try layered NPF handler first
-    if (HvHandleLayeredNpf(V, fault_gpa))
+    // Try layered NPF handler first (emulates trapped accesses in place)
+    if (HvHandleLayeredNpf(V, GuestRegs, fault_gpa))
     {
-        return;
+        return HvExitResume;
     }
 
     // Try hook system
     if (HookNptHandleFault(V, fault_gpa))
     {
-        DbgPrint("SVM-HV: NPF handled by hook system\n");
-        return;
+        HV_EXIT_LOG("SVM-HV: NPF handled by hook system\n");
+        return HvExitResume;
     }
 
-    // ========== FIX #5: Handle MMIO region faults dynamically ==========
-    // If NPF is due to missing mapping, try to create it
-    // This handles late MMIO region discovery on bare metal
-    UINT64 page = fault_gpa & ~0x1FFFFFULL;  // Align to 2MB boundary
-    
-    // Check if this looks like an MMIO region (high physical addresses)
-    if (page >= 0xE0000000ULL && page < 0x100000000ULL)
+    // Unpopulated slot (64-bit MMIO aperture above RAM): build its identity
+    // mapping on demand instead of mapping the whole physical address space
+    if (NptHandleLazyFill(&V->Npt, fault_gpa))
     {
-        DbgPrint("SVM-HV: Creating NPT mapping for MMIO region 0x%llX\n", page);
-        
-        // Create NPT entry for this MMIO page
-        UINT64 pml4_i = (page >> 39) & 0x1FF;
-        UINT64 pdpt_i = (page >> 30) & 0x1FF;
-        UINT64 pd_i = (page >> 21) & 0x1FF;
-
-        // Walk NPT structure
-        NPT_ENTRY* pml4 = V->Npt.Pml4;
-        if (!pml4)
-        {
-            DbgPrint("SVM-HV: NPT PML4 not initialized!\n");
-            goto inject_fault;
-        }
-
-        // Check/create PDPT entry
-        if (!pml4[pml4_i].Present)
-        {
-            DbgPrint("SVM-HV: PML4[%llu] not present, cannot create MMIO mapping\n", pml4_i);
-            goto inject_fault;
-        }
-
-        // For simplicity, check if we can find the existing PD
-        // A more robust implementation would call NptEnsureSubtable
-        UINT64 pdpt_pa = pml4[pml4_i].PageFrame << 12;
-        NPT_ENTRY* pdpt = (NPT_ENTRY*)NptLookupTable(pdpt_pa);
-        
-        if (pdpt && pdpt[pdpt_i].Present && !pdpt[pdpt_i].LargePage)
-        {
-            UINT64 pd_pa = pdpt[pdpt_i].PageFrame << 12;
-            NPT_ENTRY* pd = (NPT_ENTRY*)NptLookupTable(pd_pa);
-            
-            if (pd)
-            {
-                NPT_ENTRY* pde = &pd[pd_i];
-                if (!pde->Present)
-                {
-                    pde->Present = 1;
-                    pde->Write = 1;
-                    pde->User = 1;
-                    pde->LargePage = 1;
-                    pde->CacheDisable = 1;  // Uncached for MMIO
-                    pde->PageFrame = page >> 12;
-                    
-                    // Mark TLB flush needed
-                    V->Npt.TlbFlushPending = TRUE;
-                    
-                    DbgPrint("SVM-HV: MMIO mapping created successfully for 0x%llX\n", page);
-                    return;
-                }
-            }
-        }
+        V->Npt.TlbFlushPending = TRUE;
+        return HvExitResume;
     }
 
-inject_fault:
     // If we couldn't handle it, inject #PF to guest
-    DbgPrint("SVM-HV: Unhandled NPF - injecting #PF to guest\n");
+    HV_EXIT_LOG("SVM-HV: Unhandled NPF - injecting #PF to guest\n");
     
-    // Inject #PF (Page Fault) exception to guest
-    // Format: [31]=Valid, [11]=ErrorCodeValid, [10:8]=Type (3=Exception), [7:0]=Vector (14=#PF)
-    c->EventInjection = (1UL << 31) | (1UL << 11) | (3UL << 8) | 14;
-    c->EventInjectionError = (UINT32)error_code;
+    HvEventQueueException(V, HV_VECTOR_PF, TRUE, (UINT32)error_code);
     
     // Set CR2 to faulting address
-    VmcbState(&V->GuestVmcb)->Cr2 = fault_gpa;
+    VmcbSetCr2(&V->GuestVmcb, fault_gpa);
+    return HvExitResume;
+}
+
+//
+// Physical interrupt, intercepted only while deferred work is waiting for a
+// dedicated exit; HandleVmExit runs it, and the interrupt is still pending
+// for the guest on VMRUN
+//
+static HV_EXIT_ACTION HvHandleIntr(VCPU* V, PGUEST_REGISTERS GuestRegs)
+{
+    UNREFERENCED_PARAMETER(V);
+    UNREFERENCED_PARAMETER(GuestRegs);
+    return HvExitResume;
 }
 
 //
 // Handle HLT exit
 //
-static VOID HvHandleHlt(VCPU* V)
+static HV_EXIT_ACTION HvHandleHlt(VCPU* V, PGUEST_REGISTERS GuestRegs)
 {
-    HvAdvanceRIP(V, 1);
+    UNREFERENCED_PARAMETER(V);
+    UNREFERENCED_PARAMETER(GuestRegs);
+    return HvExitAdvanceRip;
 }
 
 //
 // Handle RDTSC exit - compensate for VMEXIT overhead to prevent timing detection
 //
-static VOID HvHandleRdtsc(VCPU* V, PGUEST_REGISTERS GuestRegs)
+static HV_EXIT_ACTION HvHandleRdtsc(VCPU* V, PGUEST_REGISTERS GuestRegs)
 {
     VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
     
@@ -240,13 +250,13 @@ static VOID HvHandleRdtsc(VCPU* V, PGUEST_REGISTERS GuestRegs)
     GuestRegs->Rax = (UINT32)tsc;
     GuestRegs->Rdx = (UINT32)(tsc >> 32);
     
-    HvAdvanceRIP(V, 2);
+    return HvExitAdvanceRip;
 }
 
 //
 // Handle RDTSCP exit - same as RDTSC but also returns IA32_TSC_AUX in ECX
 //
-static VOID HvHandleRdtscp(VCPU* V, PGUEST_REGISTERS GuestRegs)
+static HV_EXIT_ACTION HvHandleRdtscp(VCPU* V, PGUEST_REGISTERS GuestRegs)
 {
     VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
     
@@ -265,16 +275,118 @@ static VOID HvHandleRdtscp(VCPU* V, PGUEST_REGISTERS GuestRegs)
     GuestRegs->Rdx = (UINT32)(tsc >> 32);
     GuestRegs->Rcx = aux;
     
-    HvAdvanceRIP(V, 3);
+    return HvExitAdvanceRip;
+}
+
+//
+// Handle I/O exit - only ports marked in the IOPM get here (see iopm.c)
+//
+static HV_EXIT_ACTION HvHandleIo(VCPU* V, PGUEST_REGISTERS GuestRegs)
+{
+    return HvIoHandleExit(V, GuestRegs);
+}
+
+//
+// Handle VINTR exit - clear V_IRQ to acknowledge; the interrupt is
+// delivered to the guest on the next VMRUN
+//
+static HV_EXIT_ACTION HvHandleVintr(VCPU* V, PGUEST_REGISTERS GuestRegs)
+{
+    UNREFERENCED_PARAMETER(GuestRegs);
+    HvEventWindowExit(V);
+    return HvExitResume;
+}
+
+//
+// Default handler for exit codes nobody registered - inject #UD.
+// This is safer than blindly advancing RIP by 1 byte
+//
+static HV_EXIT_ACTION HvHandleUnknownExit(VCPU* V, PGUEST_REGISTERS GuestRegs)
+{
+    UNREFERENCED_PARAMETER(GuestRegs);
+
+    HV_EXIT_LOG("SVM-HV: [CPU %llu] Unhandled VMEXIT 0x%llX at RIP 0x%llX\n",
+             V->HostStackLayout.ProcessorIndex, VmcbControl(&V->GuestVmcb)->ExitCode, VmcbState(&V->GuestVmcb)->Rip);
+
+    HvEventQueueException(V, HV_VECTOR_UD, FALSE, 0);
+    return HvExitResume;
+}
+
+//
+// Placeholder a slot holds while (un)registration rewrites its length and
+// flags. It behaves exactly like the default handler, which is what the
+// slot means until the new handler is published.
+//
+static HV_EXIT_ACTION HvHandleClaimedExit(VCPU* V, PGUEST_REGISTERS GuestRegs)
+{
+    return HvHandleUnknownExit(V, GuestRegs);
+}
+
+static const HV_EXIT_ENTRY g_HvUnknownExit = { HvHandleUnknownExit, 0, 0 };
+
+//
+// Exit handler registration. The slot is claimed with a CAS before anything
+// in it is written, so a losing caller never touches the entry a VCPU may be
+// dispatching through; the handler is published last with a full barrier,
+// so a VCPU that reads it also reads the length and flags that go with it.
+//
+NTSTATUS HvRegisterExitHandler(UINT64 ExitCode, HV_EXIT_HANDLER Handler, UINT8 InsnLength, UINT8 Flags)
+{
+    if (ExitCode >= HV_EXIT_TABLE_SIZE || !Handler)
+        return STATUS_INVALID_PARAMETER;
+
+    HV_EXIT_ENTRY* e = &g_HvExitTable[ExitCode];
+
+    if (InterlockedCompareExchangePointer((PVOID volatile*)&e->Handler, (PVOID)HvHandleClaimedExit,
+                                          (PVOID)HvHandleUnknownExit) != (PVOID)HvHandleUnknownExit)
+        return STATUS_OBJECT_NAME_COLLISION;
+
+    e->InsnLength = InsnLength;
+    e->Flags = Flags;
+    InterlockedExchangePointer((PVOID volatile*)&e->Handler, (PVOID)Handler);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HvUnregisterExitHandler(UINT64 ExitCode, HV_EXIT_HANDLER Handler)
+{
+    if (ExitCode >= HV_EXIT_TABLE_SIZE || !Handler)
+        return STATUS_INVALID_PARAMETER;
+
+    HV_EXIT_ENTRY* e = &g_HvExitTable[ExitCode];
+
+    if (InterlockedCompareExchangePointer((PVOID volatile*)&e->Handler, (PVOID)HvHandleClaimedExit,
+                                          (PVOID)Handler) != (PVOID)Handler)
+        return STATUS_NOT_FOUND;
+
+    // Back to exactly what HvInitializeExitHandlers put there
+    e->InsnLength = g_HvUnknownExit.InsnLength;
+    e->Flags = g_HvUnknownExit.Flags;
+    InterlockedExchangePointer((PVOID volatile*)&e->Handler, (PVOID)HvHandleUnknownExit);
+    return STATUS_SUCCESS;
 }
 
 //
-// Handle I/O exit
+// Fill the table with the default handler and claim the core intercepts.
+// Call once before the first VMRUN
 //
-static VOID HvHandleIo(VCPU* V)
+VOID HvInitializeExitHandlers(VOID)
 {
-    HookIoIntercept(V);
-    HvAdvanceRIP(V, 2);
+    for (ULONG i = 0; i < HV_EXIT_TABLE_SIZE; i++)
+        g_HvExitTable[i] = g_HvUnknownExit;
+
+    // MSR handlers reach VMLOAD-state MSRs through HvMsrReadGuest, which
+    // works with either state loaded; VMMCALL swaps per hypercall in
+    // HookVmmcallDispatch
+    HvRegisterExitHandler(SVM_EXIT_CPUID,   HvHandleCpuid,   2, 0);
+    HvRegisterExitHandler(SVM_EXIT_MSR,     HvHandleMsr,     2, 0);
+    HvRegisterExitHandler(SVM_EXIT_VMMCALL, HvHandleVmmcall, 3, HV_EXIT_HAS_SLACK);
+    HvRegisterExitHandler(SVM_EXIT_NPF,     HvHandleNpf,     0, 0);
+    HvRegisterExitHandler(SVM_EXIT_HLT,     HvHandleHlt,     1, HV_EXIT_HAS_SLACK);
+    HvRegisterExitHandler(SVM_EXIT_IOIO,    HvHandleIo,      0, 0);
+    HvRegisterExitHandler(SVM_EXIT_RDTSC,   HvHandleRdtsc,   2, 0);
+    HvRegisterExitHandler(SVM_EXIT_RDTSCP,  HvHandleRdtscp,  3, 0);
+    HvRegisterExitHandler(SVM_EXIT_VINTR,   HvHandleVintr,   0, 0);
+    HvRegisterExitHandler(SVM_EXIT_INTR,    HvHandleIntr,    0, HV_EXIT_HAS_SLACK);
 }
 
 //
@@ -286,73 +398,91 @@ EXTERN_C BOOLEAN HandleVmExit(VCPU* V, PGUEST_REGISTERS GuestRegs)
     VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
     VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
     UINT64 exitCode = c->ExitCode;
+    UINT64 exitTsc = V->HostStackLayout.ExitTsc;
+    UINT64 exitRip = s->Rip;
 
     V->Exec.ExitCount++;
     V->Exec.LastExitCode = exitCode;
 
-    // Load host state
-    PHYSICAL_ADDRESS hostVmcbPa = MmGetPhysicalAddress(&V->HostVmcb);
-    __svm_vmload(hostVmcbPa.QuadPart);
+    // Nothing has changed since the VMRUN that just exited; handlers clear
+    // the clean bits of whatever they modify through the vmcb.h accessors
+    VmcbMarkAllClean(&V->GuestVmcb);
+
+    // Any flush requested for that VMRUN has been done; only ask again below
+    // if this exit needs one
+    c->TlbControl = 0;
 
     // Copy RAX from VMCB to guest registers (RAX is saved in VMCB, not stack)
     GuestRegs->Rax = s->Rax;
 
-    switch (exitCode)
-    {
-    case SVM_EXIT_CPUID:
-        HvHandleCpuid(V, GuestRegs);
-        break;
-
-    case SVM_EXIT_MSR:
-        HvHandleMsr(V, GuestRegs);
-        break;
-
-    case SVM_EXIT_VMMCALL:
-        HvHandleVmmcall(V, GuestRegs);
-        break;
-
-    case SVM_EXIT_NPF:
-        if (!HvHandleLayeredNpf(V, c->ExitInfo1))
-            HvHandleNpf(V);
-        break;
-
-    case SVM_EXIT_HLT:
-        HvHandleHlt(V);
-        break;
-
-    case SVM_EXIT_IOIO:
-        HvHandleIo(V);
-        break;
-
-    case SVM_EXIT_RDTSC:
-        HvHandleRdtsc(V, GuestRegs);
-        break;
-
-    case SVM_EXIT_RDTSCP:
-        HvHandleRdtscp(V, GuestRegs);
-        break;
-
-    case SVM_EXIT_VINTR:
-        // Virtual interrupt pending - clear V_IRQ to acknowledge
-        // The interrupt will be delivered to guest on next VMRUN
-        c->InterruptControl &= ~(1UL << 8);  // Clear V_IRQ bit
-        break;
-
-    default:
-        // Unknown exit - log and inject #UD exception to guest
-        // This is safer than blindly advancing RIP by 1 byte
-        DbgPrint("SVM-HV: [CPU %llu] Unhandled VMEXIT 0x%llX at RIP 0x%llX\n",
-                 V->HostStackLayout.ProcessorIndex, exitCode, s->Rip);
-        
-        // Inject #UD (Invalid Opcode) exception
-        // EventInjection format: [31]=Valid, [10:8]=Type (3=Exception), [7:0]=Vector (6=#UD)
-        c->EventInjection = (1UL << 31) | (3UL << 8) | 6;
-        break;
-    }
+    // EVENTINJ was consumed by the VMRUN; requeue anything the exit cut off
+    HvEventBeginExit(V);
+
+    // One bounds check and one indirect call; out-of-range codes
+    // (VMEXIT_INVALID, -1) take the default handler. The entry is read once,
+    // handler first, so a concurrent (un)registration cannot hand this exit
+    // one handler with another's length or flags (see HvRegisterExitHandler)
+    const HV_EXIT_ENTRY* slot = exitCode < HV_EXIT_TABLE_SIZE ? &g_HvExitTable[exitCode] : &g_HvUnknownExit;
+    HV_EXIT_ENTRY entry;
+    entry.Handler = *(HV_EXIT_HANDLER volatile*)&slot->Handler;
+    _ReadWriteBarrier();
+    entry.InsnLength = slot->InsnLength;
+    entry.Flags = slot->Flags;
+
+    // Host VMLOAD state only for handlers that asked for it (and always
+    // when exit-path logging is compiled in: DbgPrint runs on host GS)
+#ifndef HV_EXIT_PATH_DEBUG
+    if ((entry.Flags & HV_EXIT_NEEDS_HOST_STATE) || !g_HvLazyHostState)
+#endif
+        HvEnsureHostState(V);
+
+    if (entry.Flags & HV_EXIT_NEEDS_XSTATE)
+        HvXstateEnsure(V);
+
+    UINT64 handlerStart = __rdtsc();
+    HV_EXIT_ACTION action = entry.Handler(V, GuestRegs);
+    HvStatsRecordExit(V, exitCode, __rdtsc() - handlerStart);
+    HvStatsRecordWorldSwitch(V, V->HostStackLayout.VmrunTsc, exitTsc);
+    HvHotspotRecord(V, exitRip, exitCode, s->Cr3);
+    if (action == HvExitAdvanceRip)
+        HvAdvanceRIP(V, entry.InsnLength);
+
+    // Deferred maintenance: one compare until an item is due, then it waits
+    // for a slack exit
+    HvDeferPoll(V, exitTsc, (entry.Flags & HV_EXIT_HAS_SLACK) != 0);
+
+    // At most one queued event per VMRUN, highest priority first
+    HvEventDeliver(V);
+
+    // Binary trace record instead of logging: outcome = action, plus the
+    // vector of any event going into the guest on this VMRUN
+    UINT32 outcome = (UINT32)action;
+    if (c->EventInjection & (1UL << 31))
+        outcome |= HV_TRACE_OUTCOME_INJECT | ((UINT32)(c->EventInjection & 0xFF) << 16);
+    HvTraceExit(V, exitTsc, exitRip, outcome);
 
     // Copy RAX back to VMCB
     s->Rax = GuestRegs->Rax;
 
+    // Replay NPT changes published by any VCPU since our last exit (hooks
+    // added/removed elsewhere); sets TlbFlushPending once for the batch
+    NptSyncChanges(&V->Npt);
+
+    // A few leaves of the accessed-bit sampler per exit, when it is running
+    NptSampleStep(&V->Npt);
+
+    // A copy-on-write clone of the NPT root moves this VCPU off the shared
+    // identity hierarchy; point NestedCr3 at the private copy
+    if (c->NestedCr3 != V->Npt.Pml4Pa.QuadPart)
+    {
+        VmcbSetNestedCr3(&V->GuestVmcb, V->Npt.Pml4Pa.QuadPart);
+        V->Npt.TlbFlushPending = TRUE;
+    }
+
+    // Benchmark baseline: behave as if every cached field had changed
+    if (!g_HvVmcbCaching)
+        VmcbMarkDirty(&V->GuestVmcb, VMCB_CLEAN_ALL);
+
     // ========== FIX #3: Execute TLB flush if pending ==========
     // Check if TLB flush is needed after hook operations
     if (V->Npt.TlbFlushPending)
@@ -366,9 +496,13 @@ EXTERN_C BOOLEAN HandleVmExit(VCPU* V, PGUEST_REGISTERS GuestRegs)
         
         V->Npt.TlbFlushPending = FALSE;
         
-        DbgPrint("SVM-HV: TLB flushed after hook operation\n");
+        HV_EXIT_LOG("SVM-HV: TLB flushed after hook operation\n");
     }
 
+    // Put back the guest's vector state if a handler saved it; xmm0-5 are
+    // reloaded from the stub's spill after this
+    HvXstateRestore(V);
+
     // Return FALSE to continue running guest
     return FALSE;
 }
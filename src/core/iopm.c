@@ -0,0 +1,415 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "iopm.h"
+#include "msr.h"
+#include "vmcb.h"
+#include "smp.h"
+#include "sync.h"
+#include "guest_mem.h"
+#include "msrpm.h"
+#include "event.h"
+#include "guest_walk.h"
+
+//
+// EXITINFO1 for IOIO intercepts (AMD APM vol. 2, "IOIO Intercepts")
+//
+#define IOIO_TYPE_IN        (1ULL << 0)
+#define IOIO_STR            (1ULL << 2)
+#define IOIO_REP            (1ULL << 3)
+#define IOIO_SZ8            (1ULL << 4)
+#define IOIO_SZ16           (1ULL << 5)
+#define IOIO_A16            (1ULL << 7)
+#define IOIO_A32            (1ULL << 8)
+#define IOIO_SEG_SHIFT      10          // Effective segment of OUTS (decode assists)
+#define IOIO_PORT_SHIFT     16
+
+#define RFLAGS_DF           (1ULL << 10)
+
+//
+// Intercept bits every VCPU starts from; HvIoSetIntercept keeps it in step
+// with the live maps
+//
+static UINT8 g_HvIopmTemplate[HV_IOPM_SIZE];
+
+static HV_IO_RANGE g_HvIoHandlers[HV_IO_MAX_HANDLERS];
+static volatile LONG g_HvIoHandlerCount = 0;
+static HV_SPINLOCK g_HvIoLock = HV_SPINLOCK_INIT;
+
+NTSTATUS HvIoInitVcpu(VCPU* V)
+{
+    V->Io = (HV_IO_STATE*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_IO_STATE), HV_IO_TAG);
+    if (!V->Io)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(V->Io, FIELD_OFFSET(HV_IO_STATE, Buffer));
+    RtlCopyMemory(V->Iopm, g_HvIopmTemplate, HV_IOPM_SIZE);
+    return STATUS_SUCCESS;
+}
+
+VOID HvIoDestroyVcpu(VCPU* V)
+{
+    if (V->Io)
+    {
+        ExFreePoolWithTag(V->Io, HV_IO_TAG);
+        V->Io = NULL;
+    }
+}
+
+//
+// Same rules as the MSRPM: the processor reads the map on every access, so
+// bits may change under a running guest
+//
+static NTSTATUS HvIopmUpdate(UINT8* Map, UINT16 First, UINT16 Last, BOOLEAN Enable)
+{
+    if (First > Last)
+        return STATUS_INVALID_PARAMETER;
+
+    for (ULONG port = First; port <= Last; port++)
+    {
+        volatile LONG* word = (volatile LONG*)Map + port / 32;
+        LONG mask = 1L << (port & 31);
+
+        if (Enable)
+            InterlockedOr(word, mask);
+        else
+            InterlockedAnd(word, ~mask);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HvIoSetVcpuIntercept(VCPU* V, UINT16 First, UINT16 Last, BOOLEAN Enable)
+{
+    return HvIopmUpdate((UINT8*)V->Iopm, First, Last, Enable);
+}
+
+NTSTATUS HvIoSetIntercept(UINT16 First, UINT16 Last, BOOLEAN Enable)
+{
+    NTSTATUS st = HvIopmUpdate(g_HvIopmTemplate, First, Last, Enable);
+    if (!NT_SUCCESS(st))
+        return st;
+
+    for (ULONG i = 0; i < SmpGetVcpuCount(); i++)
+    {
+        VCPU* v = SmpGetVcpu(i);
+        if (v && v->Iopm)
+            HvIopmUpdate((UINT8*)v->Iopm, First, Last, Enable);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Append-only like the MSR handler table; ranges may not overlap.
+// Registering does not set any intercept bit.
+//
+NTSTATUS HvRegisterIoHandler(UINT16 First, UINT16 Last, HV_IO_HANDLER Handler)
+{
+    NTSTATUS st = STATUS_SUCCESS;
+
+    if (!Handler || First > Last)
+        return STATUS_INVALID_PARAMETER;
+
+    HvSpinLockAcquire(&g_HvIoLock);
+
+    LONG count = g_HvIoHandlerCount;
+    for (LONG i = 0; i < count; i++)
+    {
+        if (First <= g_HvIoHandlers[i].Last && g_HvIoHandlers[i].First <= Last)
+        {
+            st = STATUS_OBJECT_NAME_COLLISION;
+            goto out;
+        }
+    }
+
+    if (count == HV_IO_MAX_HANDLERS)
+    {
+        st = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+
+    HV_IO_RANGE* r = &g_HvIoHandlers[count];
+    r->First = First;
+    r->Last = Last;
+    r->Handler = Handler;
+
+    // Publish the entry before the count that makes it visible
+    _WriteBarrier();
+    InterlockedExchange(&g_HvIoHandlerCount, count + 1);
+
+out:
+    HvSpinLockRelease(&g_HvIoLock);
+    return st;
+}
+
+//
+// Handler whose range overlaps any byte of the access
+//
+static HV_IO_HANDLER HvIoFindHandler(UINT16 Port, UINT8 Size)
+{
+    LONG count = g_HvIoHandlerCount;
+    ULONG last = (ULONG)Port + Size - 1;
+
+    for (LONG i = 0; i < count; i++)
+    {
+        if (Port <= g_HvIoHandlers[i].Last && g_HvIoHandlers[i].First <= last)
+            return g_HvIoHandlers[i].Handler;
+    }
+
+    return NULL;
+}
+
+static VOID HvIoPassThrough(HV_IO_ACCESS* A)
+{
+    if (A->In)
+    {
+        switch (A->Size)
+        {
+        case 1:  __inbytestring(A->Port, (PUCHAR)A->Data, A->Count);     break;
+        case 2:  __inwordstring(A->Port, (PUSHORT)A->Data, A->Count);    break;
+        default: __indwordstring(A->Port, (PULONG)A->Data, A->Count);    break;
+        }
+    }
+    else
+    {
+        switch (A->Size)
+        {
+        case 1:  __outbytestring(A->Port, (PUCHAR)A->Data, A->Count);    break;
+        case 2:  __outwordstring(A->Port, (PUSHORT)A->Data, A->Count);   break;
+        default: __outdwordstring(A->Port, (PULONG)A->Data, A->Count);   break;
+        }
+    }
+}
+
+static BOOLEAN HvIoDispatch(VCPU* V, HV_IO_ACCESS* A)
+{
+    HV_IO_HANDLER handler = HvIoFindHandler(A->Port, A->Size);
+
+    V->Io->Elements += A->Count;
+    if (handler)
+        return handler(V, A);
+
+    HvIoPassThrough(A);
+    V->Io->PassThrough += A->Count;
+    return TRUE;
+}
+
+static HV_EXIT_ACTION HvIoInjectGp(VCPU* V)
+{
+    HvEventQueueException(V, HV_VECTOR_GP, TRUE, 0);
+    return HvExitResume;
+}
+
+//
+// The guest page behind a string operand is not present or does not allow
+// the access: hand the guest a #PF so it resolves it and re-executes the
+// instruction with the registers left where they stopped
+//
+static HV_EXIT_ACTION HvIoInjectPf(VCPU* V, UINT64 Address, UINT32 ErrorCode)
+{
+    VmcbSetCr2(&V->GuestVmcb, Address);
+    HvEventQueueException(V, HV_VECTOR_PF, TRUE, ErrorCode);
+    return HvExitResume;
+}
+
+static UINT64 HvIoSegmentBase(VCPU* V, ULONG Segment)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
+
+    switch (Segment)
+    {
+    case 1:  return s->Cs.Base;
+    case 2:  return s->Ss.Base;
+    case 3:  return s->Ds.Base;
+    case 4:  return HvMsrReadGuest(V, MSR_FS_BASE);
+    case 5:  return HvMsrReadGuest(V, MSR_GS_BASE);
+    default: return s->Es.Base;
+    }
+}
+
+//
+// Partial register writes: 8- and 16-bit writes keep the upper bits,
+// 32-bit writes zero-extend
+//
+static __forceinline VOID HvIoSetReg(UINT64* Reg, UINT64 Value, UINT64 Mask)
+{
+    if (Mask == 0xFFFFFFFF)
+        *Reg = Value & Mask;
+    else
+        *Reg = (*Reg & ~Mask) | (Value & Mask);
+}
+
+static VOID HvIoReverse(UINT8* Data, UINT32 Count, UINT8 Size)
+{
+    for (UINT32 i = 0, j = Count - 1; i < j; i++, j--)
+    {
+        for (UINT8 b = 0; b < Size; b++)
+        {
+            UINT8 t = Data[i * Size + b];
+            Data[i * Size + b] = Data[j * Size + b];
+            Data[j * Size + b] = t;
+        }
+    }
+}
+
+//
+// Copy one chunk of a string operand by guest physical address. The chunk
+// spans at most two pages: First bytes at Low, the rest at the start of
+// High's page.
+//
+static BOOLEAN HvIoCopy(VCPU* V, UINT64 Low, UINT64 High, SIZE_T First, PUCHAR Data, SIZE_T Bytes, BOOLEAN Write)
+{
+    BOOLEAN (*copy)(VCPU*, UINT64, PVOID, SIZE_T) = Write ? GuestWriteGpa : GuestReadGpa;
+
+    if (!copy(V, Low, Data, First))
+        return FALSE;
+
+    return First == Bytes || copy(V, High & ~(UINT64)(PAGE_SIZE - 1), Data + First, Bytes - First);
+}
+
+//
+// INS/OUTS, REP or not. Elements are moved a guest page at a time: both
+// ends of the chunk are translated before the port is touched and the data
+// is then copied by GPA, so a missing page turns into a #PF carrying the
+// walk's error code and faulting address with no I/O lost. When more than HV_IO_MAX_STRING_BYTES are
+// left, RIP stays on the instruction and the guest re-executes the REP
+// with updated RCX/RSI/RDI, giving pending interrupts a window.
+//
+static HV_EXIT_ACTION HvIoString(VCPU* V, PGUEST_REGISTERS GuestRegs, HV_IO_ACCESS* A, UINT64 Info)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
+    UINT64 mask = (Info & IOIO_A16) ? 0xFFFF : (Info & IOIO_A32) ? 0xFFFFFFFF : ~0ULL;
+    BOOLEAN rep = (Info & IOIO_REP) != 0;
+    BOOLEAN down = (s->Rflags & RFLAGS_DF) != 0;
+    UINT64* index = A->In ? &GuestRegs->Rdi : &GuestRegs->Rsi;
+
+    // INS always stores through ES; OUTS reports its segment (ES when the
+    // CPU has no decode assists, which only matters for FS/GS overrides)
+    UINT64 base = HvIoSegmentBase(V, A->In ? 0 : (ULONG)((Info >> IOIO_SEG_SHIFT) & 7));
+    UINT64 remaining = rep ? (GuestRegs->Rcx & mask) : 1;
+    UINT64 budget = HV_IO_MAX_STRING_BYTES / A->Size;
+    UINT32 access = (A->In ? GUEST_ACCESS_WRITE : 0) | (s->Cpl == 3 ? GUEST_ACCESS_USER : 0);
+    GUEST_WALK walk;
+
+    V->Io->StringExits++;
+    A->Data = V->Io->Buffer;
+
+    while (remaining && budget)
+    {
+        UINT64 offset = *index & mask;
+        UINT64 linear = base + offset;
+        UINT64 n;
+
+        // Stay inside the page of the first element, in the direction of travel
+        if (down)
+            n = (linear & (PAGE_SIZE - 1)) / A->Size + 1;
+        else
+            n = (PAGE_SIZE - (linear & (PAGE_SIZE - 1))) / A->Size;
+        if (!n)
+            n = 1;  // Element straddles the page boundary
+        if (n > remaining)
+            n = remaining;
+        if (n > budget)
+            n = budget;
+
+        SIZE_T bytes = (SIZE_T)n * A->Size;
+        UINT64 low = down ? linear - (bytes - A->Size) : linear;
+
+        // INS writes guest memory, OUTS reads it, with the guest's CPL
+        if (!GuestWalkCurrent(V, low, access, &walk))
+            return HvIoInjectPf(V, low, walk.ErrorCode);
+        UINT64 gpaLow = walk.Gpa;
+        if (!GuestWalkCurrent(V, low + bytes - 1, access, &walk))
+            return HvIoInjectPf(V, low + bytes - 1, walk.ErrorCode);
+        UINT64 gpaHigh = walk.Gpa;
+
+        SIZE_T first = bytes;
+        if ((low ^ (low + bytes - 1)) & ~(UINT64)(PAGE_SIZE - 1))
+            first = PAGE_SIZE - (low & (PAGE_SIZE - 1));
+
+        // Copies by GPA only fail without a mapping window, which a running
+        // VCPU always has; #GP rather than a #PF the walk did not report
+        A->Count = (UINT32)n;
+        if (A->In)
+        {
+            if (!HvIoDispatch(V, A))
+                return HvIoInjectGp(V);
+            if (down)
+                HvIoReverse(A->Data, A->Count, A->Size);
+            if (!HvIoCopy(V, gpaLow, gpaHigh, first, A->Data, bytes, TRUE))
+                return HvIoInjectGp(V);
+        }
+        else
+        {
+            if (!HvIoCopy(V, gpaLow, gpaHigh, first, A->Data, bytes, FALSE))
+                return HvIoInjectGp(V);
+            if (down)
+                HvIoReverse(A->Data, A->Count, A->Size);
+            if (!HvIoDispatch(V, A))
+                return HvIoInjectGp(V);
+        }
+
+        HvIoSetReg(index, down ? offset - bytes : offset + bytes, mask);
+        if (rep)
+            HvIoSetReg(&GuestRegs->Rcx, (GuestRegs->Rcx & mask) - n, mask);
+
+        remaining -= n;
+        budget -= n;
+    }
+
+    if (!remaining)
+        s->Rip = c->ExitInfo2;
+
+    return HvExitResume;
+}
+
+//
+// IOIO exit. EXITINFO1 describes the access and EXITINFO2 holds the RIP of
+// the next instruction, so no instruction length is needed
+//
+HV_EXIT_ACTION HvIoHandleExit(VCPU* V, PGUEST_REGISTERS GuestRegs)
+{
+    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
+    UINT64 info = c->ExitInfo1;
+    HV_IO_ACCESS a;
+
+    a.Port = (UINT16)(info >> IOIO_PORT_SHIFT);
+    a.Size = (info & IOIO_SZ8) ? 1 : (info & IOIO_SZ16) ? 2 : 4;
+    a.In = (info & IOIO_TYPE_IN) != 0;
+
+    V->Io->Exits++;
+
+    if (info & IOIO_STR)
+        return HvIoString(V, GuestRegs, &a, info);
+
+    UINT32 value = (UINT32)GuestRegs->Rax;
+    a.Count = 1;
+    a.Data = &value;
+
+    if (!HvIoDispatch(V, &a))
+        return HvIoInjectGp(V);
+
+    // IN AL/AX keeps the rest of RAX; IN EAX zero-extends
+    if (a.In)
+        HvIoSetReg(&GuestRegs->Rax, value, a.Size == 4 ? 0xFFFFFFFF : (1ULL << (a.Size * 8)) - 1);
+
+    VmcbState(&V->GuestVmcb)->Rip = c->ExitInfo2;
+    return HvExitResume;
+}
+
+UINT64 HvIoQuery(VCPU* V, HV_IO_STAT Stat)
+{
+    HV_IO_STATE* io = V->Io;
+    if (!io)
+        return 0;
+
+    switch (Stat)
+    {
+    case HvIoStatExits:         return io->Exits;
+    case HvIoStatStringExits:   return io->StringExits;
+    case HvIoStatElements:      return io->Elements;
+    case HvIoStatPassThrough:   return io->PassThrough;
+    default:                    return 0;
+    }
+}
@@ -0,0 +1,443 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "msrpm.h"
+#include "msr.h"
+#include "vmcb.h"
+#include "smp.h"
+#include "sync.h"
+#include "event.h"
+
+//
+// Intercept bits every VCPU starts from; HvMsrSetIntercept keeps it in step
+// with the live maps so a VCPU created later sees the same policy
+//
+static UINT8 g_HvMsrpmTemplate[HV_MSRPM_SIZE];
+
+static HV_MSR_HANDLER g_HvMsrHandlers[HV_MSR_MAX_HANDLERS];
+static volatile LONG g_HvMsrHandlerCount = 0;
+static HV_SPINLOCK g_HvMsrLock = HV_SPINLOCK_INIT;
+
+//
+// Fault-safe MSR access (msr_safe.asm). The stub's #GP gate chains to the
+// host's own handler for any fault that is not on its two instructions.
+//
+extern BOOLEAN HvMsrSafeRead(UINT32 Msr, UINT64* Value);
+extern BOOLEAN HvMsrSafeWrite(UINT32 Msr, UINT64 Value);
+extern VOID HvMsrSafeGpHandler(VOID);
+
+UINT64 g_HvMsrGpHandler = 0;
+
+#define HV_MSR_IDT_SIZE     (256 * 16)
+
+#pragma pack(push, 1)
+typedef struct _HV_MSR_IDTR
+{
+    UINT16 Limit;
+    UINT64 Base;
+} HV_MSR_IDTR;
+#pragma pack(pop)
+
+NTSTATUS HvMsrInitVcpu(VCPU* V)
+{
+    V->MsrShadow = (HV_MSR_SHADOW*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_MSR_SHADOW), HV_MSR_TAG);
+    if (!V->MsrShadow)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    V->MsrSafeIdt = ExAllocatePoolWithTag(NonPagedPoolNx, HV_MSR_IDT_SIZE, HV_MSR_TAG);
+    if (!V->MsrSafeIdt)
+    {
+        HvMsrDestroyVcpu(V);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(V->MsrShadow, sizeof(HV_MSR_SHADOW));
+    V->MsrSafeIdtReady = FALSE;
+    RtlCopyMemory(V->Msrpm, g_HvMsrpmTemplate, HV_MSRPM_SIZE);
+    return STATUS_SUCCESS;
+}
+
+VOID HvMsrDestroyVcpu(VCPU* V)
+{
+    if (V->MsrShadow)
+    {
+        ExFreePoolWithTag(V->MsrShadow, HV_MSR_TAG);
+        V->MsrShadow = NULL;
+    }
+
+    if (V->MsrSafeIdt)
+    {
+        ExFreePoolWithTag(V->MsrSafeIdt, HV_MSR_TAG);
+        V->MsrSafeIdt = NULL;
+    }
+}
+
+//
+// Bit index of the MSR's read bit (write is the next one up); FALSE for
+// MSRs outside the three regions, which always exit
+//
+static BOOLEAN HvMsrpmBit(UINT32 Msr, ULONG* Bit)
+{
+    ULONG offset;
+
+    if (Msr <= 0x1FFF)
+        offset = 0;
+    else if (Msr - 0xC0000000 <= 0x1FFF)
+        offset = 0x800, Msr -= 0xC0000000;
+    else if (Msr - 0xC0010000 <= 0x1FFF)
+        offset = 0x1000, Msr -= 0xC0010000;
+    else
+        return FALSE;
+
+    *Bit = offset * 8 + Msr * 2;
+    return TRUE;
+}
+
+//
+// The processor reads the map on each intercepted access (only its base
+// address falls under the IOPM clean bit), so bits can change under a
+// running guest; atomics keep concurrent updates of one dword intact
+//
+static NTSTATUS HvMsrpmUpdate(UINT8* Map, UINT32 First, UINT32 Last, UINT32 Access, BOOLEAN Enable)
+{
+    ULONG bit;
+
+    if (First > Last || !(Access & (HV_MSR_READ | HV_MSR_WRITE)))
+        return STATUS_INVALID_PARAMETER;
+
+    // A range must sit inside one region
+    if (!HvMsrpmBit(First, &bit) || !HvMsrpmBit(Last, &bit) || ((First ^ Last) & ~0x1FFFU))
+        return STATUS_INVALID_PARAMETER;
+
+    for (UINT32 msr = First; ; msr++)
+    {
+        HvMsrpmBit(msr, &bit);
+
+        LONG mask = 0;
+        if (Access & HV_MSR_READ)
+            mask |= 1L << (bit & 31);
+        if (Access & HV_MSR_WRITE)
+            mask |= 1L << ((bit & 31) + 1);
+
+        volatile LONG* word = (volatile LONG*)Map + bit / 32;
+        if (Enable)
+            InterlockedOr(word, mask);
+        else
+            InterlockedAnd(word, ~mask);
+
+        if (msr == Last)
+            break;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HvMsrSetVcpuInterceptRange(VCPU* V, UINT32 First, UINT32 Last, UINT32 Access, BOOLEAN Enable)
+{
+    return HvMsrpmUpdate((UINT8*)V->Msrpm, First, Last, Access, Enable);
+}
+
+NTSTATUS HvMsrSetVcpuIntercept(VCPU* V, UINT32 Msr, UINT32 Access, BOOLEAN Enable)
+{
+    return HvMsrSetVcpuInterceptRange(V, Msr, Msr, Access, Enable);
+}
+
+NTSTATUS HvMsrSetInterceptRange(UINT32 First, UINT32 Last, UINT32 Access, BOOLEAN Enable)
+{
+    NTSTATUS st = HvMsrpmUpdate(g_HvMsrpmTemplate, First, Last, Access, Enable);
+    if (!NT_SUCCESS(st))
+        return st;
+
+    for (ULONG i = 0; i < SmpGetVcpuCount(); i++)
+    {
+        VCPU* v = SmpGetVcpu(i);
+        if (v && v->Msrpm)
+            HvMsrpmUpdate((UINT8*)v->Msrpm, First, Last, Access, Enable);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HvMsrSetIntercept(UINT32 Msr, UINT32 Access, BOOLEAN Enable)
+{
+    return HvMsrSetInterceptRange(Msr, Msr, Access, Enable);
+}
+
+//
+// Handlers are only ever appended, so the exit path can scan the table
+// without taking the lock. Registering does not change any intercept bit;
+// the owner decides when its MSR should exit.
+//
+NTSTATUS HvRegisterMsrHandler(UINT32 Msr, HV_MSR_READ_HANDLER Read, HV_MSR_WRITE_HANDLER Write, UINT32 Flags)
+{
+    NTSTATUS st = STATUS_SUCCESS;
+
+    if (!Read && !Write)
+        return STATUS_INVALID_PARAMETER;
+
+    HvSpinLockAcquire(&g_HvMsrLock);
+
+    LONG count = g_HvMsrHandlerCount;
+    for (LONG i = 0; i < count; i++)
+    {
+        if (g_HvMsrHandlers[i].Msr == Msr)
+        {
+            st = STATUS_OBJECT_NAME_COLLISION;
+            goto out;
+        }
+    }
+
+    if (count == HV_MSR_MAX_HANDLERS)
+    {
+        st = STATUS_INSUFFICIENT_RESOURCES;
+        goto out;
+    }
+
+    HV_MSR_HANDLER* h = &g_HvMsrHandlers[count];
+    h->Msr = Msr;
+    h->Flags = Flags;
+    h->Read = Read;
+    h->Write = Write;
+    h->Generation = 1;
+
+    // Publish the entry before the count that makes it visible
+    _WriteBarrier();
+    InterlockedExchange(&g_HvMsrHandlerCount, count + 1);
+
+out:
+    HvSpinLockRelease(&g_HvMsrLock);
+    return st;
+}
+
+static HV_MSR_HANDLER* HvMsrFindHandler(UINT32 Msr, ULONG* Index)
+{
+    LONG count = g_HvMsrHandlerCount;
+
+    for (LONG i = 0; i < count; i++)
+    {
+        if (g_HvMsrHandlers[i].Msr == Msr)
+        {
+            *Index = (ULONG)i;
+            return &g_HvMsrHandlers[i];
+        }
+    }
+
+    return NULL;
+}
+
+//
+// For handlers whose answer changed without a guest write (hook state)
+//
+VOID HvMsrInvalidateShadow(UINT32 Msr)
+{
+    ULONG index;
+    HV_MSR_HANDLER* h = HvMsrFindHandler(Msr, &index);
+
+    if (h)
+        InterlockedIncrement(&h->Generation);
+}
+
+//
+// The guest's own value of an MSR. The VMLOAD-state MSRs are in the CPU
+// while the exit runs on guest state and in the VMCB once HvEnsureHostState
+// swapped them out; EFER and PAT always live in the VMCB.
+//
+UINT64 HvMsrReadGuest(VCPU* V, UINT32 Msr)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
+    BOOLEAN inVmcb = V->HostStackLayout.HostStateLoaded != 0;
+
+    switch (Msr)
+    {
+    case MSR_EFER:              return s->Efer;
+    case MSR_PAT:               return s->Pat;
+    case MSR_STAR:              if (inVmcb) return s->Star;         break;
+    case MSR_LSTAR:             if (inVmcb) return s->Lstar;        break;
+    case MSR_CSTAR:             if (inVmcb) return s->Cstar;        break;
+    case MSR_SFMASK:            if (inVmcb) return s->SfMask;       break;
+    case MSR_KERNEL_GS_BASE:    if (inVmcb) return s->KernelGsBase; break;
+    case MSR_FS_BASE:           if (inVmcb) return s->Fs.Base;      break;
+    case MSR_GS_BASE:           if (inVmcb) return s->Gs.Base;      break;
+    case MSR_SYSENTER_CS:       if (inVmcb) return s->SysenterCs;   break;
+    case MSR_SYSENTER_ESP:      if (inVmcb) return s->SysenterEsp;  break;
+    case MSR_SYSENTER_EIP:      if (inVmcb) return s->SysenterEip;  break;
+    default:                    break;
+    }
+
+    return __readmsr(Msr);
+}
+
+VOID HvMsrWriteGuest(VCPU* V, UINT32 Msr, UINT64 Value)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
+    BOOLEAN inVmcb = V->HostStackLayout.HostStateLoaded != 0;
+
+    switch (Msr)
+    {
+    case MSR_EFER:
+        VmcbSetEfer(&V->GuestVmcb, Value | EFER_SVME);     // VMRUN requires SVME
+        return;
+    case MSR_PAT:
+        s->Pat = Value;
+        VmcbMarkDirty(&V->GuestVmcb, VMCB_CLEAN_NP);
+        return;
+    case MSR_STAR:              if (inVmcb) { s->Star = Value;         return; } break;
+    case MSR_LSTAR:             if (inVmcb) { s->Lstar = Value;        return; } break;
+    case MSR_CSTAR:             if (inVmcb) { s->Cstar = Value;        return; } break;
+    case MSR_SFMASK:            if (inVmcb) { s->SfMask = Value;       return; } break;
+    case MSR_KERNEL_GS_BASE:    if (inVmcb) { s->KernelGsBase = Value; return; } break;
+    case MSR_FS_BASE:           if (inVmcb) { s->Fs.Base = Value;      return; } break;
+    case MSR_GS_BASE:           if (inVmcb) { s->Gs.Base = Value;      return; } break;
+    case MSR_SYSENTER_CS:       if (inVmcb) { s->SysenterCs = Value;   return; } break;
+    case MSR_SYSENTER_ESP:      if (inVmcb) { s->SysenterEsp = Value;  return; } break;
+    case MSR_SYSENTER_EIP:      if (inVmcb) { s->SysenterEip = Value;  return; } break;
+    default:                    break;
+    }
+
+    __writemsr(Msr, Value);
+}
+
+static BOOLEAN HvMsrInMap(UINT32 Msr)
+{
+    ULONG bit;
+    return HvMsrpmBit(Msr, &bit);
+}
+
+//
+// The IDT is per CPU, so each VCPU copies the one it runs on the first time
+// it needs it and points only the #GP gate (keeping its selector, IST and
+// type) at the stub
+//
+static VOID HvMsrBuildSafeIdt(VCPU* V)
+{
+    HV_MSR_IDTR host;
+    __sidt(&host);
+
+    SIZE_T bytes = min((SIZE_T)host.Limit + 1, (SIZE_T)HV_MSR_IDT_SIZE);
+    PUINT8 idt = (PUINT8)V->MsrSafeIdt;
+
+    RtlZeroMemory(idt, HV_MSR_IDT_SIZE);
+    RtlCopyMemory(idt, (PVOID)host.Base, bytes);
+
+    PUINT8 gate = idt + HV_VECTOR_GP * 16;
+    UINT64 original = *(UINT16*)gate | ((UINT64)*(UINT16*)(gate + 6) << 16) |
+                      ((UINT64)*(UINT32*)(gate + 8) << 32);
+    UINT64 handler = (UINT64)HvMsrSafeGpHandler;
+
+    *(UINT16*)gate = (UINT16)handler;
+    *(UINT16*)(gate + 6) = (UINT16)(handler >> 16);
+    *(UINT32*)(gate + 8) = (UINT32)(handler >> 32);
+
+    // The same kernel handler on every CPU
+    InterlockedExchange64((volatile LONG64*)&g_HvMsrGpHandler, (LONG64)original);
+    V->MsrSafeIdtReady = TRUE;
+}
+
+//
+// Run an out-of-range MSR access natively. Such MSRs always exit, including
+// ones this part does not implement; a #GP raised here is the guest's and is
+// reported as FALSE instead of crashing the host.
+//
+static BOOLEAN HvMsrNativeAccess(VCPU* V, UINT32 Msr, UINT64* Value, BOOLEAN Write)
+{
+    HV_MSR_IDTR host, safe;
+    BOOLEAN ok;
+
+    if (!V->MsrSafeIdt)
+        return FALSE;
+
+    if (!V->MsrSafeIdtReady)
+        HvMsrBuildSafeIdt(V);
+
+    safe.Limit = HV_MSR_IDT_SIZE - 1;
+    safe.Base = (UINT64)V->MsrSafeIdt;
+
+    __sidt(&host);
+    __lidt(&safe);
+    ok = Write ? HvMsrSafeWrite(Msr, *Value) : HvMsrSafeRead(Msr, Value);
+    __lidt(&host);
+
+    if (!ok && V->MsrShadow)
+        V->MsrShadow->NativeFaults++;
+
+    return ok;
+}
+
+BOOLEAN HvMsrHandleRead(VCPU* V, UINT32 Msr, UINT64* Value)
+{
+    HV_MSR_SHADOW* shadow = V->MsrShadow;
+    ULONG index;
+    HV_MSR_HANDLER* h = HvMsrFindHandler(Msr, &index);
+
+    if (!h || !h->Read)
+    {
+        if (HvMsrInMap(Msr))
+            *Value = HvMsrReadGuest(V, Msr);
+        else if (!HvMsrNativeAccess(V, Msr, Value, FALSE))
+            return FALSE;
+
+        if (shadow)
+            shadow->PassThrough++;
+        return TRUE;
+    }
+
+    if (!(h->Flags & HV_MSR_SHADOWED) || !shadow)
+        return h->Read(V, Msr, Value);
+
+    // Generation first: an invalidation racing the handler call leaves the
+    // entry stale rather than wrongly current
+    LONG generation = h->Generation;
+    if (shadow->Entries[index].Generation == generation)
+    {
+        *Value = shadow->Entries[index].Value;
+        shadow->Hits++;
+        return TRUE;
+    }
+
+    if (!h->Read(V, Msr, Value))
+        return FALSE;
+
+    shadow->Entries[index].Value = *Value;
+    shadow->Entries[index].Generation = generation;
+    shadow->HandlerReads++;
+    return TRUE;
+}
+
+BOOLEAN HvMsrHandleWrite(VCPU* V, UINT32 Msr, UINT64 Value)
+{
+    ULONG index;
+    HV_MSR_HANDLER* h = HvMsrFindHandler(Msr, &index);
+
+    if (!h || !h->Write)
+    {
+        if (HvMsrInMap(Msr))
+            HvMsrWriteGuest(V, Msr, Value);
+        else if (!HvMsrNativeAccess(V, Msr, &Value, TRUE))
+            return FALSE;
+    }
+    else if (!h->Write(V, Msr, Value))
+    {
+        return FALSE;
+    }
+
+    // Handlers may keep the value globally; every VCPU re-reads
+    if (h && (h->Flags & HV_MSR_SHADOWED))
+        InterlockedIncrement(&h->Generation);
+
+    return TRUE;
+}
+
+UINT64 HvMsrQuery(VCPU* V, HV_MSR_STAT Stat)
+{
+    HV_MSR_SHADOW* shadow = V->MsrShadow;
+    if (!shadow)
+        return 0;
+
+    switch (Stat)
+    {
+    case HvMsrStatShadowHits:   return shadow->Hits;
+    case HvMsrStatHandlerReads: return shadow->HandlerReads;
+    case HvMsrStatPassThrough:  return shadow->PassThrough;
+    case HvMsrStatNativeFaults: return shadow->NativeFaults;
+    default:                    return 0;
+    }
+}
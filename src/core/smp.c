@@ -3,15 +3,182 @@
 #include "svm.h"
 #include "vmcb.h"
 #include "vcpu.h"
+#include <intrin.h>
 
 #define SMP_VCPU_TAG 'VmsP'
 #define SMP_PNUM_TAG 'NmsP'
+#define SMP_KICK_TAG 'KmsP'
+
+#define MSR_APIC_BASE           0x1B
+#define APIC_BASE_X2APIC_ENABLE (1ULL << 10)
+#define MSR_X2APIC_ID           0x802
+#define MSR_X2APIC_ICR          0x830
+
+#define APIC_REG_ICR_LOW        0x300
+#define APIC_REG_ICR_HIGH       0x310
+#define APIC_ICR_DELIVERY_NMI   (4u << 8)
+#define APIC_ICR_LEVEL_ASSERT   (1u << 14)
+#define APIC_ICR_BUSY           (1u << 12)
+
+//
+// Registry of the running VCPUs so subsystems (NPT change propagation) can
+// reach other cores from VMEXIT context
+//
+static SMP_STATE* g_SmpActive = NULL;
+
+ULONG SmpGetVcpuCount(VOID)
+{
+    return g_SmpActive ? g_SmpActive->ProcessorCount : 0;
+}
+
+VCPU* SmpGetVcpu(ULONG Index)
+{
+    if (!g_SmpActive || Index >= g_SmpActive->ProcessorCount)
+        return NULL;
+
+    return g_SmpActive->Vcpus[Index];
+}
+
+ULONG SmpQueryKicks(VOID)
+{
+    return g_SmpActive ? (ULONG)g_SmpActive->Kicks : 0;
+}
+
+//
+// Runs in the guest on the kicked core. Any intercepted instruction is
+// enough to force a VMEXIT, and every VMEXIT ends with the NPT sync, so a
+// CPUID is all the kick needs.
+//
+static BOOLEAN SmpNmiCallback(PVOID Context, BOOLEAN Handled)
+{
+    SMP_STATE* State = (SMP_STATE*)Context;
+    ULONG index = KeGetCurrentProcessorNumberEx(NULL);
+
+    UNREFERENCED_PARAMETER(Handled);
+
+    if (index >= State->ProcessorCount || !InterlockedExchange(&State->KickPending[index], 0))
+        return FALSE;
+
+    int regs[4];
+    __cpuid(regs, 0);
+    return TRUE;
+}
+
+static VOID SmpSendNmi(SMP_STATE* State, UINT32 ApicId)
+{
+    if (State->X2Apic)
+    {
+        __writemsr(MSR_X2APIC_ICR, ((UINT64)ApicId << 32) | APIC_ICR_LEVEL_ASSERT | APIC_ICR_DELIVERY_NMI);
+        return;
+    }
+
+    volatile UINT32* icrLow = (volatile UINT32*)((PUINT8)State->ApicMmio + APIC_REG_ICR_LOW);
+    volatile UINT32* icrHigh = (volatile UINT32*)((PUINT8)State->ApicMmio + APIC_REG_ICR_HIGH);
+
+    while (*icrLow & APIC_ICR_BUSY)
+        _mm_pause();
+
+    *icrHigh = ApicId << 24;
+    *icrLow = APIC_ICR_LEVEL_ASSERT | APIC_ICR_DELIVERY_NMI;
+}
+
+static __forceinline BOOLEAN SmpCanSendNmi(SMP_STATE* State)
+{
+    return State && State->NmiCallback && (State->X2Apic || State->ApicMmio);
+}
+
+//
+// Force one VCPU through a VMEXIT so it acts on state posted for it now
+// rather than on its next natural exit. A core that already has a kick in
+// flight is skipped.
+//
+VOID SmpKick(ULONG Index)
+{
+    SMP_STATE* State = g_SmpActive;
+    if (!SmpCanSendNmi(State) || Index >= State->ProcessorCount || !State->Vcpus[Index])
+        return;
+
+    if (InterlockedExchange(&State->KickPending[Index], 1))
+        return;
+
+    SmpSendNmi(State, State->ApicIds[Index]);
+    InterlockedIncrement(&State->Kicks);
+}
+
+//
+// Kick every other VCPU, e.g. so it picks up pending NPT changes
+//
+VOID SmpKickOthers(ULONG SelfIndex)
+{
+    SMP_STATE* State = g_SmpActive;
+    if (!SmpCanSendNmi(State))
+        return;
+
+    for (ULONG i = 0; i < State->ProcessorCount; i++)
+    {
+        if (i != SelfIndex)
+            SmpKick(i);
+    }
+}
+
+//
+// An NMI for the guest on core Index, sent through its local APIC. It is not
+// flagged as a kick, so SmpNmiCallback leaves it to the guest's own
+// handlers. Sent from the exit path (GIF clear) it stays pending until the
+// next VMRUN and is then taken by the guest under the guest's own NMI
+// blocking, which the hypervisor cannot see as NMIs are not intercepted.
+//
+BOOLEAN SmpRaiseGuestNmi(ULONG Index)
+{
+    SMP_STATE* State = g_SmpActive;
+    if (!SmpCanSendNmi(State) || Index >= State->ProcessorCount || !State->Vcpus[Index])
+        return FALSE;
+
+    SmpSendNmi(State, State->ApicIds[Index]);
+    return TRUE;
+}
+
+static UINT32 SmpReadApicId(BOOLEAN x2Apic)
+{
+    if (x2Apic)
+        return (UINT32)__readmsr(MSR_X2APIC_ID);
+
+    int regs[4];
+    __cpuid(regs, 1);
+    return ((UINT32)regs[1] >> 24) & 0xFF;
+}
+
+static VOID SmpInitKick(SMP_STATE* State)
+{
+    UINT64 apicBase = __readmsr(MSR_APIC_BASE);
+    State->X2Apic = (apicBase & APIC_BASE_X2APIC_ENABLE) != 0;
+
+    if (!State->X2Apic)
+    {
+        PHYSICAL_ADDRESS pa = { .QuadPart = (LONGLONG)(apicBase & ~0xFFFULL) };
+        State->ApicMmio = MmMapIoSpace(pa, PAGE_SIZE, MmNonCached);
+    }
+
+    State->NmiCallback = KeRegisterNmiCallback(SmpNmiCallback, State);
+
+    if (!State->NmiCallback || (!State->X2Apic && !State->ApicMmio))
+        DbgPrint("SVM-HV: Remote VCPU kick unavailable, NPT changes sync on next exit\n");
+}
 
 static VOID SmpFreeState(SMP_STATE* State)
 {
     if (!State)
         return;
 
+    if (g_SmpActive == State)
+        g_SmpActive = NULL;
+
+    if (State->NmiCallback)
+        KeDeregisterNmiCallback(State->NmiCallback);
+
+    if (State->ApicMmio)
+        MmUnmapIoSpace(State->ApicMmio, PAGE_SIZE);
+
     if (State->Vcpus)
     {
         for (ULONG i = 0; i < State->ProcessorCount; i++)
@@ -27,6 +194,12 @@ static VOID SmpFreeState(SMP_STATE* State)
     if (State->ProcessorNumbers)
         ExFreePoolWithTag(State->ProcessorNumbers, SMP_PNUM_TAG);
 
+    if (State->ApicIds)
+        ExFreePoolWithTag(State->ApicIds, SMP_KICK_TAG);
+
+    if (State->KickPending)
+        ExFreePoolWithTag((PVOID)State->KickPending, SMP_KICK_TAG);
+
     RtlZeroMemory(State, sizeof(*State));
 }
 
@@ -50,8 +223,10 @@ NTSTATUS SmpInitialize(SMP_STATE* State, ULONG MaxVcpus)
     State->ProcessorCount = target;
     State->Vcpus = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(VCPU*) * target, SMP_VCPU_TAG);
     State->ProcessorNumbers = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(PROCESSOR_NUMBER) * target, SMP_PNUM_TAG);
+    State->ApicIds = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(UINT32) * target, SMP_KICK_TAG);
+    State->KickPending = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(LONG) * target, SMP_KICK_TAG);
 
-    if (!State->Vcpus || !State->ProcessorNumbers)
+    if (!State->Vcpus || !State->ProcessorNumbers || !State->ApicIds || !State->KickPending)
     {
         DbgPrint("SVM-HV: SMP alloc failed (vcpus=%p, pnums=%p)\n",
             State->Vcpus, State->ProcessorNumbers);
@@ -61,6 +236,9 @@ NTSTATUS SmpInitialize(SMP_STATE* State, ULONG MaxVcpus)
 
     RtlZeroMemory(State->Vcpus, sizeof(VCPU*) * target);
     RtlZeroMemory(State->ProcessorNumbers, sizeof(PROCESSOR_NUMBER) * target);
+    RtlZeroMemory((PVOID)State->KickPending, sizeof(LONG) * target);
+
+    SmpInitKick(State);
 
     for (ULONG i = 0; i < target; i++)
         KeGetProcessorNumberFromIndex(i, &State->ProcessorNumbers[i]);
@@ -75,11 +253,11 @@ NTSTATUS SmpInitialize(SMP_STATE* State, ULONG MaxVcpus)
         affinity.Mask = 1ull << pn.Number;
 
         KeSetSystemGroupAffinityThread(&affinity, &previous);
+        State->ApicIds[i] = SmpReadApicId(State->X2Apic);
         NTSTATUS st = SvmInit(&State->Vcpus[i]);
         if (NT_SUCCESS(st))
         {
-            VMCB_CONTROL_AREA* c = VmcbControl(&State->Vcpus[i]->GuestVmcb);
-            c->GuestAsid = i + 1;
+            VmcbSetAsid(&State->Vcpus[i]->GuestVmcb, i + 1);
         }
         KeRevertToUserGroupAffinityThread(&previous);
 
@@ -93,6 +271,7 @@ NTSTATUS SmpInitialize(SMP_STATE* State, ULONG MaxVcpus)
         }
     }
 
+    g_SmpActive = State;
     return STATUS_SUCCESS;
 }
 
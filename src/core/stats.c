@@ -0,0 +1,184 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "stats.h"
+#include "vcpu.h"
+
+NTSTATUS HvStatsInitVcpu(VCPU* V)
+{
+    V->Stats = (HV_STATS*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_STATS), HV_STAT_TAG);
+    if (!V->Stats)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(V->Stats, sizeof(HV_STATS));
+    return STATUS_SUCCESS;
+}
+
+VOID HvStatsDestroyVcpu(VCPU* V)
+{
+    if (V->Stats)
+    {
+        ExFreePoolWithTag(V->Stats, HV_STAT_TAG);
+        V->Stats = NULL;
+    }
+}
+
+//
+// Log-linear bucket: exact below 4, then 4 sub-buckets per power of two
+//
+static __forceinline ULONG HvHistBucket(UINT64 Value)
+{
+    if (Value < (1ULL << HV_HIST_SUB_BITS))
+        return (ULONG)Value;
+
+    ULONG msb;
+    _BitScanReverse64(&msb, Value);
+
+    ULONG index = ((msb - HV_HIST_SUB_BITS + 1) << HV_HIST_SUB_BITS) |
+                  (ULONG)((Value >> (msb - HV_HIST_SUB_BITS)) & ((1ULL << HV_HIST_SUB_BITS) - 1));
+
+    return index < HV_HIST_BUCKETS ? index : HV_HIST_BUCKETS - 1;
+}
+
+static __forceinline VOID HvHistAdd(HV_HISTOGRAM* H, UINT64 Value)
+{
+    H->Count++;
+    H->Total += Value;
+    if (Value > H->Max)
+        H->Max = Value;
+    H->Buckets[HvHistBucket(Value)]++;
+}
+
+//
+// Pending resets are applied by the owner so readers never race a writer
+// that is halfway through a histogram
+//
+static __forceinline HV_STATS* HvStatsOwned(VCPU* V)
+{
+    HV_STATS* st = V->Stats;
+
+    if (st && st->ResetPending)
+    {
+        RtlZeroMemory(st, FIELD_OFFSET(HV_STATS, ResetPending));
+        st->ResetPending = 0;
+    }
+
+    return st;
+}
+
+VOID HvStatsRecordExit(VCPU* V, UINT64 ExitCode, UINT64 Cycles)
+{
+    HV_STATS* st = HvStatsOwned(V);
+    if (!st || ExitCode >= HV_EXIT_TABLE_SIZE)
+        return;
+
+    ULONG slot = st->ExitSlot[ExitCode];
+    if (!slot)
+    {
+        // The last slot is "other" (code HV_EXIT_TABLE_SIZE) once the rest are taken
+        if (st->ExitSlotsUsed < HV_STAT_EXIT_SLOTS - 1)
+        {
+            slot = ++st->ExitSlotsUsed;
+            st->ExitCodes[slot - 1] = ExitCode;
+        }
+        else
+        {
+            slot = HV_STAT_EXIT_SLOTS;
+            st->ExitCodes[slot - 1] = HV_EXIT_TABLE_SIZE;
+        }
+
+        st->ExitSlot[ExitCode] = (UINT8)slot;
+    }
+
+    HvHistAdd(&st->Exit[slot - 1], Cycles);
+}
+
+VOID HvStatsRecordCall(VCPU* V, UINT64 Code, UINT64 Cycles)
+{
+    HV_STATS* st = HvStatsOwned(V);
+    if (!st)
+        return;
+
+    // Hypercall codes are sparse 64-bit values; a short scan beats a map
+    ULONG slot;
+    for (slot = 0; slot < st->CallSlotsUsed; slot++)
+    {
+        if (st->CallCodes[slot] == Code)
+            break;
+    }
+
+    if (slot == st->CallSlotsUsed)
+    {
+        if (st->CallSlotsUsed == HV_STAT_CALL_SLOTS)
+            return;
+
+        st->CallCodes[slot] = Code;
+        st->CallSlotsUsed++;
+    }
+
+    HvHistAdd(&st->Call[slot], Cycles);
+}
+
+//
+// VmrunTsc is stamped by LaunchVm just before VMRUN, ExitTsc just after the
+// guest registers are saved. The previous exit's host time therefore ends at
+// this VMRUN, and the guest ran from this VMRUN until ExitTsc.
+//
+VOID HvStatsRecordWorldSwitch(VCPU* V, UINT64 VmrunTsc, UINT64 ExitTsc)
+{
+    HV_STATS* st = HvStatsOwned(V);
+    if (!st)
+        return;
+
+    if (st->LastExitTsc && VmrunTsc > st->LastExitTsc)
+        st->HostTsc += VmrunTsc - st->LastExitTsc;
+
+    if (ExitTsc > VmrunTsc)
+        st->GuestTsc += ExitTsc - VmrunTsc;
+
+    st->LastExitTsc = ExitTsc;
+}
+
+UINT64 HvStatsQuery(VCPU* Source, HV_STAT_FIELD Field)
+{
+    HV_STATS* st = Source->Stats;
+    if (!st)
+        return 0;
+
+    switch (Field)
+    {
+    case HvStatGuestTsc:  return st->GuestTsc;
+    case HvStatHostTsc:   return st->HostTsc;
+    case HvStatExits:     return Source->Exec.ExitCount;
+    case HvStatExitSlots: return st->ExitSlotsUsed;
+    case HvStatCallSlots: return st->CallSlotsUsed;
+    default:              return 0;
+    }
+}
+
+//
+// Slots are not necessarily contiguous (the exit "other" slot is last);
+// returns FALSE for slots that never recorded anything
+//
+BOOLEAN HvStatsGetHistogram(VCPU* Source, BOOLEAN Calls, ULONG Slot, UINT64* Code, HV_HISTOGRAM* Out)
+{
+    HV_STATS* st = Source->Stats;
+    if (!st)
+        return FALSE;
+
+    if (Slot >= (Calls ? HV_STAT_CALL_SLOTS : HV_STAT_EXIT_SLOTS))
+        return FALSE;
+
+    HV_HISTOGRAM* h = Calls ? &st->Call[Slot] : &st->Exit[Slot];
+    if (!h->Count)
+        return FALSE;
+
+    *Code = Calls ? st->CallCodes[Slot] : st->ExitCodes[Slot];
+    *Out = *h;
+    return TRUE;
+}
+
+VOID HvStatsRequestReset(VCPU* Source)
+{
+    if (Source->Stats)
+        InterlockedExchange(&Source->Stats->ResetPending, 1);
+}
@@ -6,6 +6,18 @@
 #include "npt.h"
 #include "layers.h"
 #include "vcpu.h"
+#include "guest_mem.h"
+#include "trace.h"
+#include "stats.h"
+#include "hotspot.h"
+#include "xstate.h"
+#include "cpuid_cache.h"
+#include "msrpm.h"
+#include "iopm.h"
+#include "emulate.h"
+#include "event.h"
+#include "defer.h"
+#include "guest_walk.h"
 
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 0x1000
@@ -14,8 +26,6 @@
 // Assembly function - never returns to caller
 extern VOID LaunchVm(PVOID HostRsp);
 
-#define MSRPM_SIZE      0x6000
-#define IOPM_SIZE       0x2000
 #define MSR_VM_HSAVE    0xC0010117
 
 typedef struct _DESCRIPTOR_TABLE_REG {
@@ -125,7 +135,7 @@ static UINT16 GetSegmentAccessRights(UINT16 SegmentSelector, ULONG_PTR GdtBase)
 //
 static NTSTATUS AllocMsrpm(VCPU* V)
 {
-    V->Msrpm = AllocAligned(MSRPM_SIZE, &V->MsrpmPa);
+    V->Msrpm = AllocAligned(HV_MSRPM_SIZE, &V->MsrpmPa);
     return V->Msrpm ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
 }
 
@@ -134,7 +144,7 @@ static NTSTATUS AllocMsrpm(VCPU* V)
 //
 static NTSTATUS AllocIopm(VCPU* V)
 {
-    V->Iopm = AllocAligned(IOPM_SIZE, &V->IopmPa);
+    V->Iopm = AllocAligned(HV_IOPM_SIZE, &V->IopmPa);
     return V->Iopm ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
 }
 
@@ -156,13 +166,16 @@ static VOID SetupVmcbFromContext(VCPU* V, PCONTEXT Ctx)
     
     // Setup control area
     c->GuestAsid = 1;
-    c->VmcbClean = 0;
+    c->VmcbClean = 0;   // Nothing cached yet; HandleVmExit manages it from the first exit on
     
     // Intercepts - use Intercepts array
-    // Word 3: CPUID (bit 18), optionally RDTSC (bit 1) for timing attack mitigation
-    c->Intercepts[3] = SVM_INTERCEPT_CPUID;
+    // Word 3: CPUID (bit 18), IOIO (bit 27; only ports set in the IOPM exit),
+    // MSR (bit 28; MSRs set in the MSRPM exit, and so does every MSR outside
+    // its three ranges - those run natively, see msrpm.c), optionally RDTSC
+    // for timing attack mitigation
+    c->Intercepts[3] = SVM_INTERCEPT_CPUID | SVM_INTERCEPT_IOIO | SVM_INTERCEPT_MSR;
     
-    // Word 4: VMRUN (bit 0), VMMCALL (bit 1), optionally RDTSCP (bit 3)
+    // Word 4: VMRUN (bit 0), VMMCALL (bit 1), optionally RDTSCP (bit 7)
     c->Intercepts[4] = SVM_INTERCEPT_VMRUN | SVM_INTERCEPT_VMMCALL;
     
     // RDTSC/RDTSCP interception DISABLED by default
@@ -324,6 +337,13 @@ NTSTATUS SvmInit(VCPU** Out)
         st = HV_STATUS_ALLOC_MSRPM;
         goto fail;
     }
+
+    // Intercept policy from the MSRPM template, plus the shadow cache
+    if (!NT_SUCCESS(st = HvMsrInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvMsrInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
     
     // Allocate IOPM
     if (!NT_SUCCESS(st = AllocIopm(V)))
@@ -332,6 +352,13 @@ NTSTATUS SvmInit(VCPU** Out)
         st = HV_STATUS_ALLOC_IOPM;
         goto fail;
     }
+
+    // Port intercepts from the IOPM template, plus the string I/O buffer
+    if (!NT_SUCCESS(st = HvIoInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvIoInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
     
     // Initialize NPT
     if (!NT_SUCCESS(st = NptInitialize(&V->Npt)))
@@ -340,6 +367,76 @@ NTSTATUS SvmInit(VCPU** Out)
         goto fail;
     }
 
+    // Map window for guest memory access from the exit path
+    if (!NT_SUCCESS(st = GuestMemInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: GuestMemInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
+    // Exit trace ring
+    if (!NT_SUCCESS(st = HvTraceInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvTraceInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
+    // Exit latency histograms
+    if (!NT_SUCCESS(st = HvStatsInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvStatsInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
+    // Exit-site sketch
+    if (!NT_SUCCESS(st = HvHotspotInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvHotspotInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
+    // Extended-state area for vector-using exit handlers
+    if (!NT_SUCCESS(st = HvXstateInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvXstateInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
+    // CPUID snapshot, taken here because SvmInit runs on the owning CPU
+    if (!NT_SUCCESS(st = HvCpuidInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvCpuidInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
+    // Decode cache for emulating NPF-trapped accesses
+    if (!NT_SUCCESS(st = HvEmuInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvEmuInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
+    // Pending-event queue; every exit delivers from it
+    if (!NT_SUCCESS(st = HvEventInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvEventInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
+    // Deadlines for deferred maintenance
+    if (!NT_SUCCESS(st = HvDeferInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: HvDeferInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
+    // Translation cache for guest virtual addresses
+    if (!NT_SUCCESS(st = GuestTlbInitVcpu(V)))
+    {
+        DbgPrint("SVM-HV: GuestTlbInitVcpu failed: 0x%X\n", st);
+        goto fail;
+    }
+
     *Out = V;
     return STATUS_SUCCESS;
 
@@ -390,7 +487,9 @@ NTSTATUS SvmLaunch(VCPU* V)
     V->HostStackLayout.HostVmcbPa = hostVmcbPa.QuadPart;
     V->HostStackLayout.Self = V;
     V->HostStackLayout.ProcessorIndex = cpuIndex;
-    V->HostStackLayout.Reserved1 = MAXUINT64;
+    // The VMCB holds the guest's FS/GS/TR/... from the VMSAVE below, so the
+    // first VMRUN must VMLOAD it
+    V->HostStackLayout.HostStateLoaded = TRUE;
     
     // Save guest VMCB state
     __svm_vmsave(guestVmcbPa.QuadPart);
@@ -437,6 +536,18 @@ VOID SvmShutdown(VCPU* V)
     if (V->Iopm) 
         MmFreeContiguousMemory(V->Iopm);
 
+    GuestTlbDestroyVcpu(V);
+    HvDeferDestroyVcpu(V);
+    HvEventDestroyVcpu(V);
+    HvEmuDestroyVcpu(V);
+    HvIoDestroyVcpu(V);
+    HvMsrDestroyVcpu(V);
+    HvCpuidDestroyVcpu(V);
+    HvXstateDestroyVcpu(V);
+    HvHotspotDestroyVcpu(V);
+    HvStatsDestroyVcpu(V);
+    HvTraceDestroyVcpu(V);
+    GuestMemDestroyVcpu(V);
     NptDestroy(&V->Npt);
     MmFreeContiguousMemory(V);
 }
@@ -0,0 +1,134 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "trace.h"
+#include "vcpu.h"
+#include "vmcb.h"
+
+#define HV_TRACE_MASK   (HV_TRACE_RING_RECORDS - 1)
+
+C_ASSERT((HV_TRACE_RING_RECORDS & HV_TRACE_MASK) == 0);
+
+static volatile BOOLEAN g_HvTraceEnabled = TRUE;
+
+NTSTATUS HvTraceInitVcpu(VCPU* V)
+{
+    V->Trace = (HV_TRACE_RING*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_TRACE_RING), HV_TRACE_TAG);
+    if (!V->Trace)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(V->Trace, sizeof(HV_TRACE_RING));
+    return STATUS_SUCCESS;
+}
+
+VOID HvTraceDestroyVcpu(VCPU* V)
+{
+    if (V->Trace)
+    {
+        ExFreePoolWithTag(V->Trace, HV_TRACE_TAG);
+        V->Trace = NULL;
+    }
+}
+
+VOID HvTraceEnable(BOOLEAN Enable)
+{
+    g_HvTraceEnabled = Enable;
+}
+
+//
+// Append one record for the exit being handled. Runs on the VMEXIT path:
+// a handful of stores, no locks, no waiting on the consumer.
+//
+VOID HvTraceExit(VCPU* V, UINT64 Tsc, UINT64 Rip, UINT32 Outcome)
+{
+    HV_TRACE_RING* ring = V->Trace;
+    if (!g_HvTraceEnabled || !ring)
+        return;
+
+    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
+    UINT64 index = ring->Head;
+    HV_TRACE_RECORD* r = &ring->Records[index & HV_TRACE_MASK];
+
+    // Overwriting a record the consumer has not taken yet
+    if (index - ring->Tail >= HV_TRACE_RING_RECORDS)
+        ring->Lost++;
+
+    // Seq = 0 marks the slot torn while the fields change
+    r->Seq = 0;
+    _WriteBarrier();
+
+    r->Tsc = Tsc;
+    r->ExitCode = c->ExitCode;
+    r->Rip = Rip;
+    r->ExitInfo1 = c->ExitInfo1;
+    r->ExitInfo2 = c->ExitInfo2;
+    r->Cr3 = VmcbState(&V->GuestVmcb)->Cr3;
+    r->Outcome = Outcome;
+    _WriteBarrier();
+
+    r->Seq = index + 1;
+    ring->Head = index + 1;
+}
+
+//
+// Copy up to Max completed records out of Source's ring, oldest first.
+// Safe to call from any CPU while Source keeps producing; a record that is
+// overwritten mid-copy fails its sequence check and is skipped.
+//
+ULONG HvTraceDrain(VCPU* Source, HV_TRACE_RECORD* Out, ULONG Max)
+{
+    HV_TRACE_RING* ring = Source->Trace;
+    ULONG count = 0;
+
+    if (!ring)
+        return 0;
+
+    HvSpinLockAcquire(&ring->DrainLock);
+
+    UINT64 tail = ring->Tail;
+    UINT64 head = ring->Head;
+
+    // Everything older than one ring length is gone (already counted as lost)
+    if (head - tail > HV_TRACE_RING_RECORDS)
+        tail = head - HV_TRACE_RING_RECORDS;
+
+    while (count < Max && tail < head)
+    {
+        HV_TRACE_RECORD* r = &ring->Records[tail & HV_TRACE_MASK];
+
+        Out[count] = *r;
+        _ReadWriteBarrier();
+
+        if (Out[count].Seq != tail + 1 || r->Seq != tail + 1)
+        {
+            // Producer lapped us during the copy; resync to the oldest live record
+            head = ring->Head;
+            tail = (head - tail > HV_TRACE_RING_RECORDS) ? head - HV_TRACE_RING_RECORDS : tail + 1;
+            continue;
+        }
+
+        count++;
+        tail++;
+        ring->Tail = tail;
+    }
+
+    ring->Tail = tail;
+    ring->Drained += count;
+
+    HvSpinLockRelease(&ring->DrainLock);
+    return count;
+}
+
+VOID HvTraceQueryStats(VCPU* Source, HV_TRACE_STATS* Stats)
+{
+    HV_TRACE_RING* ring = Source->Trace;
+
+    RtlZeroMemory(Stats, sizeof(*Stats));
+    Stats->Enabled = g_HvTraceEnabled;
+
+    if (ring)
+    {
+        Stats->Written = ring->Head;
+        Stats->Drained = ring->Drained;
+        Stats->Lost = ring->Lost;
+    }
+}
@@ -0,0 +1,120 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "xstate.h"
+#include "vcpu.h"
+
+#define CPUID_1_ECX_OSXSAVE         (1UL << 27)
+#define CPUID_7_EBX_AVX2            (1UL << 5)
+#define CPUID_D1_EAX_XSAVEOPT       (1UL << 0)
+
+NTSTATUS HvXstateInitVcpu(VCPU* V)
+{
+    int regs[4];
+
+    V->Xstate = (HV_XSTATE*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_XSTATE), HV_XSTATE_TAG);
+    if (!V->Xstate)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    HV_XSTATE* x = V->Xstate;
+    RtlZeroMemory(x, sizeof(HV_XSTATE));
+
+    // Without OSXSAVE there is no XSAVE area to manage; HvXstateEnsure
+    // then refuses and callers stay on their scalar paths
+    __cpuid(regs, 1);
+    if (!(regs[2] & CPUID_1_ECX_OSXSAVE))
+        return STATUS_SUCCESS;
+
+    // EBX: bytes needed for every component currently enabled in XCR0
+    __cpuidex(regs, 0xD, 0);
+    x->Size = (ULONG)regs[1];
+
+    __cpuidex(regs, 0xD, 1);
+    x->Optimized = (regs[0] & CPUID_D1_EAX_XSAVEOPT) != 0;
+
+    __cpuidex(regs, 7, 0);
+    x->Avx2 = (regs[1] & CPUID_7_EBX_AVX2) &&
+              (_xgetbv(0) & (HV_XSTATE_SSE | HV_XSTATE_AVX)) == (HV_XSTATE_SSE | HV_XSTATE_AVX);
+
+    x->Allocation = ExAllocatePoolWithTag(NonPagedPoolNx, x->Size + HV_XSTATE_ALIGN, HV_XSTATE_TAG);
+    if (!x->Allocation)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    // XRSTOR faults on a dirty header, so the image starts zeroed
+    RtlZeroMemory(x->Allocation, x->Size + HV_XSTATE_ALIGN);
+    x->Area = (PUCHAR)(((ULONG_PTR)x->Allocation + HV_XSTATE_ALIGN - 1) & ~(ULONG_PTR)(HV_XSTATE_ALIGN - 1));
+    return STATUS_SUCCESS;
+}
+
+VOID HvXstateDestroyVcpu(VCPU* V)
+{
+    if (!V->Xstate)
+        return;
+
+    if (V->Xstate->Allocation)
+        ExFreePoolWithTag(V->Xstate->Allocation, HV_XSTATE_TAG);
+
+    ExFreePoolWithTag(V->Xstate, HV_XSTATE_TAG);
+    V->Xstate = NULL;
+}
+
+//
+// Save the guest's x87/SSE/AVX state for the rest of this exit. XCR0 is not
+// switched on VMRUN, so the mask is the guest's own XCR0 limited to the
+// components host code can touch. XSAVEOPT skips components still in their
+// init state and, when the last XRSTOR came from this same area, those the
+// guest has not modified since. Returns FALSE if there is nowhere to save.
+//
+BOOLEAN HvXstateEnsure(VCPU* V)
+{
+    HV_XSTATE* x = V->Xstate;
+    if (!x || !x->Area)
+        return FALSE;
+
+    if (x->Saved)
+        return TRUE;
+
+    x->Mask = _xgetbv(0) & (HV_XSTATE_X87 | HV_XSTATE_SSE | HV_XSTATE_AVX);
+    if (x->Optimized)
+        _xsaveopt64(x->Area, x->Mask);
+    else
+        _xsave64(x->Area, x->Mask);
+
+    x->Saved = TRUE;
+    x->Saves++;
+    return TRUE;
+}
+
+//
+// Called by HandleVmExit once the handler is done; a no-op for exits that
+// never saved
+//
+VOID HvXstateRestore(VCPU* V)
+{
+    HV_XSTATE* x = V->Xstate;
+    if (!x || !x->Saved)
+        return;
+
+    _xrstor64(x->Area, x->Mask);
+    x->Saved = FALSE;
+}
+
+BOOLEAN HvXstateAvx2(VCPU* V)
+{
+    return V->Xstate && V->Xstate->Area && V->Xstate->Avx2;
+}
+
+UINT64 HvXstateQuery(VCPU* V, HV_XSTATE_FIELD Field)
+{
+    HV_XSTATE* x = V->Xstate;
+    if (!x)
+        return 0;
+
+    switch (Field)
+    {
+    case HvXstateSize:          return x->Area ? x->Size : 0;
+    case HvXstateSaves:         return x->Saves;
+    case HvXstateAvx2Usable:    return HvXstateAvx2(V);
+    case HvXstateOptimizedSave: return x->Optimized;
+    default:                    return 0;
+    }
+}
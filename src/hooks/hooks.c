@@ -1,5 +1,6 @@
 #include <ntifs.h>
 #include "hooks.h"
+#include "svm.h"
 #include "vcpu.h"
 #include "vmcb.h"
 #include "guest_mem.h"
@@ -10,13 +11,24 @@
 #include "process_manager.h"
 #include "communication.h"
 #include "sync.h"
+#include "smp.h"
+#include "trace.h"
+#include "stats.h"
+#include "hotspot.h"
+#include "xstate.h"
+#include "page_hash.h"
+#include "cpuid_cache.h"
+#include "msrpm.h"
+#include "iopm.h"
+#include "emulate.h"
+#include "event.h"
+#include "defer.h"
+#include "guest_walk.h"
 
 // Spinlock for protecting global syscall hook state
 static HV_SPINLOCK g_SyscallLock = HV_SPINLOCK_INIT;
 
 static UINT64 g_OriginalLstar = 0;        
-static UINT64 g_OriginalStar = 0;
-static UINT64 g_OriginalSfMask = 0;
 
 static UINT64 g_HvSyscallHandler = 0;     
 static BOOLEAN g_SyscallHookEnabled = FALSE;
@@ -57,30 +69,39 @@ VOID HookCpuidEmulate(UINT32 leaf, UINT32 subleaf,
 
 
 
-UINT64 HookHandleMsrRead(VCPU* V, UINT64 msr)
+//
+// LSTAR while the syscall hook is installed: reads are answered from the
+// per-VCPU shadow cache, writes only move the entry we chain to
+//
+static BOOLEAN HookLstarRead(VCPU* V, UINT32 msr, UINT64* value)
 {
-    switch (msr)
-    {
-    case MSR_LSTAR:
-        if (g_SyscallHookEnabled)
-            return g_HvSyscallHandler;
-        return g_OriginalLstar;
+    UNREFERENCED_PARAMETER(V);
+    UNREFERENCED_PARAMETER(msr);
 
-    case MSR_STAR:
-        return g_OriginalStar;
+    *value = g_SyscallHookEnabled ? g_HvSyscallHandler : g_OriginalLstar;
+    return TRUE;
+}
+
+static BOOLEAN HookLstarWrite(VCPU* V, UINT32 msr, UINT64 value)
+{
+    UNREFERENCED_PARAMETER(V);
+    UNREFERENCED_PARAMETER(msr);
 
-    case MSR_SFMASK:
-        return g_OriginalSfMask;
+    g_OriginalLstar = value;
+    return TRUE;
+}
 
-    default:
-        return StealthMaskMsrRead((UINT32)msr, __readmsr(msr));
-    }
+//
+// LSTAR is only intercepted while the hook is in place; everything else
+// about syscall MSRs stays out of the exit path
+//
+NTSTATUS HookRegisterMsrHandlers(VOID)
+{
+    return HvRegisterMsrHandler(MSR_LSTAR, HookLstarRead, HookLstarWrite, HV_MSR_SHADOWED);
 }
 
 VOID HookInstallSyscall(VCPU* V)
 {
-    UNREFERENCED_PARAMETER(V);
-    
     HvSpinLockAcquire(&g_SyscallLock);
     
     if (g_SyscallHookEnabled)
@@ -89,23 +110,22 @@ VOID HookInstallSyscall(VCPU* V)
         return;
     }
 
-    g_OriginalLstar = __readmsr(MSR_LSTAR);
-    g_OriginalStar = __readmsr(MSR_STAR);
-    g_OriginalSfMask = __readmsr(MSR_SFMASK);
+    g_OriginalLstar = HvMsrReadGuest(V, MSR_LSTAR);
 
     //
     //  syscall entry    
     //
     if (g_HvSyscallHandler != 0)
     {
-        __writemsr(MSR_LSTAR, g_HvSyscallHandler);
+        HvMsrWriteGuest(V, MSR_LSTAR, g_HvSyscallHandler);
+        HvMsrSetVcpuIntercept(V, MSR_LSTAR, HV_MSR_READ | HV_MSR_WRITE, TRUE);
         g_SyscallHookEnabled = TRUE;
+        HvMsrInvalidateShadow(MSR_LSTAR);
     }
     
     HvSpinLockRelease(&g_SyscallLock);
 }
-
-VOID HookRemoveSyscall()
+VOID HookRemoveSyscall(VCPU* V)
 {
     HvSpinLockAcquire(&g_SyscallLock);
     
@@ -115,40 +135,15 @@ VOID HookRemoveSyscall()
         return;
     }
 
-    __writemsr(MSR_LSTAR, g_OriginalLstar);
-    __writemsr(MSR_STAR, g_OriginalStar);
-    __writemsr(MSR_SFMASK, g_OriginalSfMask);
+    HvMsrWriteGuest(V, MSR_LSTAR, g_OriginalLstar);
+    HvMsrSetVcpuIntercept(V, MSR_LSTAR, HV_MSR_READ | HV_MSR_WRITE, FALSE);
 
     g_SyscallHookEnabled = FALSE;
+    HvMsrInvalidateShadow(MSR_LSTAR);
     
     HvSpinLockRelease(&g_SyscallLock);
 }
 
-VOID HookHandleMsrWrite(VCPU* V, UINT64 msr, UINT64 value)
-{
-    switch (msr)
-    {
-    case MSR_LSTAR:
-    {
-        g_OriginalLstar = value;
-        return;
-    }
-    case MSR_STAR:
-    {
-        g_OriginalStar = value;
-        return;
-    }
-    case MSR_SFMASK:
-    {
-        g_OriginalSfMask = value;
-        return;
-    }
-    default:
-        __writemsr(msr, value);
-        return;
-    }
-}
-
 
 
 UINT64 HookEncryptCr3(UINT64 cr3)
@@ -190,9 +185,10 @@ BOOLEAN HookNptHandleFault(VCPU* V, UINT64 faultingGpa)
 {
     UINT64 page = faultingGpa & ~0xFFFULL;
 
-    if (V->Npt.ShadowHook.Active && page == V->Npt.ShadowHook.TargetGpaPage)
+    UINT64 newHpa;
+    if (NptFindShadowHook(&V->Npt, page, &newHpa))
     {
-        NptHookPage(&V->Npt, page, V->Npt.ShadowHook.NewHpaPage);
+        NptHookPage(&V->Npt, page, newHpa);
         return TRUE;
     }
 
@@ -201,6 +197,22 @@ BOOLEAN HookNptHandleFault(VCPU* V, UINT64 faultingGpa)
 
 
 
+//
+// Guest-visible layout of one sampler histogram entry (one per 2MB region)
+//
+typedef struct _HV_SAMPLE_REGION
+{
+    UINT16 Touched;
+    UINT8 Heat;
+    UINT8 Pad;
+} HV_SAMPLE_REGION;
+
+static VOID HookKickIfImmediate(VCPU* V, UINT64 flags)
+{
+    if (!(flags & 1))
+        SmpKickOthers((ULONG)V->HostStackLayout.ProcessorIndex);
+}
+
 UINT64 HookVmmcallDispatch(VCPU* V, UINT64 code, UINT64 a1, UINT64 a2, UINT64 a3)
 {
     switch (code)
@@ -228,17 +240,61 @@ UINT64 HookVmmcallDispatch(VCPU* V, UINT64 code, UINT64 a1, UINT64 a2, UINT64 a3
         HookDisableCr3Encryption();
         return TRUE;
 
-    case 0x110:   // install shadow EPT hook (a1 = target GVA, a2 = new HPA/GPA)
+    //
+    // Shadow hooks are published to every VCPU through the NPT change
+    // journal; a3 bit 0 set = lazy (no NMI kick, others pick it up on their
+    // next exit)
+    //
+    case 0x110:   // add shadow NPT hook (a1 = target GVA, a2 = new HPA)
+    {
+        PHYSICAL_ADDRESS gpa = GuestTranslateGvaToGpa(V, a1);
+        if (!gpa.QuadPart || !NptPublishHook(gpa.QuadPart, a2))
+            return FALSE;
+
+        HookKickIfImmediate(V, a3);
+        return TRUE;
+    }
+
+    case 0x111:   // remove shadow NPT hook (a1 = target GVA)
     {
         PHYSICAL_ADDRESS gpa = GuestTranslateGvaToGpa(V, a1);
-        if (!gpa.QuadPart)
+        if (!gpa.QuadPart || !NptPublishUnhook(gpa.QuadPart))
             return FALSE;
 
-        return NptInstallShadowHook(&V->Npt, gpa.QuadPart, a2);
+        HookKickIfImmediate(V, a3);
+        return TRUE;
+    }
+
+    case 0x112:   // batch add (a1 = GVA of {target GVA, new HPA} pairs, a2 = count); returns published
+    {
+        NPT_HOOK_DESC batch[32];
+        ULONG published = 0;
+
+        for (UINT64 done = 0; done < a2; )
+        {
+            ULONG chunk = (a2 - done < RTL_NUMBER_OF(batch)) ? (ULONG)(a2 - done) : RTL_NUMBER_OF(batch);
+            if (!GuestReadGva(V, a1 + done * sizeof(NPT_HOOK_DESC), batch, chunk * sizeof(NPT_HOOK_DESC)))
+                break;
+
+            for (ULONG i = 0; i < chunk; i++)
+            {
+                PHYSICAL_ADDRESS gpa = GuestTranslateGvaToGpa(V, batch[i].TargetGpa);
+                if (gpa.QuadPart && NptPublishHook(gpa.QuadPart, batch[i].NewHpa))
+                    published++;
+            }
+
+            done += chunk;
+        }
+
+        // One kick and one flush per VCPU for the whole batch
+        if (published)
+            HookKickIfImmediate(V, a3);
+        return published;
     }
 
-    case 0x111:   // clear shadow hook
-        NptClearShadowHook(&V->Npt);
+    case 0x113:   // remove every shadow hook
+        NptPublishClearHooks();
+        HookKickIfImmediate(V, a3);
         return TRUE;
 
     case 0x200:  // stealth mode enable
@@ -284,9 +340,299 @@ UINT64 HookVmmcallDispatch(VCPU* V, UINT64 code, UINT64 a1, UINT64 a2, UINT64 a3
         return hpa.QuadPart;
     }
 
+    case 0x223: // query guest TLB (a1 = cpu index, a2: 0 = hits, 1 = misses, 2 = stale, 3 = faults, 4 = flushes, 5 = rechecks)
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        return source ? GuestTlbQuery(source, (GUEST_TLB_STAT)a2) : 0;
+    }
+
+    case 0x224: // drop every VCPU's cached translations (after editing guest page tables)
+        GuestTlbInvalidate();
+        return TRUE;
+
+    case 0x230: // query NPT arena usage (a1: 0 = high-water, 1 = in use, 2 = capacity, 3 = failures, 4 = splits, 5 = merges)
+    {
+        NPT_ARENA_STATS stats;
+        NptQueryArena(&V->Npt, &stats);
+        switch (a1)
+        {
+        case 0: return stats.HighWater;
+        case 1: return stats.InUse;
+        case 2: return stats.Capacity;
+        case 3: return stats.Failures;
+        case 4: return stats.Splits;
+        case 5: return stats.Merges;
+        default: return 0;
+        }
+    }
+
+    case 0x231: // query NPT sync (a1: 0 = generation, 1 = last visible ticks, 2 = max visible ticks, 3 = kicks, 4 = resyncs)
+    {
+        NPT_SYNC_STATS stats;
+        NptQuerySyncStats(&stats);
+        switch (a1)
+        {
+        case 0: return stats.Generation;
+        case 1: return stats.LastVisibleTicks;
+        case 2: return stats.MaxVisibleTicks;
+        case 3: return stats.Kicks;
+        case 4: return stats.Resyncs;
+        default: return 0;
+        }
+    }
+
+    case 0x240: // start dirty logging (a1 = base GPA, a2 = page count, a3 bit 0 = use hardware D bit)
+        return NT_SUCCESS(NptDirtyLogStart(&V->Npt, (ULONG)V->HostStackLayout.ProcessorIndex, a1, (ULONG)a2, (ULONG)a3));
+
+    case 0x241: // stop dirty logging
+        NptDirtyLogStop(&V->Npt, (ULONG)V->HostStackLayout.ProcessorIndex);
+        return TRUE;
+
+    case 0x242: // harvest + reset (a1 = GVA of bitmap buffer, a2 = buffer bytes); returns dirty pages or ~0
+    {
+        PULONG bitmap;
+        ULONG pages;
+        ULONG dirty = NptDirtyLogHarvest(&V->Npt, (ULONG)V->HostStackLayout.ProcessorIndex, &bitmap, &pages);
+        if (!bitmap)
+            return ~0ULL;
+
+        SIZE_T bytes = ((SIZE_T)pages + 7) / 8;
+        BOOLEAN ok = a2 >= bytes && GuestWriteGva(V, a1, bitmap, bytes);
+        NptDirtyLogHarvestDone();
+
+        return ok ? dirty : ~0ULL;
+    }
+
+    case 0x243: // query dirty logging (a1: 0 = active, 1 = pages, 2 = write faults on this cpu, 3 = stragglers, 4 = start failures)
+    {
+        NPT_DIRTY_STATS stats;
+        NptQueryDirtyStats(&V->Npt, &stats);
+        switch (a1)
+        {
+        case 0: return stats.Active;
+        case 1: return stats.PageCount;
+        case 2: return stats.Faults;
+        case 3: return stats.Stragglers;
+        case 4: return stats.StartFailures;
+        default: return 0;
+        }
+    }
+
+    case 0x250: // sampler: add GPA range (a1 = base GPA, a2 = page count)
+        return NT_SUCCESS(NptSamplerAddRange(a1, a2));
+
+    case 0x251: // sampler: start (a1 = minimum TSC ticks between passes)
+        NptSamplerControl(TRUE, a1);
+        return TRUE;
+
+    case 0x252: // sampler: stop and drop all ranges
+        NptSamplerControl(FALSE, 0);
+        return TRUE;
+
+    case 0x253: // sampler: read histogram (a1 = GVA of {u16 touched, u8 heat, u8 pad} array, a2 = max regions); returns completed passes
+    {
+        NPT_SAMPLE_BUCKET buckets[64];
+        HV_SAMPLE_REGION out[64];
+        ULONG passes = 0;
+
+        for (ULONG done = 0; done < a2; )
+        {
+            ULONG want = (a2 - done < RTL_NUMBER_OF(out)) ? (ULONG)(a2 - done) : RTL_NUMBER_OF(out);
+            ULONG chunk = NptSamplerCollect(buckets, done, want, &passes);
+            if (!chunk)
+                break;
+
+            for (ULONG i = 0; i < chunk; i++)
+            {
+                out[i].Touched = buckets[i].Touched;
+                out[i].Heat = buckets[i].Heat;
+                out[i].Pad = 0;
+            }
+
+            if (!GuestWriteGva(V, a1 + done * sizeof(HV_SAMPLE_REGION), out, chunk * sizeof(HV_SAMPLE_REGION)))
+                return 0;
+
+            done += chunk;
+        }
+
+        return passes;
+    }
+
+    case 0x260: // drain exit trace (a1 = cpu index, a2 = GVA of record array, a3 = max records); returns records or ~0
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        HV_TRACE_RECORD out[16];
+        UINT64 done = 0;
+
+        if (!source)
+            return ~0ULL;
+
+        while (done < a3)
+        {
+            ULONG want = (a3 - done < RTL_NUMBER_OF(out)) ? (ULONG)(a3 - done) : RTL_NUMBER_OF(out);
+            ULONG chunk = HvTraceDrain(source, out, want);
+            if (!chunk)
+                break;
+
+            // Records already taken off the ring are lost if the copy fails
+            if (!GuestWriteGva(V, a2 + done * sizeof(HV_TRACE_RECORD), out, chunk * sizeof(HV_TRACE_RECORD)))
+                return ~0ULL;
+
+            done += chunk;
+        }
+
+        return done;
+    }
+
+    case 0x261: // query exit trace (a1 = cpu index, a2: 0 = written, 1 = drained, 2 = lost, 3 = enabled)
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        HV_TRACE_STATS stats;
+
+        if (!source)
+            return 0;
+
+        HvTraceQueryStats(source, &stats);
+        switch (a2)
+        {
+        case 0: return stats.Written;
+        case 1: return stats.Drained;
+        case 2: return stats.Lost;
+        case 3: return stats.Enabled;
+        default: return 0;
+        }
+    }
+
+    case 0x262: // enable / disable exit tracing on all cpus (a1 = 1 / 0)
+        HvTraceEnable(a1 != 0);
+        return TRUE;
+
+    case 0x270: // query exit stats (a1 = cpu index, a2: 0 = guest tsc, 1 = host tsc, 2 = exits, 3 = exit slots, 4 = call slots)
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        return source ? HvStatsQuery(source, (HV_STAT_FIELD)a2) : 0;
+    }
+
+    case 0x271: // read histogram (a1 = cpu index, a2 = slot | 0x10000 for hypercalls, a3 = GVA of histogram); returns its code or ~0
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        HV_HISTOGRAM hist;
+        UINT64 histCode;
+
+        if (!source || !HvStatsGetHistogram(source, (a2 & 0x10000) != 0, (ULONG)(a2 & 0xFFFF), &histCode, &hist))
+            return ~0ULL;
+
+        if (!GuestWriteGva(V, a3, &hist, sizeof(hist)))
+            return ~0ULL;
+
+        return histCode;
+    }
+
+    case 0x272: // reset exit stats (a1 = cpu index, ~0 = all cpus)
+    {
+        for (ULONG i = 0; i < SmpGetVcpuCount(); i++)
+        {
+            if (a1 == ~0ULL || a1 == i)
+                HvStatsRequestReset(SmpGetVcpu(i));
+        }
+        return TRUE;
+    }
+
+    case 0x280: // top exit sites across all cpus (a1 = GVA of {rip, exit code, cr3, count} array, a2 = max entries, up to 32); returns entries
+    {
+        HV_HOTSPOT_ENTRY top[HV_HOTSPOT_MAX_RESULTS];
+        ULONG n = HvHotspotMerge(top, (ULONG)min(a2, HV_HOTSPOT_MAX_RESULTS));
+
+        if (n && !GuestWriteGva(V, a1, top, n * sizeof(HV_HOTSPOT_ENTRY)))
+            return 0;
+        return n;
+    }
+
+    case 0x281: // reset exit-site sketches on all cpus
+        HvHotspotRequestReset();
+        return TRUE;
+
+    case 0x290: // VMCB clean-bit caching (a1 = 1 on / 0 off, for A/B benchmarks)
+        HvSetVmcbCaching(a1 != 0);
+        return TRUE;
+
+    case 0x291: // lazy VMLOAD/VMSAVE (a1 = 1 on / 0 off = swap host state on every exit)
+        HvSetLazyHostState(a1 != 0);
+        return TRUE;
+
+    case 0x2A0: // hash guest physical pages (a1 = GPA, a2 = page count, a3 = 1 AVX2 / 0 scalar); returns hash or ~0
+        return PageHashGuest(V, a1, a2, a3 != 0);
+
+    case 0x2A1: // query extended-state area (a1: 0 = size, 1 = saves, 2 = avx2 usable, 3 = xsaveopt)
+        return HvXstateQuery(V, (HV_XSTATE_FIELD)a1);
+
+    case 0x2B0: // query CPUID snapshot (a1 = cpu index, a2: 0 = hits, 1 = live executions, 2 = cached entries)
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        if (!source || !source->Cpuid)
+            return 0;
+        return a2 == 0 ? source->Cpuid->Hits : a2 == 1 ? source->Cpuid->Misses : source->Cpuid->Used;
+    }
+
+    case 0x2C0: // query MSR exits (a1 = cpu index, a2: 0 = shadow hits, 1 = handler reads, 2 = pass-through, 3 = #GP on native access)
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        return source ? HvMsrQuery(source, (HV_MSR_STAT)a2) : 0;
+    }
+
+    case 0x2D0: // intercept ports a1..a2 on every VCPU (a3 = enable); ports without a handler pass through
+        if (a1 > 0xFFFF || a2 > 0xFFFF)
+            return 0;
+        return NT_SUCCESS(HvIoSetIntercept((UINT16)a1, (UINT16)a2, (BOOLEAN)(a3 != 0)));
+
+    case 0x2D1: // query IOIO exits (a1 = cpu index, a2: 0 = exits, 1 = string exits, 2 = elements, 3 = pass-through)
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        return source ? HvIoQuery(source, (HV_IO_STAT)a2) : 0;
+    }
+
+    case 0x2E0: // query NPF emulation (a1 = cpu index, a2: 0 = emulated, 1 = decode cache hits, 2 = guest fetches, 3 = failures, 4 = #PF injected)
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        return source ? HvEmuQuery(source, (HV_EMU_STAT)a2) : 0;
+    }
+
+    case 0x2E1: // drop every VCPU's decoded instructions (after patching guest code)
+        HvEmuInvalidate();
+        return TRUE;
+
+    case 0x2F0: // query event injection (a1 = cpu index, a2: 0 = posted, 1 = injected, 2 = re-injected, 3 = #DF merges, 4 = window exits, 5 = NMIs raised)
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        return source ? HvEventQuery(source, (HV_EVENT_STAT)a2) : 0;
+    }
+
+    case 0x2F1: // post external interrupt (a1 = cpu index, a2 = vector 32-255)
+    case 0x2F2: // post NMI (a1 = cpu index)
+    {
+        VCPU* target = SmpGetVcpu((ULONG)a1);
+        BOOLEAN posted;
+
+        if (!target || (code == 0x2F1 && a2 > 0xFF))
+            return 0;
+
+        posted = (code == 0x2F1) ? HvEventQueueInterrupt(target, (UINT8)a2) : HvEventQueueNmi(target);
+        if (posted && target != V)
+            SmpKick((ULONG)a1);
+
+        return posted;
+    }
+
+    case 0x310: // query deferred work (a1 = cpu index, a2 = item, a3: 0 = slack runs, 1 = dedicated-exit runs, 2 = postponed, 3 = items, 4 = runs, 5 = cycles, 6 = max cycles, 7 = stragglers)
+    {
+        VCPU* source = SmpGetVcpu((ULONG)a1);
+        return source ? HvDeferQuery(source, (ULONG)a2, (HV_DEFER_STAT)a3) : 0;
+    }
+
     case 0x320: // query current process base
     {
         PROCESS_DETAILS details = { 0 };
+        HvEnsureHostState(V);   // Current thread comes from the host PCR via GS
         if (NT_SUCCESS(ProcessQueryCurrent(&details)))
             return details.ImageBase;
         return 0;
@@ -313,7 +659,7 @@ UINT64 HookVmmcallDispatch(VCPU* V, UINT64 code, UINT64 a1, UINT64 a2, UINT64 a3
         return TRUE;
 
     case 0x301:
-        HookRemoveSyscall();
+        HookRemoveSyscall(V);
         return TRUE;
 
     default:
@@ -321,10 +667,3 @@ UINT64 HookVmmcallDispatch(VCPU* V, UINT64 code, UINT64 a1, UINT64 a2, UINT64 a3
     }
 }
 
-
-
-VOID HookIoIntercept(VCPU* V)
-{
-    //  todo:    IO 
-}
-
@@ -1,132 +1,186 @@
 #include "guest_mem.h"
+#include "guest_walk.h"
 #include "npt.h"
 #include "vcpu.h"
 #include "vmcb.h"
 #include "hooks.h"
-
-static BOOLEAN ReadGuestPhysical(VCPU* V, UINT64 GuestPhysical, PVOID Buffer, SIZE_T Size)
+#include "svm.h"
+#include <intrin.h>
+
+#define GUEST_MEM_TAG       'WMVH'
+#define WINDOW_FRAME_MASK   0x000FFFFFFFFFF000ULL
+#define WINDOW_PTE_FLAGS    0x8000000000000003ULL  // P | RW | NX, WB via PAT 0
+#define CR4_LA57            (1ULL << 12)
+
+//
+// Guest physical memory is reached through a per-VCPU mapping window: one
+// page of reserved system VA whose PTE is located once at init and rewritten
+// in place on the exit path. This keeps MmCopyMemory / MmMapIoSpace (which
+// take locks and may flush TLBs on other cores) out of host context.
+//
+NTSTATUS GuestMemInitVcpu(VCPU* V)
 {
-    UNREFERENCED_PARAMETER(V);
-    
-    // Use MmCopyMemory for safe physical memory access at any address
-    MM_COPY_ADDRESS srcAddr = {0};
-    srcAddr.PhysicalAddress.QuadPart = GuestPhysical;
-    
-    SIZE_T bytesTransferred = 0;
-    NTSTATUS status = MmCopyMemory(Buffer, srcAddr, Size, MM_COPY_MEMORY_PHYSICAL, &bytesTransferred);
-    
-    if (!NT_SUCCESS(status) || bytesTransferred != Size) {
-        DbgPrint("SVM-HV: MmCopyMemory FAILED for PA=0x%llX Status=0x%X\n", GuestPhysical, status);
-        return FALSE;
+    V->MapWindow.Va = MmAllocateMappingAddress(PAGE_SIZE, GUEST_MEM_TAG);
+    if (!V->MapWindow.Va)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    //
+    // Walk the current page tables down to the PTE backing the window,
+    // starting at the PML5 when the host runs with 5-level paging. Kernel
+    // space is shared by every address space, so the entry found here is
+    // the one the host sees on any core. The PTE itself is not present
+    // until the window is first pointed somewhere, so this cannot reuse
+    // GuestWalkTables.
+    //
+    UINT64 va = (UINT64)V->MapWindow.Va;
+    UINT64 tablePa = __readcr3() & WINDOW_FRAME_MASK;
+    int top = (__readcr4() & CR4_LA57) ? 48 : 39;
+
+    for (int shift = top; shift >= 12; shift -= 9)
+    {
+        PHYSICAL_ADDRESS pa;
+        pa.QuadPart = tablePa;
+
+        UINT64* table = (UINT64*)MmGetVirtualForPhysical(pa);
+        if (!table)
+            break;
+
+        UINT64* entry = &table[(va >> shift) & 0x1FF];
+        if (shift == 12)
+        {
+            V->MapWindow.Pte = (volatile UINT64*)entry;
+            return STATUS_SUCCESS;
+        }
+
+        if (!(*entry & 1) || (*entry & (1ULL << 7)))
+            break;
+
+        tablePa = *entry & WINDOW_FRAME_MASK;
     }
-    
-    return TRUE;
+
+    DbgPrint("SVM-HV: Could not locate PTE for mapping window %p\n", V->MapWindow.Va);
+    MmFreeMappingAddress(V->MapWindow.Va, GUEST_MEM_TAG);
+    V->MapWindow.Va = NULL;
+    return STATUS_UNSUCCESSFUL;
 }
 
-static BOOLEAN WriteGuestPhysical(VCPU* V, UINT64 GuestPhysical, PVOID Buffer, SIZE_T Size)
+VOID GuestMemDestroyVcpu(VCPU* V)
 {
-    UNREFERENCED_PARAMETER(V);
-    
-    // For writes, we use MDL to map the physical page
-    PHYSICAL_ADDRESS pa;
-    pa.QuadPart = GuestPhysical;
-    
-    // Try to map the physical address
-    PVOID mapped = MmMapIoSpace(pa, Size, MmNonCached);
-    if (mapped) {
-        RtlCopyMemory(mapped, Buffer, Size);
-        MmUnmapIoSpace(mapped, Size);
-        return TRUE;
+    if (!V->MapWindow.Va)
+        return;
+
+    if (V->MapWindow.Pte)
+    {
+        *V->MapWindow.Pte = 0;
+        __invlpg(V->MapWindow.Va);
     }
-    
-    // Fallback: for high physical addresses, use MmAllocatePagesForMdlEx + MmMapLockedPagesSpecifyCache
-    // This is more complex but works for any physical address
-    DbgPrint("SVM-HV: WriteGuestPhysical MmMapIoSpace failed for PA=0x%llX\n", GuestPhysical);
-    return FALSE;
+
+    MmFreeMappingAddress(V->MapWindow.Va, GUEST_MEM_TAG);
+    V->MapWindow.Va = NULL;
+    V->MapWindow.Pte = NULL;
 }
 
-static UINT64 ReadGuestQword(VCPU* V, UINT64 gpa)
+static __forceinline VOID WindowMap(VCPU* V, UINT64 Physical)
 {
-    UINT64 val = 0;
-    ReadGuestPhysical(V, gpa, &val, sizeof(val));
-    return val;
+    *V->MapWindow.Pte = (Physical & WINDOW_FRAME_MASK) | WINDOW_PTE_FLAGS;
+    __invlpg(V->MapWindow.Va);
 }
 
-PHYSICAL_ADDRESS GuestTranslateGvaToGpa(VCPU* V, UINT64 Gva)
+static BOOLEAN WindowCopy(VCPU* V, UINT64 Physical, PVOID Buffer, SIZE_T Size, BOOLEAN Write)
 {
-    PHYSICAL_ADDRESS pa = { 0 };
-    
-    // Mask for extracting physical frame from page table entry
-    // Bits 12-51 contain the physical frame, we need to mask off NX (bit 63) and reserved bits
-    #define PTE_FRAME_MASK 0x000FFFFFFFFFF000ULL
+    if (!V->MapWindow.Pte)
+        return FALSE;
 
-    UINT64 cr3_enc = VmcbState(&V->GuestVmcb)->Cr3;
-    // Use guest CR3 directly - HookDecryptCr3 handles CR3 XOR decryption if active
-    UINT64 cr3 = HookDecryptCr3(V, cr3_enc);
+    PUCHAR buf = (PUCHAR)Buffer;
+    PUCHAR window = (PUCHAR)V->MapWindow.Va;
 
-    DbgPrint("SVM-HV: GVA->GPA: Gva=0x%llX, cr3_enc=0x%llX, cr3=0x%llX\n", Gva, cr3_enc, cr3);
+    while (Size)
+    {
+        UINT64 offset = Physical & (PAGE_SIZE - 1);
+        SIZE_T chunk = PAGE_SIZE - offset;
+        if (chunk > Size)
+            chunk = Size;
+
+        WindowMap(V, Physical);
+
+        if (Write)
+        {
+            GuestTlbNotifyWrite(V, Physical);
+            RtlCopyMemory(window + offset, buf, chunk);
+        }
+        else
+            RtlCopyMemory(buf, window + offset, chunk);
+
+        Physical += chunk;
+        buf += chunk;
+        Size -= chunk;
+    }
 
-    UINT64 pml4 = cr3 & PTE_FRAME_MASK;
-    UINT64 index = (Gva >> 39) & 0x1FF;
+    // Leave nothing mapped so stray accesses through the window fault
+    GuestUnmapWindow(V);
+    return TRUE;
+}
 
-    UINT64 pml4e = ReadGuestQword(V, pml4 + index * 8);
-    DbgPrint("SVM-HV: PML4[%llu] @ 0x%llX = 0x%llX\n", index, pml4 + index * 8, pml4e);
-    if (!(pml4e & 1)) {
-        DbgPrint("SVM-HV: PML4E not present!\n");
-        return pa;
-    }
+//
+// In-place access to one guest physical page for code that would rather
+// not copy it (scanners, hashing). The mapping lasts until GuestUnmapWindow
+// or the next guest memory copy on this VCPU.
+//
+PVOID GuestMapGpaPage(VCPU* V, UINT64 Gpa)
+{
+    if (!V->MapWindow.Pte)
+        return NULL;
 
-    UINT64 pdpt = (pml4e & PTE_FRAME_MASK);
-    index = (Gva >> 30) & 0x1FF;
+    WindowMap(V, Gpa);
+    return V->MapWindow.Va;
+}
 
-    UINT64 pdpte = ReadGuestQword(V, pdpt + index * 8);
-    DbgPrint("SVM-HV: PDPT[%llu] @ 0x%llX = 0x%llX\n", index, pdpt + index * 8, pdpte);
-    if (!(pdpte & 1)) {
-        DbgPrint("SVM-HV: PDPTE not present!\n");
-        return pa;
-    }
+VOID GuestUnmapWindow(VCPU* V)
+{
+    if (!V->MapWindow.Pte)
+        return;
+
+    *V->MapWindow.Pte = 0;
+    __invlpg(V->MapWindow.Va);
+}
 
-    if (pdpte & (1ULL << 7))
+static BOOLEAN ReadGuestPhysical(VCPU* V, UINT64 GuestPhysical, PVOID Buffer, SIZE_T Size)
+{
+    if (!WindowCopy(V, GuestPhysical, Buffer, Size, FALSE))
     {
-        // 1GB page
-        pa.QuadPart = (pdpte & 0x000FFFFFC0000000ULL) + (Gva & 0x3FFFFFFFULL);
-        DbgPrint("SVM-HV: 1GB page -> GPA=0x%llX\n", pa.QuadPart);
-        return pa;
+        HV_EXIT_LOG("SVM-HV: ReadGuestPhysical failed for PA=0x%llX\n", GuestPhysical);
+        return FALSE;
     }
 
-    UINT64 pd = (pdpte & PTE_FRAME_MASK);
-    index = (Gva >> 21) & 0x1FF;
-
-    UINT64 pde = ReadGuestQword(V, pd + index * 8);
-    DbgPrint("SVM-HV: PD[%llu] @ 0x%llX = 0x%llX\n", index, pd + index * 8, pde);
-    if (!(pde & 1)) {
-        DbgPrint("SVM-HV: PDE not present!\n");
-        return pa;
-    }
+    return TRUE;
+}
 
-    if (pde & (1ULL << 7))
+static BOOLEAN WriteGuestPhysical(VCPU* V, UINT64 GuestPhysical, PVOID Buffer, SIZE_T Size)
+{
+    if (!WindowCopy(V, GuestPhysical, Buffer, Size, TRUE))
     {
-        // 2MB page
-        pa.QuadPart = (pde & 0x000FFFFFFFE00000ULL) + (Gva & 0x1FFFFFULL);
-        DbgPrint("SVM-HV: 2MB page -> GPA=0x%llX\n", pa.QuadPart);
-        return pa;
+        HV_EXIT_LOG("SVM-HV: WriteGuestPhysical failed for PA=0x%llX\n", GuestPhysical);
+        return FALSE;
     }
 
-    UINT64 pt = (pde & PTE_FRAME_MASK);
-    index = (Gva >> 12) & 0x1FF;
+    return TRUE;
+}
+
+//
+// Translations go through the unified walker and this VCPU's software TLB
+// (see guest_walk.h)
+//
+PHYSICAL_ADDRESS GuestTranslateGvaToGpa(VCPU* V, UINT64 Gva)
+{
+    PHYSICAL_ADDRESS pa = { 0 };
+    GUEST_WALK walk;
 
-    UINT64 pte = ReadGuestQword(V, pt + index * 8);
-    DbgPrint("SVM-HV: PT[%llu] @ 0x%llX = 0x%llX\n", index, pt + index * 8, pte);
-    if (!(pte & 1)) {
-        DbgPrint("SVM-HV: PTE not present!\n");
-        return pa;
-    }
+    if (GuestWalkCurrent(V, Gva, 0, &walk))
+        pa.QuadPart = walk.Gpa;
+    else
+        HV_EXIT_LOG("SVM-HV: GVA->GPA: Gva=0x%llX not mapped (error 0x%X)\n", Gva, walk.ErrorCode);
 
-    pa.QuadPart = (pte & PTE_FRAME_MASK) + (Gva & 0xFFFULL);
-    DbgPrint("SVM-HV: 4KB page -> GPA=0x%llX\n", pa.QuadPart);
     return pa;
-    
-    #undef PTE_FRAME_MASK
 }
 
 PHYSICAL_ADDRESS GuestTranslateGpaToHpa(VCPU* V, UINT64 Gpa)
@@ -143,20 +197,40 @@ PHYSICAL_ADDRESS GuestTranslateGvaToHpa(VCPU* V, UINT64 Gva)
     return GuestTranslateGpaToHpa(V, gpa.QuadPart);
 }
 
-BOOLEAN GuestReadGva(VCPU* V, UINT64 Gva, PVOID Buffer, SIZE_T Size)
+//
+// Guest virtual buffers are only contiguous per page; translate each page
+//
+static BOOLEAN GuestCopyGva(VCPU* V, UINT64 Gva, PUCHAR Buffer, SIZE_T Size, BOOLEAN Write)
 {
-    PHYSICAL_ADDRESS gpa = GuestTranslateGvaToGpa(V, Gva);
-    if (!gpa.QuadPart) return FALSE;
+    while (Size)
+    {
+        SIZE_T chunk = PAGE_SIZE - (Gva & (PAGE_SIZE - 1));
+        if (chunk > Size)
+            chunk = Size;
+
+        PHYSICAL_ADDRESS gpa = GuestTranslateGvaToGpa(V, Gva);
+        if (!gpa.QuadPart)
+            return FALSE;
+
+        if (!WindowCopy(V, gpa.QuadPart, Buffer, chunk, Write))
+            return FALSE;
+
+        Gva += chunk;
+        Buffer += chunk;
+        Size -= chunk;
+    }
 
-    return ReadGuestPhysical(V, gpa.QuadPart, Buffer, Size);
+    return TRUE;
 }
 
-BOOLEAN GuestWriteGva(VCPU* V, UINT64 Gva, PVOID Buffer, SIZE_T Size)
+BOOLEAN GuestReadGva(VCPU* V, UINT64 Gva, PVOID Buffer, SIZE_T Size)
 {
-    PHYSICAL_ADDRESS gpa = GuestTranslateGvaToGpa(V, Gva);
-    if (!gpa.QuadPart) return FALSE;
+    return GuestCopyGva(V, Gva, (PUCHAR)Buffer, Size, FALSE);
+}
 
-    return WriteGuestPhysical(V, gpa.QuadPart, Buffer, Size);
+BOOLEAN GuestWriteGva(VCPU* V, UINT64 Gva, PVOID Buffer, SIZE_T Size)
+{
+    return GuestCopyGva(V, Gva, (PUCHAR)Buffer, Size, TRUE);
 }
 
 BOOLEAN GuestReadGpa(VCPU* V, UINT64 Gpa, PVOID Buffer, SIZE_T Size)
@@ -168,3 +242,8 @@ BOOLEAN GuestWriteGpa(VCPU* V, UINT64 Gpa, PVOID Buffer, SIZE_T Size)
 {
     return WriteGuestPhysical(V, Gpa, Buffer, Size);
 }
+
+BOOLEAN GuestReadHpa(VCPU* V, UINT64 Hpa, PVOID Buffer, SIZE_T Size)
+{
+    return ReadGuestPhysical(V, Hpa, Buffer, Size);
+}
@@ -0,0 +1,318 @@
+#include <ntifs.h>
+#include "guest_walk.h"
+#include "guest_mem.h"
+#include "hooks.h"
+#include "vmcb.h"
+
+#define WALK_FRAME_MASK     0x000FFFFFFFFFF000ULL
+#define WALK_PRESENT        (1ULL << 0)
+#define WALK_RW             (1ULL << 1)
+#define WALK_US             (1ULL << 2)
+#define WALK_PS             (1ULL << 7)
+#define WALK_NX             (1ULL << 63)
+#define WALK_ACCESSED       (1ULL << 5)
+#define WALK_DIRTY          (1ULL << 6)
+
+#define CR0_WP              (1ULL << 16)
+#define CR4_LA57            (1ULL << 12)
+#define EFER_NXE            (1ULL << 11)
+
+static volatile LONG g_GuestTlbGeneration = 1;
+
+static BOOLEAN GuestWalkAllows(UINT32 Rights, UINT32 Paging, UINT32 Access)
+{
+    if ((Access & GUEST_ACCESS_USER) && !(Rights & GUEST_ACCESS_USER))
+        return FALSE;
+
+    // Supervisor writes ignore R/W unless CR0.WP is set
+    if ((Access & GUEST_ACCESS_WRITE) && !(Rights & GUEST_ACCESS_WRITE) &&
+        ((Access & GUEST_ACCESS_USER) || (Paging & GUEST_PAGING_WP)))
+        return FALSE;
+
+    if ((Access & GUEST_ACCESS_EXEC) && !(Rights & GUEST_ACCESS_EXEC))
+        return FALSE;
+
+    return TRUE;
+}
+
+//
+// Rights are the intersection over every level: R/W and U/S must be set at
+// each one, NX (when EFER.NXE is on) at any one removes execute. Accessed
+// and dirty bits are left alone; these are not guest accesses.
+//
+BOOLEAN GuestWalkTables(GUEST_READ_QWORD Read, PVOID Context, UINT64 Cr3, UINT64 Gva,
+                        UINT32 Paging, UINT32 Access, GUEST_WALK* Walk)
+{
+    UINT64 table = Cr3 & WALK_FRAME_MASK;   // Drops the PCID / PWT / PCD bits
+    UINT32 rights = GUEST_ACCESS_WRITE | GUEST_ACCESS_USER | GUEST_ACCESS_EXEC;
+    ULONG shift = (Paging & GUEST_PAGING_LA57) ? 48 : 39;
+
+    Access &= GUEST_ACCESS_WRITE | GUEST_ACCESS_USER | GUEST_ACCESS_EXEC;
+    RtlZeroMemory(Walk, sizeof(*Walk));
+    Walk->ErrorCode = Access;
+
+    for (;;)
+    {
+        UINT64 entryGpa = table + ((Gva >> shift) & 0x1FF) * sizeof(UINT64);
+        UINT64 entry;
+
+        if (!Read(Context, entryGpa, &entry) || !(entry & WALK_PRESENT))
+            return FALSE;
+
+        if (!(entry & WALK_RW))
+            rights &= ~GUEST_ACCESS_WRITE;
+        if (!(entry & WALK_US))
+            rights &= ~GUEST_ACCESS_USER;
+        if ((Paging & GUEST_PAGING_NXE) && (entry & WALK_NX))
+            rights &= ~GUEST_ACCESS_EXEC;
+
+        // PS is only a leaf bit in PDPTEs (1GB) and PDEs (2MB)
+        if (shift == 12 || ((shift == 30 || shift == 21) && (entry & WALK_PS)))
+        {
+            UINT64 size = 1ULL << shift;
+
+            Walk->Gpa = (entry & WALK_FRAME_MASK & ~(size - 1)) | (Gva & (size - 1));
+            Walk->LeafGpa = entryGpa;
+            Walk->Leaf = entry;
+            Walk->PageSize = size;
+            Walk->Rights = rights;
+            break;
+        }
+
+        Walk->UpperGpa[Walk->UpperCount] = entryGpa;
+        Walk->Upper[Walk->UpperCount++] = entry;
+        table = entry & WALK_FRAME_MASK;
+        shift -= 9;
+    }
+
+    if (!GuestWalkAllows(rights, Paging, Access))
+    {
+        Walk->ErrorCode = Access | GUEST_ACCESS_PRESENT;
+        return FALSE;
+    }
+
+    Walk->ErrorCode = 0;
+    return TRUE;
+}
+
+static BOOLEAN GuestWalkRead(PVOID Context, UINT64 Gpa, UINT64* Value)
+{
+    return GuestReadGpa((VCPU*)Context, Gpa, Value, sizeof(UINT64));
+}
+
+static UINT32 GuestPagingControls(VCPU* V)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&V->GuestVmcb);
+    UINT32 paging = 0;
+
+    if (s->Cr0 & CR0_WP)
+        paging |= GUEST_PAGING_WP;
+    if (s->Efer & EFER_NXE)
+        paging |= GUEST_PAGING_NXE;
+    if (s->Cr4 & CR4_LA57)
+        paging |= GUEST_PAGING_LA57;
+
+    return paging;
+}
+
+static __forceinline ULONG GuestTlbFilterBit(UINT64 Gpa)
+{
+    return (ULONG)(((Gpa >> 12) * 0x9E3779B97F4A7C15ULL) >> 54) & (GUEST_TLB_FILTER_BITS - 1);
+}
+
+static __forceinline VOID GuestTlbFilterAdd(GUEST_TLB* Tlb, UINT64 Gpa)
+{
+    ULONG bit = GuestTlbFilterBit(Gpa);
+    Tlb->TableFilter[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static VOID GuestTlbFlush(GUEST_TLB* Tlb)
+{
+    Tlb->Generation++;
+    RtlZeroMemory(Tlb->TableFilter, sizeof(Tlb->TableFilter));
+}
+
+//
+// Re-read every entry the cached walk went through. The CPU sets A (and D
+// in the leaf) in place; neither changes the translation.
+//
+static BOOLEAN GuestTlbRecheck(VCPU* V, GUEST_TLB_ENTRY* E)
+{
+    UINT64 value;
+
+    for (UINT32 i = 0; i < E->UpperCount; i++)
+    {
+        if (!GuestWalkRead(V, E->UpperGpa[i], &value) || ((value ^ E->Upper[i]) & ~(WALK_ACCESSED | WALK_DIRTY)))
+            return FALSE;
+    }
+
+    return GuestWalkRead(V, E->LeafGpa, &value) && !((value ^ E->Leaf) & ~(WALK_ACCESSED | WALK_DIRTY));
+}
+
+NTSTATUS GuestTlbInitVcpu(VCPU* V)
+{
+    V->Tlb = (GUEST_TLB*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(GUEST_TLB), GUEST_TLB_TAG);
+    if (!V->Tlb)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(V->Tlb, sizeof(GUEST_TLB));
+    V->Tlb->Generation = 1;
+    V->Tlb->SeenGlobal = g_GuestTlbGeneration;
+    return STATUS_SUCCESS;
+}
+
+VOID GuestTlbDestroyVcpu(VCPU* V)
+{
+    if (V->Tlb)
+    {
+        ExFreePoolWithTag(V->Tlb, GUEST_TLB_TAG);
+        V->Tlb = NULL;
+    }
+}
+
+BOOLEAN GuestWalk(VCPU* V, UINT64 Cr3, UINT64 Gva, UINT32 Access, GUEST_WALK* Walk)
+{
+    GUEST_TLB* tlb = V->Tlb;
+    UINT32 paging = GuestPagingControls(V);
+    UINT64 root = Cr3 & WALK_FRAME_MASK;
+    UINT64 page = Gva & ~0xFFFULL;
+
+    if (!tlb)
+        return GuestWalkTables(GuestWalkRead, V, Cr3, Gva, paging, Access, Walk);
+
+    // Fold in a GuestTlbInvalidate from any CPU
+    LONG global = g_GuestTlbGeneration;
+    if (tlb->SeenGlobal != global)
+    {
+        tlb->SeenGlobal = global;
+        GuestTlbFlush(tlb);
+    }
+
+    GUEST_TLB_ENTRY* e = &tlb->Entries[((page ^ root) >> 12) & (GUEST_TLB_ENTRIES - 1)];
+
+    if (e->Generation == tlb->Generation && e->Cr3 == root && e->GvaPage == page)
+    {
+        BOOLEAN valid = TRUE;
+
+        if (e->CheckedExit != V->Exec.ExitCount)
+        {
+            tlb->Rechecks++;
+            valid = GuestTlbRecheck(V, e);
+            e->CheckedExit = V->Exec.ExitCount;
+        }
+
+        if (valid)
+        {
+            tlb->Hits++;
+
+            RtlZeroMemory(Walk, sizeof(*Walk));
+            Walk->Gpa = e->GpaPage | (Gva & 0xFFF);
+            Walk->LeafGpa = e->LeafGpa;
+            Walk->Leaf = e->Leaf;
+            Walk->PageSize = e->PageSize;
+            Walk->Rights = e->Rights;
+
+            Access &= GUEST_ACCESS_WRITE | GUEST_ACCESS_USER | GUEST_ACCESS_EXEC;
+            if (!GuestWalkAllows(e->Rights, paging, Access))
+            {
+                Walk->ErrorCode = Access | GUEST_ACCESS_PRESENT;
+                tlb->Faults++;
+                return FALSE;
+            }
+
+            return TRUE;
+        }
+
+        // The guest remapped or unmapped the page, or changed a table above
+        // it, since it was cached
+        tlb->Stale++;
+        e->Generation = 0;
+    }
+
+    tlb->Misses++;
+
+    BOOLEAN ok = GuestWalkTables(GuestWalkRead, V, Cr3, Gva, paging, Access, Walk);
+    if (!ok)
+        tlb->Faults++;
+
+    // A rights violation still produced a translation worth keeping
+    if (ok || (Walk->ErrorCode & GUEST_ACCESS_PRESENT))
+    {
+        e->Cr3 = root;
+        e->GvaPage = page;
+        e->GpaPage = Walk->Gpa & ~0xFFFULL;
+        e->LeafGpa = Walk->LeafGpa;
+        e->Leaf = Walk->Leaf;
+        e->PageSize = Walk->PageSize;
+        e->Rights = Walk->Rights;
+        e->UpperCount = Walk->UpperCount;
+        e->CheckedExit = V->Exec.ExitCount;
+        e->Generation = tlb->Generation;
+
+        for (UINT32 i = 0; i < Walk->UpperCount; i++)
+        {
+            e->UpperGpa[i] = Walk->UpperGpa[i];
+            e->Upper[i] = Walk->Upper[i];
+            GuestTlbFilterAdd(tlb, Walk->UpperGpa[i]);
+        }
+
+        GuestTlbFilterAdd(tlb, Walk->LeafGpa);
+    }
+
+    return ok;
+}
+
+BOOLEAN GuestWalkCurrent(VCPU* V, UINT64 Gva, UINT32 Access, GUEST_WALK* Walk)
+{
+    // HookDecryptCr3 undoes the CR3 XOR when it is active
+    UINT64 cr3 = HookDecryptCr3(V, VmcbState(&V->GuestVmcb)->Cr3);
+
+    return GuestWalk(V, cr3, Gva, Access, Walk);
+}
+
+//
+// A write to guest physical memory the hypervisor saw (its own, or an NPT
+// write fault). If it may have hit a table a cached walk went through,
+// drop everything; false positives only cost a flush.
+//
+VOID GuestTlbNotifyWrite(VCPU* V, UINT64 Gpa)
+{
+    GUEST_TLB* tlb = V->Tlb;
+    if (!tlb)
+        return;
+
+    ULONG bit = GuestTlbFilterBit(Gpa);
+    if (tlb->TableFilter[bit / 64] & (1ULL << (bit % 64)))
+    {
+        tlb->Flushes++;
+        GuestTlbFlush(tlb);
+    }
+}
+
+//
+// After the hypervisor edits guest page tables other than through the
+// guest-memory writers (which report to GuestTlbNotifyWrite). Each VCPU
+// drops its entries on its next walk.
+//
+VOID GuestTlbInvalidate(VOID)
+{
+    InterlockedIncrement(&g_GuestTlbGeneration);
+}
+
+UINT64 GuestTlbQuery(VCPU* V, GUEST_TLB_STAT Stat)
+{
+    GUEST_TLB* tlb = V->Tlb;
+    if (!tlb)
+        return 0;
+
+    switch (Stat)
+    {
+    case GuestTlbStatHits:      return tlb->Hits;
+    case GuestTlbStatMisses:    return tlb->Misses;
+    case GuestTlbStatStale:     return tlb->Stale;
+    case GuestTlbStatFaults:    return tlb->Faults;
+    case GuestTlbStatFlushes:   return tlb->Flushes;
+    case GuestTlbStatRechecks:  return tlb->Rechecks;
+    default:                    return 0;
+    }
+}
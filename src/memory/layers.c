@@ -5,23 +5,37 @@
 #include "stealth.h"
 #include "vmcb.h"
 #include "communication.h"
+#include "emulate.h"
+#include "defer.h"
 
 #define APIC_BASE_GPA 0xFEE00000ULL
 #define ACPI_PM_GPA   0x00000400ULL
 #define SMM_TRAP_GPA  0x000A0000ULL
 #define MMIO_DOORBELL 0x0000C000ULL
 
+// The layer refresh runs as deferred work, in TSC ticks (~5 ms / ~5 us at 3 GHz)
+#define LAYER_REFRESH_PERIOD (1ULL << 24)
+#define LAYER_REFRESH_BUDGET (1ULL << 14)
+
 static VOID HvPrimeCloaking(VCPU* V)
 {
-    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
-
    
     V->CloakedTscOffset = (__rdtsc() ^ 0xC0FFEEULL);
-    c->TscOffset = V->CloakedTscOffset;
+    VmcbSetTscOffset(&V->GuestVmcb, V->CloakedTscOffset);
 
    
     StealthEnable();
-    StealthCleanVmcb(V);
+}
+
+//
+// What the per-exit HvRefreshExecLayer used to do every ExitBudget exits:
+// rearm fired traps and put the cloaked TSC offset back should anything
+// have replaced it (a no-op compare otherwise, see VmcbSetTscOffset)
+//
+static VOID HvRefreshLayersWork(VCPU* V)
+{
+    NptRearmHardwareTriggers(&V->Npt);
+    VmcbSetTscOffset(&V->GuestVmcb, V->CloakedTscOffset);
 }
 
 static VOID HvPrimeHardwareEntry(VCPU* V)
@@ -29,6 +43,9 @@ static VOID HvPrimeHardwareEntry(VCPU* V)
     CommInit(V, APIC_BASE_GPA);
 
     NptSetupHardwareTriggers(&V->Npt, APIC_BASE_GPA, ACPI_PM_GPA, SMM_TRAP_GPA, MMIO_DOORBELL);
+
+    // One registration covers every VCPU; later calls find it in place
+    HvRegisterDeferredWork("layer-refresh", HvRefreshLayersWork, LAYER_REFRESH_PERIOD, LAYER_REFRESH_BUDGET);
 }
 
 VOID HvActivateLayeredPipeline(VCPU* V)
@@ -38,16 +55,24 @@ VOID HvActivateLayeredPipeline(VCPU* V)
 
     HvPrimeCloaking(V);
     HvPrimeHardwareEntry(V);
-
-   
-    V->Exec.ExitBudget = 0x100;
 }
 
-BOOLEAN HvHandleLayeredNpf(VCPU* V, UINT64 faultGpa)
+BOOLEAN HvHandleLayeredNpf(VCPU* V, PGUEST_REGISTERS GuestRegs, UINT64 faultGpa)
 {
     if (!V)
         return FALSE;
 
+    // Complete the access against the trap's backing page; the trap stays
+    // armed, so there is no fake-page remap and nothing to rearm. An access
+    // that ended in a guest #PF never happened: no doorbell.
+    PVOID backing = NptTrapBacking(&V->Npt, faultGpa);
+    HV_EMU_RESULT emulated = backing ? HvEmulateMmio(V, GuestRegs, faultGpa, backing) : HvEmuNotHandled;
+
+    if (emulated == HvEmuCompleted)
+        CommHandleDoorbell(V, faultGpa);
+    if (emulated != HvEmuNotHandled)
+        return TRUE;
+
     UINT64 mailbox = 0;
     if (NptHandleHardwareTriggers(&V->Npt, faultGpa, &mailbox))
     {
@@ -57,24 +82,3 @@ BOOLEAN HvHandleLayeredNpf(VCPU* V, UINT64 faultGpa)
 
     return FALSE;
 }
-
-VOID HvRefreshExecLayer(VCPU* V, UINT64 exitCode)
-{
-    if (!V)
-        return;
-
-    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
-
-    V->Exec.ExitCount++;
-    V->Exec.LastExitCode = exitCode;
-
-
-    if ((V->Exec.ExitCount % V->Exec.ExitBudget) == 0)
-    {
-        NptRearmHardwareTriggers(&V->Npt);
-        StealthCleanVmcb(V);
-    }
-
-
-    c->TscOffset = V->CloakedTscOffset;
-}
@@ -1,188 +1,267 @@
 ﻿#include "npt.h"
 #include "svm.h"
+#include "sync.h"
+#include "smp.h"
+#include "vcpu.h"
+#include "guest_mem.h"
+#include "guest_walk.h"
 #include <ntifs.h>
 
 #ifndef PAGE_ALIGN
 #define PAGE_ALIGN(x) ((x) & ~0xFFFULL)
 #endif
 
-// PA->VA lookup table since MmGetVirtualForPhysical doesn't work with pool memory
-#define MAX_NPT_TABLES 2048  // Increased for 16+ core support (~35 tables per core)
-static struct {
-    UINT64 pa;
-    PVOID va;
-} g_NptTableMap[MAX_NPT_TABLES];
-static ULONG g_NptTableCount = 0;
-static KSPIN_LOCK g_NptTableLock;
-static BOOLEAN g_NptTableLockInitialized = FALSE;
+//
+// PA->VA index since MmGetVirtualForPhysical doesn't work with pool memory.
+//
+// Radix tree keyed by the table page frame number (40 bits, 4 levels of 10
+// bits). Interior nodes are published with a single interlocked compare-
+// exchange and are never freed while the hypervisor is loaded, so lookups are
+// plain loads: no lock, no IRQL change, safe from VMEXIT context on any core.
+// There is no fixed capacity - nodes are added as new PA ranges show up.
+//
+#define NPT_INDEX_BITS      10
+#define NPT_INDEX_FANOUT    (1u << NPT_INDEX_BITS)
+#define NPT_INDEX_MASK      (NPT_INDEX_FANOUT - 1)
+#define NPT_INDEX_LEVELS    4
+#define NPT_INDEX_TAG       'XIPN'
 
-static VOID NptInitTableLock(VOID)
+typedef struct _NPT_INDEX_NODE
 {
-    if (!g_NptTableLockInitialized)
-    {
-        KeInitializeSpinLock(&g_NptTableLock);
-        g_NptTableLockInitialized = TRUE;
-    }
+    PVOID volatile Slots[NPT_INDEX_FANOUT];
+} NPT_INDEX_NODE;
+
+static NPT_INDEX_NODE g_NptIndexRoot;
+static volatile LONG g_NptIndexNodes = 0;
+static volatile LONG g_NptIndexEntries = 0;
+
+static __forceinline ULONG NptIndexSlot(UINT64 pfn, ULONG level)
+{
+    return (ULONG)(pfn >> ((NPT_INDEX_LEVELS - 1 - level) * NPT_INDEX_BITS)) & NPT_INDEX_MASK;
 }
 
-//
-// Call this ONCE from DriverEntry before any SmpInitialize
-//
-VOID NptGlobalInit(VOID)
+static NPT_INDEX_NODE* NptIndexEnsureChild(NPT_INDEX_NODE* node, ULONG slot)
 {
-    if (!g_NptTableLockInitialized)
+    NPT_INDEX_NODE* child = (NPT_INDEX_NODE*)node->Slots[slot];
+    if (child)
+        return child;
+
+    child = (NPT_INDEX_NODE*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(NPT_INDEX_NODE), NPT_INDEX_TAG);
+    if (!child)
+        return NULL;
+
+    RtlZeroMemory(child, sizeof(*child));
+
+    // Publish; if another core won the race, use its node and drop ours
+    PVOID prev = InterlockedCompareExchangePointer(&node->Slots[slot], child, NULL);
+    if (prev)
     {
-        KeInitializeSpinLock(&g_NptTableLock);
-        g_NptTableLockInitialized = TRUE;
-        g_NptTableCount = 0;
-        RtlZeroMemory(g_NptTableMap, sizeof(g_NptTableMap));
-        DbgPrint("SVM-HV: NPT global state initialized\n");
+        ExFreePoolWithTag(child, NPT_INDEX_TAG);
+        return (NPT_INDEX_NODE*)prev;
     }
-}
 
+    InterlockedIncrement(&g_NptIndexNodes);
+    return child;
+}
 
-static VOID NptRegisterTable(UINT64 pa, PVOID va)
+static VOID NptIndexFreeNode(NPT_INDEX_NODE* node, ULONG level)
 {
-    KIRQL oldIrql;
-    
-    NptInitTableLock();
-    KeAcquireSpinLock(&g_NptTableLock, &oldIrql);
-    
-    if (g_NptTableCount < MAX_NPT_TABLES)
+    if (level + 1 < NPT_INDEX_LEVELS)
     {
-        g_NptTableMap[g_NptTableCount].pa = pa;
-        g_NptTableMap[g_NptTableCount].va = va;
-        g_NptTableCount++;
+        for (ULONG i = 0; i < NPT_INDEX_FANOUT; i++)
+        {
+            if (node->Slots[i])
+            {
+                NptIndexFreeNode((NPT_INDEX_NODE*)node->Slots[i], level + 1);
+                ExFreePoolWithTag(node->Slots[i], NPT_INDEX_TAG);
+                node->Slots[i] = NULL;
+            }
+        }
     }
     else
     {
-        DbgPrint("SVM-HV: WARNING - NPT table map full!\n");
+        RtlZeroMemory(node, sizeof(*node));
     }
-    
-    KeReleaseSpinLock(&g_NptTableLock, oldIrql);
 }
 
-PVOID NptLookupTable(UINT64 pa)
+static BOOLEAN NptRegisterTable(UINT64 pa, PVOID va)
 {
-    KIRQL oldIrql;
-    PVOID result = NULL;
-    
-    NptInitTableLock();
-    KeAcquireSpinLock(&g_NptTableLock, &oldIrql);
-    
-    for (ULONG i = 0; i < g_NptTableCount; i++)
+    UINT64 pfn = pa >> 12;
+    NPT_INDEX_NODE* node = &g_NptIndexRoot;
+
+    for (ULONG level = 0; level + 1 < NPT_INDEX_LEVELS; level++)
     {
-        if (g_NptTableMap[i].pa == pa)
+        node = NptIndexEnsureChild(node, NptIndexSlot(pfn, level));
+        if (!node)
         {
-            result = g_NptTableMap[i].va;
-            break;
+            DbgPrint("SVM-HV: WARNING - NPT index node allocation failed for PA 0x%llX\n", pa);
+            return FALSE;
         }
     }
-    
-    KeReleaseSpinLock(&g_NptTableLock, oldIrql);
-    return result;
+
+    PVOID prev = InterlockedExchangePointer(&node->Slots[NptIndexSlot(pfn, NPT_INDEX_LEVELS - 1)], va);
+    if (!prev)
+        InterlockedIncrement(&g_NptIndexEntries);
+
+    return TRUE;
+}
+
+static VOID NptUnregisterTable(UINT64 pa)
+{
+    UINT64 pfn = pa >> 12;
+    NPT_INDEX_NODE* node = &g_NptIndexRoot;
+
+    for (ULONG level = 0; level + 1 < NPT_INDEX_LEVELS; level++)
+    {
+        node = (NPT_INDEX_NODE*)node->Slots[NptIndexSlot(pfn, level)];
+        if (!node)
+            return;
+    }
+
+    PVOID prev = InterlockedExchangePointer(&node->Slots[NptIndexSlot(pfn, NPT_INDEX_LEVELS - 1)], NULL);
+    if (prev)
+        InterlockedDecrement(&g_NptIndexEntries);
+}
+
+PVOID NptLookupTable(UINT64 pa)
+{
+    UINT64 pfn = pa >> 12;
+    NPT_INDEX_NODE* node = &g_NptIndexRoot;
+
+    for (ULONG level = 0; level + 1 < NPT_INDEX_LEVELS; level++)
+    {
+        node = (NPT_INDEX_NODE*)node->Slots[NptIndexSlot(pfn, level)];
+        if (!node)
+            return NULL;
+    }
+
+    return node->Slots[NptIndexSlot(pfn, NPT_INDEX_LEVELS - 1)];
 }
 
-static NPT_ENTRY* NptAllocTable(PHYSICAL_ADDRESS* outPa)
+//
+// Per-VCPU table arena
+//
+// One contiguous slab reserved at NptInitialize. Every page in it is entered
+// into the PA->VA index up front, so carving a table out of it at VMEXIT time
+// is a bump or freelist pop with no call into the memory manager.
+//
+static NTSTATUS NptArenaInit(NPT_ARENA* Arena, ULONG PageCount)
 {
     PHYSICAL_ADDRESS low = { 0 };
     PHYSICAL_ADDRESS high = { .QuadPart = ~0ULL };
     PHYSICAL_ADDRESS skip = { 0 };
 
-    NPT_ENTRY* tbl = MmAllocateContiguousMemorySpecifyCache(PAGE_SIZE, low, high, skip, MmCached);
-    
-    if (!tbl)
+    RtlZeroMemory(Arena, sizeof(*Arena));
+
+    PUINT8 base = MmAllocateContiguousMemorySpecifyCache(
+        (SIZE_T)PageCount * PAGE_SIZE, low, high, skip, MmCached);
+    if (!base)
     {
-        tbl = (NPT_ENTRY*)ExAllocatePoolWithTag(NonPagedPoolNx, PAGE_SIZE, 'NPTB');
-        if (!tbl)
-        {
-            DbgPrint("SVM-HV: CRITICAL - NPT table allocation failed!\n");
-            return NULL;
-        }
+        DbgPrint("SVM-HV: NPT arena allocation failed (%lu pages)\n", PageCount);
+        return HV_STATUS_NPT_ARENA;
     }
 
-    RtlZeroMemory(tbl, PAGE_SIZE);
-    *outPa = MmGetPhysicalAddress(tbl);
-    
-    // Fix #4: Validate physical address
-    if (outPa->QuadPart == 0 || outPa->QuadPart == ~0ULL)
-    {
-        DbgPrint("SVM-HV: CRITICAL - Invalid physical address 0x%llX for NPT table!\n", 
-                 outPa->QuadPart);
-        
-        // Try to free the memory
-        __try {
-            MmFreeContiguousMemory(tbl);
-        } __except(EXCEPTION_EXECUTE_HANDLER) {
-            ExFreePoolWithTag(tbl, 'NPTB');
+    Arena->BaseVa = base;
+    Arena->BasePa = MmGetPhysicalAddress(base).QuadPart;
+    Arena->PageCount = PageCount;
+
+    for (ULONG i = 0; i < PageCount; i++)
+    {
+        if (!NptRegisterTable(Arena->BasePa + (UINT64)i * PAGE_SIZE, base + (SIZE_T)i * PAGE_SIZE))
+        {
+            // Take back the pages indexed so far before the slab goes
+            while (i--)
+                NptUnregisterTable(Arena->BasePa + (UINT64)i * PAGE_SIZE);
+
+            MmFreeContiguousMemory(base);
+            RtlZeroMemory(Arena, sizeof(*Arena));
+            return HV_STATUS_NPT_ARENA;
         }
-        
-        return NULL;
     }
-    
-    NptRegisterTable(outPa->QuadPart, tbl);
-    
-    // DbgPrint("SVM-HV: NPT table allocated - VA=%p PA=0x%llX\n", tbl, outPa->QuadPart);  // Commented to reduce noise
-    return tbl;
+
+    return STATUS_SUCCESS;
 }
 
-static NPT_ENTRY* NptResolveTableFromEntry(NPT_ENTRY* entry)
+static VOID NptArenaDestroy(NPT_ARENA* Arena)
 {
-    if (!entry || !entry->Present)
-        return NULL;
-        
-    UINT64 pa = (UINT64)entry->PageFrame << 12;
-    if (pa == 0)
-        return NULL;
-        
-    PVOID va = NptLookupTable(pa);
-    if (!va)
-    {
-        DbgPrint("SVM-HV: NptResolveTableFromEntry - lookup failed for PA 0x%llX\n", pa);
-    }
-    return (NPT_ENTRY*)va;
+    if (!Arena->BaseVa)
+        return;
+
+    for (ULONG i = 0; i < Arena->PageCount; i++)
+        NptUnregisterTable(Arena->BasePa + (UINT64)i * PAGE_SIZE);
+
+    MmFreeContiguousMemory(Arena->BaseVa);
+    RtlZeroMemory(Arena, sizeof(*Arena));
+}
+
+static __forceinline BOOLEAN NptArenaOwns(NPT_ARENA* Arena, UINT64 pa)
+{
+    return pa >= Arena->BasePa && pa < Arena->BasePa + (UINT64)Arena->PageCount * PAGE_SIZE;
 }
 
-static NPT_ENTRY* NptEnsureSubtable(NPT_ENTRY* parent, UINT64 index)
+static NPT_ENTRY* NptArenaAlloc(NPT_ARENA* Arena, PHYSICAL_ADDRESS* outPa)
 {
-    // Validate parent pointer before access
-    if (!parent)
+    ULONG index;
+
+    if (Arena->FreeHead)
     {
-        DbgPrint("SVM-HV: NptEnsureSubtable - NULL parent!\n");
-        return NULL;
+        // Free pages store (next index + 1) in their first qword
+        index = Arena->FreeHead - 1;
+        Arena->FreeHead = (ULONG)*(UINT64*)(Arena->BaseVa + (SIZE_T)index * PAGE_SIZE);
     }
-    
-    // Check if address is valid before dereferencing
-    if (!MmIsAddressValid(parent))
+    else if (Arena->NextFree < Arena->PageCount)
     {
-        DbgPrint("SVM-HV: NptEnsureSubtable - invalid parent address %p\n", parent);
-        return NULL;
+        index = Arena->NextFree++;
     }
-    
-    if (!parent[index].Present)
+    else
     {
-        PHYSICAL_ADDRESS pa;
-        NPT_ENTRY* tbl = NptAllocTable(&pa);
-        if (!tbl)
-            return NULL;
-
-        parent[index].Present = 1;
-        parent[index].Write = 1;
-        parent[index].User = 1;  // Required for NPT - allows supervisor mode access
-        parent[index].PageFrame = pa.QuadPart >> 12;
+        Arena->Failures++;
+        return NULL;
     }
 
-    return NptResolveTableFromEntry(&parent[index]);
+    Arena->InUse++;
+    if (Arena->InUse > Arena->HighWater)
+        Arena->HighWater = Arena->InUse;
+
+    NPT_ENTRY* tbl = (NPT_ENTRY*)(Arena->BaseVa + (SIZE_T)index * PAGE_SIZE);
+    RtlZeroMemory(tbl, PAGE_SIZE);
+    outPa->QuadPart = Arena->BasePa + (UINT64)index * PAGE_SIZE;
+    return tbl;
+}
+
+static VOID NptArenaFree(NPT_ARENA* Arena, NPT_ENTRY* tbl)
+{
+    ULONG index = (ULONG)(((PUINT8)tbl - Arena->BaseVa) / PAGE_SIZE);
+
+    *(UINT64*)tbl = Arena->FreeHead;
+    Arena->FreeHead = index + 1;
+    Arena->InUse--;
+}
+
+static NPT_ENTRY* NptAllocTable(NPT_STATE* State, PHYSICAL_ADDRESS* outPa)
+{
+    NPT_ENTRY* tbl = NptArenaAlloc(&State->Arena, outPa);
+    if (!tbl)
+        HV_EXIT_LOG("SVM-HV: CRITICAL - NPT arena exhausted (%lu pages)\n", State->Arena.PageCount);
+
+    return tbl;
 }
 
+VOID NptQueryArena(NPT_STATE* State, NPT_ARENA_STATS* Stats)
+{
+    Stats->Capacity = State->Arena.PageCount;
+    Stats->InUse = State->Arena.InUse;
+    Stats->HighWater = State->Arena.HighWater;
+    Stats->Failures = State->Arena.Failures;
+    Stats->Splits = State->Splits;
+    Stats->Merges = State->Merges;
+}
 
 static NPT_ENTRY* NptGetEntry(
     NPT_STATE* State,
     UINT64 gpa,
     UINT64* outLevel)
 {
-    UINT64 gpaPage = gpa >> 12;
-
     UINT64 pml4_i = (gpa >> 39) & 0x1FF;
     UINT64 pdpt_i = (gpa >> 30) & 0x1FF;
     UINT64 pd_i = (gpa >> 21) & 0x1FF;
@@ -226,118 +305,270 @@ static NPT_ENTRY* NptGetEntry(
     return &pt[pt_i];
 }
 
-static BOOLEAN NptReadGuestQword(NPT_STATE* State, UINT64 gpa, UINT64* outValue)
+//
+// Copy-on-write: make sure the table referenced by 'entry' is owned by this
+// VCPU, cloning it from the shared hierarchy into the arena if it is not.
+//
+static NPT_ENTRY* NptPrivatizeTable(NPT_STATE* State, NPT_ENTRY* table, PHYSICAL_ADDRESS* inOutPa)
 {
-    PHYSICAL_ADDRESS hpa = NptTranslateGpaToHpa(State, gpa);
-    if (!hpa.QuadPart)
-        return FALSE;
+    if (NptArenaOwns(&State->Arena, inOutPa->QuadPart))
+        return table;
 
-    PVOID mapped = MmMapIoSpace(hpa, sizeof(UINT64), MmNonCached);
-    if (!mapped)
-        return FALSE;
+    PHYSICAL_ADDRESS pa;
+    NPT_ENTRY* clone = NptAllocTable(State, &pa);
+    if (!clone)
+        return NULL;
 
-    *outValue = *(volatile UINT64*)mapped;
-    MmUnmapIoSpace(mapped, sizeof(UINT64));
-    return TRUE;
+    RtlCopyMemory(clone, table, PAGE_SIZE);
+    *inOutPa = pa;
+    State->CowClones++;
+    return clone;
 }
 
-static VOID NptProtectPageForTrap(NPT_STATE* State, UINT64 gpa, NPT_ENTRY* entry,
-    UINT64* originalFrame,
-    BOOLEAN arm)
+//
+// Private leaf for 'gpa' and its level. When the walk ends on a non-present
+// entry, NULL is returned with *outLevel set to that entry's level so a
+// caller scanning a range can step over the whole hole.
+//
+static NPT_ENTRY* NptGetEntryForWrite(
+    NPT_STATE* State,
+    UINT64 gpa,
+    UINT64* outLevel)
 {
-    if (!entry)
-        return;
+    PHYSICAL_ADDRESS pa = State->Pml4Pa;
+    NPT_ENTRY* table = NptPrivatizeTable(State, State->Pml4, &pa);
+    if (!table)
+        return NULL;
 
-    if (arm)
+    if (table != State->Pml4)
     {
-        *originalFrame = entry->PageFrame;
-        entry->Present = 0; 
+        // New root: HandleVmExit picks up the NestedCr3 change and flushes
+        State->Pml4 = table;
+        State->Pml4Pa = pa;
+        State->TlbFlushPending = TRUE;
     }
-    else
+
+    for (UINT64 level = 0; ; level++)
     {
-        entry->PageFrame = *originalFrame;
-        entry->Present = 1;
+        NPT_ENTRY* entry = &table[(gpa >> (39 - 9 * level)) & 0x1FF];
+        if (!entry->Present)
+        {
+            *outLevel = level;
+            return NULL;
+        }
+
+        if (level == 3 || (level > 0 && entry->LargePage))
+        {
+            *outLevel = level;
+            return entry;
+        }
+
+        pa.QuadPart = entry->PageFrame << 12;
+        NPT_ENTRY* child = (NPT_ENTRY*)NptLookupTable(pa.QuadPart);
+        if (!child)
+            return NULL;
+
+        table = NptPrivatizeTable(State, child, &pa);
+        if (!table)
+            return NULL;
+
+        entry->PageFrame = pa.QuadPart >> 12;
     }
 }
 
+//
+// Split / merge engine
+//
+// The identity map is built from 1GB leaves. Anything that changes a single
+// page (hooks, traps) first splits only the path covering that page down to
+// a 4KB PTE: 1GB -> 512 x 2MB -> 512 x 4KB. When the page goes back to its
+// identity mapping the path is coalesced again so the guest keeps full TLB
+// reach. Split tables always come from the VCPU arena.
+//
+#define NPT_MERGE_IGNORE_MASK ((1ULL << 5) | (1ULL << 6))  // Accessed, Dirty
 
-PHYSICAL_ADDRESS NptTranslateGpaToHpa(NPT_STATE* State, UINT64 gpa)
+static NPT_ENTRY* NptSplitLeaf(NPT_STATE* State, NPT_ENTRY* leaf, UINT64 level)
 {
-    // NPT is identity mapped (GPA == HPA)
-    // Hardware uses NPT tables during VMRUN, but for software translation
-    // we can return GPA directly since it equals HPA
     PHYSICAL_ADDRESS pa;
-    pa.QuadPart = gpa;
-    return pa;
-}
-
+    NPT_ENTRY* tbl = NptAllocTable(State, &pa);
+    if (!tbl)
+        return NULL;
 
-PHYSICAL_ADDRESS NptTranslateGvaToHpa(NPT_STATE* State, UINT64 gva)
-{
-    PHYSICAL_ADDRESS pa = { 0 };
+    // Children of a 1GB leaf are 2MB leaves, children of a 2MB leaf are PTEs
+    UINT64 stride = (level == 1) ? 512 : 1;
 
-    if (!State->ShadowCr3)
-        return pa;
+    NPT_ENTRY child = *leaf;
+    child.LargePage = (level == 1) ? 1 : 0;
 
-    UINT64 cr3 = State->ShadowCr3 & ~0xFFFULL;
-    UINT64 index = (gva >> 39) & 0x1FF;
+    for (UINT64 i = 0; i < 512; i++)
+    {
+        tbl[i] = child;
+        tbl[i].PageFrame = leaf->PageFrame + i * stride;
+    }
 
-    UINT64 pml4e;
-    if (!NptReadGuestQword(State, cr3 + index * sizeof(UINT64), &pml4e) || !(pml4e & PAGE_PRESENT))
-        return pa;
+    NPT_ENTRY link = { 0 };
+    link.Present = 1;
+    link.Write = 1;
+    link.User = 1;
+    link.PageFrame = pa.QuadPart >> 12;
 
-    UINT64 pdpt = pml4e & ~0xFFFULL;
-    index = (gva >> 30) & 0x1FF;
+    *leaf = link;
+    State->Splits++;
+    State->TlbFlushPending = TRUE;
+    return tbl;
+}
 
-    UINT64 pdpte;
-    if (!NptReadGuestQword(State, pdpt + index * sizeof(UINT64), &pdpte) || !(pdpte & PAGE_PRESENT))
-        return pa;
+//
+// Private 4KB PTE for 'gpa', splitting any large leaf on the way
+//
+static NPT_ENTRY* NptGetPageEntryForWrite(NPT_STATE* State, UINT64 gpa)
+{
+    UINT64 level;
+    NPT_ENTRY* entry = NptGetEntryForWrite(State, gpa, &level);
+    if (!entry)
+        return NULL;
 
-    if (pdpte & (1ULL << 7))
+    while (level < 3)
     {
-        pa.QuadPart = (pdpte & ~0x3FFFFFFFULL) + (gva & 0x3FFFFFFFULL);
-        pa = NptTranslateGpaToHpa(State, pa.QuadPart);
-        return pa;
+        NPT_ENTRY* tbl = NptSplitLeaf(State, entry, level);
+        if (!tbl)
+            return NULL;
+
+        level++;
+        entry = &tbl[(gpa >> (39 - 9 * level)) & 0x1FF];
     }
 
-    UINT64 pd = pdpte & ~0xFFFULL;
-    index = (gva >> 21) & 0x1FF;
+    return entry;
+}
 
-    UINT64 pde;
-    if (!NptReadGuestQword(State, pd + index * sizeof(UINT64), &pde) || !(pde & PAGE_PRESENT))
-        return pa;
+//
+// A table can collapse into one leaf of the parent's size when all 512
+// entries are present, share attributes and map one contiguous, aligned run
+//
+static BOOLEAN NptTableIsUniform(NPT_ENTRY* tbl, UINT64 stride)
+{
+    UINT64 first = tbl[0].Value & ~NPT_MERGE_IGNORE_MASK;
+
+    if (!tbl[0].Present || (tbl[0].PageFrame & (stride * 512 - 1)))
+        return FALSE;
 
-    if (pde & (1ULL << 7))
+    for (UINT64 i = 1; i < 512; i++)
     {
-        pa.QuadPart = (pde & ~0x1FFFFFULL) + (gva & 0x1FFFFFULL);
-        pa = NptTranslateGpaToHpa(State, pa.QuadPart);
-        return pa;
+        NPT_ENTRY expect = { .Value = first };
+        expect.PageFrame += i * stride;
+
+        if ((tbl[i].Value & ~NPT_MERGE_IGNORE_MASK) != expect.Value)
+            return FALSE;
     }
 
-    UINT64 pt = pde & ~0xFFFULL;
-    index = (gva >> 12) & 0x1FF;
+    return TRUE;
+}
+
+static BOOLEAN NptCollapseTable(NPT_STATE* State, NPT_ENTRY* parent, UINT64 level)
+{
+    UINT64 pa = parent->PageFrame << 12;
+    if (!parent->Present || parent->LargePage || !NptArenaOwns(&State->Arena, pa))
+        return FALSE;
+
+    NPT_ENTRY* tbl = (NPT_ENTRY*)NptLookupTable(pa);
+    if (!tbl)
+        return FALSE;
+
+    // PD entries are 2MB leaves (stride 512 frames), PT entries are 4KB
+    UINT64 stride = (level == 1) ? 512 : 1;
+    if (level == 1 && !tbl[0].LargePage)
+        return FALSE;
+
+    if (!NptTableIsUniform(tbl, stride))
+        return FALSE;
+
+    NPT_ENTRY leaf = tbl[0];
+    leaf.LargePage = 1;
 
-    UINT64 pte;
-    if (!NptReadGuestQword(State, pt + index * sizeof(UINT64), &pte) || !(pte & PAGE_PRESENT))
+    *parent = leaf;
+    NptArenaFree(&State->Arena, tbl);
+
+    State->Merges++;
+    State->TlbFlushPending = TRUE;
+    return TRUE;
+}
+
+//
+// Coalesce the path covering 'gpa' as far up as it will go (PT -> 2MB,
+// PD -> 1GB). Only touches tables this VCPU already owns.
+//
+static VOID NptTryMerge(NPT_STATE* State, UINT64 gpa)
+{
+    NPT_ENTRY* pdpt = (NPT_ENTRY*)NptLookupTable(State->Pml4[(gpa >> 39) & 0x1FF].PageFrame << 12);
+    if (!State->Pml4[(gpa >> 39) & 0x1FF].Present || !pdpt)
+        return;
+
+    NPT_ENTRY* pdpte = &pdpt[(gpa >> 30) & 0x1FF];
+    if (!pdpte->Present || pdpte->LargePage)
+        return;
+
+    NPT_ENTRY* pd = (NPT_ENTRY*)NptLookupTable(pdpte->PageFrame << 12);
+    if (!pd)
+        return;
+
+    NptCollapseTable(State, &pd[(gpa >> 21) & 0x1FF], 2);
+    NptCollapseTable(State, pdpte, 1);
+}
+
+//
+// Put one 4KB page back to its identity mapping and re-coalesce its region
+//
+static VOID NptRestoreIdentityPage(NPT_STATE* State, UINT64 gpa)
+{
+    UINT64 level;
+    NPT_ENTRY* entry = NptGetEntry(State, gpa, &level);
+    if (!entry || level != 3)
+        return;
+
+    entry->PageFrame = gpa >> 12;
+    entry->Present = 1;
+    State->TlbFlushPending = TRUE;
+
+    NptTryMerge(State, gpa);
+}
+
+PHYSICAL_ADDRESS NptTranslateGpaToHpa(NPT_STATE* State, UINT64 gpa)
+{
+    // NPT is identity mapped (GPA == HPA)
+    // Hardware uses NPT tables during VMRUN, but for software translation
+    // we can return GPA directly since it equals HPA
+    PHYSICAL_ADDRESS pa;
+    UNREFERENCED_PARAMETER(State);
+    pa.QuadPart = gpa;
+    return pa;
+}
+
+
+PHYSICAL_ADDRESS NptTranslateGvaToHpa(NPT_STATE* State, UINT64 gva)
+{
+    PHYSICAL_ADDRESS pa = { 0 };
+    GUEST_WALK walk;
+
+    if (!State->ShadowCr3)
         return pa;
 
-    pa.QuadPart = (pte & ~0xFFFULL) + (gva & 0xFFFULL);
-    pa = NptTranslateGpaToHpa(State, pa.QuadPart);
+    if (GuestWalk(CONTAINING_RECORD(State, VCPU, Npt), State->ShadowCr3, gva, 0, &walk))
+        pa = NptTranslateGpaToHpa(State, walk.Gpa);
+
     return pa;
 }
 
 
 BOOLEAN NptHookPage(NPT_STATE* State, UINT64 targetGpaPage, UINT64 newHpaPage)
 {
-    UINT64 level;
-
-    NPT_ENTRY* entry = NptGetEntry(State, targetGpaPage, &level);
+    NPT_ENTRY* entry = NptGetPageEntryForWrite(State, targetGpaPage);
     if (!entry)
         return FALSE;
 
     entry->PageFrame = (newHpaPage >> 12);
     entry->Dirty = 1;
     entry->Accessed = 1;
+    State->TlbFlushPending = TRUE;
 
     return TRUE;
 }
@@ -347,23 +578,20 @@ VOID NptUpdateShadowCr3(NPT_STATE* State, UINT64 GuestCr3)
     State->ShadowCr3 = GuestCr3;
 }
 
-static BOOLEAN NptArmTrap(NPT_STATE* State, UINT64 gpa, NPT_ENTRY* entry,
-    UINT64* originalFrame,
-    BOOLEAN* armed)
-{
-    if (!entry)
-        return FALSE;
-
-    NptProtectPageForTrap(State, gpa, entry, originalFrame, TRUE);
-    *armed = TRUE;
-    return TRUE;
-}
-
+//
+// Trap registry
+//
+// Each trap owns one 4KB GPA page that is left not-present so the first
+// touch takes an NPF. The registry is a slot array plus a PAGE_MAP from GPA
+// page to slot index, and each slot caches its leaf PTE so the NPF path is a
+// single hash probe. Fired traps go on a short list so rearm only visits
+// those.
+//
+// The cached leaf stays valid for the life of the trap: the PT holding it
+// was split for the trap and cannot be merged while the PTE is non-identity.
+//
 static BOOLEAN NptPromoteTrapToFake(NPT_STATE* State, NPT_ENTRY* entry)
 {
-    if (!entry)
-        return FALSE;
-
     ULONG slot = State->FakePageIndex & 1;
     PHYSICAL_ADDRESS fakePa = State->FakePagePa[slot];
     if (!fakePa.QuadPart)
@@ -379,199 +607,1632 @@ static BOOLEAN NptPromoteTrapToFake(NPT_STATE* State, NPT_ENTRY* entry)
     return TRUE;
 }
 
-static BOOLEAN NptHandleSingleTrigger(NPT_STATE* State,
-    UINT64 gpa,
-    NPT_ENTRY* entry,
-    UINT64* originalFrame,
-    BOOLEAN* armed,
-    BOOLEAN* usingFake,
-    UINT64* mailboxValue)
+static __forceinline VOID NptArmTrap(NPT_STATE* State, NPT_TRAP* trap)
 {
-    if (!*armed || !entry)
-        return FALSE;
+    trap->Leaf->PageFrame = trap->OriginalPageFrame;
+    trap->Leaf->Present = 0;
+    trap->Armed = TRUE;
+    trap->UsingFakePage = FALSE;
+    State->TlbFlushPending = TRUE;
+}
+
+BOOLEAN NptAddTrap(NPT_STATE* State, UINT64 Gpa)
+{
+    UINT64 page = Gpa & ~0xFFFULL;
+
+    if (!State->Traps || PageMapFind(&State->TrapIndex, page))
+        return FALSE;
+
+    if (State->TrapCount >= NPT_TRAP_CAPACITY)
+        return FALSE;
+
+    NPT_ENTRY* leaf = NptGetPageEntryForWrite(State, page);
+    if (!leaf)
+        return FALSE;
+
+    // Slots are kept dense; removal moves the last slot into the hole
+    ULONG id = State->TrapCount;
+    if (!PageMapInsert(&State->TrapIndex, page, id))
+        return FALSE;
+
+    NPT_TRAP* trap = &State->Traps[id];
+    RtlZeroMemory(trap, sizeof(*trap));
+    trap->GpaPage = page;
+    trap->Leaf = leaf;
+    trap->OriginalPageFrame = leaf->PageFrame;
+
+    State->TrapCount++;
+    NptArmTrap(State, trap);
+    return TRUE;
+}
+
+static VOID NptUnfireTrap(NPT_STATE* State, ULONG id)
+{
+    for (ULONG i = 0; i < State->FiredCount; i++)
+    {
+        if (State->Fired[i] == id)
+        {
+            State->Fired[i] = State->Fired[--State->FiredCount];
+            return;
+        }
+    }
+}
+
+BOOLEAN NptRemoveTrap(NPT_STATE* State, UINT64 Gpa)
+{
+    UINT64 page = Gpa & ~0xFFFULL;
+    UINT64 id;
+
+    if (!State->Traps || !PageMapRemove(&State->TrapIndex, page, &id))
+        return FALSE;
+
+    NPT_TRAP* trap = &State->Traps[id];
+    trap->Leaf->PageFrame = trap->OriginalPageFrame;
+    trap->Leaf->Present = 1;
+
+    if (trap->UsingFakePage)
+        NptUnfireTrap(State, (ULONG)id);
+
+    // Keep the array dense: move the last trap into the freed slot
+    ULONG last = --State->TrapCount;
+    if ((ULONG)id != last)
+    {
+        State->Traps[id] = State->Traps[last];
+        *PageMapFind(&State->TrapIndex, State->Traps[id].GpaPage) = id;
+
+        for (ULONG i = 0; i < State->FiredCount; i++)
+        {
+            if (State->Fired[i] == last)
+                State->Fired[i] = (ULONG)id;
+        }
+    }
+
+    // Identity again; coalesce the region if this was its last trap/hook
+    NptRestoreIdentityPage(State, page);
+    return TRUE;
+}
+
+//
+// One hash probe: not a trap page, or already fired -> not ours
+//
+BOOLEAN NptHandleTrapFault(NPT_STATE* State, UINT64 FaultGpa, UINT64* MailboxValue)
+{
+    UINT64* id = PageMapFind(&State->TrapIndex, FaultGpa);
+    if (!id)
+        return FALSE;
+
+    NPT_TRAP* trap = &State->Traps[*id];
+    if (!trap->Armed || trap->UsingFakePage)
+        return FALSE;
+
+    trap->UsingFakePage = NptPromoteTrapToFake(State, trap->Leaf);
+    trap->Armed = FALSE;
+    if (!trap->UsingFakePage)
+        return FALSE;
+
+    State->Fired[State->FiredCount++] = (ULONG)*id;
+    State->TlbFlushPending = TRUE;
+
+    if (MailboxValue)
+        *MailboxValue = FaultGpa;
+    return TRUE;
+}
+
+//
+// Host VA an armed trap's accesses are emulated against: the fake page the
+// trap would otherwise be switched to. NULL if Gpa is not an armed trap.
+//
+PVOID NptTrapBacking(NPT_STATE* State, UINT64 Gpa)
+{
+    UINT64* id = PageMapFind(&State->TrapIndex, Gpa);
+    if (!id)
+        return NULL;
+
+    NPT_TRAP* trap = &State->Traps[*id];
+    if (!trap->Armed || trap->UsingFakePage)
+        return NULL;
+
+    return State->FakePageVa[State->FakePageIndex & 1];
+}
+
+VOID NptRearmTraps(NPT_STATE* State)
+{
+    while (State->FiredCount)
+    {
+        ULONG id = State->Fired[--State->FiredCount];
+        NptArmTrap(State, &State->Traps[id]);
+    }
+}
+
+VOID NptClearTraps(NPT_STATE* State)
+{
+    while (State->TrapCount)
+        NptRemoveTrap(State, State->Traps[State->TrapCount - 1].GpaPage);
+
+    State->FiredCount = 0;
+}
+
+//
+// Disarm every trap and let the split regions around them coalesce again
+//
+VOID NptClearHardwareTriggers(NPT_STATE* State)
+{
+    if (!State->Mailbox.Active)
+        return;
+
+    NptClearTraps(State);
+    State->Mailbox.Active = FALSE;
+}
+
+BOOLEAN NptSetupHardwareTriggers(NPT_STATE* State, UINT64 apicGpa, UINT64 acpiGpa, UINT64 smmGpa, UINT64 mmioGpa)
+{
+    // Re-arming at new addresses: give the old pages back first
+    NptClearHardwareTriggers(State);
+
+    BOOLEAN ok = TRUE;
+    ok &= NptAddTrap(State, apicGpa);
+    ok &= NptAddTrap(State, acpiGpa);
+    ok &= NptAddTrap(State, smmGpa);
+    ok &= NptAddTrap(State, mmioGpa);
+
+    State->Mailbox.GpaPage = apicGpa & ~0xFFFULL;
+    State->Mailbox.Active = TRUE;
+    State->Mailbox.LastMessage = 0;
+
+    return ok;
+}
+
+BOOLEAN NptHandleHardwareTriggers(NPT_STATE* State, UINT64 faultGpa, UINT64* mailboxValue)
+{
+    return NptHandleTrapFault(State, faultGpa, mailboxValue);
+}
+
+VOID NptRearmHardwareTriggers(NPT_STATE* State)
+{
+    NptRearmTraps(State);
+}
+
+//
+// Shadow hooks: GPA page -> replacement HPA page, applied eagerly so the
+// guest sees the substitution without taking an NPF first. The NPF path only
+// needs the hash probe to re-apply a hook whose PTE was disturbed.
+//
+BOOLEAN NptAddShadowHook(NPT_STATE* State, UINT64 TargetGpa, UINT64 NewHpa)
+{
+    if (!State)
+        return FALSE;
+
+    UINT64 page = TargetGpa & ~0xFFFULL;
+    UINT64 newPage = NewHpa & ~0xFFFULL;
+
+    BOOLEAN existed = PageMapFind(&State->Hooks, page) != NULL;
+    if (!PageMapInsert(&State->Hooks, page, newPage))
+        return FALSE;
+
+    if (!NptHookPage(State, page, newPage))
+    {
+        if (!existed)
+            PageMapRemove(&State->Hooks, page, NULL);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// Arena pages a batch of hooks will take: one PT per 2MB region that is not
+// split yet, plus the PD and the PML4/PDPT clones above it the first time a
+// 1GB leaf is split. Regions are only recorded when they cost a page, so the
+// list never outgrows the arena.
+//
+typedef struct _NPT_HOOK_PLAN
+{
+    ULONG Budget;
+    ULONG Pages;
+    ULONG Regions;
+    BOOLEAN Pml4;
+    UINT64 Region[NPT_ARENA_PAGES];
+} NPT_HOOK_PLAN;
+
+static BOOLEAN NptPlanHookPage(NPT_STATE* State, NPT_HOOK_PLAN* Plan, UINT64 gpa)
+{
+    UINT64 level;
+    NPT_ENTRY* leaf = NptGetEntry(State, gpa, &level);
+
+    // Already a 4KB PTE (its tables are private), or unmapped and refused later
+    if (!leaf || level == 3)
+        return TRUE;
+
+    UINT64 region = gpa & ~0x1FFFFFULL;
+    BOOLEAN sameGb = FALSE, same512Gb = FALSE;
+
+    for (ULONG i = 0; i < Plan->Regions; i++)
+    {
+        if (Plan->Region[i] == region)
+            return TRUE;
+
+        sameGb |= (Plan->Region[i] >> 30) == (gpa >> 30);
+        same512Gb |= (Plan->Region[i] >> 39) == (gpa >> 39);
+    }
+
+    ULONG pages = 1;
+    BOOLEAN pml4 = FALSE;
+
+    // A 2MB leaf sits in a private PD; a 1GB leaf may still be shared
+    if (level == 1 && !sameGb)
+    {
+        pages++;
+
+        UINT64 pdptPa = State->Pml4[(gpa >> 39) & 0x1FF].PageFrame << 12;
+        if (!same512Gb && !NptArenaOwns(&State->Arena, pdptPa))
+            pages++;
+
+        if (!Plan->Pml4 && !NptArenaOwns(&State->Arena, State->Pml4Pa.QuadPart))
+        {
+            pages++;
+            pml4 = TRUE;
+        }
+    }
+
+    if (Plan->Pages + pages > Plan->Budget || Plan->Regions == ARRAYSIZE(Plan->Region))
+        return FALSE;
+
+    Plan->Pages += pages;
+    Plan->Pml4 |= pml4;
+    Plan->Region[Plan->Regions++] = region;
+    return TRUE;
+}
+
+//
+// Install many hooks back to back; they all land before the next VMRUN so a
+// single TLB flush (TlbFlushPending) covers the whole batch. A batch the
+// arena cannot hold is refused as a whole before anything is split.
+//
+ULONG NptAddShadowHooks(NPT_STATE* State, const NPT_HOOK_DESC* Hooks, ULONG Count)
+{
+    ULONG installed = 0;
+
+    if (!State)
+        return 0;
+
+    NPT_HOOK_PLAN plan;
+    plan.Budget = State->Arena.PageCount - State->Arena.InUse;
+    plan.Pages = 0;
+    plan.Regions = 0;
+    plan.Pml4 = FALSE;
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        // Runs in exit context: no logging, the caller sees 0 installed
+        if (!NptPlanHookPage(State, &plan, Hooks[i].TargetGpa))
+            return 0;
+    }
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        if (NptAddShadowHook(State, Hooks[i].TargetGpa, Hooks[i].NewHpa))
+            installed++;
+    }
+
+    return installed;
+}
+
+BOOLEAN NptRemoveShadowHook(NPT_STATE* State, UINT64 TargetGpa)
+{
+    if (!State)
+        return FALSE;
+
+    UINT64 page = TargetGpa & ~0xFFFULL;
+    if (!PageMapRemove(&State->Hooks, page, NULL))
+        return FALSE;
+
+    // Back to identity; the split path coalesces once its last hook is gone
+    NptRestoreIdentityPage(State, page);
+    return TRUE;
+}
+
+BOOLEAN NptFindShadowHook(NPT_STATE* State, UINT64 Gpa, UINT64* NewHpa)
+{
+    UINT64* value = PageMapFind(&State->Hooks, Gpa);
+    if (!value)
+        return FALSE;
+
+    *NewHpa = *value;
+    return TRUE;
+}
+
+VOID NptClearShadowHooks(NPT_STATE* State)
+{
+    if (!State)
+        return;
+
+    ULONG cursor = 0;
+    UINT64 page, newPage;
+
+    while (PageMapNext(&State->Hooks, &cursor, &page, &newPage))
+        NptRestoreIdentityPage(State, page);
+
+    PageMapClear(&State->Hooks);
+
+    // Mark TLB flush needed to restore original mappings
+    State->TlbFlushPending = TRUE;
+}
+
+static UINT64 NptGetMaxPhysicalAddress(PPHYSICAL_MEMORY_RANGE ranges)
+{
+    UINT64 maxPa = 0;
+
+    for (PPHYSICAL_MEMORY_RANGE r = ranges; r->BaseAddress.QuadPart || r->NumberOfBytes.QuadPart; r++)
+    {
+        UINT64 end = r->BaseAddress.QuadPart + r->NumberOfBytes.QuadPart;
+        if (end > maxPa)
+            maxPa = end;
+    }
+
+    return maxPa;
+}
+
+static UINT64 NptGetCpuPhysicalAddressLimit(VOID)
+{
+    int info[4];
+
+    __cpuid(info, 0x80000000);
+    if ((UINT32)info[0] < 0x80000008)
+        return 1ULL << 36;
+
+    __cpuid(info, 0x80000008);
+    return 1ULL << (info[0] & 0xFF);
+}
+
+//
+// Shared identity hierarchy
+//
+// All VCPUs start out with NestedCr3 pointing at one read-only identity map.
+// A VCPU that needs to change a mapping clones just the tables on the path to
+// that leaf into its own arena (see NptGetEntryForWrite); everything else
+// stays shared.
+//
+// The map is sized from MmGetPhysicalMemoryRanges: only the PML4 slots that
+// cover RAM and the sub-4GB MMIO hole are populated at load. Slots above that
+// (64-bit BAR apertures) are faulted in on first NPF from a small reserve.
+//
+#define NPT_SHARED_RESERVE_PAGES 16
+
+static struct
+{
+    NPT_ENTRY* Pml4;
+    PHYSICAL_ADDRESS Pml4Pa;
+
+    // PML4 page, eagerly populated PDPTs, then the lazy fill reserve
+    PUINT8 BlockVa;
+    UINT64 BlockPa;
+    ULONG BlockPages;
+    ULONG NextPage;
+    HV_SPINLOCK FillLock;
+
+    // 2 bits per GB (NPT_GPA_CLASS) below RamTopGb
+    PUINT8 ClassMap;
+    UINT64 RamTopGb;
+    UINT64 PhysLimit;
+
+    SIZE_T Bytes;
+    ULONG EagerSlots;
+    volatile LONG LazySlots;
+} g_NptShared;
+
+#define NPT_CLASS_TAG 'CMPN'
+
+static __forceinline NPT_GPA_CLASS NptClassMapGet(UINT64 gb)
+{
+    return (NPT_GPA_CLASS)((g_NptShared.ClassMap[gb >> 2] >> ((gb & 3) * 2)) & 3);
+}
+
+static __forceinline VOID NptClassMapSet(UINT64 gb, NPT_GPA_CLASS cls)
+{
+    PUINT8 b = &g_NptShared.ClassMap[gb >> 2];
+    *b = (UINT8)((*b & ~(3u << ((gb & 3) * 2))) | ((UINT32)cls << ((gb & 3) * 2)));
+}
+
+//
+// O(1): RAM and the sub-4GB hole come from the class map, everything above
+// the top of RAM up to MAXPHYADDR is treated as the 64-bit MMIO aperture.
+//
+NPT_GPA_CLASS NptClassifyGpa(UINT64 gpa)
+{
+    UINT64 gb = gpa >> 30;
+
+    if (gb < g_NptShared.RamTopGb)
+        return NptClassMapGet(gb);
+
+    if (gpa < g_NptShared.PhysLimit)
+        return NptGpaMmio;
+
+    return NptGpaNone;
+}
+
+static NTSTATUS NptBuildMemoryMap(VOID)
+{
+    PPHYSICAL_MEMORY_RANGE ranges = MmGetPhysicalMemoryRanges();
+    if (!ranges)
+        return HV_STATUS_NPT_RANGES;
+
+    UINT64 ramTop = NptGetMaxPhysicalAddress(ranges);
+
+    // Cover at least the sub-4GB MMIO hole (LAPIC, IOAPIC, PCI config)
+    UINT64 eagerTop = ramTop > 0x100000000ULL ? ramTop : 0x100000000ULL;
+
+    g_NptShared.PhysLimit = NptGetCpuPhysicalAddressLimit();
+    g_NptShared.RamTopGb = (eagerTop + 0x3FFFFFFFULL) >> 30;
+
+    SIZE_T mapBytes = (SIZE_T)((g_NptShared.RamTopGb + 3) / 4);
+    g_NptShared.ClassMap = ExAllocatePoolWithTag(NonPagedPoolNx, mapBytes, NPT_CLASS_TAG);
+    if (!g_NptShared.ClassMap)
+    {
+        ExFreePool(ranges);
+        return HV_STATUS_NPT_RANGES;
+    }
+
+    // Anything below the top of RAM that is not RAM is a hole/MMIO window
+    for (UINT64 gb = 0; gb < g_NptShared.RamTopGb; gb++)
+        NptClassMapSet(gb, NptGpaMmio);
+
+    for (PPHYSICAL_MEMORY_RANGE r = ranges; r->BaseAddress.QuadPart || r->NumberOfBytes.QuadPart; r++)
+    {
+        UINT64 first = (UINT64)r->BaseAddress.QuadPart >> 30;
+        UINT64 last = ((UINT64)r->BaseAddress.QuadPart + r->NumberOfBytes.QuadPart - 1) >> 30;
+
+        for (UINT64 gb = first; gb <= last && gb < g_NptShared.RamTopGb; gb++)
+            NptClassMapSet(gb, NptGpaRam);
+    }
+
+    ExFreePool(ranges);
+
+    DbgPrint("SVM-HV: Physical memory map: RAM top 0x%llX, %llu GB classified, MAXPHYADDR 0x%llX\n",
+             ramTop, g_NptShared.RamTopGb, g_NptShared.PhysLimit);
+    return STATUS_SUCCESS;
+}
+
+//
+// Fill one PDPT with 1GB identity leaves for every GB of its 512GB slot that
+// classifies as RAM or MMIO
+//
+static VOID NptFillIdentityPdpt(NPT_ENTRY* pdpt, UINT64 pml4Index)
+{
+    for (UINT64 pdpIndex = 0; pdpIndex < 512; pdpIndex++)
+    {
+        // Physical address this 1GB page maps to:
+        // Page index = pml4Index * 512 + pdpIndex
+        // Physical address = pageIndex * 1GB = pageIndex * 0x40000000
+        // PageFrame field = physAddr >> 12 = pageIndex << 18
+        UINT64 pageIndex = pml4Index * 512ULL + pdpIndex;
+
+        NPT_GPA_CLASS cls = NptClassifyGpa(pageIndex << 30);
+        if (cls == NptGpaNone)
+            continue;
+
+        pdpt[pdpIndex].Present = 1;
+        pdpt[pdpIndex].Write = 1;
+        pdpt[pdpIndex].User = 1;       // Supervisor for NPT
+        pdpt[pdpIndex].LargePage = 1;  // 1GB huge page!
+        pdpt[pdpIndex].CacheDisable = (cls == NptGpaMmio && pageIndex >= 4) ? 1 : 0;
+        pdpt[pdpIndex].PageFrame = pageIndex << 18;  // Correct: physAddr >> 12
+    }
+}
+
+static NPT_ENTRY* NptSharedAllocTable(PHYSICAL_ADDRESS* outPa)
+{
+    if (g_NptShared.NextPage >= g_NptShared.BlockPages)
+    {
+        outPa->QuadPart = 0;
+        return NULL;
+    }
+
+    ULONG index = g_NptShared.NextPage++;
+    outPa->QuadPart = g_NptShared.BlockPa + (UINT64)index * PAGE_SIZE;
+    return (NPT_ENTRY*)(g_NptShared.BlockVa + (SIZE_T)index * PAGE_SIZE);
+}
+
+static VOID NptSharedIdentityDestroy(VOID)
+{
+    if (g_NptShared.BlockVa)
+    {
+        for (ULONG i = 0; i < g_NptShared.BlockPages; i++)
+            NptUnregisterTable(g_NptShared.BlockPa + (UINT64)i * PAGE_SIZE);
+
+        MmFreeContiguousMemory(g_NptShared.BlockVa);
+    }
+
+    if (g_NptShared.ClassMap)
+        ExFreePoolWithTag(g_NptShared.ClassMap, NPT_CLASS_TAG);
+
+    RtlZeroMemory(&g_NptShared, sizeof(g_NptShared));
+}
+
+static NTSTATUS NptSharedIdentityBuild(VOID)
+{
+    NTSTATUS st = NptBuildMemoryMap();
+    if (!NT_SUCCESS(st))
+        return st;
+
+    // Eagerly populate only the 512GB slots that hold RAM or the low hole
+    ULONG eagerSlots = (ULONG)((g_NptShared.RamTopGb + 511) / 512);
+
+    PHYSICAL_ADDRESS low = { 0 };
+    PHYSICAL_ADDRESS high = { .QuadPart = ~0ULL };
+    PHYSICAL_ADDRESS skip = { 0 };
+
+    ULONG pages = 1 + eagerSlots + NPT_SHARED_RESERVE_PAGES;
+    SIZE_T bytes = (SIZE_T)pages * PAGE_SIZE;
+
+    PUINT8 block = MmAllocateContiguousMemorySpecifyCache(bytes, low, high, skip, MmCached);
+    if (!block)
+    {
+        DbgPrint("SVM-HV: Failed to allocate shared NPT block (%llu bytes)\n", (UINT64)bytes);
+        return HV_STATUS_NPT_PDPT;
+    }
+    RtlZeroMemory(block, bytes);
+
+    g_NptShared.BlockVa = block;
+    g_NptShared.BlockPa = MmGetPhysicalAddress(block).QuadPart;
+    g_NptShared.BlockPages = pages;
+    g_NptShared.Bytes = bytes;
+    g_NptShared.EagerSlots = eagerSlots;
+
+    // Every page of the block (including the reserve) is indexed up front so
+    // lazy fill at VMEXIT time never allocates
+    for (ULONG i = 0; i < pages; i++)
+    {
+        if (!NptRegisterTable(g_NptShared.BlockPa + (UINT64)i * PAGE_SIZE, block + (SIZE_T)i * PAGE_SIZE))
+            return HV_STATUS_NPT_PML4;
+    }
+
+    g_NptShared.Pml4 = NptSharedAllocTable(&g_NptShared.Pml4Pa);
+
+    for (ULONG64 pml4Index = 0; pml4Index < eagerSlots; pml4Index++)
+    {
+        PHYSICAL_ADDRESS pdptPa;
+        NPT_ENTRY* pdpt = NptSharedAllocTable(&pdptPa);
+
+        NptFillIdentityPdpt(pdpt, pml4Index);
+
+        g_NptShared.Pml4[pml4Index].Present = 1;
+        g_NptShared.Pml4[pml4Index].Write = 1;
+        g_NptShared.Pml4[pml4Index].User = 1;  // Supervisor bit for NPT
+        g_NptShared.Pml4[pml4Index].PageFrame = pdptPa.QuadPart >> 12;
+    }
+
+    DbgPrint("SVM-HV: Identity mapped %llu GB using 1GB pages (%lu PML4 slots, %lu lazy reserve)\n",
+             (UINT64)eagerSlots * 512, eagerSlots, (ULONG)NPT_SHARED_RESERVE_PAGES);
+    return STATUS_SUCCESS;
+}
+
+//
+// NPF on a GPA whose PML4 slot was never populated: if the classifier says it
+// is RAM or MMIO, build the slot's identity PDPT (once, in the shared map)
+// and link it into this VCPU's root.
+//
+BOOLEAN NptHandleLazyFill(NPT_STATE* State, UINT64 gpa)
+{
+    if (NptClassifyGpa(gpa) == NptGpaNone)
+        return FALSE;
+
+    UINT64 pml4_i = (gpa >> 39) & 0x1FF;
+
+    if (!g_NptShared.Pml4[pml4_i].Present)
+    {
+        HvSpinLockAcquire(&g_NptShared.FillLock);
+
+        if (!g_NptShared.Pml4[pml4_i].Present)
+        {
+            PHYSICAL_ADDRESS pdptPa;
+            NPT_ENTRY* pdpt = NptSharedAllocTable(&pdptPa);
+            if (!pdpt)
+            {
+                HvSpinLockRelease(&g_NptShared.FillLock);
+                return FALSE;
+            }
+
+            NptFillIdentityPdpt(pdpt, pml4_i);
+
+            NPT_ENTRY pml4e = { 0 };
+            pml4e.Present = 1;
+            pml4e.Write = 1;
+            pml4e.User = 1;
+            pml4e.PageFrame = pdptPa.QuadPart >> 12;
+
+            // Single store publishes the fully built PDPT to every core
+            InterlockedExchange64((volatile LONG64*)&g_NptShared.Pml4[pml4_i].Value, (LONG64)pml4e.Value);
+            InterlockedIncrement(&g_NptShared.LazySlots);
+        }
+
+        HvSpinLockRelease(&g_NptShared.FillLock);
+    }
+
+    // A VCPU that already cloned its root needs the slot linked privately
+    if (State->Pml4 != g_NptShared.Pml4 && !State->Pml4[pml4_i].Present)
+        State->Pml4[pml4_i] = g_NptShared.Pml4[pml4_i];
+
+    return State->Pml4[pml4_i].Present != 0;
+}
+
+//
+// Dirty page logging
+//
+// While logging is on, every 4KB leaf in the range is write-protected. The
+// first write in an epoch takes one NPF, sets the page's bit in this VCPU's
+// current bitmap and makes the page writable again. With NPT_DIRTY_USE_DBIT
+// nothing is protected; the hardware D bit in the nested PTE is collected
+// and cleared at each epoch instead, so writes cost no faults at all.
+//
+// Each VCPU keeps two bitmaps. An epoch boundary (replayed from the change
+// journal on the VCPU itself) re-protects what was written, flushes and
+// swaps buffers; the retired buffer is then stable until the next boundary,
+// which is what the harvest reads. The harvest consumes it (clears what it
+// collected), and a boundary folds whatever is still in the old retired
+// buffer into the one it retires, so a VCPU that missed a harvest, or went
+// through several boundaries before the next one, loses nothing.
+//
+#define NPT_DIRTY_TAG               'DDPN'
+//
+// How long a harvest waits in exit context for kicked VCPUs to reach the
+// epoch boundary. A kicked VCPU normally gets there within microseconds;
+// one that does not is counted as a straggler and its writes are reported
+// by a later harvest instead.
+//
+#define NPT_DIRTY_SYNC_TIMEOUT_TSC  0x100000ULL
+
+static struct
+{
+    HV_SPINLOCK Lock;       // One start/stop/harvest at a time
+    BOOLEAN Active;
+    UINT64 BaseGpa;
+    ULONG PageCount;
+    ULONG Flags;
+    PULONG Harvest;         // Union of the retired per-VCPU bitmaps
+    ULONG Stragglers;       // VCPUs that missed the last harvest deadline
+    volatile LONG StartFailures;
+} g_NptDirty;
+
+#define NPT_DIRTY_BITMAP_BYTES (NPT_DIRTY_MAX_PAGES / 8)
+
+static __forceinline VOID NptBitSet(PULONG bitmap, ULONG bit)
+{
+    bitmap[bit >> 5] |= 1u << (bit & 31);
+}
+
+static __forceinline BOOLEAN NptBitTest(PULONG bitmap, ULONG bit)
+{
+    return (bitmap[bit >> 5] >> (bit & 31)) & 1;
+}
+
+static VOID NptDirtyStop(NPT_STATE* State)
+{
+    if (!State->Dirty.Active)
+        return;
+
+    for (ULONG i = 0; i < State->Dirty.PageCount; i++)
+    {
+        UINT64 gpa = State->Dirty.BaseGpa + ((UINT64)i << 12);
+        UINT64 level;
+
+        NPT_ENTRY* pte = NptGetEntry(State, gpa, &level);
+        if (pte && level == 3)
+            pte->Write = 1;
+
+        // Coalesce once per 2MB region (or at the end of the range)
+        if (((gpa >> 12) & 0x1FF) == 0x1FF || i + 1 == State->Dirty.PageCount)
+            NptTryMerge(State, gpa);
+    }
+
+    State->Dirty.Active = FALSE;
+    State->TlbFlushPending = TRUE;
+}
+
+//
+// Write-protect (or clear D on) every page of the range. If the arena runs
+// out part way, the pages already done are put back and the VCPU is left
+// without a session: a partly covered range would silently miss writes.
+//
+static BOOLEAN NptDirtyStart(NPT_STATE* State, UINT64 BaseGpa, ULONG PageCount, ULONG Flags)
+{
+    if (State->Dirty.Active)
+        NptDirtyStop(State);
+
+    State->Dirty.BaseGpa = BaseGpa & ~0xFFFULL;
+    State->Dirty.PageCount = PageCount;
+    State->Dirty.UseDBit = (Flags & NPT_DIRTY_USE_DBIT) != 0;
+    State->Dirty.Current = 0;
+    RtlZeroMemory(State->Dirty.Bitmap[0], NPT_DIRTY_BITMAP_BYTES);
+    RtlZeroMemory(State->Dirty.Bitmap[1], NPT_DIRTY_BITMAP_BYTES);
+
+    for (ULONG i = 0; i < PageCount; i++)
+    {
+        NPT_ENTRY* pte = NptGetPageEntryForWrite(State, State->Dirty.BaseGpa + ((UINT64)i << 12));
+        if (!pte)
+        {
+            // Undo pages [0, i) and coalesce what was split for them
+            State->Dirty.PageCount = i;
+            State->Dirty.Active = TRUE;
+            NptDirtyStop(State);
+
+            InterlockedIncrement(&g_NptDirty.StartFailures);
+            return FALSE;
+        }
+
+        if (State->Dirty.UseDBit)
+            pte->Dirty = 0;
+        else
+            pte->Write = 0;
+    }
+
+    State->Dirty.Active = TRUE;
+    State->TlbFlushPending = TRUE;
+    return TRUE;
+}
+
+static VOID NptDirtyEpoch(NPT_STATE* State)
+{
+    if (!State->Dirty.Active)
+        return;
+
+    PULONG current = State->Dirty.Bitmap[State->Dirty.Current];
+
+    for (ULONG i = 0; i < State->Dirty.PageCount; i++)
+    {
+        if (!State->Dirty.UseDBit && !NptBitTest(current, i))
+            continue;
+
+        NPT_ENTRY* pte = NptGetPageEntryForWrite(State, State->Dirty.BaseGpa + ((UINT64)i << 12));
+        if (!pte)
+            continue;
+
+        if (State->Dirty.UseDBit)
+        {
+            if (pte->Dirty)
+                NptBitSet(current, i);
+            pte->Dirty = 0;
+        }
+        else
+        {
+            pte->Write = 0;
+        }
+    }
+
+    // The previous retired buffer is empty unless no harvest has consumed it
+    // yet; carry those pages forward before it becomes the live buffer
+    PULONG previous = State->Dirty.Bitmap[State->Dirty.Current ^ 1];
+    ULONG words = (State->Dirty.PageCount + 31) / 32;
+
+    for (ULONG w = 0; w < words; w++)
+    {
+        current[w] |= previous[w];
+        previous[w] = 0;
+    }
+
+    // New writes go to the other buffer from here on; 'current' is retired
+    State->Dirty.Current ^= 1;
+    State->TlbFlushPending = TRUE;
+}
+
+//
+// Write NPF on a logged page: record it and hand write access straight back
+//
+BOOLEAN NptHandleDirtyFault(NPT_STATE* State, UINT64 Gpa, UINT64 ErrorCode)
+{
+    if (!State->Dirty.Active || State->Dirty.UseDBit || !(ErrorCode & PAGE_WRITE))
+        return FALSE;
+
+    UINT64 index = (Gpa - State->Dirty.BaseGpa) >> 12;
+    if (Gpa < State->Dirty.BaseGpa || index >= State->Dirty.PageCount)
+        return FALSE;
+
+    NPT_ENTRY* pte = NptGetPageEntryForWrite(State, Gpa);
+    if (!pte || !pte->Present)
+        return FALSE;
+
+    NptBitSet(State->Dirty.Bitmap[State->Dirty.Current], (ULONG)index);
+    pte->Write = 1;
+    State->Dirty.Faults++;
+    return TRUE;
+}
+
+//
+// Accessed-bit working-set sampler
+//
+// Instead of taking faults, the sampler reads and clears NPT_ENTRY.Accessed
+// on whatever leaves already cover the selected ranges (1GB, 2MB or 4KB -
+// nothing is split for it). Each VCPU walks its own hierarchy a few leaves
+// per VMEXIT, so a pass over even a large range never stalls a core. Leaves
+// are privatized first (copy-on-write, as for a hook): clearing A in the
+// shared identity map would steal accesses from every other VCPU.
+//
+// The configuration is copied into each VCPU when its sequence number
+// changes; otherwise the exit path reads only its own state and takes no
+// lock. NptSamplerCollect merges the per-VCPU histograms.
+//
+// At the end of a pass the per-2MB-region counts become the histogram:
+//   Touched = pages found accessed in the last pass (large leaves count all
+//             of their pages), Heat = saturating count of passes in which the
+//             region was touched, decaying when it was not.
+//
+#define NPT_SAMPLE_STEP_LEAVES  64
+#define NPT_SAMPLE_TAG          'SSPN'
+
+static struct
+{
+    HV_SPINLOCK Lock;
+    volatile BOOLEAN Active;
+    volatile ULONG Seq;     // Bumped on every reconfiguration
+    UINT64 PeriodTsc;       // Minimum spacing between pass starts
+    ULONG RangeCount;
+    ULONG BucketCount;
+    NPT_SAMPLE_RANGE Ranges[NPT_SAMPLE_MAX_RANGES];
+} g_NptSampler;
+
+//
+// Take a copy of the configuration and start over; called with the lock held
+//
+static VOID NptSampleReset(NPT_STATE* State)
+{
+    RtlZeroMemory(State->Sampler.Buckets, NPT_SAMPLE_MAX_BUCKETS * sizeof(NPT_SAMPLE_BUCKET));
+    RtlCopyMemory(State->Sampler.Ranges, g_NptSampler.Ranges, sizeof(g_NptSampler.Ranges));
+    State->Sampler.RangeCount = g_NptSampler.RangeCount;
+    State->Sampler.BucketCount = g_NptSampler.BucketCount;
+    State->Sampler.PeriodTsc = g_NptSampler.PeriodTsc;
+    State->Sampler.Seq = g_NptSampler.Seq;
+    State->Sampler.Range = 0;
+    State->Sampler.Cursor = g_NptSampler.RangeCount ? g_NptSampler.Ranges[0].BaseGpa : 0;
+    State->Sampler.NextPassTsc = 0;
+    State->Sampler.Passes = 0;
+}
+
+static VOID NptSampleFinishPass(NPT_STATE* State)
+{
+    for (ULONG i = 0; i < State->Sampler.BucketCount; i++)
+    {
+        NPT_SAMPLE_BUCKET* b = &State->Sampler.Buckets[i];
+
+        b->Touched = b->Accum;
+        if (b->Accum)
+            b->Heat = (b->Heat < 0xFF) ? b->Heat + 1 : 0xFF;
+        else
+            b->Heat -= (b->Heat + 7) >> 3;
+        b->Accum = 0;
+    }
+
+    State->Sampler.Passes++;
+    State->Sampler.Range = 0;
+    State->Sampler.Cursor = State->Sampler.Ranges[0].BaseGpa;
+    State->Sampler.NextPassTsc = __rdtsc() + State->Sampler.PeriodTsc;
+
+    // Cached translations would hide re-accesses from the next pass
+    State->TlbFlushPending = TRUE;
+}
+
+//
+// Credit 'pages' accessed pages at [gpa, gpa + size) clipped to the range
+//
+static VOID NptSampleCredit(NPT_STATE* State, ULONG range, UINT64 gpa, UINT64 size)
+{
+    const NPT_SAMPLE_RANGE* r = &State->Sampler.Ranges[range];
+    UINT64 start = max(gpa, r->BaseGpa);
+    UINT64 end = min(gpa + size, r->EndGpa);
+    UINT64 baseRegion = r->BaseGpa >> 21;
+
+    while (start < end)
+    {
+        UINT64 regionEnd = (start | 0x1FFFFFULL) + 1;
+        UINT64 chunkEnd = min(regionEnd, end);
+
+        NPT_SAMPLE_BUCKET* b = &State->Sampler.Buckets[r->FirstBucket + ((start >> 21) - baseRegion)];
+        b->Accum += (UINT16)((chunkEnd - start) >> 12);
+
+        start = chunkEnd;
+    }
+}
+
+//
+// Called at the end of every VMEXIT; visits at most NPT_SAMPLE_STEP_LEAVES
+// leaves and returns
+//
+VOID NptSampleStep(NPT_STATE* State)
+{
+    if (!g_NptSampler.Active || !State->Sampler.Buckets)
+        return;
+
+    // Reconfigured: pick up the new ranges (or try again on a later exit)
+    if (State->Sampler.Seq != g_NptSampler.Seq)
+    {
+        if (!HvSpinLockTryAcquire(&g_NptSampler.Lock))
+            return;
+
+        NptSampleReset(State);
+        HvSpinLockRelease(&g_NptSampler.Lock);
+    }
+
+    if (!State->Sampler.RangeCount)
+        return;
+
+    if (State->Sampler.NextPassTsc && __rdtsc() < State->Sampler.NextPassTsc)
+        return;
+    State->Sampler.NextPassTsc = 0;
+
+    for (ULONG visited = 0; visited < NPT_SAMPLE_STEP_LEAVES; visited++)
+    {
+        ULONG range = State->Sampler.Range;
+        UINT64 gpa = State->Sampler.Cursor;
+
+        if (gpa >= State->Sampler.Ranges[range].EndGpa)
+        {
+            if (++State->Sampler.Range >= State->Sampler.RangeCount)
+            {
+                NptSampleFinishPass(State);
+                break;
+            }
+
+            State->Sampler.Cursor = State->Sampler.Ranges[State->Sampler.Range].BaseGpa;
+            continue;
+        }
+
+        // Private leaf, cloned out of the shared map on the first visit
+        UINT64 level = 3;
+        NPT_ENTRY* leaf = NptGetEntryForWrite(State, gpa, &level);
+
+        // Span of the leaf, or of the hole the walk stopped at: 0 = 512GB,
+        // 1 = 1GB, 2 = 2MB, 3 = 4KB (also the step when the arena is empty)
+        UINT64 size = 1ULL << (39 - 9 * level);
+        UINT64 base = gpa & ~(size - 1);
+
+        if (leaf && leaf->Present && leaf->Accessed)
+        {
+            leaf->Accessed = 0;
+            NptSampleCredit(State, range, base, size);
+        }
+
+        State->Sampler.Cursor = base + size;
+    }
+}
+
+NTSTATUS NptSamplerAddRange(UINT64 BaseGpa, UINT64 PageCount)
+{
+    UINT64 base = BaseGpa & ~0xFFFULL;
+
+    // Both come from the guest: bound the size before any arithmetic on it
+    if (!PageCount || PageCount > (UINT64)NPT_SAMPLE_MAX_BUCKETS * 512)
+        return STATUS_INVALID_PARAMETER;
+
+    UINT64 end = base + (PageCount << 12);
+    if (end < base || end > ~0x1FFFFFULL)
+        return STATUS_INVALID_PARAMETER;
+
+    UINT64 buckets = ((end + 0x1FFFFFULL) >> 21) - (base >> 21);
 
-    if ((gpa & ~0xFFFULL) != (entry->PageFrame << 12) && entry->Present)
+    HvSpinLockAcquire(&g_NptSampler.Lock);
+
+    if (g_NptSampler.RangeCount >= NPT_SAMPLE_MAX_RANGES ||
+        g_NptSampler.BucketCount + buckets > NPT_SAMPLE_MAX_BUCKETS)
     {
-       
-        return FALSE;
+        HvSpinLockRelease(&g_NptSampler.Lock);
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    if (!*usingFake)
+    ULONG i = g_NptSampler.RangeCount++;
+    g_NptSampler.Ranges[i].BaseGpa = base;
+    g_NptSampler.Ranges[i].EndGpa = end;
+    g_NptSampler.Ranges[i].FirstBucket = g_NptSampler.BucketCount;
+    g_NptSampler.BucketCount += (ULONG)buckets;
+    g_NptSampler.Seq++;
+
+    HvSpinLockRelease(&g_NptSampler.Lock);
+    return STATUS_SUCCESS;
+}
+
+VOID NptSamplerControl(BOOLEAN Enable, UINT64 PeriodTsc)
+{
+    HvSpinLockAcquire(&g_NptSampler.Lock);
+
+    if (Enable)
     {
-        *usingFake = NptPromoteTrapToFake(State, entry);
-        *armed = FALSE;
-        if (mailboxValue)
-            *mailboxValue = gpa;
-        return *usingFake;
+        g_NptSampler.PeriodTsc = PeriodTsc;
+        g_NptSampler.Active = TRUE;
     }
+    else
+    {
+        g_NptSampler.Active = FALSE;
+        g_NptSampler.RangeCount = 0;
+        g_NptSampler.BucketCount = 0;
+    }
+    g_NptSampler.Seq++;
 
-    return FALSE;
+    HvSpinLockRelease(&g_NptSampler.Lock);
 }
 
-BOOLEAN NptSetupHardwareTriggers(NPT_STATE* State, UINT64 apicGpa, UINT64 acpiGpa, UINT64 smmGpa, UINT64 mmioGpa)
+//
+// Histogram across all VCPUs: a region is as hot as its hottest VCPU says.
+// Copies regions [First, First + MaxBuckets) and returns how many exist.
+//
+ULONG NptSamplerCollect(NPT_SAMPLE_BUCKET* Out, ULONG First, ULONG MaxBuckets, ULONG* Passes)
 {
-    UINT64 level;
+    HvSpinLockAcquire(&g_NptSampler.Lock);
 
-    NPT_ENTRY* apic = NptGetEntry(State, apicGpa, &level);
-    NPT_ENTRY* acpi = NptGetEntry(State, acpiGpa, &level);
-    NPT_ENTRY* smm = NptGetEntry(State, smmGpa, &level);
-    NPT_ENTRY* mmio = NptGetEntry(State, mmioGpa, &level);
+    ULONG count = 0;
+    if (First < g_NptSampler.BucketCount)
+        count = min(g_NptSampler.BucketCount - First, MaxBuckets);
 
-    BOOLEAN ok = TRUE;
-    ok &= NptArmTrap(State, apicGpa, apic, &State->Apic.OriginalPageFrame, &State->Apic.Armed);
-    ok &= NptArmTrap(State, acpiGpa, acpi, &State->Acpi.OriginalPageFrame, &State->Acpi.Armed);
-    ok &= NptArmTrap(State, smmGpa, smm, &State->Smm.OriginalPageFrame, &State->Smm.Armed);
-    ok &= NptArmTrap(State, mmioGpa, mmio, &State->Mmio.OriginalPageFrame, &State->Mmio.Armed);
+    RtlZeroMemory(Out, count * sizeof(NPT_SAMPLE_BUCKET));
+    *Passes = 0;
 
-    State->Apic.GpaPage = apicGpa & ~0xFFFULL;
-    State->Acpi.GpaPage = acpiGpa & ~0xFFFULL;
-    State->Smm.GpaPage = smmGpa & ~0xFFFULL;
-    State->Mmio.GpaPage = mmioGpa & ~0xFFFULL;
+    for (ULONG v = 0; v < SmpGetVcpuCount(); v++)
+    {
+        VCPU* vcpu = SmpGetVcpu(v);
+        if (!vcpu || !vcpu->Npt.Sampler.Buckets || vcpu->Npt.Sampler.Seq != g_NptSampler.Seq)
+            continue;
 
-    State->Apic.UsingFakePage = FALSE;
-    State->Acpi.UsingFakePage = FALSE;
-    State->Smm.UsingFakePage = FALSE;
-    State->Mmio.UsingFakePage = FALSE;
+        for (ULONG i = 0; i < count; i++)
+        {
+            NPT_SAMPLE_BUCKET* b = &vcpu->Npt.Sampler.Buckets[First + i];
+            Out[i].Touched = max(Out[i].Touched, b->Touched);
+            Out[i].Heat = max(Out[i].Heat, b->Heat);
+        }
 
-    State->Mailbox.GpaPage = apicGpa & ~0xFFFULL;
-    State->Mailbox.Active = TRUE;
-    State->Mailbox.LastMessage = 0;
+        *Passes = max(*Passes, vcpu->Npt.Sampler.Passes);
+    }
+
+    HvSpinLockRelease(&g_NptSampler.Lock);
+    return count;
+}
+
+//
+// Cross-VCPU change propagation
+//
+// Every VCPU owns its NPT, so a hook has to be applied once per VCPU. A
+// hypercall on any core publishes the change into a global journal and bumps
+// the NPT generation; each VCPU compares its synced generation against the
+// global one at the end of every VMEXIT and replays what it missed, with one
+// ASID flush (TlbControl = 3) per batch. Remote cores are kicked with an NMI
+// when the change has to be visible now (SmpKickOthers).
+//
+// The journal lock only covers copying records out of the ring; they are
+// applied after it is dropped (NPT_SYNC_BATCH at a time), since one record
+// can be as expensive as a dirty-log start over NPT_DIRTY_MAX_PAGES pages.
+//
+// If a VCPU falls more than NPT_JOURNAL_SIZE records behind it rebuilds its
+// hook set and dirty-log state from the authoritative global copies instead.
+//
+#define NPT_JOURNAL_SIZE 1024
+#define NPT_SYNC_BATCH   16
+
+typedef enum _NPT_CHANGE_TYPE
+{
+    NptChangeHookAdd = 1,
+    NptChangeHookRemove,
+    NptChangeHookClear,
+    NptChangeDirtyStart,
+    NptChangeDirtyStop,
+    NptChangeDirtyEpoch,
+} NPT_CHANGE_TYPE;
+
+typedef struct _NPT_CHANGE
+{
+    UINT64 Generation;
+    UINT64 Gpa;
+    UINT64 Hpa;
+    UINT64 PublishTsc;
+    ULONG Type;
+    ULONG Acks;         // VCPUs that have applied this record
+    ULONG Flags;
+} NPT_CHANGE;
+
+static struct
+{
+    HV_SPINLOCK Lock;
+    volatile LONG64 Generation;
+    PAGE_MAP Hooks;     // Authoritative hook set, for resync
+    NPT_CHANGE Ring[NPT_JOURNAL_SIZE];
+
+    // Publish -> applied on every VCPU, in TSC ticks
+    UINT64 LastVisibleTicks;
+    UINT64 MaxVisibleTicks;
+    ULONG Resyncs;
+} g_NptJournal;
+
+static UINT64 NptJournalAppend(NPT_CHANGE_TYPE Type, UINT64 Gpa, UINT64 Hpa)
+{
+    UINT64 gen = (UINT64)g_NptJournal.Generation + 1;
+    NPT_CHANGE* rec = &g_NptJournal.Ring[gen & (NPT_JOURNAL_SIZE - 1)];
+
+    rec->Generation = gen;
+    rec->Type = Type;
+    rec->Gpa = Gpa & ~0xFFFULL;
+    rec->Hpa = Hpa & ~0xFFFULL;
+    rec->Acks = 0;
+    rec->Flags = 0;
+    rec->PublishTsc = __rdtsc();
+
+    // Record is complete before the generation makes it visible
+    InterlockedExchange64(&g_NptJournal.Generation, (LONG64)gen);
+    return gen;
+}
+
+BOOLEAN NptPublishHook(UINT64 TargetGpa, UINT64 NewHpa)
+{
+    HvSpinLockAcquire(&g_NptJournal.Lock);
+
+    BOOLEAN ok = PageMapInsert(&g_NptJournal.Hooks, TargetGpa, NewHpa & ~0xFFFULL);
+    if (ok)
+        NptJournalAppend(NptChangeHookAdd, TargetGpa, NewHpa);
 
+    HvSpinLockRelease(&g_NptJournal.Lock);
     return ok;
 }
 
-BOOLEAN NptHandleHardwareTriggers(NPT_STATE* State, UINT64 faultGpa, UINT64* mailboxValue)
+BOOLEAN NptPublishUnhook(UINT64 TargetGpa)
 {
-    UINT64 level;
+    HvSpinLockAcquire(&g_NptJournal.Lock);
 
-    NPT_ENTRY* apic = NptGetEntry(State, State->Apic.GpaPage, &level);
-    NPT_ENTRY* acpi = NptGetEntry(State, State->Acpi.GpaPage, &level);
-    NPT_ENTRY* smm = NptGetEntry(State, State->Smm.GpaPage, &level);
-    NPT_ENTRY* mmio = NptGetEntry(State, State->Mmio.GpaPage, &level);
+    BOOLEAN ok = PageMapRemove(&g_NptJournal.Hooks, TargetGpa, NULL);
+    if (ok)
+        NptJournalAppend(NptChangeHookRemove, TargetGpa, 0);
 
-    if (NptHandleSingleTrigger(State, faultGpa, apic, &State->Apic.OriginalPageFrame, &State->Apic.Armed, &State->Apic.UsingFakePage, mailboxValue))
-        return TRUE;
-    if (NptHandleSingleTrigger(State, faultGpa, acpi, &State->Acpi.OriginalPageFrame, &State->Acpi.Armed, &State->Acpi.UsingFakePage, mailboxValue))
-        return TRUE;
-    if (NptHandleSingleTrigger(State, faultGpa, smm, &State->Smm.OriginalPageFrame, &State->Smm.Armed, &State->Smm.UsingFakePage, mailboxValue))
-        return TRUE;
-    if (NptHandleSingleTrigger(State, faultGpa, mmio, &State->Mmio.OriginalPageFrame, &State->Mmio.Armed, &State->Mmio.UsingFakePage, mailboxValue))
-        return TRUE;
+    HvSpinLockRelease(&g_NptJournal.Lock);
+    return ok;
+}
 
-    return FALSE;
+VOID NptPublishClearHooks(VOID)
+{
+    HvSpinLockAcquire(&g_NptJournal.Lock);
+
+    PageMapClear(&g_NptJournal.Hooks);
+    NptJournalAppend(NptChangeHookClear, 0, 0);
+
+    HvSpinLockRelease(&g_NptJournal.Lock);
 }
 
-VOID NptRearmHardwareTriggers(NPT_STATE* State)
+static VOID NptApplyChange(NPT_STATE* State, NPT_CHANGE* rec)
 {
-    UINT64 level;
-    NPT_ENTRY* apic = NptGetEntry(State, State->Apic.GpaPage, &level);
-    NPT_ENTRY* acpi = NptGetEntry(State, State->Acpi.GpaPage, &level);
-    NPT_ENTRY* smm = NptGetEntry(State, State->Smm.GpaPage, &level);
-    NPT_ENTRY* mmio = NptGetEntry(State, State->Mmio.GpaPage, &level);
+    switch (rec->Type)
+    {
+    case NptChangeHookAdd:
+        if (!NptAddShadowHook(State, rec->Gpa, rec->Hpa))
+            State->SyncFailures++;
+        break;
+
+    case NptChangeHookRemove:
+        NptRemoveShadowHook(State, rec->Gpa);
+        break;
+
+    case NptChangeHookClear:
+        NptClearShadowHooks(State);
+        break;
+
+    case NptChangeDirtyStart:
+        NptDirtyStart(State, rec->Gpa, (ULONG)rec->Hpa, rec->Flags);
+        break;
+
+    case NptChangeDirtyStop:
+        NptDirtyStop(State);
+        break;
+
+    case NptChangeDirtyEpoch:
+        NptDirtyEpoch(State);
+        break;
+    }
+}
 
-    if (State->Apic.UsingFakePage)
+//
+// Rebuild from the global state as of one generation: the dirty-log settings
+// and the hook map are snapshotted under the journal lock (the map a batch at
+// a time) and applied outside it. A change published meanwhile has a newer
+// generation and is replayed by the caller afterwards, so an entry the scan
+// misses or sees stale is corrected then. Slots only move when the map is
+// rehashed; the scan starts over if that happens between batches, so nothing
+// that was there all along is skipped (re-adding a hook is harmless).
+//
+static VOID NptResync(NPT_STATE* State)
+{
+    struct { UINT64 Gpa; UINT64 Hpa; } hooks[NPT_SYNC_BATCH];
+    ULONG cursor = 0, count, rehashes = 0;
+
+    HvSpinLockAcquire(&g_NptJournal.Lock);
+
+    UINT64 gen = (UINT64)g_NptJournal.Generation;
+    rehashes = g_NptJournal.Hooks.Rehashes;
+    BOOLEAN dirtyActive = g_NptDirty.Active;
+    UINT64 dirtyBase = g_NptDirty.BaseGpa;
+    ULONG dirtyPages = g_NptDirty.PageCount;
+    ULONG dirtyFlags = g_NptDirty.Flags;
+    g_NptJournal.Resyncs++;
+
+    HvSpinLockRelease(&g_NptJournal.Lock);
+
+    // Dirty logging: keep a matching session (its bitmaps hold unharvested
+    // writes), otherwise start or stop to match the global one
+    if (!dirtyActive)
     {
-        if (apic)
-        {
-            apic->PageFrame = State->Apic.OriginalPageFrame;
-            apic->Present = 0;
-        }
-        State->Apic.UsingFakePage = FALSE;
-        State->Apic.Armed = TRUE;
+        NptDirtyStop(State);
+    }
+    else if (!State->Dirty.Active || State->Dirty.BaseGpa != dirtyBase ||
+             State->Dirty.PageCount != dirtyPages ||
+             State->Dirty.UseDBit != ((dirtyFlags & NPT_DIRTY_USE_DBIT) != 0))
+    {
+        NptDirtyStart(State, dirtyBase, dirtyPages, dirtyFlags);
     }
 
-    if (State->Acpi.UsingFakePage)
+    NptClearShadowHooks(State);
+
+    do
     {
-        if (acpi)
+        count = 0;
+
+        HvSpinLockAcquire(&g_NptJournal.Lock);
+        if (g_NptJournal.Hooks.Rehashes != rehashes)
         {
-            acpi->PageFrame = State->Acpi.OriginalPageFrame;
-            acpi->Present = 0;
+            rehashes = g_NptJournal.Hooks.Rehashes;
+            cursor = 0;
         }
-        State->Acpi.UsingFakePage = FALSE;
-        State->Acpi.Armed = TRUE;
-    }
 
-    if (State->Smm.UsingFakePage)
-    {
-        if (smm)
+        while (count < NPT_SYNC_BATCH &&
+               PageMapNext(&g_NptJournal.Hooks, &cursor, &hooks[count].Gpa, &hooks[count].Hpa))
+            count++;
+        HvSpinLockRelease(&g_NptJournal.Lock);
+
+        for (ULONG i = 0; i < count; i++)
         {
-            smm->PageFrame = State->Smm.OriginalPageFrame;
-            smm->Present = 0;
+            if (!NptAddShadowHook(State, hooks[i].Gpa, hooks[i].Hpa))
+                State->SyncFailures++;
         }
-        State->Smm.UsingFakePage = FALSE;
-        State->Smm.Armed = TRUE;
-    }
+    } while (count == NPT_SYNC_BATCH);
+
+    State->SyncedGeneration = gen;
+}
+
+//
+// Count this VCPU as having applied (first, last]; called with the journal
+// lock held. Records the ring has already reused are skipped.
+//
+static VOID NptAckChanges(UINT64 first, UINT64 last, UINT64 now)
+{
+    ULONG vcpus = SmpGetVcpuCount();
 
-    if (State->Mmio.UsingFakePage)
+    for (UINT64 gen = first + 1; gen <= last; gen++)
     {
-        if (mmio)
+        NPT_CHANGE* rec = &g_NptJournal.Ring[gen & (NPT_JOURNAL_SIZE - 1)];
+        if (rec->Generation != gen)
+            continue;
+
+        // Last VCPU to apply a record closes its visibility window
+        if (++rec->Acks == vcpus)
         {
-            mmio->PageFrame = State->Mmio.OriginalPageFrame;
-            mmio->Present = 0;
+            UINT64 ticks = now - rec->PublishTsc;
+            g_NptJournal.LastVisibleTicks = ticks;
+            if (ticks > g_NptJournal.MaxVisibleTicks)
+                g_NptJournal.MaxVisibleTicks = ticks;
         }
-        State->Mmio.UsingFakePage = FALSE;
-        State->Mmio.Armed = TRUE;
     }
 }
 
-BOOLEAN NptInstallShadowHook(NPT_STATE* State, UINT64 TargetGpa, UINT64 NewHpa)
+//
+// Called at the end of every VMEXIT. The common case is one compare.
+//
+BOOLEAN NptSyncChanges(NPT_STATE* State)
 {
-    if (!State)
+    NPT_CHANGE batch[NPT_SYNC_BATCH];
+    UINT64 acked = State->SyncedGeneration;
+
+    if ((UINT64)g_NptJournal.Generation == State->SyncedGeneration)
         return FALSE;
 
-    State->ShadowHook.TargetGpaPage = TargetGpa & ~0xFFFULL;
-    State->ShadowHook.NewHpaPage = NewHpa & ~0xFFFULL;
-    State->ShadowHook.Active = TRUE;
-    
-    // Mark that TLB needs flushing on next VMRUN
-    // The VMCB TlbControl field will be set by the caller or VMEXIT handler
-    // NOTE: For proper multi-core support, an IPI should be sent to all cores
-    // to flush their TLBs. For now, we rely on the ASID/TLB control mechanism.
+    for (;;)
+    {
+        UINT64 from = State->SyncedGeneration;
+        ULONG count = 0;
+
+        HvSpinLockAcquire(&g_NptJournal.Lock);
+
+        // Acknowledge the batch applied on the previous pass
+        NptAckChanges(acked, from, __rdtsc());
+        acked = from;
+
+        UINT64 target = (UINT64)g_NptJournal.Generation;
+        if (target == from)
+        {
+            HvSpinLockRelease(&g_NptJournal.Lock);
+            break;
+        }
+
+        if (target - from > NPT_JOURNAL_SIZE)
+        {
+            HvSpinLockRelease(&g_NptJournal.Lock);
+
+            // Resynced state is not acknowledged record by record
+            NptResync(State);
+            acked = State->SyncedGeneration;
+            continue;
+        }
+
+        // Within NPT_JOURNAL_SIZE of the head, so the ring still holds these
+        while (count < NPT_SYNC_BATCH && from + count < target)
+        {
+            batch[count] = g_NptJournal.Ring[(from + count + 1) & (NPT_JOURNAL_SIZE - 1)];
+            count++;
+        }
+
+        HvSpinLockRelease(&g_NptJournal.Lock);
+
+        for (ULONG i = 0; i < count; i++)
+            NptApplyChange(State, &batch[i]);
+
+        // Progress is visible to NptWaitForGeneration batch by batch
+        *(volatile UINT64*)&State->SyncedGeneration = from + count;
+    }
+
+    // One ASID flush for the whole batch
     State->TlbFlushPending = TRUE;
-    
     return TRUE;
 }
 
-VOID NptClearShadowHook(NPT_STATE* State)
+VOID NptQuerySyncStats(NPT_SYNC_STATS* Stats)
 {
-    if (!State)
-        return;
+    Stats->Generation = (UINT64)g_NptJournal.Generation;
+    Stats->LastVisibleTicks = g_NptJournal.LastVisibleTicks;
+    Stats->MaxVisibleTicks = g_NptJournal.MaxVisibleTicks;
+    Stats->Resyncs = g_NptJournal.Resyncs;
+    Stats->Kicks = SmpQueryKicks();
+}
 
-    State->ShadowHook.Active = FALSE;
-    State->ShadowHook.TargetGpaPage = 0;
-    State->ShadowHook.NewHpaPage = 0;
-    
-    // Mark TLB flush needed to restore original mappings
-    State->TlbFlushPending = TRUE;
+//
+// Wait (bounded) for every VCPU to replay up to 'gen'; they are being kicked
+//
+static VOID NptWaitForGeneration(UINT64 gen)
+{
+    UINT64 deadline = __rdtsc() + NPT_DIRTY_SYNC_TIMEOUT_TSC;
+    ULONG count = SmpGetVcpuCount();
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        VCPU* vcpu = SmpGetVcpu(i);
+        if (!vcpu)
+            continue;
+
+        while (*(volatile UINT64*)&vcpu->Npt.SyncedGeneration < gen && __rdtsc() < deadline)
+            _mm_pause();
+    }
 }
 
-static UINT64 NptGetMaxPhysicalAddress()
+NTSTATUS NptDirtyLogStart(NPT_STATE* Self, ULONG SelfIndex, UINT64 BaseGpa, ULONG PageCount, ULONG Flags)
 {
-    UINT64 maxPa = 0;
+    if (!PageCount || PageCount > NPT_DIRTY_MAX_PAGES || !g_NptDirty.Harvest)
+        return STATUS_INVALID_PARAMETER;
 
-    PPHYSICAL_MEMORY_RANGE ranges = MmGetPhysicalMemoryRanges();
-    if (!ranges)
+    if (!HvSpinLockTryAcquire(&g_NptDirty.Lock))
+        return STATUS_DEVICE_BUSY;
+
+    LONG failures = g_NptDirty.StartFailures;
+
+    // Settings change under the journal lock with the record, so a resync
+    // sees them consistent with the generation it snapshots
+    HvSpinLockAcquire(&g_NptJournal.Lock);
+
+    g_NptDirty.BaseGpa = BaseGpa & ~0xFFFULL;
+    g_NptDirty.PageCount = PageCount;
+    g_NptDirty.Flags = Flags;
+    g_NptDirty.Active = TRUE;
+
+    UINT64 gen = NptJournalAppend(NptChangeDirtyStart, BaseGpa, PageCount);
+    g_NptJournal.Ring[gen & (NPT_JOURNAL_SIZE - 1)].Flags = Flags;
+    HvSpinLockRelease(&g_NptJournal.Lock);
+
+    SmpKickOthers(SelfIndex);
+    NptSyncChanges(Self);
+    NptWaitForGeneration(gen);
+
+    // Logging is all or nothing: if any VCPU could not cover the range, take
+    // the session down everywhere rather than report an incomplete bitmap
+    if (g_NptDirty.StartFailures != failures)
+    {
+        HvSpinLockAcquire(&g_NptJournal.Lock);
+        g_NptDirty.Active = FALSE;
+        NptJournalAppend(NptChangeDirtyStop, 0, 0);
+        HvSpinLockRelease(&g_NptJournal.Lock);
+
+        SmpKickOthers(SelfIndex);
+        NptSyncChanges(Self);
+
+        HvSpinLockRelease(&g_NptDirty.Lock);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    HvSpinLockRelease(&g_NptDirty.Lock);
+    return STATUS_SUCCESS;
+}
+
+VOID NptDirtyLogStop(NPT_STATE* Self, ULONG SelfIndex)
+{
+    HvSpinLockAcquire(&g_NptDirty.Lock);
+
+    if (g_NptDirty.Active)
+    {
+        HvSpinLockAcquire(&g_NptJournal.Lock);
+        g_NptDirty.Active = FALSE;
+        NptJournalAppend(NptChangeDirtyStop, 0, 0);
+        HvSpinLockRelease(&g_NptJournal.Lock);
+
+        SmpKickOthers(SelfIndex);
+        NptSyncChanges(Self);
+    }
+
+    HvSpinLockRelease(&g_NptDirty.Lock);
+}
+
+//
+// Close the current epoch on every VCPU and return the union of the pages
+// written during it. VCPUs that do not reach the boundary in time keep their
+// writes, and the boundary carries them forward when they do reach it, so
+// those pages show up in the next harvest.
+//
+ULONG NptDirtyLogHarvest(NPT_STATE* Self, ULONG SelfIndex, PULONG* Bitmap, ULONG* PageCount)
+{
+    *Bitmap = NULL;
+    *PageCount = 0;
+
+    if (!HvSpinLockTryAcquire(&g_NptDirty.Lock))
         return 0;
 
-    for (PPHYSICAL_MEMORY_RANGE r = ranges; r->BaseAddress.QuadPart || r->NumberOfBytes.QuadPart; r++)
+    if (!g_NptDirty.Active)
     {
-        UINT64 end = r->BaseAddress.QuadPart + r->NumberOfBytes.QuadPart;
-        if (end > maxPa)
-            maxPa = end;
+        HvSpinLockRelease(&g_NptDirty.Lock);
+        return 0;
     }
 
-    ExFreePool(ranges);
-    return maxPa;
+    HvSpinLockAcquire(&g_NptJournal.Lock);
+    UINT64 gen = NptJournalAppend(NptChangeDirtyEpoch, 0, 0);
+    HvSpinLockRelease(&g_NptJournal.Lock);
+
+    SmpKickOthers(SelfIndex);
+    NptSyncChanges(Self);
+    NptWaitForGeneration(gen);
+
+    ULONG words = (g_NptDirty.PageCount + 31) / 32;
+    RtlZeroMemory(g_NptDirty.Harvest, NPT_DIRTY_BITMAP_BYTES);
+    g_NptDirty.Stragglers = 0;
+
+    for (ULONG v = 0; v < SmpGetVcpuCount(); v++)
+    {
+        VCPU* vcpu = SmpGetVcpu(v);
+        if (!vcpu)
+            continue;
+
+        if (*(volatile UINT64*)&vcpu->Npt.SyncedGeneration < gen)
+        {
+            g_NptDirty.Stragglers++;
+            continue;
+        }
+
+        // The owner only touches the retired buffer again at the next epoch,
+        // which cannot be published while we hold the dirty-log lock
+        PULONG retired = vcpu->Npt.Dirty.Bitmap[vcpu->Npt.Dirty.Current ^ 1];
+        for (ULONG w = 0; w < words; w++)
+        {
+            g_NptDirty.Harvest[w] |= retired[w];
+            retired[w] = 0;
+        }
+    }
+
+    ULONG dirty = 0;
+    for (ULONG w = 0; w < words; w++)
+        dirty += __popcnt(g_NptDirty.Harvest[w]);
+
+    *Bitmap = g_NptDirty.Harvest;
+    *PageCount = g_NptDirty.PageCount;
+
+    // Caller copies the bitmap out and then drops the lock
+    return dirty;
+}
+
+VOID NptDirtyLogHarvestDone(VOID)
+{
+    HvSpinLockRelease(&g_NptDirty.Lock);
+}
+
+VOID NptQueryDirtyStats(NPT_STATE* State, NPT_DIRTY_STATS* Stats)
+{
+    Stats->Active = g_NptDirty.Active;
+    Stats->PageCount = g_NptDirty.PageCount;
+    Stats->Faults = State->Dirty.Faults;
+    Stats->Stragglers = g_NptDirty.Stragglers;
+    Stats->StartFailures = (ULONG)g_NptDirty.StartFailures;
+}
+
+//
+// Call this ONCE from DriverEntry before any SmpInitialize
+//
+NTSTATUS NptGlobalInit(VOID)
+{
+    NptIndexFreeNode(&g_NptIndexRoot, 0);
+    g_NptIndexNodes = 0;
+    g_NptIndexEntries = 0;
+    RtlZeroMemory(&g_NptShared, sizeof(g_NptShared));
+    RtlZeroMemory(&g_NptJournal, sizeof(g_NptJournal));
+
+    RtlZeroMemory(&g_NptDirty, sizeof(g_NptDirty));
+    RtlZeroMemory(&g_NptSampler, sizeof(g_NptSampler));
+
+    NTSTATUS st = NptSharedIdentityBuild();
+    if (NT_SUCCESS(st))
+        st = PageMapInit(&g_NptJournal.Hooks, NPT_HOOK_CAPACITY);
+
+    if (NT_SUCCESS(st))
+    {
+        g_NptDirty.Harvest = ExAllocatePoolWithTag(NonPagedPoolNx, NPT_DIRTY_BITMAP_BYTES, NPT_DIRTY_TAG);
+        if (!g_NptDirty.Harvest)
+            st = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (!NT_SUCCESS(st))
+    {
+        NptGlobalDestroy();
+        return st;
+    }
+
+    DbgPrint("SVM-HV: NPT global state initialized\n");
+    return STATUS_SUCCESS;
+}
+
+//
+// Call this from DriverUnload after every VCPU has been torn down
+//
+VOID NptGlobalDestroy(VOID)
+{
+    if (g_NptDirty.Harvest)
+        ExFreePoolWithTag(g_NptDirty.Harvest, NPT_DIRTY_TAG);
+    g_NptDirty.Harvest = NULL;
+
+    PageMapDestroy(&g_NptJournal.Hooks);
+    NptSharedIdentityDestroy();
+    NptIndexFreeNode(&g_NptIndexRoot, 0);
+    g_NptIndexNodes = 0;
+    g_NptIndexEntries = 0;
 }
 
+VOID NptReportSharing(ULONG VcpuCount)
+{
+    if (!VcpuCount)
+        return;
+
+    //
+    // Compare against the old per-VCPU identity map (a PML4 plus 512 PDPTs
+    // each) rather than against the shared block alone: every VCPU still
+    // reserves its arena, and its PML4 clone comes out of that arena
+    //
+    UINT64 sharedKb = g_NptShared.Bytes / 1024;
+    UINT64 arenaKb = (UINT64)NPT_ARENA_PAGES * PAGE_SIZE / 1024;
+    UINT64 baselineKb = (UINT64)VcpuCount * (1 + 512) * PAGE_SIZE / 1024;
+    UINT64 currentKb = sharedKb + (UINT64)VcpuCount * arenaKb;
+
+    DbgPrint("SVM-HV: NPT memory for %lu VCPUs: %llu KB shared + %llu KB arena per VCPU = %llu KB\n",
+             VcpuCount, sharedKb, arenaKb, currentKb);
+
+    if (currentKb <= baselineKb)
+        DbgPrint("SVM-HV: NPT memory: %llu KB saved against %llu KB of per-VCPU identity maps\n",
+                 baselineKb - currentKb, baselineKb);
+    else
+        DbgPrint("SVM-HV: NPT memory: %llu KB more than %llu KB of per-VCPU identity maps\n",
+                 currentKb - baselineKb, baselineKb);
+}
 
+//
+// On failure everything allocated so far is released here and State is left
+// zeroed, so the caller's NptDestroy has nothing left to do
+//
 NTSTATUS NptInitialize(NPT_STATE* State)
 {
+    NTSTATUS st;
+
     if (!State) return STATUS_INVALID_PARAMETER;
     RtlZeroMemory(State, sizeof(*State));
 
-    // Initialize spinlock for table map
-    NptInitTableLock();
+    if (!g_NptShared.Pml4)
+        return HV_STATUS_NPT_PML4;
 
     // Allocate fake pages (for hardware trigger traps)
     for (ULONG i = 0; i < 2; i++)
@@ -585,98 +2246,83 @@ NTSTATUS NptInitialize(NPT_STATE* State)
         if (!State->FakePageVa[i])
         {
             DbgPrint("SVM-HV: NPT fake page alloc failed (slot=%lu)\n", i);
-            return HV_STATUS_NPT_FAKEPAGE;
+            st = HV_STATUS_NPT_FAKEPAGE;
+            goto fail;
         }
 
         RtlZeroMemory(State->FakePageVa[i], PAGE_SIZE);
         State->FakePagePa[i] = MmGetPhysicalAddress(State->FakePageVa[i]);
     }
 
-    // ==========================================================================
-    // SIMPLE 1GB PAGE IDENTITY MAPPING (like reference project)
-    // This covers the ENTIRE 512GB address space using 1GB huge pages
-    // No need for complex per-range mapping - just identity map everything
-    // ==========================================================================
-    
-    DbgPrint("SVM-HV: Using 1GB huge page NPT for full identity mapping\n");
-    
-    // Allocate PML4 (512 entries)
-    PHYSICAL_ADDRESS low = { 0 };
-    PHYSICAL_ADDRESS high = { .QuadPart = ~0ULL };
-    PHYSICAL_ADDRESS skip = { 0 };
-    
-    NPT_ENTRY* pml4 = MmAllocateContiguousMemorySpecifyCache(
-        sizeof(NPT_ENTRY) * 512, low, high, skip, MmCached);
-    if (!pml4)
+    // Reserve the table arena up front so every table this VCPU will ever
+    // own (cloned PML4/PDPTs, split PDs and PTs) comes from memory we hold
+    st = NptArenaInit(&State->Arena, NPT_ARENA_PAGES);
+    if (!NT_SUCCESS(st))
+        goto fail;
+
+    st = PageMapInit(&State->Hooks, NPT_HOOK_CAPACITY);
+    if (!NT_SUCCESS(st))
+        goto fail;
+
+    st = PageMapInit(&State->TrapIndex, NPT_TRAP_CAPACITY);
+    if (!NT_SUCCESS(st))
+        goto fail;
+
+    st = STATUS_INSUFFICIENT_RESOURCES;
+
+    State->Traps = ExAllocatePoolWithTag(NonPagedPoolNx, NPT_TRAP_CAPACITY * sizeof(NPT_TRAP), NPT_TRAP_TAG);
+    State->Fired = ExAllocatePoolWithTag(NonPagedPoolNx, NPT_TRAP_CAPACITY * sizeof(ULONG), NPT_TRAP_TAG);
+    if (!State->Traps || !State->Fired)
+        goto fail;
+
+    for (ULONG i = 0; i < 2; i++)
     {
-        DbgPrint("SVM-HV: Failed to allocate PML4\n");
-        return HV_STATUS_NPT_PML4;
+        State->Dirty.Bitmap[i] = ExAllocatePoolWithTag(NonPagedPoolNx, NPT_DIRTY_BITMAP_BYTES, NPT_DIRTY_TAG);
+        if (!State->Dirty.Bitmap[i])
+            goto fail;
     }
-    RtlZeroMemory(pml4, sizeof(NPT_ENTRY) * 512);
-    
-    State->Pml4 = pml4;
-    State->Pml4Pa = MmGetPhysicalAddress(pml4);
-    NptRegisterTable(State->Pml4Pa.QuadPart, pml4);
+
+    State->Sampler.Buckets = ExAllocatePoolWithTag(NonPagedPoolNx,
+        NPT_SAMPLE_MAX_BUCKETS * sizeof(NPT_SAMPLE_BUCKET), NPT_SAMPLE_TAG);
+    if (!State->Sampler.Buckets)
+        goto fail;
+    RtlZeroMemory(State->Sampler.Buckets, NPT_SAMPLE_MAX_BUCKETS * sizeof(NPT_SAMPLE_BUCKET));
+
+    // Start out on the shared identity map; NptGetEntryForWrite privatizes
+    State->Pml4 = g_NptShared.Pml4;
+    State->Pml4Pa = g_NptShared.Pml4Pa;
+
+    DbgPrint("SVM-HV: NPT initialization complete (shared root PA=0x%llX)\n", State->Pml4Pa.QuadPart);
     
-    // Allocate PDPT entries array (512 PML4 entries x 512 PDPT entries = 262144 entries)
-    // Each PDPT entry with LargePage=1 covers 1GB
-    // Total coverage = 512 * 512 * 1GB = 256TB (full x64 address space)
-    SIZE_T pdptSize = sizeof(NPT_ENTRY) * 512 * 512;
-    NPT_ENTRY* allPdpt = MmAllocateContiguousMemorySpecifyCache(
-        pdptSize, low, high, skip, MmCached);
-    if (!allPdpt)
-    {
-        DbgPrint("SVM-HV: Failed to allocate PDPT array (%llu bytes)\n", (UINT64)pdptSize);
-        MmFreeContiguousMemory(pml4);
-        return HV_STATUS_NPT_PDPT;
+    return STATUS_SUCCESS;
+
+fail:
+    if (State->Sampler.Buckets)
+        ExFreePoolWithTag(State->Sampler.Buckets, NPT_SAMPLE_TAG);
+
+    for (ULONG i = 0; i < 2; i++)
+    {
+        if (State->Dirty.Bitmap[i])
+            ExFreePoolWithTag(State->Dirty.Bitmap[i], NPT_DIRTY_TAG);
     }
-    RtlZeroMemory(allPdpt, pdptSize);
-    
-    State->PdptEntries = allPdpt;
-    State->PdptEntriesPa = MmGetPhysicalAddress(allPdpt);
-    
-    DbgPrint("SVM-HV: Allocated PML4 at %p (PA=0x%llX)\n", pml4, State->Pml4Pa.QuadPart);
-    DbgPrint("SVM-HV: Allocated PDPT array at %p (PA=0x%llX, size=0x%llX)\n", 
-             allPdpt, State->PdptEntriesPa.QuadPart, (UINT64)pdptSize);
-    
-    // Setup all 512 PML4 entries, each pointing to a block of 512 PDPT entries
-    for (ULONG64 pml4Index = 0; pml4Index < 512; pml4Index++)
-    {
-        // Each PML4 entry points to a contiguous set of 512 PDPT entries
-        NPT_ENTRY* thisPdpt = &allPdpt[pml4Index * 512];
-        PHYSICAL_ADDRESS pdptPa = MmGetPhysicalAddress(thisPdpt);
-        
-        pml4[pml4Index].Present = 1;
-        pml4[pml4Index].Write = 1;
-        pml4[pml4Index].User = 1;  // Supervisor bit for NPT
-        pml4[pml4Index].PageFrame = pdptPa.QuadPart >> 12;
-        
-        // NOTE: We intentionally do NOT call NptRegisterTable for each PDPT block
-        // since we have a contiguous allocation. The table map has limited size
-        // and would overflow with 512 entries per CPU * N CPUs.
-        
-        
-        // Setup all 512 PDPT entries as 1GB huge pages (identity mapped)
-        for (ULONG64 pdpIndex = 0; pdpIndex < 512; pdpIndex++)
-        {
-            // Physical address this 1GB page maps to:
-            // Page index = pml4Index * 512 + pdpIndex
-            // Physical address = pageIndex * 1GB = pageIndex * 0x40000000
-            // PageFrame field = physAddr >> 12 = pageIndex << 18
-            UINT64 pageIndex = pml4Index * 512ULL + pdpIndex;
-            
-            thisPdpt[pdpIndex].Present = 1;
-            thisPdpt[pdpIndex].Write = 1;
-            thisPdpt[pdpIndex].User = 1;       // Supervisor for NPT
-            thisPdpt[pdpIndex].LargePage = 1;  // 1GB huge page!
-            thisPdpt[pdpIndex].PageFrame = pageIndex << 18;  // Correct: physAddr >> 12
-        }
+
+    if (State->Fired)
+        ExFreePoolWithTag(State->Fired, NPT_TRAP_TAG);
+    if (State->Traps)
+        ExFreePoolWithTag(State->Traps, NPT_TRAP_TAG);
+
+    PageMapDestroy(&State->TrapIndex);
+    PageMapDestroy(&State->Hooks);
+    NptArenaDestroy(&State->Arena);
+
+    for (ULONG i = 0; i < 2; i++)
+    {
+        if (State->FakePageVa[i])
+            MmFreeContiguousMemory(State->FakePageVa[i]);
     }
-    
-    DbgPrint("SVM-HV: Identity mapped 256TB using 1GB pages (512 PML4 x 512 PDPT)\n");
-    DbgPrint("SVM-HV: NPT initialization complete\n");
-    
-    return STATUS_SUCCESS;
+
+    RtlZeroMemory(State, sizeof(*State));
+    return st;
 }
 
 
@@ -691,33 +2337,42 @@ VOID NptDestroy(NPT_STATE* State)
     {
         if (State->FakePageVa[i])
             MmFreeContiguousMemory(State->FakePageVa[i]);
+        State->FakePageVa[i] = NULL;
     }
 
-    if (State->Pml4)
-    {
-        for (UINT64 pml4_i = 0; pml4_i < 512; pml4_i++)
-        {
-            if (!State->Pml4[pml4_i].Present)
-                continue;
+    PageMapDestroy(&State->Hooks);
+    PageMapDestroy(&State->TrapIndex);
 
-            NPT_ENTRY* pdpt = NptResolveTableFromEntry(&State->Pml4[pml4_i]);
-            if (!pdpt || !MmIsAddressValid(pdpt))
-                continue;
-
-            for (UINT64 pdpt_i = 0; pdpt_i < 512; pdpt_i++)
-            {
-                if (!pdpt[pdpt_i].Present || pdpt[pdpt_i].LargePage)
-                    continue;
+    if (State->Traps)
+        ExFreePoolWithTag(State->Traps, NPT_TRAP_TAG);
+    if (State->Fired)
+        ExFreePoolWithTag(State->Fired, NPT_TRAP_TAG);
+    State->Traps = NULL;
+    State->Fired = NULL;
 
-                NPT_ENTRY* pd = NptResolveTableFromEntry(&pdpt[pdpt_i]);
-                if (pd && MmIsAddressValid(pd))
-                    MmFreeContiguousMemory(pd);
-            }
+    for (ULONG i = 0; i < 2; i++)
+    {
+        if (State->Dirty.Bitmap[i])
+            ExFreePoolWithTag(State->Dirty.Bitmap[i], NPT_DIRTY_TAG);
+        State->Dirty.Bitmap[i] = NULL;
+    }
+    State->Dirty.Active = FALSE;
 
-            MmFreeContiguousMemory(pdpt);
-        }
+    if (State->Sampler.Buckets)
+        ExFreePoolWithTag(State->Sampler.Buckets, NPT_SAMPLE_TAG);
+    State->Sampler.Buckets = NULL;
+    State->TrapCount = State->FiredCount = 0;
 
-        MmFreeContiguousMemory(State->Pml4);
+    // Private tables (cloned PML4/PDPTs, PDs, PTs) all live in the arena and
+    // go away with it; the shared hierarchy is released by NptGlobalDestroy
+    if (State->Arena.BaseVa)
+    {
+        DbgPrint("SVM-HV: NPT arena high-water %lu/%lu pages (%lu failed allocations, %lu COW clones, %lu splits, %lu merges)\n",
+                 State->Arena.HighWater, State->Arena.PageCount, State->Arena.Failures, State->CowClones,
+                 State->Splits, State->Merges);
+        NptArenaDestroy(&State->Arena);
     }
-}
 
+    State->Pml4 = NULL;
+    State->Pml4Pa.QuadPart = 0;
+}
@@ -0,0 +1,100 @@
+#include <ntifs.h>
+#include <intrin.h>
+#include "page_hash.h"
+#include "guest_mem.h"
+#include "xstate.h"
+
+#define PAGE_HASH_LANES     8
+#define PAGE_HASH_PRIME1    0x9E3779B1U
+#define PAGE_HASH_PRIME2    0x85EBCA77U
+
+static __forceinline UINT32 PageHashRound(UINT32 Acc, UINT32 Input)
+{
+    Acc += Input * PAGE_HASH_PRIME2;
+    Acc = (Acc << 13) | (Acc >> 19);
+    return Acc * PAGE_HASH_PRIME1;
+}
+
+static VOID PageHashScalar(UINT32* Lanes, const UINT32* Page)
+{
+    for (ULONG i = 0; i < PAGE_SIZE / sizeof(UINT32); i += PAGE_HASH_LANES)
+    {
+        for (ULONG lane = 0; lane < PAGE_HASH_LANES; lane++)
+            Lanes[lane] = PageHashRound(Lanes[lane], Page[i + lane]);
+    }
+}
+
+//
+// One ymm register holds all eight lanes, so a 4KB page is 128 iterations
+// of load / multiply / rotate / multiply. Only called with the guest's
+// vector state saved (HvXstateEnsure).
+//
+static VOID PageHashAvx2(UINT32* Lanes, const UINT32* Page)
+{
+    const __m256i prime1 = _mm256_set1_epi32((int)PAGE_HASH_PRIME1);
+    const __m256i prime2 = _mm256_set1_epi32((int)PAGE_HASH_PRIME2);
+    __m256i acc = _mm256_loadu_si256((const __m256i*)Lanes);
+
+    for (ULONG i = 0; i < PAGE_SIZE / sizeof(UINT32); i += PAGE_HASH_LANES)
+    {
+        __m256i input = _mm256_loadu_si256((const __m256i*)&Page[i]);
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(input, prime2));
+        acc = _mm256_or_si256(_mm256_slli_epi32(acc, 13), _mm256_srli_epi32(acc, 19));
+        acc = _mm256_mullo_epi32(acc, prime1);
+    }
+
+    _mm256_storeu_si256((__m256i*)Lanes, acc);
+    _mm256_zeroupper();
+}
+
+static UINT64 PageHashFinish(const UINT32* Lanes, UINT64 Pages)
+{
+    UINT64 h = Pages * PAGE_SIZE;
+
+    for (ULONG lane = 0; lane < PAGE_HASH_LANES; lane++)
+    {
+        h ^= Lanes[lane];
+        h *= 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+    }
+
+    h ^= h >> 30;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return h;
+}
+
+//
+// Hash Pages guest physical pages starting at Gpa (rounded down to a page).
+// Vector selects the AVX2 kernel; it falls back to scalar when the CPU or
+// the XSAVE area cannot support it. Returns PAGE_HASH_FAILED on bad input.
+//
+UINT64 PageHashGuest(VCPU* V, UINT64 Gpa, UINT64 Pages, BOOLEAN Vector)
+{
+    UINT32 lanes[PAGE_HASH_LANES];
+
+    if (Pages > PAGE_HASH_MAX_PAGES)
+        return PAGE_HASH_FAILED;
+
+    for (ULONG lane = 0; lane < PAGE_HASH_LANES; lane++)
+        lanes[lane] = PAGE_HASH_PRIME1 + lane;
+
+    if (Vector)
+        Vector = HvXstateAvx2(V) && HvXstateEnsure(V);
+
+    Gpa &= ~(UINT64)(PAGE_SIZE - 1);
+    for (UINT64 i = 0; i < Pages; i++, Gpa += PAGE_SIZE)
+    {
+        const UINT32* page = (const UINT32*)GuestMapGpaPage(V, Gpa);
+        if (!page)
+            return PAGE_HASH_FAILED;
+
+        if (Vector)
+            PageHashAvx2(lanes, page);
+        else
+            PageHashScalar(lanes, page);
+    }
+
+    GuestUnmapWindow(V);
+    return PageHashFinish(lanes, Pages);
+}
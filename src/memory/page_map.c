@@ -0,0 +1,200 @@
+#include "page_map.h"
+
+static __forceinline UINT64 PageMapKey(UINT64 gpa)
+{
+    return (gpa & ~0xFFFULL) | 1;
+}
+
+static __forceinline ULONG PageMapHash(UINT64 key)
+{
+    // Fibonacci hashing on the page frame number
+    return (ULONG)(((key >> 12) * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+NTSTATUS PageMapInit(PAGE_MAP* Map, ULONG Capacity)
+{
+    RtlZeroMemory(Map, sizeof(*Map));
+
+    // Round the slot count up so 'Capacity' entries fit under 3/4 load
+    ULONG slots = 16;
+    while (slots / 4 * 3 < Capacity)
+        slots <<= 1;
+
+    SIZE_T bytes = (SIZE_T)slots * sizeof(PAGE_MAP_SLOT);
+    Map->Slots = ExAllocatePoolWithTag(NonPagedPoolNx, bytes, PAGE_MAP_TAG);
+    if (!Map->Slots)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(Map->Slots, bytes);
+    Map->Mask = slots - 1;
+    Map->Limit = slots / 4 * 3;
+    return STATUS_SUCCESS;
+}
+
+VOID PageMapDestroy(PAGE_MAP* Map)
+{
+    if (Map->Slots)
+        ExFreePoolWithTag(Map->Slots, PAGE_MAP_TAG);
+
+    RtlZeroMemory(Map, sizeof(*Map));
+}
+
+VOID PageMapClear(PAGE_MAP* Map)
+{
+    if (!Map->Slots)
+        return;
+
+    RtlZeroMemory(Map->Slots, (SIZE_T)(Map->Mask + 1) * sizeof(PAGE_MAP_SLOT));
+    Map->Count = 0;
+    Map->Used = 0;
+}
+
+//
+// Drop every tombstone without a second table. Live entries are re-placed in
+// probe order starting just past a slot that was empty before the sweep: no
+// probe chain crosses such a slot, so each entry's home comes before it in
+// that order and it can only move back towards its home, into a slot no
+// entry visited later depends on.
+//
+static VOID PageMapRehash(PAGE_MAP* Map)
+{
+    ULONG start = 0;
+
+    while (Map->Slots[start].Key)
+        start++;
+
+    for (ULONG i = 0; i <= Map->Mask; i++)
+    {
+        if (Map->Slots[i].Key == PAGE_MAP_TOMBSTONE)
+            Map->Slots[i].Key = 0;
+    }
+
+    for (ULONG n = 1; n <= Map->Mask; n++)
+    {
+        PAGE_MAP_SLOT* slot = &Map->Slots[(start + n) & Map->Mask];
+        if (!slot->Key)
+            continue;
+
+        PAGE_MAP_SLOT entry = *slot;
+        slot->Key = 0;
+
+        ULONG i = PageMapHash(entry.Key) & Map->Mask;
+        while (Map->Slots[i].Key)
+            i = (i + 1) & Map->Mask;
+
+        Map->Slots[i] = entry;
+    }
+
+    Map->Used = Map->Count;
+    Map->Rehashes++;
+}
+
+UINT64* PageMapFind(PAGE_MAP* Map, UINT64 Gpa)
+{
+    if (!Map->Count)
+        return NULL;
+
+    UINT64 key = PageMapKey(Gpa);
+
+    for (ULONG i = PageMapHash(key) & Map->Mask; ; i = (i + 1) & Map->Mask)
+    {
+        PAGE_MAP_SLOT* slot = &Map->Slots[i];
+
+        if (slot->Key == key)
+            return &slot->Value;
+
+        if (!slot->Key)
+            return NULL;
+    }
+}
+
+BOOLEAN PageMapInsert(PAGE_MAP* Map, UINT64 Gpa, UINT64 Value)
+{
+    if (!Map->Slots)
+        return FALSE;
+
+    // Full only counting tombstones: reclaim them rather than refuse
+    if (Map->Used >= Map->Limit && Map->Count < Map->Limit)
+        PageMapRehash(Map);
+
+    UINT64 key = PageMapKey(Gpa);
+    PAGE_MAP_SLOT* reuse = NULL;
+
+    for (ULONG i = PageMapHash(key) & Map->Mask; ; i = (i + 1) & Map->Mask)
+    {
+        PAGE_MAP_SLOT* slot = &Map->Slots[i];
+
+        if (slot->Key == key)
+        {
+            slot->Value = Value;
+            return TRUE;
+        }
+
+        if (slot->Key == PAGE_MAP_TOMBSTONE && !reuse)
+            reuse = slot;
+
+        if (!slot->Key)
+        {
+            if (!reuse)
+            {
+                if (Map->Used >= Map->Limit)
+                    return FALSE;
+
+                Map->Used++;
+                reuse = slot;
+            }
+            break;
+        }
+    }
+
+    reuse->Key = key;
+    reuse->Value = Value;
+    Map->Count++;
+    return TRUE;
+}
+
+BOOLEAN PageMapRemove(PAGE_MAP* Map, UINT64 Gpa, UINT64* OldValue)
+{
+    UINT64* value = PageMapFind(Map, Gpa);
+    if (!value)
+        return FALSE;
+
+    PAGE_MAP_SLOT* slot = CONTAINING_RECORD(value, PAGE_MAP_SLOT, Value);
+
+    if (OldValue)
+        *OldValue = slot->Value;
+
+    slot->Key = PAGE_MAP_TOMBSTONE;
+    slot->Value = 0;
+    Map->Count--;
+
+    // Last entry gone: drop the tombstones so probe chains reset. Otherwise
+    // rehash once they make up a quarter of the slots, before misses start
+    // walking long chains of them.
+    if (!Map->Count)
+        PageMapClear(Map);
+    else if (Map->Used - Map->Count > (Map->Mask + 1) / 4)
+        PageMapRehash(Map);
+
+    return TRUE;
+}
+
+BOOLEAN PageMapNext(PAGE_MAP* Map, ULONG* Cursor, UINT64* Gpa, UINT64* Value)
+{
+    if (!Map->Slots)
+        return FALSE;
+
+    while (*Cursor <= Map->Mask)
+    {
+        PAGE_MAP_SLOT* slot = &Map->Slots[(*Cursor)++];
+
+        if (slot->Key & 1)
+        {
+            *Gpa = slot->Key & ~0xFFFULL;
+            *Value = slot->Value;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
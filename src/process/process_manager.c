@@ -2,13 +2,72 @@
 #include <intrin.h>
 
 #define EPROCESS_DIRECTORY_TABLE_BASE 0x28
+#define KPCR_CURRENT_THREAD           0x188
+#define PROCESS_WALK_LIMIT            0x10000
+
+//
+// EPROCESS / KTHREAD field offsets, decoded once at load from the exported
+// accessors so queries made from the VMEXIT path never call into Ps/Ob.
+//
+static struct
+{
+    ULONG UniqueProcessId;
+    ULONG ActiveProcessLinks;
+    ULONG SectionBaseAddress;
+    ULONG ThreadProcess;
+    PEPROCESS SystemProcess;
+    BOOLEAN Ready;
+} g_ProcessOffsets = { 0 };
+
+//
+// Accessors of the form `mov rax, [rcx+imm32]; ret` expose the offset
+// they read directly in their code bytes
+//
+static ULONG ProcessDecodeFieldOffset(PVOID Routine)
+{
+    const UCHAR* code = (const UCHAR*)Routine;
+
+    if (!code || code[0] != 0x48 || code[1] != 0x8B || code[2] != 0x81)
+        return 0;
+
+    return *(const ULONG UNALIGNED*)(code + 3);
+}
+
+NTSTATUS ProcessManagerInit(VOID)
+{
+    g_ProcessOffsets.UniqueProcessId = ProcessDecodeFieldOffset((PVOID)PsGetProcessId);
+    g_ProcessOffsets.SectionBaseAddress = ProcessDecodeFieldOffset((PVOID)PsGetProcessSectionBaseAddress);
+    g_ProcessOffsets.ThreadProcess = ProcessDecodeFieldOffset((PVOID)PsGetThreadProcess);
+    g_ProcessOffsets.SystemProcess = PsInitialSystemProcess;
+
+    if (!g_ProcessOffsets.UniqueProcessId || !g_ProcessOffsets.SectionBaseAddress ||
+        !g_ProcessOffsets.ThreadProcess || !g_ProcessOffsets.SystemProcess)
+    {
+        DbgPrint("SVM-HV: ProcessManagerInit could not decode EPROCESS offsets\n");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    // ActiveProcessLinks directly follows UniqueProcessId on every x64 build
+    g_ProcessOffsets.ActiveProcessLinks = g_ProcessOffsets.UniqueProcessId + sizeof(HANDLE);
+    g_ProcessOffsets.Ready = TRUE;
+
+    DbgPrint("SVM-HV: EPROCESS offsets: Pid=0x%X Links=0x%X SectionBase=0x%X Thread->Process=0x%X\n",
+             g_ProcessOffsets.UniqueProcessId, g_ProcessOffsets.ActiveProcessLinks,
+             g_ProcessOffsets.SectionBaseAddress, g_ProcessOffsets.ThreadProcess);
+    return STATUS_SUCCESS;
+}
+
+static HANDLE ProcessGetId(PEPROCESS Process)
+{
+    return *(HANDLE*)((PUCHAR)Process + g_ProcessOffsets.UniqueProcessId);
+}
 
 static VOID ProcessFillInfo(PEPROCESS Process, HANDLE Pid, PPROCESS_DETAILS Details)
 {
     Details->ProcessId = Pid;
-    Details->ImageBase = (UINT64)PsGetProcessSectionBaseAddress(Process);
+    Details->ImageBase = *(UINT64*)((PUCHAR)Process + g_ProcessOffsets.SectionBaseAddress);
+
 
-    
     Details->DirectoryTableBase = *(UINT64*)((PUCHAR)Process + EPROCESS_DIRECTORY_TABLE_BASE);
 }
 
@@ -17,14 +76,33 @@ NTSTATUS ProcessQueryByPid(HANDLE Pid, PPROCESS_DETAILS Details)
     if (!Details)
         return STATUS_INVALID_PARAMETER;
 
-    PEPROCESS process = NULL;
-    NTSTATUS status = PsLookupProcessByProcessId(Pid, &process);
-    if (!NT_SUCCESS(status))
-        return status;
+    if (!g_ProcessOffsets.Ready)
+        return STATUS_NOT_SUPPORTED;
 
-    ProcessFillInfo(process, Pid, Details);
-    ObDereferenceObject(process);
-    return STATUS_SUCCESS;
+    //
+    // Walk ActiveProcessLinks from the System process. The guest is frozen
+    // while we run, so the list cannot change underneath us; the step bound
+    // only guards against a corrupted list.
+    //
+    PUCHAR system = (PUCHAR)g_ProcessOffsets.SystemProcess;
+    PLIST_ENTRY head = (PLIST_ENTRY)(system + g_ProcessOffsets.ActiveProcessLinks);
+    PLIST_ENTRY entry = head;
+
+    for (ULONG i = 0; i < PROCESS_WALK_LIMIT; i++)
+    {
+        PEPROCESS process = (PEPROCESS)((PUCHAR)entry - g_ProcessOffsets.ActiveProcessLinks);
+        if (ProcessGetId(process) == Pid)
+        {
+            ProcessFillInfo(process, Pid, Details);
+            return STATUS_SUCCESS;
+        }
+
+        entry = entry->Flink;
+        if (!entry || entry == head)
+            break;
+    }
+
+    return STATUS_INVALID_CID;
 }
 
 NTSTATUS ProcessQueryCurrent(PPROCESS_DETAILS Details)
@@ -32,7 +110,16 @@ NTSTATUS ProcessQueryCurrent(PPROCESS_DETAILS Details)
     if (!Details)
         return STATUS_INVALID_PARAMETER;
 
-    PEPROCESS process = PsGetCurrentProcess();
-    ProcessFillInfo(process, PsGetCurrentProcessId(), Details);
+    if (!g_ProcessOffsets.Ready)
+        return STATUS_NOT_SUPPORTED;
+
+    // Host GS still points at this core's KPCR, so KPRCB.CurrentThread is
+    // the thread that was running when the guest exited
+    PUCHAR thread = (PUCHAR)__readgsqword(KPCR_CURRENT_THREAD);
+    if (!thread)
+        return STATUS_UNSUCCESSFUL;
+
+    PEPROCESS process = *(PEPROCESS*)(thread + g_ProcessOffsets.ThreadProcess);
+    ProcessFillInfo(process, ProcessGetId(process), Details);
     return STATUS_SUCCESS;
 }
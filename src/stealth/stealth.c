@@ -3,6 +3,8 @@
 #include "vcpu.h"
 #include "vmcb.h"
 #include "msr.h"
+#include "cpuid_cache.h"
+#include "msrpm.h"
 
 
 
@@ -95,25 +97,30 @@ BOOLEAN StealthPreventVmrunDetection()
 }
 
 
-VOID StealthCleanVmcb(VCPU* V)
+//
+// EFER reads only exit while stealth is on, to hide SVME
+//
+static BOOLEAN StealthEferRead(VCPU* V, UINT32 msr, UINT64* value)
 {
-    if (!g_StealthEnabled)
-        return;
-
-    VMCB_CONTROL_AREA* c = VmcbControl(&V->GuestVmcb);
-
-    c->VmcbClean = 0xFFFFFFFFUL;
+    *value = StealthMaskMsrRead(msr, HvMsrReadGuest(V, msr));
+    return TRUE;
 }
 
-
 VOID StealthEnable()
 {
     g_StealthEnabled = TRUE;
+    HvCpuidInvalidate();
+
+    // Registration is permanent; a second enable just finds it in place
+    HvRegisterMsrHandler(MSR_EFER, StealthEferRead, NULL, 0);
+    HvMsrSetIntercept(MSR_EFER, HV_MSR_READ, g_HideSvmMsr);
 }
 
 VOID StealthDisable()
 {
     g_StealthEnabled = FALSE;
+    HvCpuidInvalidate();
+    HvMsrSetIntercept(MSR_EFER, HV_MSR_READ, FALSE);
 }
 
 BOOLEAN StealthIsEnabled()
@@ -0,0 +1,72 @@
+//
+// HvDecodeInstruction cost per instruction over the decode_corpus.h
+// encodings: the ones that decode, the ones that are rejected, and the
+// whole corpus in a shuffled order so the branch predictor cannot learn it.
+//
+#include "../src/core/decode.c"
+#include "decode_corpus.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_DECODES   (1u << 24)
+#define BENCH_MIX       4096
+
+static volatile UINT64 g_BenchSink;
+
+static UINT64 BenchRandom(UINT64* s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static double BenchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static VOID BenchRun(const char* Name, const DECODE_CASE* const* Cases, ULONG Count)
+{
+    UINT64 sum = 0;
+    HV_INSN insn;
+
+    double t0 = BenchNow();
+    for (ULONG i = 0; i < BENCH_DECODES; i++)
+    {
+        const DECODE_CASE* t = Cases[i % Count];
+        sum += HvDecodeInstruction(t->Bytes, t->Count, t->Mode, &insn) + insn.Length;
+    }
+    double ns = (BenchNow() - t0) / BENCH_DECODES;
+
+    printf("%-10s (%4lu encodings): %.1f ns per decode\n", Name, (unsigned long)Count, ns);
+    g_BenchSink = sum;
+}
+
+int main(void)
+{
+    static const DECODE_CASE* accepted[DECODE_CORPUS_SIZE];
+    static const DECODE_CASE* rejected[DECODE_CORPUS_SIZE];
+    static const DECODE_CASE* mix[BENCH_MIX];
+    ULONG nAccepted = 0, nRejected = 0;
+    UINT64 seed = 0x9E3779B97F4A7C15ULL;
+
+    for (ULONG i = 0; i < DECODE_CORPUS_SIZE; i++)
+    {
+        if (g_DecodeCorpus[i].Ok)
+            accepted[nAccepted++] = &g_DecodeCorpus[i];
+        else
+            rejected[nRejected++] = &g_DecodeCorpus[i];
+    }
+
+    for (ULONG i = 0; i < BENCH_MIX; i++)
+        mix[i] = &g_DecodeCorpus[BenchRandom(&seed) % DECODE_CORPUS_SIZE];
+
+    BenchRun("accepted", accepted, nAccepted);
+    BenchRun("rejected", rejected, nRejected);
+    BenchRun("shuffled", mix, BENCH_MIX);
+    return 0;
+}
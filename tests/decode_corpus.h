@@ -0,0 +1,160 @@
+#pragma once
+#include "decode.h"
+
+//
+// Encodings and what HvDecodeInstruction has to make of them. Covers every
+// opcode form the decoder accepts, legacy / REX prefix interplay, SIB and
+// RIP-relative addressing, high-byte registers, the implicit SS segment and
+// the encodings it must reject. A case with Ok == FALSE only checks that.
+//
+typedef struct _DECODE_CASE
+{
+    const char* Name;
+    UINT8 Bytes[HV_INSN_MAX_LENGTH];
+    UINT8 Count;
+    HV_CPU_MODE Mode;
+    BOOLEAN Ok;
+    HV_INSN Expect;     // Op, Length, sizes, segment, operands
+} DECODE_CASE;
+
+#define R_   HV_REG_NONE
+
+#define DECODE_MEM(op, len, size, reg, base, index, scale, disp) \
+    { .Op = (op), .Length = (len), .OperandSize = (size), .AddressSize = 8, .Segment = HV_SEG_DS, \
+      .Reg = (reg), .Base = (base), .Index = (index), .Scale = (scale), .Disp = (disp) }
+
+static const DECODE_CASE g_DecodeCorpus[] =
+{
+    // MOV m, r / MOV r, m
+    { "mov [rax], ecx",         { 0x89, 0x08 }, 2, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovStore, 2, 4, 1, 0, R_, 1, 0) },
+    { "mov [rsp+8], rcx",       { 0x48, 0x89, 0x4C, 0x24, 0x08 }, 5, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovStore, .Length = 5, .OperandSize = 8, .AddressSize = 8, .Segment = HV_SEG_SS,
+        .Reg = 1, .Base = 4, .Index = R_, .Scale = 1, .Disp = 8 } },
+    { "mov r8d, [rbp-8]",       { 0x44, 0x8B, 0x45, 0xF8 }, 4, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovLoad, .Length = 4, .OperandSize = 4, .AddressSize = 8, .Segment = HV_SEG_SS,
+        .Reg = 8, .Base = 5, .Index = R_, .Scale = 1, .Disp = -8 } },
+    { "mov [r13+0], eax",       { 0x41, 0x89, 0x45, 0x00 }, 4, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovStore, 4, 4, 0, 13, R_, 1, 0) },
+    { "mov eax, [rax+r9*4]",    { 0x42, 0x8B, 0x04, 0x88 }, 4, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovLoad, 4, 4, 0, 0, 9, 4, 0) },
+    { "mov r15, [r12+r10*8+0x1000]", { 0x4F, 0x8B, 0xBC, 0xD4, 0x00, 0x10, 0x00, 0x00 }, 8, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovLoad, 8, 8, 15, 12, 10, 8, 0x1000) },
+    { "mov [0x1000], eax",      { 0x89, 0x04, 0x25, 0x00, 0x10, 0x00, 0x00 }, 7, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovStore, 7, 4, 0, R_, R_, 1, 0x1000) },
+    { "mov eax, [rip+0x10]",    { 0x8B, 0x05, 0x10, 0x00, 0x00, 0x00 }, 6, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovLoad, .Length = 6, .OperandSize = 4, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = 0, .Base = R_, .Index = R_, .Scale = 1, .RipRelative = TRUE, .Disp = 0x10 } },
+    { "mov rcx, [rip-0x20]",    { 0x48, 0x8B, 0x0D, 0xE0, 0xFF, 0xFF, 0xFF }, 7, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovLoad, .Length = 7, .OperandSize = 8, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = 1, .Base = R_, .Index = R_, .Scale = 1, .RipRelative = TRUE, .Disp = -0x20 } },
+    { "mov [rax], dx",          { 0x66, 0x89, 0x10 }, 3, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovStore, 3, 2, 2, 0, R_, 1, 0) },
+    { "mov [rax], dx (rex dropped)", { 0x48, 0x66, 0x89, 0x10 }, 4, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovStore, 4, 2, 2, 0, R_, 1, 0) },
+    { "mov [eax], ecx",         { 0x67, 0x89, 0x08 }, 3, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovStore, .Length = 3, .OperandSize = 4, .AddressSize = 4, .Segment = HV_SEG_DS,
+        .Reg = 1, .Base = 0, .Index = R_, .Scale = 1 } },
+    { "mov gs:[rax], eax",      { 0x65, 0x89, 0x00 }, 3, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovStore, .Length = 3, .OperandSize = 4, .AddressSize = 8, .Segment = HV_SEG_GS,
+        .Reg = 0, .Base = 0, .Index = R_, .Scale = 1 } },
+    { "mov ds:[rbp], eax",      { 0x3E, 0x89, 0x45, 0x00 }, 4, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovStore, 4, 4, 0, 5, R_, 1, 0) },
+
+    // High-byte registers and their REX replacements
+    { "mov [rax+1], ah",        { 0x88, 0x60, 0x01 }, 3, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovStore, .Length = 3, .OperandSize = 1, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = 0, .HighByte = TRUE, .Base = 0, .Index = R_, .Scale = 1, .Disp = 1 } },
+    { "mov bh, [rcx]",          { 0x8A, 0x39 }, 2, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovLoad, .Length = 2, .OperandSize = 1, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = 3, .HighByte = TRUE, .Base = 1, .Index = R_, .Scale = 1 } },
+    { "mov [rax+1], spl",       { 0x40, 0x88, 0x60, 0x01 }, 4, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovStore, 4, 1, 4, 0, R_, 1, 1) },
+    { "mov [rax], r9b",         { 0x44, 0x88, 0x08 }, 3, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovStore, 3, 1, 9, 0, R_, 1, 0) },
+
+    // MOV m, imm and moffs
+    { "mov dword [rax+0x300], 1", { 0xC7, 0x80, 0x00, 0x03, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00 }, 10, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovStore, .Length = 10, .OperandSize = 4, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = R_, .HasImm = TRUE, .Base = 0, .Index = R_, .Scale = 1, .Disp = 0x300, .Imm = 1 } },
+    { "mov qword [rdi], -1",    { 0x48, 0xC7, 0x07, 0xFF, 0xFF, 0xFF, 0xFF }, 7, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovStore, .Length = 7, .OperandSize = 8, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = R_, .HasImm = TRUE, .Base = 7, .Index = R_, .Scale = 1, .Imm = ~0ULL } },
+    { "mov byte [rsi], 0x80",   { 0xC6, 0x06, 0x80 }, 3, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovStore, .Length = 3, .OperandSize = 1, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = R_, .HasImm = TRUE, .Base = 6, .Index = R_, .Scale = 1, .Imm = 0xFFFFFFFFFFFFFF80ULL } },
+    { "mov rax, [0xFEE00000]",  { 0x48, 0xA1, 0x00, 0x00, 0xE0, 0xFE, 0x00, 0x00, 0x00, 0x00 }, 10, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovLoad, 10, 8, 0, R_, R_, 0, 0xFEE00000LL) },
+    { "mov [0xFEE000B0], al",   { 0xA2, 0xB0, 0x00, 0xE0, 0xFE, 0x00, 0x00, 0x00, 0x00 }, 9, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnMovStore, 9, 1, 0, R_, R_, 0, 0xFEE000B0LL) },
+
+    // MOVZX / MOVSX
+    { "movzx eax, byte [rax+4]", { 0x0F, 0xB6, 0x40, 0x04 }, 4, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovzx, .Length = 4, .OperandSize = 4, .SourceSize = 1, .AddressSize = 8,
+        .Segment = HV_SEG_DS, .Reg = 0, .Base = 0, .Index = R_, .Scale = 1, .Disp = 4 } },
+    { "movsx rcx, word [rax]",  { 0x48, 0x0F, 0xBF, 0x08 }, 4, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovsx, .Length = 4, .OperandSize = 8, .SourceSize = 2, .AddressSize = 8,
+        .Segment = HV_SEG_DS, .Reg = 1, .Base = 0, .Index = R_, .Scale = 1 } },
+
+    // String operations
+    { "rep movsq",              { 0xF3, 0x48, 0xA5 }, 3, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovs, .Length = 3, .OperandSize = 8, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Rep = TRUE, .Reg = R_, .Base = R_, .Index = R_ } },
+    { "rep stosb",              { 0xF3, 0xAA }, 2, HvCpuMode64, TRUE,
+      { .Op = HvInsnStos, .Length = 2, .OperandSize = 1, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Rep = TRUE, .Reg = 0, .Base = R_, .Index = R_ } },
+    { "cs movsb",               { 0x2E, 0xA4 }, 2, HvCpuMode64, TRUE,
+      { .Op = HvInsnMovs, .Length = 2, .OperandSize = 1, .AddressSize = 8, .Segment = HV_SEG_CS,
+        .Reg = R_, .Base = R_, .Index = R_ } },
+
+    // Read-modify-write
+    { "or dword [rax+0x10], 1", { 0x83, 0x48, 0x10, 0x01 }, 4, HvCpuMode64, TRUE,
+      { .Op = HvInsnOr, .Length = 4, .OperandSize = 4, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = R_, .MemIsDest = TRUE, .HasImm = TRUE, .Base = 0, .Index = R_, .Scale = 1, .Disp = 0x10, .Imm = 1 } },
+    { "and dword [rax+0x10], 0x7FFFFFFF", { 0x81, 0x60, 0x10, 0xFF, 0xFF, 0xFF, 0x7F }, 7, HvCpuMode64, TRUE,
+      { .Op = HvInsnAnd, .Length = 7, .OperandSize = 4, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = R_, .MemIsDest = TRUE, .HasImm = TRUE, .Base = 0, .Index = R_, .Scale = 1, .Disp = 0x10,
+        .Imm = 0x7FFFFFFF } },
+    { "and qword [rax], -2",    { 0x48, 0x83, 0x20, 0xFE }, 4, HvCpuMode64, TRUE,
+      { .Op = HvInsnAnd, .Length = 4, .OperandSize = 8, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = R_, .MemIsDest = TRUE, .HasImm = TRUE, .Base = 0, .Index = R_, .Scale = 1,
+        .Imm = 0xFFFFFFFFFFFFFFFEULL } },
+    { "or [rbx], ch",           { 0x08, 0x2B }, 2, HvCpuMode64, TRUE,
+      { .Op = HvInsnOr, .Length = 2, .OperandSize = 1, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = 1, .HighByte = TRUE, .MemIsDest = TRUE, .Base = 3, .Index = R_, .Scale = 1 } },
+    { "and edx, [rsi]",         { 0x23, 0x16 }, 2, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnAnd, 2, 4, 2, 6, R_, 1, 0) },
+    { "lock cmpxchg [rdx], ecx", { 0xF0, 0x0F, 0xB1, 0x0A }, 4, HvCpuMode64, TRUE,
+      { .Op = HvInsnCmpxchg, .Length = 4, .OperandSize = 4, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Lock = TRUE, .Reg = 1, .Base = 2, .Index = R_, .Scale = 1 } },
+    { "cmpxchg [rax], ah",      { 0x0F, 0xB0, 0x20 }, 3, HvCpuMode64, TRUE,
+      { .Op = HvInsnCmpxchg, .Length = 3, .OperandSize = 1, .AddressSize = 8, .Segment = HV_SEG_DS,
+        .Reg = 0, .HighByte = TRUE, .Base = 0, .Index = R_, .Scale = 1 } },
+    { "xchg [rax], ecx",        { 0x87, 0x08 }, 2, HvCpuMode64, TRUE,
+      DECODE_MEM(HvInsnXchg, 2, 4, 1, 0, R_, 1, 0) },
+
+    // 32-bit code: 0x40-0x4F are INC/DEC, disp32 is absolute
+    { "mov [ebp-4], eax (32)",  { 0x89, 0x45, 0xFC }, 3, HvCpuMode32, TRUE,
+      { .Op = HvInsnMovStore, .Length = 3, .OperandSize = 4, .AddressSize = 4, .Segment = HV_SEG_SS,
+        .Reg = 0, .Base = 5, .Index = R_, .Scale = 1, .Disp = -4 } },
+    { "mov eax, [0x10] (32)",   { 0x8B, 0x05, 0x10, 0x00, 0x00, 0x00 }, 6, HvCpuMode32, TRUE,
+      { .Op = HvInsnMovLoad, .Length = 6, .OperandSize = 4, .AddressSize = 4, .Segment = HV_SEG_DS,
+        .Reg = 0, .Base = R_, .Index = R_, .Scale = 1, .Disp = 0x10 } },
+    { "inc eax (32)",           { 0x40, 0x89, 0x08 }, 3, HvCpuMode32, FALSE, { 0 } },
+
+    // Rejected: no memory operand, 16-bit addressing, unsupported or cut short
+    { "mov eax, ecx",           { 0x89, 0xC8 }, 2, HvCpuMode64, FALSE, { 0 } },
+    { "mov [bx], ax (16)",      { 0x89, 0x07 }, 2, HvCpuMode16, FALSE, { 0 } },
+    { "add [rax], ecx",         { 0x01, 0x08 }, 2, HvCpuMode64, FALSE, { 0 } },
+    { "mov byte [rax], imm /1", { 0xC6, 0x08, 0x00 }, 3, HvCpuMode64, FALSE, { 0 } },
+    { "nop",                    { 0x90 }, 1, HvCpuMode64, FALSE, { 0 } },
+    { "truncated modrm",        { 0x48, 0x89 }, 2, HvCpuMode64, FALSE, { 0 } },
+    { "truncated disp32",       { 0x8B, 0x05, 0x10, 0x00 }, 4, HvCpuMode64, FALSE, { 0 } },
+    { "modrm past 15 bytes",    { 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+                                  0x66, 0x66, 0x89 }, 15, HvCpuMode64, FALSE, { 0 } },
+};
+
+#undef R_
+#undef DECODE_MEM
+
+#define DECODE_CORPUS_SIZE  (sizeof(g_DecodeCorpus) / sizeof(g_DecodeCorpus[0]))
@@ -0,0 +1,58 @@
+//
+// HvDecodeInstruction against the corpus in decode_corpus.h. Every field of
+// HV_INSN is compared for the encodings that must decode; the rest only
+// have to be rejected.
+//
+#include "../src/core/decode.c"
+#include "decode_corpus.h"
+
+#include <stdio.h>
+
+static int TestCompare(const DECODE_CASE* T, const HV_INSN* I)
+{
+    const HV_INSN* E = &T->Expect;
+
+    return I->Op != E->Op || I->Length != E->Length || I->OperandSize != E->OperandSize ||
+           I->SourceSize != E->SourceSize || I->AddressSize != E->AddressSize || I->Segment != E->Segment ||
+           I->Rep != E->Rep || I->Lock != E->Lock || I->Reg != E->Reg || I->HighByte != E->HighByte ||
+           I->MemIsDest != E->MemIsDest || I->HasImm != E->HasImm || I->Base != E->Base ||
+           I->Index != E->Index || I->Scale != E->Scale || I->RipRelative != E->RipRelative ||
+           I->Disp != E->Disp || I->Imm != E->Imm;
+}
+
+static VOID TestPrint(const char* What, const HV_INSN* I)
+{
+    printf("  %-6s op %u len %u size %u/%u addr %u seg %u rep %u lock %u reg %u%s dest %u imm %u "
+           "base %u index %u scale %u rip %u disp %lld imm 0x%llX\n",
+           What, I->Op, I->Length, I->OperandSize, I->SourceSize, I->AddressSize, I->Segment, I->Rep, I->Lock,
+           I->Reg, I->HighByte ? "h" : "", I->MemIsDest, I->HasImm, I->Base, I->Index, I->Scale,
+           I->RipRelative, (long long)I->Disp, (unsigned long long)I->Imm);
+}
+
+int main(void)
+{
+    int failures = 0;
+
+    for (ULONG i = 0; i < DECODE_CORPUS_SIZE; i++)
+    {
+        const DECODE_CASE* t = &g_DecodeCorpus[i];
+        HV_INSN insn;
+        BOOLEAN ok = HvDecodeInstruction(t->Bytes, t->Count, t->Mode, &insn);
+
+        if (ok != t->Ok)
+        {
+            printf("FAIL %s: %s\n", t->Name, ok ? "decoded, expected rejection" : "rejected");
+            failures++;
+        }
+        else if (ok && TestCompare(t, &insn))
+        {
+            printf("FAIL %s\n", t->Name);
+            TestPrint("got", &insn);
+            TestPrint("want", &t->Expect);
+            failures++;
+        }
+    }
+
+    printf("%lu encodings, %d failures\n", (unsigned long)DECODE_CORPUS_SIZE, failures);
+    return failures != 0;
+}
@@ -0,0 +1,281 @@
+//
+// Guest page-table walk cost over synthetic tables, for 4- and 5-level
+// paging and 4KB / 2MB / 1GB leaves:
+//
+//   walk       GuestWalkTables alone, what every TLB miss pays
+//   miss       GuestWalk over more pages than the TLB holds
+//   recheck    GuestWalk hits, each the first in its exit (the walk's
+//              entries are re-read)
+//   hit        GuestWalk hits within one exit
+//
+// then the refusals (user access to a supervisor page, write to a
+// read-only page with CR0.WP, execute from an NX page) walked and cached.
+//
+// guest_walk.c is built on its own rather than with km/km.c, whose
+// GuestWalk stub serves the NPT tests; the few services it needs are
+// defined here over a flat "guest physical" array. A table read is a
+// memcpy here, where the driver maps each one through its window, so walk
+// and recheck cost more there relative to hit.
+//
+#include "../src/memory/guest_walk.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_WALKS         (1u << 22)
+#define BENCH_PAGES         GUEST_TLB_ENTRIES      // One TLB slot each
+#define BENCH_MISS_PAGES    (GUEST_TLB_ENTRIES * 64)
+#define BENCH_MEM_PAGES     64
+
+#define BENCH_CR0_WP        (1ULL << 16)
+#define BENCH_CR4_LA57      (1ULL << 12)
+#define BENCH_EFER_NXE      (1ULL << 11)
+
+#define BENCH_P             0x001ULL
+#define BENCH_RW            0x002ULL
+#define BENCH_US            0x004ULL
+#define BENCH_PS            0x080ULL
+#define BENCH_NX            (1ULL << 63)
+#define BENCH_TABLE         (BENCH_P | BENCH_RW | BENCH_US)
+
+static UINT64 g_Mem[BENCH_MEM_PAGES * 512];
+static ULONG g_MemUsed;
+static VCPU g_Vcpu;
+static volatile UINT64 g_BenchSink;
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE Type, SIZE_T Bytes, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Type);
+    UNREFERENCED_PARAMETER(Tag);
+    return calloc(1, Bytes);
+}
+
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    free(P);
+}
+
+BOOLEAN GuestReadGpa(VCPU* Vcpu, UINT64 GuestPhysicalAddress, PVOID Buffer, SIZE_T Size)
+{
+    UNREFERENCED_PARAMETER(Vcpu);
+    if (GuestPhysicalAddress + Size > sizeof(g_Mem))
+        return FALSE;
+
+    memcpy(Buffer, (UINT8*)g_Mem + GuestPhysicalAddress, Size);
+    return TRUE;
+}
+
+UINT64 HookDecryptCr3(struct _VCPU* V, UINT64 cr3_enc)
+{
+    UNREFERENCED_PARAMETER(V);
+    return cr3_enc;
+}
+
+static BOOLEAN BenchRead(PVOID Context, UINT64 Gpa, UINT64* Value)
+{
+    return GuestReadGpa((VCPU*)Context, Gpa, Value, sizeof(UINT64));
+}
+
+static double BenchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//
+// Page 0 stays unused, so a zero entry never looks like a table
+//
+static UINT64 BenchTable(void)
+{
+    return (UINT64)(++g_MemUsed) << 12;
+}
+
+static UINT64* BenchEntry(UINT64 Table, UINT64 Gva, ULONG Shift)
+{
+    return &g_Mem[Table / 8 + ((Gva >> Shift) & 0x1FF)];
+}
+
+//
+// Map Count pages of PageSize at Gva (consecutive pages) with the leaf
+// flags given. Upper levels grant everything, so the leaf decides the
+// rights. Returns the CR3.
+//
+static UINT64 BenchBuild(BOOLEAN La57, UINT64 PageSize, UINT64 Gva, ULONG Count, UINT64 LeafFlags)
+{
+    UINT64 root;
+    ULONG leafShift = (PageSize == (1ULL << 30)) ? 30 : (PageSize == (1ULL << 21)) ? 21 : 12;
+
+    memset(g_Mem, 0, sizeof(g_Mem));
+    g_MemUsed = 0;
+    root = BenchTable();
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        UINT64 va = Gva + i * PageSize;
+        UINT64 table = root;
+
+        for (ULONG shift = La57 ? 48 : 39; shift > leafShift; shift -= 9)
+        {
+            UINT64* e = BenchEntry(table, va, shift);
+            if (!*e)
+                *e = BenchTable() | BENCH_TABLE;
+            table = *e & WALK_FRAME_MASK;
+        }
+
+        // Leaf frames are never read; place them well above the tables
+        *BenchEntry(table, va, leafShift) = ((1ULL << 40) + i * PageSize) | LeafFlags |
+                                            (leafShift != 12 ? BENCH_PS : 0);
+    }
+
+    return root;
+}
+
+static VOID BenchSetPaging(BOOLEAN La57, UINT64 Cr3)
+{
+    VMCB_STATE_SAVE_AREA* s = VmcbState(&g_Vcpu.GuestVmcb);
+
+    s->Cr0 = BENCH_CR0_WP;
+    s->Cr4 = La57 ? BENCH_CR4_LA57 : 0;
+    s->Efer = BENCH_EFER_NXE;
+    s->Cr3 = Cr3;
+
+    GuestTlbInvalidate();
+}
+
+static UINT32 BenchPaging(BOOLEAN La57)
+{
+    return GUEST_PAGING_WP | GUEST_PAGING_NXE | (La57 ? GUEST_PAGING_LA57 : 0);
+}
+
+typedef enum _BENCH_MODE
+{
+    BenchWalk,
+    BenchMiss,
+    BenchRecheck,
+    BenchHit,
+} BENCH_MODE;
+
+//
+// ns per translation of Pages pages starting at Gva, all expected to end
+// with Expect (TRUE = translated)
+//
+static double BenchRun(BENCH_MODE Mode, BOOLEAN La57, UINT64 Cr3, UINT64 Gva, UINT64 Stride,
+                       ULONG Pages, UINT32 Access, BOOLEAN Expect, int* Failed)
+{
+    GUEST_WALK walk;
+    UINT64 sum = 0;
+
+    BenchSetPaging(La57, Cr3);
+
+    double t0 = BenchNow();
+    for (ULONG i = 0; i < BENCH_WALKS; i++)
+    {
+        UINT64 va = Gva + (i % Pages) * Stride + 0x123;
+        BOOLEAN ok;
+
+        if (Mode == BenchWalk)
+            ok = GuestWalkTables(BenchRead, &g_Vcpu, Cr3, va, BenchPaging(La57), Access, &walk);
+        else
+        {
+            if (Mode == BenchRecheck)
+                g_Vcpu.Exec.ExitCount++;
+            ok = GuestWalk(&g_Vcpu, Cr3, va, Access, &walk);
+        }
+
+        if (ok != Expect)
+            *Failed = 1;
+        sum += walk.Gpa;
+    }
+    double ns = (BenchNow() - t0) / BENCH_WALKS;
+
+    g_BenchSink = sum;
+    return ns;
+}
+
+static int BenchPaging4And5(void)
+{
+    static const UINT64 sizes[] = { 1ULL << 12, 1ULL << 21, 1ULL << 30 };
+    static const char* const sizeNames[] = { "4KB", "2MB", "1GB" };
+    int failed = 0;
+
+    printf("%-8s %-5s %8s %8s %8s %8s  (ns per translation)\n", "paging", "page", "walk", "miss", "recheck", "hit");
+
+    for (ULONG level = 4; level <= 5; level++)
+    {
+        BOOLEAN la57 = (level == 5);
+
+        for (ULONG s = 0; s < 3; s++)
+        {
+            UINT64 gva = 0x0000100000000000ULL;
+            double ns[4];
+
+            // The TLB slot comes from the 4KB page number, so step one 4KB
+            // page further into each large page to spread them over slots.
+            // That drifts into the next page now and then; map twice over.
+            UINT64 stride = sizes[s] + (s ? (1ULL << 12) : 0);
+            UINT64 cr3 = BenchBuild(la57, sizes[s], gva, BENCH_MISS_PAGES * 2, BENCH_P | BENCH_RW | BENCH_US);
+
+            for (ULONG m = BenchWalk; m <= BenchHit; m++)
+            {
+                ULONG pages = (m == BenchMiss) ? BENCH_MISS_PAGES : BENCH_PAGES;
+                ns[m] = BenchRun((BENCH_MODE)m, la57, cr3, gva, stride, pages, GUEST_ACCESS_WRITE, TRUE, &failed);
+            }
+
+            printf("%u-level  %-5s %8.1f %8.1f %8.1f %8.1f\n", (unsigned)level, sizeNames[s], ns[0], ns[1], ns[2], ns[3]);
+        }
+    }
+
+    return failed;
+}
+
+static int BenchRefusals(void)
+{
+    static const struct
+    {
+        const char* Name;
+        UINT64 LeafFlags;
+        UINT32 Access;
+    } cases[] = {
+        { "user on supervisor",  BENCH_P | BENCH_RW,            GUEST_ACCESS_USER },
+        { "write on read-only",  BENCH_P | BENCH_US,            GUEST_ACCESS_WRITE },
+        { "exec on NX",          BENCH_P | BENCH_RW | BENCH_NX, GUEST_ACCESS_EXEC },
+        { "not present",         0,                             0 },
+    };
+    int failed = 0;
+
+    printf("\n%-20s %8s %8s %8s  (4-level, 4KB; ns per refusal)\n", "refusal", "walk", "recheck", "hit");
+
+    for (ULONG c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        UINT64 gva = 0x0000100000000000ULL;
+        UINT64 cr3 = BenchBuild(FALSE, 1ULL << 12, gva, BENCH_PAGES, cases[c].LeafFlags);
+        double walk = BenchRun(BenchWalk, FALSE, cr3, gva, 1ULL << 12, BENCH_PAGES, cases[c].Access, FALSE, &failed);
+        double recheck = BenchRun(BenchRecheck, FALSE, cr3, gva, 1ULL << 12, BENCH_PAGES, cases[c].Access, FALSE, &failed);
+        double hit = BenchRun(BenchHit, FALSE, cr3, gva, 1ULL << 12, BENCH_PAGES, cases[c].Access, FALSE, &failed);
+
+        printf("%-20s %8.1f %8.1f %8.1f\n", cases[c].Name, walk, recheck, hit);
+    }
+
+    return failed;
+}
+
+int main(void)
+{
+    int failed;
+
+    if (!NT_SUCCESS(GuestTlbInitVcpu(&g_Vcpu)))
+        return 1;
+
+    failed = BenchPaging4And5();
+    failed |= BenchRefusals();
+
+    GuestTlbDestroyVcpu(&g_Vcpu);
+
+    if (failed)
+        printf("FAILED: a translation did not end as expected\n");
+    return failed;
+}
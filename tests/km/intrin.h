@@ -0,0 +1,104 @@
+#pragma once
+#include <ntifs.h>
+
+//
+// MSVC intrinsics the tested sources use, mapped onto gcc builtins. Anything
+// that only makes sense in ring 0 (MSRs, CRs, SVM, port I/O) is declared but
+// never defined, so a test that reaches one fails to link instead of running.
+//
+static __forceinline void __cpuidex(int Info[4], int Leaf, int Sub)
+{
+    __asm__ __volatile__("cpuid" : "=a"(Info[0]), "=b"(Info[1]), "=c"(Info[2]), "=d"(Info[3]) : "a"(Leaf), "c"(Sub));
+}
+
+static __forceinline void __cpuid(int Info[4], int Leaf)
+{
+    __cpuidex(Info, Leaf, 0);
+}
+
+static __forceinline UINT64 __rdtsc(void)                { return __builtin_ia32_rdtsc(); }
+static __forceinline void _mm_pause(void)                { __builtin_ia32_pause(); }
+static __forceinline void _mm_lfence(void)               { __builtin_ia32_lfence(); }
+static __forceinline void _mm_mfence(void)               { __builtin_ia32_mfence(); }
+static __forceinline void _mm_sfence(void)               { __builtin_ia32_sfence(); }
+static __forceinline void _ReadWriteBarrier(void)        { __asm__ __volatile__("" ::: "memory"); }
+static __forceinline void _WriteBarrier(void)            { __asm__ __volatile__("" ::: "memory"); }
+#define MemoryBarrier()                                  __sync_synchronize()
+
+static __forceinline LONG _InterlockedCompareExchange(volatile LONG* p, LONG x, LONG c)         { return __sync_val_compare_and_swap(p, c, x); }
+static __forceinline LONG _InterlockedExchange(volatile LONG* p, LONG v)                        { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+static __forceinline LONG _InterlockedIncrement(volatile LONG* p)                               { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+static __forceinline LONG _InterlockedDecrement(volatile LONG* p)                               { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); }
+static __forceinline LONG _InterlockedExchangeAdd(volatile LONG* p, LONG v)                     { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+static __forceinline LONG _InterlockedOr(volatile LONG* p, LONG v)                              { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST); }
+static __forceinline LONG _InterlockedAnd(volatile LONG* p, LONG v)                             { return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST); }
+static __forceinline LONG64 _InterlockedCompareExchange64(volatile LONG64* p, LONG64 x, LONG64 c) { return __sync_val_compare_and_swap(p, c, x); }
+static __forceinline LONG64 _InterlockedExchange64(volatile LONG64* p, LONG64 v)                { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+static __forceinline LONG64 _InterlockedIncrement64(volatile LONG64* p)                         { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+static __forceinline LONG64 _InterlockedExchangeAdd64(volatile LONG64* p, LONG64 v)             { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+static __forceinline LONG64 _InterlockedOr64(volatile LONG64* p, LONG64 v)                      { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST); }
+static __forceinline LONG64 _InterlockedAnd64(volatile LONG64* p, LONG64 v)                     { return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST); }
+static __forceinline PVOID _InterlockedCompareExchangePointer(PVOID volatile* p, PVOID x, PVOID c) { return __sync_val_compare_and_swap(p, c, x); }
+static __forceinline PVOID _InterlockedExchangePointer(PVOID volatile* p, PVOID v)              { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+
+#define InterlockedCompareExchange          _InterlockedCompareExchange
+#define InterlockedExchange                 _InterlockedExchange
+#define InterlockedIncrement                _InterlockedIncrement
+#define InterlockedDecrement                _InterlockedDecrement
+#define InterlockedExchangeAdd              _InterlockedExchangeAdd
+#define InterlockedOr                       _InterlockedOr
+#define InterlockedAnd                      _InterlockedAnd
+#define InterlockedCompareExchange64        _InterlockedCompareExchange64
+#define InterlockedExchange64               _InterlockedExchange64
+#define InterlockedIncrement64              _InterlockedIncrement64
+#define InterlockedExchangeAdd64            _InterlockedExchangeAdd64
+#define InterlockedOr64                     _InterlockedOr64
+#define InterlockedAnd64                    _InterlockedAnd64
+#define InterlockedCompareExchangePointer   _InterlockedCompareExchangePointer
+#define InterlockedExchangePointer          _InterlockedExchangePointer
+#define ReadNoFence64(p)                    (*(volatile LONG64*)(p))
+#define WriteNoFence64(p, v)                (*(volatile LONG64*)(p) = (v))
+
+static __forceinline unsigned char _BitScanForward(ULONG* i, ULONG m)     { if (!m) return 0; *i = __builtin_ctz(m); return 1; }
+static __forceinline unsigned char _BitScanReverse(ULONG* i, ULONG m)     { if (!m) return 0; *i = 31 - __builtin_clz(m); return 1; }
+static __forceinline unsigned char _BitScanForward64(ULONG* i, UINT64 m)  { if (!m) return 0; *i = __builtin_ctzll(m); return 1; }
+static __forceinline unsigned char _BitScanReverse64(ULONG* i, UINT64 m)  { if (!m) return 0; *i = 63 - __builtin_clzll(m); return 1; }
+static __forceinline unsigned char _bittest64(const LONG64* p, LONG64 b)  { return (unsigned char)((*p >> b) & 1); }
+static __forceinline unsigned char _bittestandset64(LONG64* p, LONG64 b)  { unsigned char o = (unsigned char)((*p >> b) & 1); *p |= 1LL << b; return o; }
+static __forceinline unsigned int __popcnt(unsigned int v)                { return (unsigned int)__builtin_popcount(v); }
+static __forceinline UINT64 __popcnt64(UINT64 v)                          { return (UINT64)__builtin_popcountll(v); }
+static __forceinline UINT64 _rotl64(UINT64 v, int s)                      { return (v << (s & 63)) | (v >> ((64 - s) & 63)); }
+static __forceinline UINT64 __ull_rshift(UINT64 v, int s)                 { return v >> (s & 63); }
+static __forceinline UINT64 _umul128(UINT64 a, UINT64 b, UINT64* hi)      { unsigned __int128 r = (unsigned __int128)a * b; *hi = (UINT64)(r >> 64); return (UINT64)r; }
+
+UINT64 __readmsr(ULONG Msr);
+void   __writemsr(ULONG Msr, UINT64 Value);
+UINT64 __rdtscp(UINT32* Aux);
+UINT64 __readcr0(void);
+UINT64 __readcr2(void);
+UINT64 __readcr3(void);
+UINT64 __readcr4(void);
+UINT64 __readgsqword(unsigned long Offset);
+UINT64 _xgetbv(UINT32 Xcr);
+void   __svm_vmload(UINT64 Pa);
+void   __svm_vmsave(UINT64 Pa);
+void   __svm_vmrun(UINT64 Pa);
+void   _sgdt(void* Gdtr);
+void   __sidt(void* Idtr);
+ULONG  __segmentlimit(ULONG Selector);
+void   __invlpg(void* Va);
+void   _xsave64(void* Area, UINT64 Mask);
+void   _xsaveopt64(void* Area, UINT64 Mask);
+void   _xrstor64(const void* Area, UINT64 Mask);
+UINT8  __inbyte(USHORT Port);
+UINT16 __inword(USHORT Port);
+ULONG  __indword(USHORT Port);
+void   __outbyte(USHORT Port, UINT8 Value);
+void   __outword(USHORT Port, UINT16 Value);
+void   __outdword(USHORT Port, ULONG Value);
+void   __inbytestring(USHORT Port, PUCHAR Buffer, ULONG Count);
+void   __inwordstring(USHORT Port, PUSHORT Buffer, ULONG Count);
+void   __indwordstring(USHORT Port, PULONG Buffer, ULONG Count);
+void   __outbytestring(USHORT Port, PUCHAR Buffer, ULONG Count);
+void   __outwordstring(USHORT Port, PUSHORT Buffer, ULONG Count);
+void   __outdwordstring(USHORT Port, PULONG Buffer, ULONG Count);
@@ -0,0 +1,160 @@
+#include <ntifs.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "vcpu.h"
+#include "guest_walk.h"
+
+//
+// Kernel services backed by the C heap. A buffer's "physical" address is its
+// virtual address, so anything the NPT code registers in its PA->VA index
+// can be followed by a plain pointer dereference.
+//
+ULONG DbgPrint(const char* Format, ...)
+{
+    va_list args;
+
+    if (!getenv("KM_VERBOSE"))
+        return 0;
+
+    va_start(args, Format);
+    vfprintf(stderr, Format, args);
+    va_end(args);
+    return 0;
+}
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE Type, SIZE_T Bytes, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Type);
+    UNREFERENCED_PARAMETER(Tag);
+    return malloc(Bytes);
+}
+
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    free(P);
+}
+
+VOID ExFreePool(PVOID P)
+{
+    free(P);
+}
+
+//
+// Contiguous memory is what ends up in NPT_ENTRY.PageFrame, so it has to sit
+// below 1TB: gcc keeps `entry.PageFrame << 12` at the 40-bit width of the
+// bitfield where MSVC widens it to 64 bits, and heap addresses are higher
+// than that. Each block is mapped at a fixed address below 1TB instead.
+//
+#define KM_CONTIGUOUS_BASE  0x4000000000ULL
+#define KM_CONTIGUOUS_MAX   1024
+
+static UINT64 g_KmContiguousNext = KM_CONTIGUOUS_BASE;
+static struct { PVOID Va; SIZE_T Bytes; } g_KmContiguous[KM_CONTIGUOUS_MAX];
+
+PVOID MmAllocateContiguousMemorySpecifyCache(SIZE_T Bytes, PHYSICAL_ADDRESS Low, PHYSICAL_ADDRESS High,
+                                             PHYSICAL_ADDRESS Boundary, MEMORY_CACHING_TYPE Cache)
+{
+    UNREFERENCED_PARAMETER(Low);
+    UNREFERENCED_PARAMETER(High);
+    UNREFERENCED_PARAMETER(Boundary);
+    UNREFERENCED_PARAMETER(Cache);
+
+    Bytes = (Bytes + PAGE_SIZE - 1) & ~(SIZE_T)(PAGE_SIZE - 1);
+
+    for (ULONG i = 0; i < KM_CONTIGUOUS_MAX; i++)
+    {
+        if (g_KmContiguous[i].Va)
+            continue;
+
+        PVOID va = mmap((PVOID)(ULONG_PTR)g_KmContiguousNext, Bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (va == MAP_FAILED)
+            return NULL;
+
+        // Leave an unmapped page between blocks
+        g_KmContiguousNext += Bytes + PAGE_SIZE;
+        g_KmContiguous[i].Va = va;
+        g_KmContiguous[i].Bytes = Bytes;
+        return va;
+    }
+
+    return NULL;
+}
+
+VOID MmFreeContiguousMemory(PVOID Base)
+{
+    for (ULONG i = 0; i < KM_CONTIGUOUS_MAX; i++)
+    {
+        if (g_KmContiguous[i].Va == Base)
+        {
+            munmap(Base, g_KmContiguous[i].Bytes);
+            g_KmContiguous[i].Va = NULL;
+            return;
+        }
+    }
+}
+
+PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID Va)
+{
+    PHYSICAL_ADDRESS pa = { .QuadPart = (LONGLONG)(ULONG_PTR)Va };
+    return pa;
+}
+
+PVOID MmGetVirtualForPhysical(PHYSICAL_ADDRESS Pa)
+{
+    return (PVOID)(ULONG_PTR)Pa.QuadPart;
+}
+
+//
+// 4GB of RAM with the usual hole below 4GB: [0, 3GB) and [4GB, 5GB)
+//
+PPHYSICAL_MEMORY_RANGE MmGetPhysicalMemoryRanges(VOID)
+{
+    PPHYSICAL_MEMORY_RANGE r = calloc(3, sizeof(PHYSICAL_MEMORY_RANGE));
+    if (!r)
+        return NULL;
+
+    r[0].BaseAddress.QuadPart = 0;
+    r[0].NumberOfBytes.QuadPart = 3ULL << 30;
+    r[1].BaseAddress.QuadPart = 4ULL << 30;
+    r[1].NumberOfBytes.QuadPart = 1ULL << 30;
+    return r;
+}
+
+//
+// Hypervisor services the tested sources link against. The tests run on a
+// single thread with no VCPUs registered with the SMP layer.
+//
+ULONG SmpGetVcpuCount(VOID)
+{
+    return 0;
+}
+
+VCPU* SmpGetVcpu(ULONG Index)
+{
+    UNREFERENCED_PARAMETER(Index);
+    return NULL;
+}
+
+VOID SmpKickOthers(ULONG SelfIndex)
+{
+    UNREFERENCED_PARAMETER(SelfIndex);
+}
+
+ULONG SmpQueryKicks(VOID)
+{
+    return 0;
+}
+
+BOOLEAN GuestWalk(VCPU* V, UINT64 Cr3, UINT64 Gva, UINT32 Access, GUEST_WALK* Walk)
+{
+    UNREFERENCED_PARAMETER(V);
+    UNREFERENCED_PARAMETER(Cr3);
+    UNREFERENCED_PARAMETER(Gva);
+    UNREFERENCED_PARAMETER(Access);
+    RtlZeroMemory(Walk, sizeof(*Walk));
+    return FALSE;
+}
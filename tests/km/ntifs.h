@@ -0,0 +1,141 @@
+#pragma once
+
+//
+// User-mode stand-in for the WDK headers, just enough for the driver sources
+// the tests compile (npt.c, page_map.c, decode.c) to build under gcc on
+// x86-64 Linux. Pool and contiguous memory come from the C heap and the
+// "physical" address of a buffer is its virtual address (see km.c), so the
+// NPT code's PA->VA index and table walks run unchanged.
+//
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define __forceinline               inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(x)           __attribute__((aligned(x)))
+#define EXTERN_C
+#define UNALIGNED
+#define VOID                        void
+#define TRUE                        1
+#define FALSE                       0
+#define PAGE_SIZE                   0x1000
+#define PAGE_SHIFT                  12
+#define MAXUINT32                   ((UINT32)~((UINT32)0))
+#define MAXUINT64                   (~0ULL)
+#define MAXULONG                    0xFFFFFFFFUL
+#define UNREFERENCED_PARAMETER(x)   (void)(x)
+#define FIELD_OFFSET(t, f)          offsetof(t, f)
+#define ARRAYSIZE(a)                (sizeof(a) / sizeof((a)[0]))
+#define RTL_NUMBER_OF(a)            ARRAYSIZE(a)
+#define C_ASSERT(e)                 _Static_assert(e, #e)
+#define CONTAINING_RECORD(a, t, f)  ((t*)((char*)(a) - offsetof(t, f)))
+#define ALL_PROCESSOR_GROUPS        0xffff
+#define __try                       if (1)
+#define __except(x)                 else if (0)
+#define EXCEPTION_EXECUTE_HANDLER   1
+
+#ifndef max
+#define max(a, b)                   (((a) > (b)) ? (a) : (b))
+#define min(a, b)                   (((a) < (b)) ? (a) : (b))
+#endif
+
+typedef unsigned char UINT8, *PUINT8, UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN;
+typedef signed char INT8, CHAR, *PCHAR;
+typedef unsigned short UINT16, *PUINT16, USHORT, *PUSHORT, WCHAR;
+typedef short INT16, SHORT;
+typedef unsigned int UINT32, *PUINT32, ULONG32, DWORD, ULONG, *PULONG;
+typedef int LONG, *PLONG, INT32, INT;
+typedef unsigned long long UINT64, *PUINT64, ULONG64, *PULONG64, ULONGLONG, DWORD64;
+typedef unsigned long long ULONG_PTR, SIZE_T, *PSIZE_T;
+typedef long long INT64, LONG64, LONGLONG, LONG_PTR;
+typedef void *PVOID, *HANDLE;
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL, *PKIRQL;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+typedef union
+{
+    struct { ULONG LowPart; LONG HighPart; };
+    LONGLONG QuadPart;
+} PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS, LARGE_INTEGER;
+
+typedef struct { USHORT Length, MaximumLength; WCHAR* Buffer; } UNICODE_STRING, *PUNICODE_STRING;
+typedef struct _DRIVER_OBJECT { void (*DriverUnload)(struct _DRIVER_OBJECT*); } DRIVER_OBJECT, *PDRIVER_OBJECT;
+typedef struct { PHYSICAL_ADDRESS BaseAddress; LARGE_INTEGER NumberOfBytes; } PHYSICAL_MEMORY_RANGE, *PPHYSICAL_MEMORY_RANGE;
+typedef struct { USHORT Group; UCHAR Number; UCHAR Reserved; } PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+typedef struct { ULONG_PTR Mask; USHORT Group; USHORT Reserved[3]; } GROUP_AFFINITY;
+typedef struct { UINT8 b[0x190]; } KTRAP_FRAME;
+typedef struct { UINT64 Rax, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi, Rip; ULONG EFlags; USHORT SegCs, SegDs, SegEs, SegFs, SegGs, SegSs; } CONTEXT, *PCONTEXT;
+typedef struct _KEPROCESS* PEPROCESS;
+typedef struct _KETHREAD* PETHREAD;
+typedef union { PHYSICAL_ADDRESS PhysicalAddress; PVOID VirtualAddress; } MM_COPY_ADDRESS;
+typedef struct _LIST_ENTRY { struct _LIST_ENTRY *Flink, *Blink; } LIST_ENTRY, *PLIST_ENTRY;
+typedef struct _KDPC { int Unused; } KDPC, *PKDPC;
+typedef enum { MmNonCached, MmCached, MmWriteCombined } MEMORY_CACHING_TYPE;
+typedef enum { NonPagedPool, NonPagedPoolNx = 512 } POOL_TYPE;
+typedef BOOLEAN (*PNMI_CALLBACK)(PVOID Context, BOOLEAN Handled);
+typedef ULONG_PTR (*PKIPI_BROADCAST_WORKER)(ULONG_PTR);
+
+#define NT_SUCCESS(s)                   ((NTSTATUS)(s) >= 0)
+#define STATUS_SUCCESS                  ((NTSTATUS)0)
+#define STATUS_DEVICE_BUSY              ((NTSTATUS)0x80000011L)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_CID              ((NTSTATUS)0xC000000BL)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_COLLISION    ((NTSTATUS)0xC0000035L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_NOT_FOUND                ((NTSTATUS)0xC0000225L)
+#define MM_COPY_MEMORY_PHYSICAL         1
+
+#define RtlZeroMemory(d, n)             memset((d), 0, (n))
+#define RtlSecureZeroMemory(d, n)       memset((d), 0, (n))
+#define RtlFillMemory(d, n, v)          memset((d), (v), (n))
+#define RtlCopyMemory(d, s, n)          memcpy((d), (s), (n))
+#define RtlCompareMemory(a, b, n)       ((SIZE_T)(memcmp((a), (b), (n)) == 0 ? (n) : 0))
+
+ULONG DbgPrint(const char* Format, ...);
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE Type, SIZE_T Bytes, ULONG Tag);
+VOID  ExFreePoolWithTag(PVOID P, ULONG Tag);
+VOID  ExFreePool(PVOID P);
+
+PVOID MmAllocateContiguousMemorySpecifyCache(SIZE_T Bytes, PHYSICAL_ADDRESS Low, PHYSICAL_ADDRESS High,
+                                             PHYSICAL_ADDRESS Boundary, MEMORY_CACHING_TYPE Cache);
+VOID  MmFreeContiguousMemory(PVOID Base);
+PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID Va);
+PVOID MmGetVirtualForPhysical(PHYSICAL_ADDRESS Pa);
+PPHYSICAL_MEMORY_RANGE MmGetPhysicalMemoryRanges(VOID);
+BOOLEAN MmIsAddressValid(PVOID Va);
+PVOID MmMapIoSpace(PHYSICAL_ADDRESS Pa, SIZE_T Bytes, MEMORY_CACHING_TYPE Cache);
+VOID  MmUnmapIoSpace(PVOID Va, SIZE_T Bytes);
+NTSTATUS MmCopyMemory(PVOID Target, MM_COPY_ADDRESS Source, SIZE_T Bytes, ULONG Flags, PSIZE_T Copied);
+PVOID MmAllocateMappingAddress(SIZE_T Bytes, ULONG Tag);
+VOID  MmFreeMappingAddress(PVOID Va, ULONG Tag);
+
+VOID  KeInitializeSpinLock(PKSPIN_LOCK Lock);
+VOID  KeAcquireSpinLock(PKSPIN_LOCK Lock, PKIRQL OldIrql);
+VOID  KeReleaseSpinLock(PKSPIN_LOCK Lock, KIRQL NewIrql);
+ULONG KeGetCurrentProcessorNumber(VOID);
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER Number);
+ULONG KeQueryActiveProcessorCountEx(USHORT Group);
+NTSTATUS KeGetProcessorNumberFromIndex(ULONG Index, PPROCESSOR_NUMBER Number);
+VOID  KeSetSystemGroupAffinityThread(GROUP_AFFINITY* Affinity, GROUP_AFFINITY* Previous);
+VOID  KeRevertToUserGroupAffinityThread(GROUP_AFFINITY* Previous);
+PVOID KeRegisterNmiCallback(PNMI_CALLBACK Callback, PVOID Context);
+NTSTATUS KeDeregisterNmiCallback(PVOID Handle);
+ULONG_PTR KeIpiGenericCall(PKIPI_BROADCAST_WORKER Worker, ULONG_PTR Context);
+VOID  KeStallExecutionProcessor(ULONG Microseconds);
+
+NTSTATUS PsLookupProcessByProcessId(HANDLE Pid, PEPROCESS* Process);
+PEPROCESS PsGetCurrentProcess(VOID);
+HANDLE PsGetCurrentProcessId(VOID);
+HANDLE PsGetProcessId(PEPROCESS Process);
+PEPROCESS PsGetThreadProcess(PETHREAD Thread);
+extern PEPROCESS PsInitialSystemProcess;
+VOID ObDereferenceObject(PVOID Object);
+#define ObfDereferenceObject ObDereferenceObject
+VOID RtlCaptureContext(PCONTEXT Context);
+
+#include <intrin.h>
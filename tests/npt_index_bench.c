@@ -0,0 +1,112 @@
+//
+// PA->VA index lookup cost at 10k and 100k registered tables.
+//
+// The driver only registers whole slabs (per-VCPU arenas of NPT_ARENA_PAGES
+// contiguous frames, the shared identity block), so the first layout places
+// arena-sized runs at random in a 64GB physical range. The second scatters
+// single frames over the same range, the worst case for node count. Lookups
+// hit registered frames in random order; a second pass probes frames that
+// were never registered.
+//
+#include "../src/memory/npt.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_LOOKUPS   (1u << 22)
+#define BENCH_PFN_SPAN  (64ULL << 18)       // 64GB of 4KB frames
+
+static volatile UINT64 g_BenchSink;
+
+static UINT64 BenchRandom(UINT64* s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static double BenchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int BenchRun(ULONG tables, ULONG run)
+{
+    UINT64 seed = 0x9E3779B97F4A7C15ULL ^ tables;
+    UINT64* pas = malloc(sizeof(UINT64) * tables);
+    UINT64* probe = malloc(sizeof(UINT64) * BENCH_LOOKUPS);
+    ULONG n = 0;
+    int failed = 0;
+
+    if (!pas || !probe)
+        return 1;
+
+    while (n < tables)
+    {
+        UINT64 first = BenchRandom(&seed) % (BENCH_PFN_SPAN - run);
+        for (ULONG i = 0; i < run && n < tables; i++)
+            pas[n++] = (first + i) << 12;
+    }
+
+    for (ULONG i = 0; i < tables; i++)
+    {
+        if (!NptRegisterTable(pas[i], (PVOID)(pas[i] | 0xFFFF800000000000ULL)))
+        {
+            printf("registration failed at %lu\n", (unsigned long)i);
+            return 1;
+        }
+    }
+
+    for (ULONG i = 0; i < BENCH_LOOKUPS; i++)
+        probe[i] = pas[BenchRandom(&seed) % tables];
+
+    // Hits
+    UINT64 sum = 0;
+    double t0 = BenchNow();
+    for (ULONG i = 0; i < BENCH_LOOKUPS; i++)
+        sum += (UINT64)NptLookupTable(probe[i]);
+    double hit = (BenchNow() - t0) / BENCH_LOOKUPS;
+
+    for (ULONG i = 0; i < tables; i++)
+    {
+        if (NptLookupTable(pas[i]) != (PVOID)(pas[i] | 0xFFFF800000000000ULL))
+            failed = 1;
+    }
+
+    // Misses: frames above the populated span share only the upper levels
+    for (ULONG i = 0; i < BENCH_LOOKUPS; i++)
+        probe[i] = (BENCH_PFN_SPAN + BenchRandom(&seed) % BENCH_PFN_SPAN) << 12;
+
+    t0 = BenchNow();
+    for (ULONG i = 0; i < BENCH_LOOKUPS; i++)
+        sum += (UINT64)NptLookupTable(probe[i]);
+    double miss = (BenchNow() - t0) / BENCH_LOOKUPS;
+
+    printf("%7lu tables, %-9s (%6ld entries, %5ld nodes, %6llu KB): hit %.1f ns, miss %.1f ns%s\n",
+           (unsigned long)tables, run == 1 ? "scattered" : "slabs", (long)g_NptIndexEntries, (long)g_NptIndexNodes,
+           (unsigned long long)g_NptIndexNodes * sizeof(NPT_INDEX_NODE) / 1024,
+           hit, miss, failed ? "  LOOKUP MISMATCH" : "");
+
+    g_BenchSink = sum;
+    NptIndexFreeNode(&g_NptIndexRoot, 0);
+    g_NptIndexNodes = 0;
+    g_NptIndexEntries = 0;
+    free(pas);
+    free(probe);
+    return failed;
+}
+
+int main(void)
+{
+    int rc = 0;
+
+    rc |= BenchRun(10000, NPT_ARENA_PAGES);
+    rc |= BenchRun(100000, NPT_ARENA_PAGES);
+    rc |= BenchRun(10000, 1);
+    rc |= BenchRun(100000, 1);
+    return rc;
+}
@@ -0,0 +1,363 @@
+//
+// Random split / hook / restore / merge sequences against the real NPT code.
+//
+// Every step is checked against a model of what the nested tables should
+// map: hooked pages go to their replacement frame, everything else stays
+// identity, at every leaf size. Once every hook is gone the whole range has
+// to coalesce back to 1GB leaves with no split tables left in the arena.
+// Smaller checks follow: hook-map churn must not run out of slots, a hook
+// batch larger than the arena must be refused without splitting, a
+// dirty-log start that runs out of arena must leave nothing write-protected,
+// and the sampler must reject bad ranges and step over unmapped holes.
+//
+#include "../src/memory/npt.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_STEPS      20000
+#define TEST_GB         4           // 1GB regions exercised (includes the hole)
+#define TEST_REGIONS    3           // 2MB regions per GB
+#define TEST_PAGES      6           // 4KB pages per 2MB region
+#define TEST_SLOTS      (TEST_GB * TEST_REGIONS * TEST_PAGES)
+#define TEST_HOOK_BASE  0x7000000000ULL
+
+static NPT_STATE g_State;
+static UINT64 g_Gpa[TEST_SLOTS];
+static UINT64 g_Hook[TEST_SLOTS];   // 0 = identity
+static UINT64 g_Seed = 0x2545F4914F6CDD1DULL;
+
+static UINT64 TestRandom(void)
+{
+    g_Seed ^= g_Seed << 13;
+    g_Seed ^= g_Seed >> 7;
+    g_Seed ^= g_Seed << 17;
+    return g_Seed;
+}
+
+static UINT64 TestExpected(UINT64 gpa)
+{
+    for (ULONG i = 0; i < TEST_SLOTS; i++)
+    {
+        if (g_Hook[i] && g_Gpa[i] == (gpa & ~0xFFFULL))
+            return g_Hook[i] | (gpa & 0xFFF);
+    }
+
+    return gpa;
+}
+
+static int TestCheckGpa(UINT64 gpa, ULONG step)
+{
+    UINT64 level = 0;
+    NPT_ENTRY* leaf = NptGetEntry(&g_State, gpa, &level);
+
+    if (!leaf || !leaf->Present || !leaf->Write || !leaf->User)
+    {
+        printf("step %lu: GPA 0x%llX has no usable leaf\n", (unsigned long)step, (unsigned long long)gpa);
+        return 1;
+    }
+
+    UINT64 size = (level == 1) ? (1ULL << 30) : (level == 2) ? (1ULL << 21) : (1ULL << 12);
+    UINT64 hpa = ((UINT64)leaf->PageFrame << 12) + (gpa & (size - 1));
+
+    if (hpa != TestExpected(gpa))
+    {
+        printf("step %lu: GPA 0x%llX -> 0x%llX (level %llu), expected 0x%llX\n", (unsigned long)step,
+               (unsigned long long)gpa, (unsigned long long)hpa, (unsigned long long)level,
+               (unsigned long long)TestExpected(gpa));
+        return 1;
+    }
+
+    return 0;
+}
+
+//
+// Remove/insert churn with one entry always live, so the map never empties
+// and only the in-place rehash can reclaim tombstones
+//
+static int TestPageMapChurn(void)
+{
+    PAGE_MAP map;
+    UINT64* value;
+
+    if (!NT_SUCCESS(PageMapInit(&map, 64)))
+        return 1;
+
+    PageMapInsert(&map, 0, 1);
+
+    for (UINT64 i = 1; i <= 100000; i++)
+    {
+        if (!PageMapInsert(&map, i << 12, i) || !PageMapRemove(&map, i << 12, NULL))
+        {
+            printf("page map churn failed at %llu: %lu live, %lu used\n",
+                   (unsigned long long)i, (unsigned long)map.Count, (unsigned long)map.Used);
+            PageMapDestroy(&map);
+            return 1;
+        }
+    }
+
+    value = PageMapFind(&map, 0);
+    if (!value || *value != 1 || map.Count != 1 || !map.Rehashes)
+    {
+        printf("page map lost its live entry after churn (%lu rehashes)\n",
+               (unsigned long)map.Rehashes);
+        PageMapDestroy(&map);
+        return 1;
+    }
+
+    PageMapDestroy(&map);
+    return 0;
+}
+
+//
+// One hook in each of NPT_ARENA_PAGES fresh 2MB regions needs a PT apiece
+// plus PDs, more than the arena holds
+//
+static int TestHookBatchRefused(void)
+{
+    static NPT_HOOK_DESC hooks[NPT_ARENA_PAGES];
+    ULONG inUse = g_State.Arena.InUse;
+
+    for (ULONG i = 0; i < NPT_ARENA_PAGES; i++)
+    {
+        hooks[i].TargetGpa = (UINT64)i << 21;
+        hooks[i].NewHpa = TEST_HOOK_BASE + (UINT64)i * PAGE_SIZE;
+    }
+
+    if (NptAddShadowHooks(&g_State, hooks, NPT_ARENA_PAGES) != 0 ||
+        g_State.Arena.InUse != inUse || g_State.Hooks.Count)
+    {
+        printf("oversized hook batch was not refused up front (%lu pages in use, was %lu)\n",
+               (unsigned long)g_State.Arena.InUse, (unsigned long)inUse);
+        return 1;
+    }
+
+    // A batch that fits still goes in
+    if (NptAddShadowHooks(&g_State, hooks, 8) != 8)
+    {
+        printf("small hook batch was refused\n");
+        return 1;
+    }
+
+    NptClearShadowHooks(&g_State);
+    return 0;
+}
+
+//
+// Leave the arena a few pages short of what a full dirty-log range needs
+//
+static int TestDirtyStartRollback(void)
+{
+    static NPT_ENTRY* held[NPT_ARENA_PAGES];
+    PHYSICAL_ADDRESS pa;
+    ULONG count = 0;
+    int rc = 0;
+
+    while (g_State.Arena.PageCount - g_State.Arena.InUse > 32)
+        held[count++] = NptArenaAlloc(&g_State.Arena, &pa);
+
+    ULONG inUse = g_State.Arena.InUse;
+    LONG failures = g_NptDirty.StartFailures;
+
+    if (NptDirtyStart(&g_State, 0, NPT_DIRTY_MAX_PAGES, 0) || g_State.Dirty.Active ||
+        g_NptDirty.StartFailures != failures + 1 || g_State.Arena.InUse != inUse)
+    {
+        printf("failed dirty start was not rolled back (%lu pages in use, was %lu)\n",
+               (unsigned long)g_State.Arena.InUse, (unsigned long)inUse);
+        rc = 1;
+    }
+
+    for (ULONG i = 0; !rc && i < NPT_DIRTY_MAX_PAGES; i++)
+    {
+        UINT64 level;
+        NPT_ENTRY* leaf = NptGetEntry(&g_State, (UINT64)i << 12, &level);
+
+        if (!leaf || !leaf->Write)
+        {
+            printf("page %lu left write-protected after a failed dirty start\n", (unsigned long)i);
+            rc = 1;
+        }
+    }
+
+    while (count)
+        NptArenaFree(&g_State.Arena, held[--count]);
+
+    return rc;
+}
+
+//
+// Slot 2 of the PML4 (1TB) is beyond RAM and never faulted in, so a range
+// there is one hole the sampler crosses in a single step
+//
+static int TestSamplerRanges(void)
+{
+    int rc = 0;
+
+    if (NT_SUCCESS(NptSamplerAddRange(0, (UINT64)NPT_SAMPLE_MAX_BUCKETS * 512 + 1)) ||
+        NT_SUCCESS(NptSamplerAddRange(~0ULL - 0x3FFF, 16)) ||
+        NT_SUCCESS(NptSamplerAddRange(0, 1ULL << 52)))
+    {
+        printf("sampler accepted an oversized or wrapping range\n");
+        rc = 1;
+    }
+
+    if (!rc && (!NT_SUCCESS(NptSamplerAddRange(1ULL << 40, 1024 * 512)) ||
+                NT_SUCCESS(NptSamplerAddRange(0, 1024 * 512 + 1))))
+    {
+        printf("sampler bucket budget not enforced\n");
+        rc = 1;
+    }
+
+    NptSamplerControl(TRUE, 0);
+    NptSampleStep(&g_State);
+
+    if (!rc && g_State.Sampler.Passes != 1)
+    {
+        printf("sampler did not cross the unmapped range in one step\n");
+        rc = 1;
+    }
+
+    NptSamplerControl(FALSE, 0);
+    return rc;
+}
+
+static int TestCheckAll(ULONG step)
+{
+    int rc = 0;
+
+    // Every candidate page, its neighbours, and random addresses in range
+    for (ULONG i = 0; i < TEST_SLOTS; i++)
+    {
+        rc |= TestCheckGpa(g_Gpa[i] + 0x123, step);
+        rc |= TestCheckGpa(g_Gpa[i] + 0x1000, step);
+        rc |= TestCheckGpa(g_Gpa[i] - 0x1000 + 0xFF8, step);
+    }
+
+    for (ULONG i = 0; i < 64; i++)
+        rc |= TestCheckGpa(TestRandom() % ((UINT64)TEST_GB << 30), step);
+
+    return rc;
+}
+
+int main(void)
+{
+    ULONG adds = 0, removes = 0, splits = 0, merges = 0;
+
+    if (!NT_SUCCESS(NptGlobalInit()) || !NT_SUCCESS(NptInitialize(&g_State)))
+    {
+        printf("NPT init failed\n");
+        return 1;
+    }
+
+    // Pages clustered in a few 2MB regions of each GB so regions fill up,
+    // split and coalesce repeatedly; slot 0 of each region is its first page
+    for (ULONG gb = 0; gb < TEST_GB; gb++)
+    {
+        for (ULONG r = 0; r < TEST_REGIONS; r++)
+        {
+            UINT64 region = ((UINT64)gb << 30) + ((TestRandom() % 512) << 21);
+
+            for (ULONG p = 0; p < TEST_PAGES; p++)
+            {
+                UINT64 page = p ? (TestRandom() % 512) << 12 : 0;
+                g_Gpa[(gb * TEST_REGIONS + r) * TEST_PAGES + p] = region + page;
+            }
+        }
+    }
+
+    for (ULONG step = 0; step < TEST_STEPS; step++)
+    {
+        ULONG slot = (ULONG)(TestRandom() % TEST_SLOTS);
+        UINT64 gpa = g_Gpa[slot];
+
+        switch (TestRandom() % 4)
+        {
+        case 0:
+        {
+            UINT64 hpa = TEST_HOOK_BASE + (TestRandom() % 0x100000) * PAGE_SIZE;
+            if (NptAddShadowHook(&g_State, gpa, hpa))
+            {
+                for (ULONG i = 0; i < TEST_SLOTS; i++)
+                {
+                    if (g_Gpa[i] == gpa)
+                        g_Hook[i] = hpa;
+                }
+                adds++;
+            }
+            break;
+        }
+
+        case 1:
+            if (NptRemoveShadowHook(&g_State, gpa))
+            {
+                for (ULONG i = 0; i < TEST_SLOTS; i++)
+                {
+                    if (g_Gpa[i] == gpa)
+                        g_Hook[i] = 0;
+                }
+                removes++;
+            }
+            break;
+
+        case 2:
+            // Split down to a 4KB PTE without changing the mapping
+            if (NptGetPageEntryForWrite(&g_State, gpa))
+                splits++;
+            break;
+
+        case 3:
+            NptTryMerge(&g_State, gpa);
+            merges++;
+            break;
+        }
+
+        if (TestCheckAll(step))
+            return 1;
+    }
+
+    // Drop every hook, then coalesce whatever split-only regions remain
+    NptClearShadowHooks(&g_State);
+    RtlZeroMemory(g_Hook, sizeof(g_Hook));
+
+    for (ULONG i = 0; i < TEST_SLOTS; i++)
+        NptTryMerge(&g_State, g_Gpa[i]);
+
+    if (TestCheckAll(TEST_STEPS))
+        return 1;
+
+    for (UINT64 gb = 0; gb < TEST_GB; gb++)
+    {
+        UINT64 level = 0;
+        NPT_ENTRY* leaf = NptGetEntry(&g_State, gb << 30, &level);
+
+        if (!leaf || level != 1)
+        {
+            printf("GB %llu did not coalesce back to a 1GB leaf (level %llu)\n",
+                   (unsigned long long)gb, (unsigned long long)level);
+            return 1;
+        }
+    }
+
+    // Only the copy-on-write clones of the PML4 / PDPTs may still be held
+    if (g_State.Splits != g_State.Merges || g_State.Arena.InUse != g_State.CowClones)
+    {
+        printf("arena not back to baseline: %lu splits, %lu merges, %lu in use, %lu clones\n",
+               (unsigned long)g_State.Splits, (unsigned long)g_State.Merges,
+               (unsigned long)g_State.Arena.InUse, (unsigned long)g_State.CowClones);
+        return 1;
+    }
+
+    printf("%d steps: %lu hooks added, %lu removed, %lu split-only, %lu merge attempts; "
+           "%lu splits / %lu merges, arena high-water %lu pages\n",
+           TEST_STEPS, (unsigned long)adds, (unsigned long)removes, (unsigned long)splits,
+           (unsigned long)merges, (unsigned long)g_State.Splits, (unsigned long)g_State.Merges,
+           (unsigned long)g_State.Arena.HighWater);
+
+    if (TestPageMapChurn() || TestHookBatchRefused() || TestDirtyStartRollback() ||
+        TestSamplerRanges())
+        return 1;
+
+    NptDestroy(&g_State);
+    NptGlobalDestroy();
+    return 0;
+}
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+#
+# Build-time guard for the VMEXIT path.
+#
+# Everything reachable from HandleVmExit runs in host context with the guest
+# frozen and GIF clear, so it may only use precomputed per-VCPU data and
+# hypervisor-owned primitives. This script builds a call graph from the C
+# sources (plain text, no compiler needed), walks it from the exit handler
+# and fails the build if any reachable function calls an NT kernel routine.
+#
+# usage: exit_path_check.py [repo root]
+#
+
+import os
+import re
+import sys
+
+ROOTS = ["HandleVmExit"]
+
+# Kernel routine families that must never run on the exit path
+BANNED = re.compile(r"^(Nt|Zw|Mm|Ps|Ke|Ex|Ob|Io)[A-Z]\w*$|^(DbgPrint|DbgPrintEx|KdPrint)$")
+
+# Known-safe names that match the pattern above (pure macros / intrinsics)
+ALLOWED = {
+    "KeGetCurrentIrql",     # reads CR8
+}
+
+# Debug-only logging that compiles away unless HV_EXIT_PATH_DEBUG is set
+IGNORED_CALLS = {"HV_EXIT_LOG"}
+
+KEYWORDS = {
+    "if", "for", "while", "switch", "return", "sizeof", "case", "do", "else",
+    "goto", "defined", "__declspec", "DECLSPEC_ALIGN", "UNREFERENCED_PARAMETER",
+}
+
+FUNC_DEF = re.compile(
+    r"^[ \t]*(?:static\s+|EXTERN_C\s+|__forceinline\s+|inline\s+|FORCEINLINE\s+)*"
+    r"[A-Za-z_][\w \t\*]*?\b([A-Za-z_]\w*)\s*\(([^;{}()]*(?:\([^()]*\)[^;{}()]*)*)\)\s*\{",
+    re.M,
+)
+CALL = re.compile(r"\b([A-Za-z_]\w*)\s*\(")
+
+# Exit, MSR and I/O handlers and deferred work are reached through tables,
+# not by direct call; anything handed to HvRegisterExitHandler /
+# HvRegisterMsrHandler / HvRegisterIoHandler / HvRegisterDeferredWork is
+# another root
+REGISTER = re.compile(r"\bHvRegisterExitHandler\s*\([^,()]+,\s*([A-Za-z_]\w*)")
+REGISTER_MSR = re.compile(r"\bHvRegisterMsrHandler\s*\([^,()]+,\s*([A-Za-z_]\w*)\s*,\s*([A-Za-z_]\w*)")
+REGISTER_IO = re.compile(r"\bHvRegisterIoHandler\s*\([^,()]+,[^,()]+,\s*([A-Za-z_]\w*)")
+REGISTER_DEFER = re.compile(r"\bHvRegisterDeferredWork\s*\([^,()]+,\s*([A-Za-z_]\w*)")
+
+
+def strip(text):
+    text = re.sub(r"/\*.*?\*/", lambda m: "\n" * m.group(0).count("\n"), text, flags=re.S)
+    text = re.sub(r"//[^\n]*", "", text)
+    text = re.sub(r'"(?:\\.|[^"\\\n])*"', '""', text)
+    text = re.sub(r"'(?:\\.|[^'\\\n])*'", "0", text)
+    return text
+
+
+def drop_disabled_debug(text):
+    # #ifdef HV_EXIT_PATH_DEBUG ... #endif blocks are not part of release builds
+    return re.sub(r"#ifdef\s+HV_EXIT_PATH_DEBUG.*?#endif", "", text, flags=re.S)
+
+
+def body_at(text, start):
+    depth = 0
+    for i in range(start, len(text)):
+        if text[i] == "{":
+            depth += 1
+        elif text[i] == "}":
+            depth -= 1
+            if depth == 0:
+                return text[start:i + 1]
+    return text[start:]
+
+
+def collect(root):
+    funcs = {}
+    handlers = set()
+    for sub in ("src", "include"):
+        for dirpath, _, files in os.walk(os.path.join(root, sub)):
+            for name in files:
+                if not name.endswith((".c", ".h")):
+                    continue
+                path = os.path.join(dirpath, name)
+                with open(path, encoding="utf-8-sig", errors="replace") as f:
+                    text = drop_disabled_debug(strip(f.read()))
+                for m in FUNC_DEF.finditer(text):
+                    fn = m.group(1)
+                    if fn in KEYWORDS:
+                        continue
+                    body = body_at(text, m.end() - 1)
+                    calls = {c for c in CALL.findall(body) if c not in KEYWORDS}
+                    line = text.count("\n", 0, m.start()) + 1
+                    funcs[fn] = (os.path.relpath(path, root), line, calls)
+                handlers.update(REGISTER.findall(text))
+                for pair in REGISTER_MSR.findall(text):
+                    handlers.update(h for h in pair if h != "NULL")
+                handlers.update(REGISTER_IO.findall(text))
+                handlers.update(REGISTER_DEFER.findall(text))
+    return funcs, handlers
+
+
+def main():
+    root = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "..")
+    funcs, handlers = collect(root)
+
+    missing = [r for r in ROOTS if r not in funcs]
+    if missing:
+        print("exit_path_check: root function(s) not found: %s" % ", ".join(missing))
+        return 1
+
+    roots = ROOTS + sorted(h for h in handlers if h in funcs and h not in ROOTS)
+    parent = {r: None for r in roots}
+    queue = list(roots)
+    violations = []
+
+    while queue:
+        fn = queue.pop(0)
+        for callee in sorted(funcs[fn][2]):
+            if callee in IGNORED_CALLS or callee in ALLOWED:
+                continue
+            if BANNED.match(callee):
+                violations.append((fn, callee))
+                continue
+            if callee in funcs and callee not in parent:
+                parent[callee] = fn
+                queue.append(callee)
+
+    for fn, callee in violations:
+        chain = []
+        node = fn
+        while node:
+            chain.append(node)
+            node = parent[node]
+        path, line = funcs[fn][0], funcs[fn][1]
+        print("%s(%d): error EXIT001: %s called on the VMEXIT path: %s -> %s" %
+              (path, line, callee, " -> ".join(reversed(chain)), callee))
+
+    if violations:
+        print("exit_path_check: %d forbidden call(s) reachable from %s" % (len(violations), ", ".join(ROOTS)))
+        return 1
+
+    print("exit_path_check: %d functions reachable from %s, no kernel routines" % (len(parent), ", ".join(ROOTS)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
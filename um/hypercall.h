@@ -15,8 +15,10 @@ typedef enum _hv_vmcall_code {
     hv_vmcall_write_gva = 0x101,
     hv_vmcall_enable_cr3_xor = 0x102,
     hv_vmcall_disable_cr3_xor = 0x103,
-    hv_vmcall_install_shadow_hook = 0x110,
-    hv_vmcall_clear_shadow_hook = 0x111,
+    hv_vmcall_add_shadow_hook = 0x110,
+    hv_vmcall_remove_shadow_hook = 0x111,
+    hv_vmcall_add_shadow_hooks = 0x112,
+    hv_vmcall_clear_shadow_hooks = 0x113,
     hv_vmcall_stealth_enable = 0x200,
     hv_vmcall_stealth_disable = 0x201,
     hv_vmcall_last_mailbox = 0x210,
@@ -24,6 +26,40 @@ typedef enum _hv_vmcall_code {
     hv_vmcall_translate_gva_to_gpa = 0x220,
     hv_vmcall_translate_gva_to_hpa = 0x221,
     hv_vmcall_translate_gpa_to_hpa = 0x222,
+    hv_vmcall_query_guest_tlb = 0x223,
+    hv_vmcall_flush_guest_tlb = 0x224,
+    hv_vmcall_query_npt_arena = 0x230,
+    hv_vmcall_query_npt_sync = 0x231,
+    hv_vmcall_dirty_log_start = 0x240,
+    hv_vmcall_dirty_log_stop = 0x241,
+    hv_vmcall_dirty_log_harvest = 0x242,
+    hv_vmcall_query_dirty_log = 0x243,
+    hv_vmcall_sampler_add_range = 0x250,
+    hv_vmcall_sampler_start = 0x251,
+    hv_vmcall_sampler_stop = 0x252,
+    hv_vmcall_sampler_read = 0x253,
+    hv_vmcall_trace_drain = 0x260,
+    hv_vmcall_query_trace = 0x261,
+    hv_vmcall_trace_enable = 0x262,
+    hv_vmcall_query_stats = 0x270,
+    hv_vmcall_read_histogram = 0x271,
+    hv_vmcall_reset_stats = 0x272,
+    hv_vmcall_query_hotspots = 0x280,
+    hv_vmcall_reset_hotspots = 0x281,
+    hv_vmcall_vmcb_caching = 0x290,
+    hv_vmcall_lazy_host_state = 0x291,
+    hv_vmcall_hash_guest_pages = 0x2A0,
+    hv_vmcall_query_xstate = 0x2A1,
+    hv_vmcall_query_cpuid_cache = 0x2B0,
+    hv_vmcall_query_msr_stats = 0x2C0,
+    hv_vmcall_intercept_ports = 0x2D0,
+    hv_vmcall_query_io_stats = 0x2D1,
+    hv_vmcall_query_emulation = 0x2E0,
+    hv_vmcall_flush_decode_cache = 0x2E1,
+    hv_vmcall_query_events = 0x2F0,
+    hv_vmcall_post_interrupt = 0x2F1,
+    hv_vmcall_post_nmi = 0x2F2,
+    hv_vmcall_query_deferred_work = 0x310,
     hv_vmcall_query_current_process_base = 0x320,
     hv_vmcall_query_process_base = 0x321,
     hv_vmcall_query_process_dirbase = 0x322,
@@ -47,6 +83,186 @@ static inline uint64_t hv_translate_gva_to_hpa(uint64_t gva) {
     return hv_vmcall(hv_vmcall_translate_gva_to_hpa, gva, 0, 0);
 }
 
+typedef struct _hv_shadow_hook {
+    uint64_t target_gva;
+    uint64_t new_hpa;
+} hv_shadow_hook;
+
+// hook changes reach every cpu; lazy ones skip the nmi kick and land on
+// each cpu's next vmexit instead
+#define HV_HOOK_LAZY 1ull
+
+static inline uint64_t hv_add_shadow_hook(uint64_t target_gva, uint64_t new_hpa, uint64_t flags) {
+    return hv_vmcall(hv_vmcall_add_shadow_hook, target_gva, new_hpa, flags);
+}
+
+static inline uint64_t hv_remove_shadow_hook(uint64_t target_gva, uint64_t flags) {
+    return hv_vmcall(hv_vmcall_remove_shadow_hook, target_gva, 0, flags);
+}
+
+// returns the number of hooks published; one kick and flush cover the batch
+static inline uint64_t hv_add_shadow_hooks(const hv_shadow_hook* hooks, uint64_t count, uint64_t flags) {
+    return hv_vmcall(hv_vmcall_add_shadow_hooks, (uint64_t)(uintptr_t)hooks, count, flags);
+}
+
+typedef enum _hv_npt_arena_field {
+    hv_npt_arena_high_water = 0,
+    hv_npt_arena_in_use = 1,
+    hv_npt_arena_capacity = 2,
+    hv_npt_arena_failures = 3,
+    hv_npt_arena_splits = 4,
+    hv_npt_arena_merges = 5,
+} hv_npt_arena_field;
+
+static inline uint64_t hv_query_npt_arena(hv_npt_arena_field field) {
+    return hv_vmcall(hv_vmcall_query_npt_arena, field, 0, 0);
+}
+
+typedef enum _hv_npt_sync_field {
+    hv_npt_sync_generation = 0,
+    hv_npt_sync_last_visible_ticks = 1,
+    hv_npt_sync_max_visible_ticks = 2,
+    hv_npt_sync_kicks = 3,
+    hv_npt_sync_resyncs = 4,
+} hv_npt_sync_field;
+
+static inline uint64_t hv_query_npt_sync(hv_npt_sync_field field) {
+    return hv_vmcall(hv_vmcall_query_npt_sync, field, 0, 0);
+}
+
+// dirty logging over one guest physical range (max 32768 pages)
+#define HV_DIRTY_USE_DBIT 1ull
+
+static inline uint64_t hv_dirty_log_start(uint64_t base_gpa, uint64_t pages, uint64_t flags) {
+    return hv_vmcall(hv_vmcall_dirty_log_start, base_gpa, pages, flags);
+}
+
+static inline uint64_t hv_dirty_log_stop(void) {
+    return hv_vmcall(hv_vmcall_dirty_log_stop, 0, 0, 0);
+}
+
+// fills one bit per page and resets the log; returns dirty pages or ~0
+static inline uint64_t hv_dirty_log_harvest(void* bitmap, uint64_t bytes) {
+    return hv_vmcall(hv_vmcall_dirty_log_harvest, (uint64_t)(uintptr_t)bitmap, bytes, 0);
+}
+
+// accessed-bit sampler histogram, one entry per 2mb of the sampled ranges
+// in the order they were added
+typedef struct _hv_sample_region {
+    uint16_t touched;   // 4kb pages accessed in the last full pass
+    uint8_t heat;       // passes with any access (saturating, decays)
+    uint8_t pad;
+} hv_sample_region;
+
+static inline uint64_t hv_sampler_add_range(uint64_t base_gpa, uint64_t pages) {
+    return hv_vmcall(hv_vmcall_sampler_add_range, base_gpa, pages, 0);
+}
+
+static inline uint64_t hv_sampler_start(uint64_t period_tsc) {
+    return hv_vmcall(hv_vmcall_sampler_start, period_tsc, 0, 0);
+}
+
+static inline uint64_t hv_sampler_stop(void) {
+    return hv_vmcall(hv_vmcall_sampler_stop, 0, 0, 0);
+}
+
+// returns the number of completed passes
+static inline uint64_t hv_sampler_read(hv_sample_region* regions, uint64_t count) {
+    return hv_vmcall(hv_vmcall_sampler_read, (uint64_t)(uintptr_t)regions, count, 0);
+}
+
+// one vmexit, as recorded by the per-cpu trace ring
+typedef struct _hv_trace_record {
+    uint64_t seq;
+    uint64_t tsc;
+    uint64_t exit_code;
+    uint64_t rip;
+    uint64_t exit_info1;
+    uint64_t exit_info2;
+    uint64_t cr3;
+    uint32_t outcome;   // bit 0 = rip advanced, bit 8 = event injected, bits 16-23 = vector
+    uint32_t reserved;
+} hv_trace_record;
+
+typedef enum _hv_trace_field {
+    hv_trace_written = 0,
+    hv_trace_drained = 1,
+    hv_trace_lost = 2,
+    hv_trace_enabled = 3,
+} hv_trace_field;
+
+// moves up to count records of one cpu's ring into records; returns the
+// number copied or ~0
+static inline uint64_t hv_trace_drain(uint64_t cpu, hv_trace_record* records, uint64_t count) {
+    return hv_vmcall(hv_vmcall_trace_drain, cpu, (uint64_t)(uintptr_t)records, count);
+}
+
+static inline uint64_t hv_query_trace(uint64_t cpu, hv_trace_field field) {
+    return hv_vmcall(hv_vmcall_query_trace, cpu, field, 0);
+}
+
+static inline uint64_t hv_trace_enable(int enable) {
+    return hv_vmcall(hv_vmcall_trace_enable, enable ? 1 : 0, 0, 0);
+}
+
+// log-linear latency histogram: buckets 0-3 hold exact values, after that
+// four buckets per power of two (see hv_histogram_bucket_floor)
+#define hv_hist_buckets 128
+#define hv_hist_calls 0x10000
+
+typedef struct _hv_histogram {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint32_t buckets[hv_hist_buckets];
+} hv_histogram;
+
+typedef enum _hv_stat_field {
+    hv_stat_guest_tsc = 0,
+    hv_stat_host_tsc = 1,
+    hv_stat_exits = 2,
+    hv_stat_exit_slots = 3,
+    hv_stat_call_slots = 4,
+} hv_stat_field;
+
+static inline uint64_t hv_histogram_bucket_floor(uint32_t bucket) {
+    if (bucket < 4)
+        return bucket;
+    return (uint64_t)(4 + (bucket & 3)) << ((bucket >> 2) - 1);
+}
+
+static inline uint64_t hv_query_stats(uint64_t cpu, hv_stat_field field) {
+    return hv_vmcall(hv_vmcall_query_stats, cpu, field, 0);
+}
+
+// slot 0-31, or hv_hist_calls | slot for hypercalls; returns the exit or
+// hypercall code of the slot (exit code 0x404 = "other"), or ~0 if empty
+static inline uint64_t hv_read_histogram(uint64_t cpu, uint64_t slot, hv_histogram* out) {
+    return hv_vmcall(hv_vmcall_read_histogram, cpu, slot, (uint64_t)(uintptr_t)out);
+}
+
+static inline uint64_t hv_reset_stats(uint64_t cpu) {
+    return hv_vmcall(hv_vmcall_reset_stats, cpu, 0, 0);
+}
+
+// guest code that causes the most vmexits, merged over all cpus
+#define hv_hotspot_max 32
+
+typedef struct _hv_hotspot {
+    uint64_t rip;
+    uint64_t exit_code;
+    uint64_t cr3;
+    uint64_t count;     // estimated exits (count-min, may overcount slightly)
+} hv_hotspot;
+
+static inline uint64_t hv_query_hotspots(hv_hotspot* out, uint64_t count) {
+    return hv_vmcall(hv_vmcall_query_hotspots, (uint64_t)(uintptr_t)out, count, 0);
+}
+
+static inline uint64_t hv_reset_hotspots(void) {
+    return hv_vmcall(hv_vmcall_reset_hotspots, 0, 0, 0);
+}
+
 #ifdef __cplusplus
 }
 #endif
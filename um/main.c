@@ -2,6 +2,7 @@
 #include <intrin.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "hypercall.h"
@@ -67,6 +68,311 @@ static void probe_mailbox_state(void) {
     }
 }
 
+static void dump_npt_arena(void) {
+    uint64_t high_water = safe_vmcall(hv_vmcall_query_npt_arena, hv_npt_arena_high_water, 0, 0);
+    uint64_t in_use = safe_vmcall(hv_vmcall_query_npt_arena, hv_npt_arena_in_use, 0, 0);
+    uint64_t capacity = safe_vmcall(hv_vmcall_query_npt_arena, hv_npt_arena_capacity, 0, 0);
+    uint64_t failures = safe_vmcall(hv_vmcall_query_npt_arena, hv_npt_arena_failures, 0, 0);
+    uint64_t splits = safe_vmcall(hv_vmcall_query_npt_arena, hv_npt_arena_splits, 0, 0);
+    uint64_t merges = safe_vmcall(hv_vmcall_query_npt_arena, hv_npt_arena_merges, 0, 0);
+
+    printf("[+] npt arena (this cpu) : %llu/%llu pages in use, high-water %llu, %llu failed\n",
+        in_use, capacity, high_water, failures);
+    printf("[+] npt large pages      : %llu splits, %llu merges\n", splits, merges);
+
+    uint64_t generation = safe_vmcall(hv_vmcall_query_npt_sync, hv_npt_sync_generation, 0, 0);
+    uint64_t last_ticks = safe_vmcall(hv_vmcall_query_npt_sync, hv_npt_sync_last_visible_ticks, 0, 0);
+    uint64_t max_ticks = safe_vmcall(hv_vmcall_query_npt_sync, hv_npt_sync_max_visible_ticks, 0, 0);
+    uint64_t kicks = safe_vmcall(hv_vmcall_query_npt_sync, hv_npt_sync_kicks, 0, 0);
+
+    printf("[+] npt sync             : generation %llu, all-cpu visibility %llu ticks (max %llu), %llu kicks\n",
+        generation, last_ticks, max_ticks, kicks);
+}
+
+static void measure_exit_round_trip(void) {
+    const int iterations = 100000;
+    uint64_t cpuid_total = 0, cpuid_min = UINT64_MAX;
+    uint64_t vmcall_total = 0, vmcall_min = UINT64_MAX;
+    int cpu_info[4];
+
+    // cpuid and vmmcall are both intercepted, so each iteration is one full
+    // vmexit -> handler -> vmrun round trip
+    for (int i = 0; i < iterations; i++) {
+        _mm_lfence();
+        uint64_t start = __rdtsc();
+        __cpuid(cpu_info, 0);
+        _mm_lfence();
+        uint64_t delta = __rdtsc() - start;
+        cpuid_total += delta;
+        if (delta < cpuid_min) cpuid_min = delta;
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        _mm_lfence();
+        uint64_t start = __rdtsc();
+        safe_vmcall(hv_vmcall_last_mailbox, 0, 0, 0);
+        _mm_lfence();
+        uint64_t delta = __rdtsc() - start;
+        vmcall_total += delta;
+        if (delta < vmcall_min) vmcall_min = delta;
+    }
+
+    printf("[+] exit round trip      : cpuid avg %llu / min %llu cycles, vmmcall avg %llu / min %llu cycles\n",
+        cpuid_total / iterations, cpuid_min, vmcall_total / iterations, vmcall_min);
+
+    DWORD cpu = GetCurrentProcessorNumber();
+    printf("[+] cpuid snapshot cpu %-2lu : %llu entries, %llu table hits, %llu live\n", cpu,
+        safe_vmcall(hv_vmcall_query_cpuid_cache, cpu, 2, 0),
+        safe_vmcall(hv_vmcall_query_cpuid_cache, cpu, 0, 0),
+        safe_vmcall(hv_vmcall_query_cpuid_cache, cpu, 1, 0));
+    printf("[+] msr exits cpu %-2lu      : %llu shadow hits, %llu handler reads, %llu passed through, %llu #GP\n", cpu,
+        safe_vmcall(hv_vmcall_query_msr_stats, cpu, 0, 0),
+        safe_vmcall(hv_vmcall_query_msr_stats, cpu, 1, 0),
+        safe_vmcall(hv_vmcall_query_msr_stats, cpu, 2, 0),
+        safe_vmcall(hv_vmcall_query_msr_stats, cpu, 3, 0));
+}
+
+// same cpuid loop with vmcb clean bits honoured vs. forced full reloads
+static void measure_vmcb_caching(void) {
+    const int iterations = 100000;
+    int cpu_info[4];
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t total = 0, best = UINT64_MAX;
+
+        safe_vmcall(hv_vmcall_vmcb_caching, pass == 0, 0, 0);
+        for (int i = 0; i < iterations; i++) {
+            _mm_lfence();
+            uint64_t start = __rdtsc();
+            __cpuid(cpu_info, 0);
+            _mm_lfence();
+            uint64_t delta = __rdtsc() - start;
+            total += delta;
+            if (delta < best) best = delta;
+        }
+
+        printf("[+] vmcb caching %-3s     : cpuid avg %llu / min %llu cycles\n",
+            pass == 0 ? "on" : "off", total / iterations, best);
+    }
+
+    safe_vmcall(hv_vmcall_vmcb_caching, 1, 0, 0);
+}
+
+// cpuid and vmmcall round trips with the vmload/vmsave state left in the
+// cpu vs. swapped to the host and back on every exit
+static void measure_lazy_host_state(void) {
+    const int iterations = 100000;
+    int cpu_info[4];
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t cpuid_total = 0, cpuid_min = UINT64_MAX;
+        uint64_t vmcall_total = 0, vmcall_min = UINT64_MAX;
+
+        safe_vmcall(hv_vmcall_lazy_host_state, pass == 0, 0, 0);
+        for (int i = 0; i < iterations; i++) {
+            _mm_lfence();
+            uint64_t start = __rdtsc();
+            __cpuid(cpu_info, 0);
+            _mm_lfence();
+            uint64_t delta = __rdtsc() - start;
+            cpuid_total += delta;
+            if (delta < cpuid_min) cpuid_min = delta;
+        }
+
+        for (int i = 0; i < iterations; i++) {
+            _mm_lfence();
+            uint64_t start = __rdtsc();
+            safe_vmcall(hv_vmcall_last_mailbox, 0, 0, 0);
+            _mm_lfence();
+            uint64_t delta = __rdtsc() - start;
+            vmcall_total += delta;
+            if (delta < vmcall_min) vmcall_min = delta;
+        }
+
+        printf("[+] host state %-5s    : cpuid avg %llu / min %llu cycles, vmmcall avg %llu / min %llu cycles\n",
+            pass == 0 ? "lazy" : "eager", cpuid_total / iterations, cpuid_min,
+            vmcall_total / iterations, vmcall_min);
+    }
+
+    safe_vmcall(hv_vmcall_lazy_host_state, 1, 0, 0);
+}
+
+// time_vmcall: average / minimum cycles of one hypercall round trip
+static void time_vmcall(uint64_t code, uint64_t a1, uint64_t a2, uint64_t a3,
+                        uint64_t* avg, uint64_t* best, uint64_t* result) {
+    const int iterations = 20000;
+    uint64_t total = 0;
+
+    *best = UINT64_MAX;
+    for (int i = 0; i < iterations; i++) {
+        _mm_lfence();
+        uint64_t start = __rdtsc();
+        *result = safe_vmcall(code, a1, a2, a3);
+        _mm_lfence();
+        uint64_t delta = __rdtsc() - start;
+        total += delta;
+        if (delta < *best) *best = delta;
+    }
+    *avg = total / iterations;
+}
+
+// cost of saving the guest's vector state for a handler, and what an avx2
+// kernel buys back: hashes one physical page of ntdll with both kernels
+static void measure_xstate(void) {
+    uint64_t gpa = safe_vmcall(hv_vmcall_translate_gva_to_gpa, (uint64_t)GetModuleHandleW(L"ntdll.dll"), 0, 0);
+    uint64_t avg, best, scalar_hash, vector_hash, unused;
+
+    printf("[+] xstate area          : %llu bytes, avx2 %s, xsaveopt %s\n",
+        safe_vmcall(hv_vmcall_query_xstate, 0, 0, 0),
+        safe_vmcall(hv_vmcall_query_xstate, 2, 0, 0) ? "yes" : "no",
+        safe_vmcall(hv_vmcall_query_xstate, 3, 0, 0) ? "yes" : "no");
+
+    time_vmcall(hv_vmcall_hash_guest_pages, gpa, 0, 0, &avg, &best, &unused);
+    printf("[+] vmmcall no xstate    : avg %llu / min %llu cycles\n", avg, best);
+    time_vmcall(hv_vmcall_hash_guest_pages, gpa, 0, 1, &avg, &best, &unused);
+    printf("[+] vmmcall with xstate  : avg %llu / min %llu cycles\n", avg, best);
+
+    if (!gpa) {
+        printf("[!] ntdll gpa unavailable, skipping page hash timing\n");
+        return;
+    }
+
+    time_vmcall(hv_vmcall_hash_guest_pages, gpa, 1, 0, &avg, &best, &scalar_hash);
+    printf("[+] page hash scalar     : avg %llu / min %llu cycles (0x%016llx)\n", avg, best, scalar_hash);
+    time_vmcall(hv_vmcall_hash_guest_pages, gpa, 1, 1, &avg, &best, &vector_hash);
+    printf("[+] page hash avx2       : avg %llu / min %llu cycles (0x%016llx)%s\n", avg, best, vector_hash,
+        vector_hash == scalar_hash ? "" : " MISMATCH");
+}
+
+static void dump_exit_trace(void) {
+    static hv_trace_record records[4096];
+    DWORD cpus = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+    for (DWORD cpu = 0; cpu < cpus; cpu++) {
+        uint64_t count = safe_vmcall(hv_vmcall_trace_drain, cpu, (uint64_t)(uintptr_t)records, _countof(records));
+        if (count == ~0ULL)
+            continue;
+
+        uint64_t lost = safe_vmcall(hv_vmcall_query_trace, cpu, hv_trace_lost, 0);
+        printf("[+] exit trace cpu %lu   : %llu records drained, %llu lost\n", cpu, count, lost);
+
+        // newest few, oldest first
+        for (uint64_t i = count > 4 ? count - 4 : 0; i < count; i++) {
+            const hv_trace_record* r = &records[i];
+            printf("    tsc %016llx exit 0x%03llx rip %016llx info1 %llx info2 %llx cr3 %llx outcome %x\n",
+                r->tsc, r->exit_code, r->rip, r->exit_info1, r->exit_info2, r->cr3, r->outcome);
+        }
+    }
+}
+
+static const char* exit_name(uint64_t code) {
+    switch (code) {
+    case 0x60: return "intr";
+    case 0x61: return "nmi";
+    case 0x64: return "vintr";
+    case 0x6e: return "rdtsc";
+    case 0x72: return "cpuid";
+    case 0x78: return "hlt";
+    case 0x7b: return "ioio";
+    case 0x7c: return "msr";
+    case 0x81: return "vmmcall";
+    case 0x87: return "rdtscp";
+    case 0x400: return "npf";
+    case 0x404: return "other";
+    default: return "";
+    }
+}
+
+static uint64_t histogram_quantile(const hv_histogram* h, double q) {
+    uint64_t target = (uint64_t)(q * (double)h->count);
+    uint64_t seen = 0;
+
+    for (uint32_t i = 0; i < hv_hist_buckets; i++) {
+        seen += h->buckets[i];
+        if (seen > target)
+            return hv_histogram_bucket_floor(i);
+    }
+    return h->max;
+}
+
+typedef struct _hvstat_row {
+    uint64_t code;
+    hv_histogram hist;
+} hvstat_row;
+
+static int hvstat_by_total(const void* a, const void* b) {
+    uint64_t ta = ((const hvstat_row*)a)->hist.total;
+    uint64_t tb = ((const hvstat_row*)b)->hist.total;
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+static void hvstat_table(DWORD cpu, uint64_t kind) {
+    static hvstat_row rows[32];
+    int count = 0;
+
+    for (uint64_t slot = 0; slot < _countof(rows); slot++) {
+        uint64_t code = safe_vmcall(hv_vmcall_read_histogram, cpu, kind | slot, (uint64_t)(uintptr_t)&rows[count].hist);
+        if (code == ~0ULL)
+            continue;
+        rows[count++].code = code;
+    }
+
+    qsort(rows, count, sizeof(rows[0]), hvstat_by_total);
+
+    for (int i = 0; i < count; i++) {
+        const hv_histogram* h = &rows[i].hist;
+        printf("  %-7s 0x%-5llx %-8s %10llu %12llu %8llu %8llu %8llu %8llu %10llu\n",
+            kind ? "call" : "exit", rows[i].code, kind ? "" : exit_name(rows[i].code),
+            h->count, h->total, h->total / h->count,
+            histogram_quantile(h, 0.50), histogram_quantile(h, 0.99), histogram_quantile(h, 0.999), h->max);
+    }
+}
+
+static void hvstat_hotspots(void) {
+    static hv_hotspot top[10];
+    uint64_t count = safe_vmcall(hv_vmcall_query_hotspots, (uint64_t)(uintptr_t)top, _countof(top), 0);
+
+    printf("hot exit sites (all cpus)\n");
+    printf("  %-18s %-7s %-8s %-18s %10s\n", "rip", "code", "name", "cr3", "exits");
+    for (uint64_t i = 0; i < count; i++) {
+        printf("  %016llx   0x%-5llx %-8s %016llx   %10llu\n",
+            top[i].rip, top[i].exit_code, exit_name(top[i].exit_code), top[i].cr3, top[i].count);
+    }
+    printf("\n");
+}
+
+// top-like per-cpu view of where host time goes; numbers are per interval
+static void run_hvstat(DWORD interval_ms) {
+    DWORD cpus = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+    safe_vmcall(hv_vmcall_reset_stats, ~0ULL, 0, 0);
+    safe_vmcall(hv_vmcall_reset_hotspots, 0, 0, 0);
+
+    for (;;) {
+        Sleep(interval_ms);
+        printf("\x1b[2J\x1b[H");
+
+        for (DWORD cpu = 0; cpu < cpus; cpu++) {
+            uint64_t guest = safe_vmcall(hv_vmcall_query_stats, cpu, hv_stat_guest_tsc, 0);
+            uint64_t host = safe_vmcall(hv_vmcall_query_stats, cpu, hv_stat_host_tsc, 0);
+            uint64_t busy = guest + host;
+
+            printf("cpu %lu  guest %llu (%.2f%%)  host %llu (%.2f%%)\n", cpu,
+                guest, busy ? 100.0 * guest / busy : 0.0, host, busy ? 100.0 * host / busy : 0.0);
+            printf("  %-7s %-7s %-8s %10s %12s %8s %8s %8s %8s %10s\n",
+                "kind", "code", "name", "count", "cycles", "avg", "p50", "p99", "p999", "max");
+            hvstat_table(cpu, 0);
+            hvstat_table(cpu, hv_hist_calls);
+            printf("\n");
+        }
+
+        hvstat_hotspots();
+
+        safe_vmcall(hv_vmcall_reset_stats, ~0ULL, 0, 0);
+        safe_vmcall(hv_vmcall_reset_hotspots, 0, 0, 0);
+    }
+}
+
 static void test_hypervisor_write(void) {
     // Test: Write to our own memory via hypervisor
     volatile uint64_t test_value = 0xDEADBEEF12345678ULL;
@@ -95,15 +401,27 @@ static void test_hypervisor_write(void) {
     printf("[+] ================================\n\n");
 }
 
-int main(void) {
+int main(int argc, char** argv) {
     SetConsoleTitleA("syscall");
 
+    // um_demo hvstat [interval ms]
+    if (argc > 1 && strcmp(argv[1], "hvstat") == 0) {
+        run_hvstat(argc > 2 ? (DWORD)strtoul(argv[2], NULL, 0) : 1000);
+        return 0;
+    }
+
     printf("[+] make sure the svm driver is loaded first.\n\n");
 
     print_vendor_string();
     dump_process_bases();
     dump_address_translations();
     probe_mailbox_state();
+    dump_npt_arena();
+    measure_exit_round_trip();
+    measure_vmcb_caching();
+    measure_lazy_host_state();
+    measure_xstate();
+    dump_exit_trace();
     test_hypervisor_write();
 
     printf("\n[+] done.\n");